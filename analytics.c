@@ -0,0 +1,104 @@
+#include <math.h>
+#include <string.h>
+
+#include "analytics.h"
+
+// Record the current power and speed for the given second
+static void addSec(RiderStats *pStats, time_t sec)
+{
+    unsigned idx = sec % STATS_WINDOW_SECS;
+    uint32_t power = pStats->power;
+    uint32_t n;
+    double avg;
+
+    // The slot being overwritten holds the value that is
+    // leaving the 5 min window.
+    pStats->power3sSum += power - pStats->powerTbl[(sec - 3) % STATS_WINDOW_SECS];
+    pStats->power30sSum += power - pStats->powerTbl[(sec - 30) % STATS_WINDOW_SECS];
+    pStats->power5mSum += power - pStats->powerTbl[idx];
+    pStats->powerTbl[idx] = power;
+    pStats->numSecs++;
+
+    // Normalized power is the 4th root of the mean of the
+    // 4th power of the 30s average power.
+    n = (pStats->numSecs < 30) ? pStats->numSecs : 30;
+    avg = (double) pStats->power30sSum / n;
+    avg *= avg;
+    pStats->np4Sum += avg * avg;
+    pStats->speedSum += pStats->speed;
+}
+
+// Record the held power and speed for each second since the
+// last one recorded, up to the given time.
+static void advance(RiderStats *pStats, time_t now)
+{
+    time_t gap;
+
+    if (pStats->lastSec == 0) {
+        return;
+    }
+
+    gap = now - pStats->lastSec;
+    if (gap > STATS_WINDOW_SECS) {
+        // After a full window, all the sums are flat, so the
+        // rest of the gap can be added up in one step.
+        time_t skip = gap - STATS_WINDOW_SECS;
+        double power4;
+
+        for (time_t sec = pStats->lastSec + 1; sec <= (pStats->lastSec + STATS_WINDOW_SECS); sec++) {
+            addSec(pStats, sec);
+        }
+        power4 = (double) pStats->power * pStats->power;
+        power4 *= power4;
+        pStats->numSecs += skip;
+        pStats->np4Sum += power4 * skip;
+        pStats->speedSum += (double) pStats->speed * skip;
+        pStats->lastSec = now;
+    } else {
+        while (pStats->lastSec < now) {
+            addSec(pStats, ++pStats->lastSec);
+        }
+    }
+}
+
+void statsInit(RiderStats *pStats, float weight)
+{
+    memset(pStats, 0, sizeof (*pStats));
+    pStats->weight = weight;
+}
+
+void statsUpdate(RiderStats *pStats, time_t now, int power, float speed)
+{
+    if (pStats->lastSec == 0) {
+        // First sample: start recording from this second
+        pStats->lastSec = now - 1;
+    } else {
+        // The previous sample covers the seconds up to now
+        advance(pStats, (now - 1));
+    }
+
+    pStats->power = (power > 0) ? ((power < UINT16_MAX) ? power : UINT16_MAX) : 0;
+    pStats->speed = (speed > 0.0) ? speed : 0.0;
+
+    if (pStats->lastSec < now) {
+        addSec(pStats, ++pStats->lastSec);
+    }
+}
+
+void statsFinalize(RiderStats *pStats, time_t now)
+{
+    uint32_t n;
+
+    advance(pStats, now);
+
+    if ((n = pStats->numSecs) == 0) {
+        return;
+    }
+
+    pStats->summary.power3s = pStats->power3sSum / ((n < 3) ? n : 3);
+    pStats->summary.power30s = pStats->power30sSum / ((n < 30) ? n : 30);
+    pStats->summary.power5m = pStats->power5mSum / ((n < STATS_WINDOW_SECS) ? n : STATS_WINDOW_SECS);
+    pStats->summary.normPower = (int) sqrt(sqrt(pStats->np4Sum / n));
+    pStats->summary.avgSpeed = pStats->speedSum / n;
+    pStats->summary.wkg = (pStats->weight > 0.0) ? (pStats->summary.power3s / pStats->weight) : 0.0;
+}
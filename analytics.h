@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// Rolling power and speed analytics of a rider.
+//
+// Each progUpd message only updates a few running sums, in
+// constant time: the power of the rider is held until the
+// next update, and recorded once per second in a ring that
+// covers the longest window, so that the value leaving each
+// window can be subtracted from its sum. The averages, the
+// normalized power and the W/kg are only derived from those
+// sums when a leaderboard is built.
+#define STATS_WINDOW_SECS   300     // longest window (5 min)
+
+// Values derived from the running sums
+typedef struct StatsSummary {
+    int power3s;                // 3s average power (in watts)
+    int power30s;               // 30s average power (in watts)
+    int power5m;                // 5 min average power (in watts)
+    int normPower;              // normalized power (in watts)
+    float avgSpeed;             // average speed (in m/s) since the start
+    float wkg;                  // 3s average power per kg of body weight
+} StatsSummary;
+
+typedef struct RiderStats {
+    uint16_t powerTbl[STATS_WINDOW_SECS]; // power (in watts) recorded in each of the last 300 seconds
+    uint32_t power3sSum;        // sum of the power over the last 3 seconds
+    uint32_t power30sSum;       // sum of the power over the last 30 seconds
+    uint32_t power5mSum;        // sum of the power over the last 5 minutes
+    uint32_t numSecs;           // number of seconds recorded so far
+    time_t lastSec;             // last second recorded (0=none yet)
+    int power;                  // last power (in watts) reported by the rider
+    float speed;                // last speed (in m/s) reported by the rider
+    float weight;               // rider's weight (in kg) (0=unknown)
+    double np4Sum;              // sum of the 4th power of the 30s average power, once per second
+    double speedSum;            // sum of the speed, once per second
+
+    StatsSummary summary;       // derived values, updated when a leaderboard is built
+} RiderStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Clear the stats, and set the rider's weight
+extern void statsInit(RiderStats *pStats, float weight);
+
+// Record the power and speed reported by the rider at the
+// given time.
+extern void statsUpdate(RiderStats *pStats, time_t now, int power, float speed);
+
+// Bring the sums up to the given time, and update the
+// derived values.
+extern void statsFinalize(RiderStats *pStats, time_t now);
+
+#ifdef __cplusplus
+}
+#endif
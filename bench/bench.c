@@ -0,0 +1,388 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <netinet/in.h>
+
+#include "category.h"
+#include "compress.h"
+#include "defs.h"
+#include "grs.h"
+#include "json.h"
+#include "log.h"
+#include "msgbuf.h"
+#include "ranking.h"
+
+// Microbenchmarks for the hot paths of the GRS: the JSON
+// parser used on every inbound message, the rider stats
+// updated on every progUpd, and the builders of the
+// category and overall leaderboards, and their compression.
+//
+// The results are printed one line per benchmark, using
+// the same format as Go's testing package, so that the
+// output of two runs can be compared with tools such as
+// benchstat:
+//
+//   Benchmark<Name>  <iters>  <ns> ns/op  <bytes> B/op  <allocs> allocs/op  [<val> <unit>]
+//
+
+// Allocation counters, updated by the malloc() wrappers
+// below. The bench binary is linked with --wrap so that
+// every allocation made by the code under test goes
+// through these.
+static uint64_t numAllocs;
+static uint64_t numAllocBytes;
+
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t nmemb, size_t size);
+extern void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    numAllocs++;
+    numAllocBytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    numAllocs++;
+    numAllocBytes += (nmemb * size);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    numAllocs++;
+    numAllocBytes += size;
+    return __real_realloc(ptr, size);
+}
+
+// Sample payloads, as sent by the client apps
+static const char regReqMsg[] = "{\"msgType\": \"regReq\", \"name\": \"Marcelo Mourier\", \"gender\": \"male\", \"age\": \"61\", \"ride\": \"Sarbachtal\"}";
+static const char progUpdMsg[] = "{\"msgType\": \"progUpd\", \"distance\": \"16203\", \"power\": \"250\", \"speed\": \"9.722\"}";
+
+// Used to keep the compiler from optimizing away the
+// code under test.
+static volatile uintptr_t sink;
+
+typedef struct Bench Bench;
+
+typedef void (*BenchFunc)(Bench *pBench, uint64_t iters);
+
+struct Bench {
+    const char *name;           // name of the benchmark
+    BenchFunc func;             // function that runs 'iters' iterations
+    const char *msg;            // JSON message used by the parser benchmarks
+    const char *tag;            // JSON tag used by the parser benchmarks
+    int numRiders;              // number of riders used by the leaderboard benchmarks
+    int catIdx;                 // category used by the leaderboard benchmarks
+    Grs grs;                    // state used by the leaderboard benchmarks
+    MsgBuf msgBuf;              // buffer used by the leaderboard benchmarks
+    uint64_t msgBytes;          // total size of the messages built
+};
+
+static uint64_t benchTime = 1000000000;   // nanosecs
+
+static uint64_t nowNs(void)
+{
+    Timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void benchJsonFindObject(Bench *pBench, uint64_t iters)
+{
+    size_t msgLen = strlen(pBench->msg);
+
+    for (uint64_t n = 0; n < iters; n++) {
+        JsonObject obj;
+        jsonFindObject(pBench->msg, msgLen, &obj);
+        sink = (uintptr_t) obj.end;
+    }
+}
+
+static void benchJsonFindTag(Bench *pBench, uint64_t iters)
+{
+    JsonObject obj;
+
+    jsonFindObject(pBench->msg, strlen(pBench->msg), &obj);
+    for (uint64_t n = 0; n < iters; n++) {
+        sink = (uintptr_t) jsonFindTag(&obj, pBench->tag);
+    }
+}
+
+static void benchJsonGetTagValue(Bench *pBench, uint64_t iters)
+{
+    JsonObject obj;
+
+    jsonFindObject(pBench->msg, strlen(pBench->msg), &obj);
+    for (uint64_t n = 0; n < iters; n++) {
+        char *val = jsonGetTagValue(&obj, pBench->tag);
+        sink = (uintptr_t) val;
+        free(val);
+    }
+}
+
+// One progUpd per second, as sent by most VCA's
+static void benchStatsUpdate(Bench *pBench, uint64_t iters)
+{
+    static RiderStats stats;
+    time_t now = 1680469260;
+
+    statsInit(&stats, 70.0);
+    for (uint64_t n = 0; n < iters; n++) {
+        statsUpdate(&stats, now++, (150 + (n % 200)), 9.722);
+    }
+    statsFinalize(&stats, now);
+    sink = stats.summary.normPower;
+}
+
+// Classification of the registering riders into the
+// categories of the default scheme.
+static void benchCatClassify(Bench *pBench, uint64_t iters)
+{
+    int catTbl[CAT_MAX_PER_RIDER];
+
+    if (catNumCats() == 0) {
+        catInit(NULL);
+    }
+
+    for (uint64_t n = 0; n < iters; n++) {
+        sink = catClassify((n % GenderMax), (n % 100), 70.0, 250, catTbl);
+    }
+}
+
+static void benchLeaderboard(Bench *pBench, uint64_t iters)
+{
+    for (uint64_t n = 0; n < iters; n++) {
+        buildLeaderboardMsg(&pBench->grs, pBench->catIdx, 0, &pBench->msgBuf);
+        pBench->msgBytes += pBench->msgBuf.len + 1;
+    }
+}
+
+// Compression of a category leaderboard, done once per
+// period for all the riders that asked for it. The message
+// bytes are those of the compressed frame.
+static void benchCompressLeaderboard(Bench *pBench, uint64_t iters)
+{
+    for (uint64_t n = 0; n < iters; n++) {
+        EgrBuf *pBuf = compNewBuf(pBench->msgBuf.data, (pBench->msgBuf.len + 1));
+        pBench->msgBytes += pBuf->len;
+        egrReleaseBuf(pBuf);
+    }
+}
+
+// Overall rankings of 10,000 riders spread across all the
+// genders, as built every overall leaderboard period: every
+// rider moves forward a bit, then the gender rankings are
+// re-sorted and merged into the overall and gender overall
+// top 50.
+static void benchOverallRanking(Bench *pBench, uint64_t iters)
+{
+    static Rider *riders;
+    static const Rider *rankTbl[50];
+    const int numRiders = 10000;
+
+    if (riders == NULL) {
+        riders = calloc(numRiders, sizeof (Rider));
+        for (int n = 0; n < numRiders; n++) {
+            riders[n].bibNum = n + 1;
+            riders[n].gender = n % GenderMax;
+            riders[n].distance = 10000 + (n * 37) % 5000;
+            rankAddRider(&riders[n]);
+        }
+    }
+
+    for (uint64_t n = 0; n < iters; n++) {
+        for (int m = 0; m < numRiders; m++) {
+            riders[m].distance += 20 + ((m * 7 + n) % 13);
+        }
+        rankSort();
+        for (Gender gender = unspec; gender <= GenderMax; gender++) {
+            sink = rankMerge(gender, 50, rankTbl);
+        }
+    }
+}
+
+// Populate the MU65 category of the default scheme with the
+// specified number of registered riders, as seen in the
+// middle of a ride.
+static void setupLeaderboard(Bench *pBench)
+{
+    static const CmdArgs args = { .progUpdPeriod = 1 };
+    Grs *pGrs = &pBench->grs;
+
+    grsInitCats(pGrs, &args);
+    pBench->catIdx = catFind("MU65");
+
+    for (int n = 0; n < pBench->numRiders; n++) {
+        Rider *pRider = calloc(1, sizeof (Rider));
+        char name[64];
+
+        snprintf(name, sizeof (name), "Rider Number %d", (n + 1));
+        pRider->name = strdup(name);
+        pRider->bibNum = n + 1;
+        pRider->age = 61;
+        pRider->gender = male;
+        pRider->distance = 10000 + (n * 37) % 5000;
+        pRider->power = 150 + (n * 13) % 200;
+        pRider->state = registered;
+        pRider->catNodes[0].catIdx = pBench->catIdx;
+        pRider->catNodes[0].pRider = pRider;
+        pRider->numCats = 1;
+        TAILQ_INSERT_HEAD(&pGrs->catTbl[pBench->catIdx].riderList, &pRider->catNodes[0], tqEntry);
+    }
+
+    // Warm up the message buffer, as sendLeaderboardMsg()
+    // does after its first period.
+    buildLeaderboardMsg(pGrs, pBench->catIdx, 0, &pBench->msgBuf);
+}
+
+static void teardownLeaderboard(Bench *pBench)
+{
+    struct CatList *pList = &pBench->grs.catTbl[pBench->catIdx].riderList;
+    CatNode *pNode;
+
+    while ((pNode = TAILQ_FIRST(pList)) != NULL) {
+        Rider *pRider = pNode->pRider;
+        TAILQ_REMOVE(pList, pNode, tqEntry);
+        free(pRider->name);
+        free(pRider);
+    }
+    free(pBench->grs.catTbl);
+    msgBufFree(&pBench->msgBuf);
+}
+
+static Bench benchTbl[] = {
+    { .name = "JsonFindObject/regReq",              .func = benchJsonFindObject,    .msg = regReqMsg },
+    { .name = "JsonFindObject/progUpd",             .func = benchJsonFindObject,    .msg = progUpdMsg },
+    { .name = "JsonFindTag/regReq/msgType",         .func = benchJsonFindTag,       .msg = regReqMsg,   .tag = "msgType" },
+    { .name = "JsonFindTag/regReq/ride",            .func = benchJsonFindTag,       .msg = regReqMsg,   .tag = "ride" },
+    { .name = "JsonFindTag/progUpd/msgType",        .func = benchJsonFindTag,       .msg = progUpdMsg,  .tag = "msgType" },
+    { .name = "JsonFindTag/progUpd/speed",          .func = benchJsonFindTag,       .msg = progUpdMsg,  .tag = "speed" },
+    { .name = "JsonGetTagValue/regReq/name",        .func = benchJsonGetTagValue,   .msg = regReqMsg,   .tag = "name" },
+    { .name = "JsonGetTagValue/regReq/ride",        .func = benchJsonGetTagValue,   .msg = regReqMsg,   .tag = "ride" },
+    { .name = "JsonGetTagValue/progUpd/distance",   .func = benchJsonGetTagValue,   .msg = progUpdMsg,  .tag = "distance" },
+    { .name = "JsonGetTagValue/progUpd/power",      .func = benchJsonGetTagValue,   .msg = progUpdMsg,  .tag = "power" },
+    { .name = "StatsUpdate",                        .func = benchStatsUpdate },
+    { .name = "CatClassify",                        .func = benchCatClassify },
+    { .name = "OverallRanking/riders=10000",        .func = benchOverallRanking },
+    { .name = "Leaderboard/riders=10",              .func = benchLeaderboard,       .numRiders = 10 },
+    { .name = "Leaderboard/riders=100",             .func = benchLeaderboard,       .numRiders = 100 },
+    { .name = "Leaderboard/riders=500",             .func = benchLeaderboard,       .numRiders = 500 },
+    { .name = "Leaderboard/riders=1000",            .func = benchLeaderboard,       .numRiders = 1000 },
+    { .name = "Leaderboard/riders=5000",            .func = benchLeaderboard,       .numRiders = 5000 },
+    { .name = "CompressLeaderboard/riders=100",     .func = benchCompressLeaderboard, .numRiders = 100 },
+    { .name = "CompressLeaderboard/riders=1000",    .func = benchCompressLeaderboard, .numRiders = 1000 },
+    { .name = NULL }
+};
+
+static void runBench(Bench *pBench)
+{
+    uint64_t iters = 1;
+    uint64_t elapsed, allocs, allocBytes;
+
+    if (pBench->numRiders != 0) {
+        setupLeaderboard(pBench);
+    }
+
+    // Keep increasing the number of iterations until
+    // the run takes at least the bench time.
+    while (true) {
+        uint64_t start;
+
+        pBench->msgBytes = 0;
+        allocs = numAllocs;
+        allocBytes = numAllocBytes;
+        start = nowNs();
+        pBench->func(pBench, iters);
+        elapsed = nowNs() - start;
+        allocs = numAllocs - allocs;
+        allocBytes = numAllocBytes - allocBytes;
+
+        if ((elapsed >= benchTime) || (iters >= 1000000000)) {
+            break;
+        }
+
+        // Predict the number of iterations needed, but
+        // don't grow too fast.
+        {
+            uint64_t next = (elapsed != 0) ? (benchTime * iters * 12 / 10 / elapsed) : (iters * 100);
+            if (next > (iters * 100)) {
+                next = iters * 100;
+            }
+            iters = (next > iters) ? next : (iters + 1);
+        }
+    }
+
+    fprintf(stdout, "Benchmark%-36s %10lu %12.1f ns/op %10lu B/op %8.2f allocs/op",
+            pBench->name, iters, ((double) elapsed / iters),
+            (allocBytes / iters), ((double) allocs / iters));
+    if (pBench->numRiders != 0) {
+        fprintf(stdout, " %10lu msgbytes/op", (pBench->msgBytes / iters));
+    }
+    fprintf(stdout, "\n");
+    fflush(stdout);
+
+    if (pBench->numRiders != 0) {
+        teardownLeaderboard(pBench);
+    }
+}
+
+static const char *help =
+        "SYNTAX:\n"
+        "    grsbench [OPTIONS] [<filter>]\n"
+        "\n"
+        "    Runs the GRS microbenchmarks whose name contains the\n"
+        "    specified filter string (or all of them, if no filter\n"
+        "    is given.)\n"
+        "\n"
+        "OPTIONS:\n"
+        "    --bench-time <msecs>\n"
+        "        Specifies the minimum run time of each benchmark. The\n"
+        "        default is 1000 ms.\n"
+        "    --help\n"
+        "        Show this help and exit.\n"
+        "\n";
+
+int main(int argc, char *argv[])
+{
+    const char *filter = NULL;
+
+    // Keep the INFO messages of the code under test (e.g. the
+    // category scheme loading) out of the results.
+    setLogLevel(WARN);
+
+    for (int n = 1; n < argc; n++) {
+        const char *arg = argv[n];
+
+        if (strcmp(arg, "--bench-time") == 0) {
+            const char *val = argv[++n];
+            unsigned long msecs;
+            if ((val == NULL) || (sscanf(val, "%lu", &msecs) != 1)) {
+                fprintf(stderr, "Missing argument. Syntax: '%s <msecs>'\n", arg);
+                return -1;
+            }
+            benchTime = (uint64_t) msecs * 1000000;
+        } else if (strcmp(arg, "--help") == 0) {
+            fprintf(stdout, "%s\n", help);
+            return 0;
+        } else if (arg[0] == '-') {
+            fprintf(stderr, "Invalid option: %s\n", arg);
+            return -1;
+        } else {
+            filter = arg;
+        }
+    }
+
+    for (Bench *pBench = benchTbl; pBench->name != NULL; pBench++) {
+        if ((filter == NULL) || (strstr(pBench->name, filter) != NULL)) {
+            runBench(pBench);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,285 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include "builder.h"
+#include "compress.h"
+#include "log.h"
+#include "lowlat.h"
+
+// The jobs are handed to the workers through a ring protected
+// by a mutex; it is only taken once per category and period,
+// so it's never contended enough to matter. Since there are
+// only two jobs per category, the ring can never overflow.
+
+static BldJob *jobTbl;          // two jobs per category
+static int numJobs;
+static BldJob **queue;          // ring of queued jobs
+static uint64_t queueHead;
+static uint64_t queueTail;
+static pthread_mutex_t queueMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+
+static pthread_t *workerTbl;
+static int numWorkers;
+static int bldStop;
+static int evFd = -1;
+static int doneIdx;             // where the event loop resumes its scan of the done jobs
+
+int bldPrintEntry(MsgBuf *pBuf, const char *name, int bibNum, int distance, int power, int age, const StatsSummary *pSummary)
+{
+    if (pSummary == NULL) {
+        return msgBufPrintf(pBuf, "{\"name\": \"%s\", \"bibNum\": \"%d\", \"distance\": \"%d\", \"power\": \"%d\", \"dataAge\": \"%d\"}, ",
+                name, bibNum, distance, power, age);
+    }
+
+    return msgBufPrintf(pBuf, "{\"name\": \"%s\", \"bibNum\": \"%d\", \"distance\": \"%d\", \"power\": \"%d\", \"dataAge\": \"%d\", "
+            "\"power3s\": \"%d\", \"power30s\": \"%d\", \"power5m\": \"%d\", \"normPower\": \"%d\", \"avgSpeed\": \"%.2f\", \"wkg\": \"%.2f\"}, ",
+            name, bibNum, distance, power, age,
+            pSummary->power3s, pSummary->power30s, pSummary->power5m, pSummary->normPower, pSummary->avgSpeed, pSummary->wkg);
+}
+
+// Sort the entries by distance, in descending order
+static int cmpEntryDistance(const void *p1, const void *p2)
+{
+    const BldEntry *pEntry1 = p1;
+    const BldEntry *pEntry2 = p2;
+
+    return (pEntry2->distance > pEntry1->distance) - (pEntry2->distance < pEntry1->distance);
+}
+
+// Build the leaderboard message from the snapshot, the same
+// way buildLeaderboardMsg() does from the rider lists.
+static int buildMsg(BldJob *pJob)
+{
+    MsgBuf *pBuf = &pJob->msg;
+
+    msgBufReset(pBuf);
+
+    if (msgBufPrintf(pBuf, "{\"msgType\": \"leaderboard\", \"category\": \"%s\", \"riderList\": [", pJob->category) < 0) {
+        return -1;
+    }
+
+    if (pJob->maxEntries != 0) {
+        qsort(pJob->entryTbl, pJob->numEntries, sizeof (BldEntry), cmpEntryDistance);
+    }
+
+    for (int n = 0; n < pJob->numEntries; n++) {
+        const BldEntry *pEntry = &pJob->entryTbl[n];
+        if ((pJob->maxEntries != 0) && (n == pJob->maxEntries)) {
+            break;
+        }
+        if (bldPrintEntry(pBuf, (pJob->names.data + pEntry->nameOff), pEntry->bibNum, pEntry->distance, pEntry->power, pEntry->age,
+                          (pJob->stats ? &pEntry->summary : NULL)) < 0) {
+            return -1;
+        }
+    }
+
+    if (pJob->numEntries > 0) {
+        // Remove the last ", " characters
+        msgBufTrim(pBuf, 2);
+    }
+
+    if (msgBufPrintf(pBuf, "]}") < 0) {
+        return -1;
+    }
+
+    return pJob->numEntries;
+}
+
+static void *workerThread(void *arg)
+{
+    sigset_t sigMask;
+    uint64_t one = 1;
+
+    // Leave the signals to the event loop
+    sigfillset(&sigMask);
+    pthread_sigmask(SIG_BLOCK, &sigMask, NULL);
+
+    // In the low-latency mode, the workers have their own
+    // CPUs too.
+    llPinThread((int) (intptr_t) arg);
+
+    pthread_mutex_lock(&queueMutex);
+
+    while (true) {
+        BldJob *pJob;
+        uint64_t t0;
+
+        while (!bldStop && (queueHead == queueTail)) {
+            pthread_cond_wait(&queueCond, &queueMutex);
+        }
+        if (bldStop) {
+            break;
+        }
+        pJob = queue[queueHead++ % numJobs];
+        pthread_mutex_unlock(&queueMutex);
+
+        t0 = monoTimeNs();
+        pJob->numRiders = buildMsg(pJob);
+        if (pJob->compress && (pJob->numRiders > 0)) {
+            // If it fails, the event loop compresses it
+            pJob->compBuf = compNewBuf(pJob->msg.data, (pJob->msg.len + 1));
+        }
+        pJob->buildTime = monoTimeNs() - t0;
+
+        // Publish the message, and wake up the event loop
+        __atomic_store_n(&pJob->state, bldDone, __ATOMIC_RELEASE);
+        if (write(evFd, &one, sizeof (one)) != sizeof (one)) {
+            MSGLOG(ERROR, "Failed to signal the event loop! (%s)", strerror(errno));
+        }
+
+        pthread_mutex_lock(&queueMutex);
+    }
+
+    pthread_mutex_unlock(&queueMutex);
+
+    return NULL;
+}
+
+int bldInit(int numThreads, int numCats)
+{
+    numJobs = 2 * numCats;
+    if (((jobTbl = calloc(numJobs, sizeof (BldJob))) == NULL) ||
+        ((queue = calloc(numJobs, sizeof (BldJob *))) == NULL) ||
+        ((workerTbl = calloc(numThreads, sizeof (pthread_t))) == NULL)) {
+        MSGLOG(ERROR, "Failed to alloc builder jobs! (%s)", strerror(errno));
+        return -1;
+    }
+
+    if ((evFd = eventfd(0, (EFD_NONBLOCK | EFD_CLOEXEC))) < 0) {
+        MSGLOG(ERROR, "Failed to create builder eventfd! (%s)", strerror(errno));
+        return -1;
+    }
+
+    for (numWorkers = 0; numWorkers < numThreads; numWorkers++) {
+        if (pthread_create(&workerTbl[numWorkers], NULL, workerThread, (void *) (intptr_t) numWorkers) != 0) {
+            MSGLOG(ERROR, "Failed to create builder thread!");
+            return -1;
+        }
+    }
+
+    MSGLOG(INFO, "Building the leaderboards with %d worker threads", numWorkers);
+
+    return 0;
+}
+
+int bldActive(void)
+{
+    return (evFd >= 0);
+}
+
+int bldEventFd(void)
+{
+    return evFd;
+}
+
+BldJob *bldGetJob(int catIdx)
+{
+    for (int n = (2 * catIdx); n < ((2 * catIdx) + 2); n++) {
+        BldJob *pJob = &jobTbl[n];
+        if (__atomic_load_n(&pJob->state, __ATOMIC_ACQUIRE) == bldIdle) {
+            pJob->catIdx = catIdx;
+            pJob->numEntries = 0;
+            msgBufReset(&pJob->names);
+            return pJob;
+        }
+    }
+
+    return NULL;
+}
+
+int bldAddEntry(BldJob *pJob, const char *name, int bibNum, int distance, int power, int age, const StatsSummary *pSummary)
+{
+    BldEntry *pEntry;
+
+    if (pJob->numEntries == pJob->tblSize) {
+        int size = (pJob->tblSize != 0) ? (pJob->tblSize * 2) : 256;
+        BldEntry *tbl;
+        if ((tbl = realloc(pJob->entryTbl, (size * sizeof (BldEntry)))) == NULL) {
+            return -1;
+        }
+        pJob->entryTbl = tbl;
+        pJob->tblSize = size;
+    }
+
+    pEntry = &pJob->entryTbl[pJob->numEntries];
+    pEntry->nameOff = pJob->names.len;
+    pEntry->bibNum = bibNum;
+    pEntry->distance = distance;
+    pEntry->power = power;
+    pEntry->age = age;
+    if (pSummary != NULL) {
+        pEntry->summary = *pSummary;
+    }
+
+    // Keep the null terminator of the name
+    if (msgBufPrintf(&pJob->names, "%s", name) < 0) {
+        return -1;
+    }
+    pJob->names.len++;
+    pJob->numEntries++;
+
+    return 0;
+}
+
+void bldSubmit(BldJob *pJob)
+{
+    pJob->state = bldQueued;
+
+    pthread_mutex_lock(&queueMutex);
+    queue[queueTail++ % numJobs] = pJob;
+    pthread_cond_signal(&queueCond);
+    pthread_mutex_unlock(&queueMutex);
+}
+
+BldJob *bldTakeDone(void)
+{
+    uint64_t count;
+
+    // Clear the eventfd before the scan, so that a job that
+    // is done after it still wakes up the event loop.
+    if ((read(evFd, &count, sizeof (count)) < 0) && (errno != EAGAIN)) {
+        MSGLOG(ERROR, "Failed to read builder eventfd! (%s)", strerror(errno));
+    }
+
+    for (int n = 0; n < numJobs; n++) {
+        BldJob *pJob = &jobTbl[doneIdx];
+        doneIdx = (doneIdx + 1) % numJobs;
+        if (__atomic_load_n(&pJob->state, __ATOMIC_ACQUIRE) == bldDone) {
+            return pJob;
+        }
+    }
+
+    return NULL;
+}
+
+void bldRelease(BldJob *pJob)
+{
+    if (pJob->compBuf != NULL) {
+        egrReleaseBuf(pJob->compBuf);
+        pJob->compBuf = NULL;
+    }
+    __atomic_store_n(&pJob->state, bldIdle, __ATOMIC_RELEASE);
+}
+
+void bldClose(void)
+{
+    if (evFd >= 0) {
+        pthread_mutex_lock(&queueMutex);
+        bldStop = 1;
+        pthread_cond_broadcast(&queueCond);
+        pthread_mutex_unlock(&queueMutex);
+        for (int n = 0; n < numWorkers; n++) {
+            pthread_join(workerTbl[n], NULL);
+        }
+        close(evFd);
+        evFd = -1;
+    }
+}
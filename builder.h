@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "analytics.h"
+#include "defs.h"
+#include "egress.h"
+#include "msgbuf.h"
+
+// Off-loop leaderboard builder.
+//
+// When enabled, the event loop doesn't rank the riders or
+// format the leaderboard messages itself: at each period it
+// just copies the telemetry of the riders in each category
+// that changed into a job, an immutable snapshot, and hands
+// it to a small pool of worker threads, which build the
+// categories in parallel. A finished job is published back
+// with a release store of its state, and the event loop is
+// woken up through an eventfd; all it has left to do is the
+// fan-out of the message. If any of the riders of the
+// category get the leaderboards compressed, the worker
+// compresses the message too.
+//
+// Each category has two jobs, used as a double buffer: a new
+// snapshot can be taken while the message built from the
+// previous one is still waiting to be sent. If both are busy,
+// the category just skips that period.
+
+// Telemetry of a rider, as copied to the snapshot
+typedef struct BldEntry {
+    uint32_t nameOff;           // offset of the rider's name in the names buffer
+    int bibNum;                 // rider's bib number
+    int distance;               // rider's distance (in meters)
+    int power;                  // rider's power (in watts)
+    int age;                    // age (in msecs) of the rider's telemetry
+    StatsSummary summary;       // rider's stats (if included)
+} BldEntry;
+
+typedef enum BldState {
+    bldIdle = 0,                // free, or being filled by the event loop
+    bldQueued = 1,              // waiting for (or being built by) a worker
+    bldDone = 2,                // message built, waiting to be sent
+} BldState;
+
+typedef struct BldJob {
+    // Set by the event loop when the snapshot is taken
+    int catIdx;                 // index of the category
+    uint32_t seqNum;            // sequence number of the snapshot
+    uint32_t lbTick;            // leaderboard period the snapshot was taken for (0=early leaderboard)
+    int64_t snapTime;           // time (UTC, in usecs) the snapshot was taken
+    char category[16];          // name of the category
+    int maxEntries;             // max riders listed, ranked by distance (0=all, unsorted)
+    Bool stats;                 // include the stats summary of each rider?
+    Bool compress;              // also compress the message?
+    BldEntry *entryTbl;         // telemetry of the riders in the category
+    int numEntries;             // number of entries used
+    int tblSize;                // number of entries allocated
+    MsgBuf names;               // names of the riders, null-terminated back to back
+
+    // Set by the worker
+    MsgBuf msg;                 // leaderboard message
+    EgrBuf *compBuf;            // compressed leaderboard message (NULL=not compressed)
+    int numRiders;              // number of riders in the category (-1=failed to build)
+    uint64_t buildTime;         // time (in nsecs) it took to build the message
+
+    int state;                  // BldState (accessed atomically)
+} BldJob;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Start the worker threads, and allocate the jobs of the
+// specified number of categories.
+extern int bldInit(int numThreads, int numCats);
+
+// Is the builder enabled?
+extern int bldActive(void);
+
+// File descriptor that becomes readable when jobs are done
+extern int bldEventFd(void);
+
+// Get a free job of the category to take a new snapshot,
+// or NULL if both are still busy. The caller fills in the
+// rest of the settings of the job.
+extern BldJob *bldGetJob(int catIdx);
+
+// Add a rider to the snapshot
+extern int bldAddEntry(BldJob *pJob, const char *name, int bibNum, int distance, int power, int age, const StatsSummary *pSummary);
+
+// Queue the job for the workers
+extern void bldSubmit(BldJob *pJob);
+
+// Take the next job whose message was built, or NULL if
+// there are none left. The job must be released with
+// bldRelease() once the message is sent.
+extern BldJob *bldTakeDone(void);
+
+// Give the job back, to be used by the next snapshot
+extern void bldRelease(BldJob *pJob);
+
+// Append the leaderboard entry of a rider to the buffer. If
+// 'pSummary' is NULL, the stats are not included.
+extern int bldPrintEntry(MsgBuf *pBuf, const char *name, int bibNum, int distance, int power, int age, const StatsSummary *pSummary);
+
+// Stop the worker threads
+extern void bldClose(void);
+
+#ifdef __cplusplus
+}
+#endif
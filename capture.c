@@ -0,0 +1,193 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "defs.h"
+#include "log.h"
+
+// The records are queued in a single-producer/single-consumer
+// byte ring: the event loop appends them at the tail, and the
+// writer thread writes them out from the head.
+#define CAP_RING_SIZE   (8 * 1024 * 1024)   // must be a power of 2
+
+static char *capRing;
+static uint64_t capHead;
+static uint64_t capTail;
+static uint64_t capDropped;
+static uint64_t capStart;
+static FILE *capFp;
+static pthread_t capTid;
+static volatile int capStop;
+
+static void *capThread(void *arg)
+{
+    sigset_t sigMask;
+
+    // Leave the signals to the event loop
+    sigfillset(&sigMask);
+    pthread_sigmask(SIG_BLOCK, &sigMask, NULL);
+
+    while (true) {
+        uint64_t head = capHead;
+        uint64_t tail = __atomic_load_n(&capTail, __ATOMIC_ACQUIRE);
+
+        if (head != tail) {
+            // Write out everything up to the tail, in at
+            // most two chunks if the data wraps around.
+            while (head != tail) {
+                size_t off = head & (CAP_RING_SIZE - 1);
+                size_t len = tail - head;
+                if (len > (CAP_RING_SIZE - off)) {
+                    len = CAP_RING_SIZE - off;
+                }
+                if (fwrite((capRing + off), 1, len, capFp) != len) {
+                    MSGLOG(ERROR, "Failed to write capture file! (%s)", strerror(errno));
+                }
+                head += len;
+            }
+            __atomic_store_n(&capHead, head, __ATOMIC_RELEASE);
+        } else if (capStop) {
+            break;
+        } else {
+            struct timespec nap = { .tv_sec = 0, .tv_nsec = 5000000 };
+            fflush(capFp);
+            nanosleep(&nap, NULL);
+        }
+    }
+
+    fflush(capFp);
+
+    return NULL;
+}
+
+int capInit(const char *fileName)
+{
+    CapFileHdr hdr = { .magic = CAP_MAGIC };
+    Timespec now;
+
+    if ((capRing = malloc(CAP_RING_SIZE)) == NULL) {
+        MSGLOG(ERROR, "Failed to alloc capture ring! (%s)", strerror(errno));
+        return -1;
+    }
+
+    if ((capFp = fopen(fileName, "wb")) == NULL) {
+        MSGLOG(ERROR, "Failed to open capture file! file=%s (%s)", fileName, strerror(errno));
+        return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    hdr.startSec = now.tv_sec;
+    hdr.startNsec = now.tv_nsec;
+    if (fwrite(&hdr, sizeof (hdr), 1, capFp) != 1) {
+        MSGLOG(ERROR, "Failed to write capture file! file=%s (%s)", fileName, strerror(errno));
+        return -1;
+    }
+    capStart = monoTimeNs();
+
+    if (pthread_create(&capTid, NULL, capThread, NULL) != 0) {
+        MSGLOG(ERROR, "Failed to create capture thread!");
+        return -1;
+    }
+
+    MSGLOG(INFO, "Capturing traffic to file %s", fileName);
+
+    return 0;
+}
+
+int capActive(void)
+{
+    return (capFp != NULL);
+}
+
+static void ringCopy(uint64_t pos, const void *data, size_t len)
+{
+    size_t off = pos & (CAP_RING_SIZE - 1);
+    size_t len1 = ((CAP_RING_SIZE - off) < len) ? (CAP_RING_SIZE - off) : len;
+
+    memcpy((capRing + off), data, len1);
+    if (len1 < len) {
+        memcpy(capRing, ((const char *) data + len1), (len - len1));
+    }
+}
+
+void capRecord(CapRecType type, uint32_t connId, const void *data, size_t len)
+{
+    CapRecHdr rec;
+    uint64_t tail = capTail;
+
+    if (capFp == NULL) {
+        return;
+    }
+
+    if (len > CAP_MAX_DATA) {
+        len = CAP_MAX_DATA;
+    }
+
+    // Make sure there is room for the record
+    if ((tail + sizeof (rec) + len - __atomic_load_n(&capHead, __ATOMIC_ACQUIRE)) > CAP_RING_SIZE) {
+        if ((capDropped++ % 1000) == 0) {
+            MSGLOG(WARN, "Capture ring full! dropped=%lu", capDropped);
+        }
+        return;
+    }
+
+    rec.timestamp = monoTimeNs() - capStart;
+    rec.connId = connId;
+    rec.type = type;
+    rec.len = len;
+    ringCopy(tail, &rec, sizeof (rec));
+    ringCopy((tail + sizeof (rec)), data, len);
+
+    __atomic_store_n(&capTail, (tail + sizeof (rec) + len), __ATOMIC_RELEASE);
+}
+
+void capClose(void)
+{
+    if (capFp != NULL) {
+        capStop = 1;
+        pthread_join(capTid, NULL);
+        fclose(capFp);
+        capFp = NULL;
+        if (capDropped != 0) {
+            MSGLOG(WARN, "Capture records dropped: %lu", capDropped);
+        }
+    }
+}
+
+FILE *capOpen(const char *fileName, CapFileHdr *pHdr)
+{
+    FILE *fp;
+
+    if ((fp = fopen(fileName, "rb")) == NULL) {
+        MSGLOG(ERROR, "Failed to open capture file! file=%s (%s)", fileName, strerror(errno));
+        return NULL;
+    }
+
+    if ((fread(pHdr, sizeof (*pHdr), 1, fp) != 1) || (memcmp(pHdr->magic, CAP_MAGIC, sizeof (CAP_MAGIC)) != 0)) {
+        MSGLOG(ERROR, "Invalid capture file! file=%s", fileName);
+        fclose(fp);
+        return NULL;
+    }
+
+    return fp;
+}
+
+int capRead(FILE *fp, CapRecHdr *pRec, char *data)
+{
+    if (fread(pRec, sizeof (*pRec), 1, fp) != 1) {
+        return feof(fp) ? 0 : -1;
+    }
+
+    if ((pRec->len != 0) && (fread(data, pRec->len, 1, fp) != 1)) {
+        return -1;
+    }
+    data[pRec->len] = '\0';
+
+    return 1;
+}
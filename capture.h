@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Traffic capture file format: a CapFileHdr followed by a
+// sequence of records, each made of a CapRecHdr followed by
+// 'len' bytes of data. All values are in host byte order.
+#define CAP_MAGIC       "GRSCAP1"
+#define CAP_MAX_DATA    65535
+
+typedef struct CapFileHdr {
+    char magic[8];              // CAP_MAGIC
+    int64_t startSec;           // wall clock time (UTC) the capture started
+    int64_t startNsec;
+} CapFileHdr;
+
+typedef enum CapRecType {
+    capConnect = 1,             // new connection; data is the remote address
+    capData = 2,                // data received on the connection
+    capDisconnect = 3,          // connection closed
+    capRideStarted = 4,         // group ride started
+} CapRecType;
+
+typedef struct CapRecHdr {
+    uint64_t timestamp;         // time (in nsecs) since the start of the capture
+    uint32_t connId;            // connection identifier
+    uint16_t type;              // record type (CapRecType)
+    uint16_t len;               // number of data bytes that follow
+} CapRecHdr;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Start capturing to the specified file. The records are
+// written by a background thread.
+extern int capInit(const char *fileName);
+
+// Is the traffic being captured?
+extern int capActive(void);
+
+// Add a record to the capture. This is called from the
+// event loop, so it never blocks: if the writer thread
+// falls behind, the record is dropped and counted.
+extern void capRecord(CapRecType type, uint32_t connId, const void *data, size_t len);
+
+// Flush the pending records and close the capture file
+extern void capClose(void);
+
+// Open a capture file for reading, returning its header
+extern FILE *capOpen(const char *fileName, CapFileHdr *pHdr);
+
+// Read the next record from the capture file; 'data' must
+// have room for CAP_MAX_DATA+1 bytes, and is null-terminated.
+// Returns 1 if a record was read, 0 at the end of the file,
+// or -1 on error.
+extern int capRead(FILE *fp, CapRecHdr *pRec, char *data);
+
+#ifdef __cplusplus
+}
+#endif
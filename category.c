@@ -0,0 +1,351 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "category.h"
+#include "defs.h"
+#include "log.h"
+
+// Rule of a category scheme, as parsed from the file
+typedef struct CatRule {
+    char name[CAT_MAX_NAME_LEN]; // name of the category
+    int gender;                 // gender matched (-1=any)
+    int minAge;                 // age range (in years)
+    int maxAge;
+    int minWeight;              // weight range (in kg); -1=any weight, known or not
+    int maxWeight;
+    int minWkg;                 // W/kg range (in hundredths), max excluded; -1=any W/kg, known or not
+    int maxWkg;
+} CatRule;
+
+// Bit masks of the rules that match each value. The last
+// entry of the weight and W/kg tables is used for the
+// riders that didn't report them.
+static uint64_t genderMask[GenderMax];
+static uint64_t ageMask[CAT_MAX_AGE + 1];
+static uint64_t weightMask[CAT_MAX_WEIGHT + 2];
+static uint64_t wkgMask[CAT_MAX_WKG + 2];
+
+static int ruleCatTbl[CAT_MAX_RULES]; // category of each rule
+static int numRules;
+
+static char catNameTbl[CAT_MAX_CATS][CAT_MAX_NAME_LEN];
+static int numCats;
+
+// The default scheme: the gender and age group categories.
+// The general age group also takes the riders that didn't
+// report their age.
+static const char *defGenderTbl[] = {
+        [unspec]    "G",
+        [female]    "W",
+        [male]      "M",
+};
+
+static const struct {
+    const char *name;
+    int minAge;
+    int maxAge;
+} defAgeGrpTbl[] = {
+        { "G",      0,      0 },
+        { "G",      100,    CAT_MAX_AGE },
+        { "U19",    1,      18 },
+        { "U35",    19,     34 },
+        { "U40",    35,     39 },
+        { "U45",    40,     44 },
+        { "U50",    45,     49 },
+        { "U55",    50,     54 },
+        { "U60",    55,     59 },
+        { "U65",    60,     64 },
+        { "U70",    65,     69 },
+        { "U75",    70,     74 },
+        { "U80",    75,     79 },
+        { "U85",    80,     84 },
+        { "U90",    85,     89 },
+        { "U95",    90,     94 },
+        { "U100",   95,     99 },
+};
+
+static int clamp(int val, int max)
+{
+    return (val < 0) ? 0 : ((val > max) ? max : val);
+}
+
+static void setMask(uint64_t *tbl, int min, int max, uint64_t bit)
+{
+    for (int n = min; n <= max; n++) {
+        tbl[n] |= bit;
+    }
+}
+
+// Add a rule to the tables
+static int addRule(const CatRule *pRule)
+{
+    uint64_t bit;
+    int catIdx;
+
+    if ((catIdx = catFind(pRule->name)) < 0) {
+        if (numCats == CAT_MAX_CATS) {
+            MSGLOG(ERROR, "Too many categories! max=%d", CAT_MAX_CATS);
+            return -1;
+        }
+        catIdx = numCats++;
+        snprintf(catNameTbl[catIdx], sizeof (catNameTbl[catIdx]), "%s", pRule->name);
+    }
+
+    if (numRules == CAT_MAX_RULES) {
+        MSGLOG(ERROR, "Too many category rules! max=%d", CAT_MAX_RULES);
+        return -1;
+    }
+    bit = 1ULL << numRules;
+    ruleCatTbl[numRules++] = catIdx;
+
+    for (int n = unspec; n < GenderMax; n++) {
+        if ((pRule->gender < 0) || (pRule->gender == n)) {
+            genderMask[n] |= bit;
+        }
+    }
+
+    setMask(ageMask, clamp(pRule->minAge, CAT_MAX_AGE), clamp(pRule->maxAge, CAT_MAX_AGE), bit);
+
+    if (pRule->minWeight < 0) {
+        setMask(weightMask, 0, (CAT_MAX_WEIGHT + 1), bit);
+    } else {
+        setMask(weightMask, clamp(pRule->minWeight, CAT_MAX_WEIGHT), clamp(pRule->maxWeight, CAT_MAX_WEIGHT), bit);
+    }
+
+    if (pRule->minWkg < 0) {
+        setMask(wkgMask, 0, (CAT_MAX_WKG + 1), bit);
+    } else {
+        setMask(wkgMask, clamp(pRule->minWkg, CAT_MAX_WKG), clamp((pRule->maxWkg - 1), CAT_MAX_WKG), bit);
+    }
+
+    return 0;
+}
+
+static int loadDefScheme(void)
+{
+    for (Gender gender = unspec; gender < GenderMax; gender++) {
+        for (int n = 0; n < (sizeof (defAgeGrpTbl) / sizeof (defAgeGrpTbl[0])); n++) {
+            CatRule rule = {
+                .gender = gender,
+                .minAge = defAgeGrpTbl[n].minAge,
+                .maxAge = defAgeGrpTbl[n].maxAge,
+                .minWeight = -1,
+                .minWkg = -1,
+            };
+            snprintf(rule.name, sizeof (rule.name), "%s%s", defGenderTbl[gender], defAgeGrpTbl[n].name);
+            if (addRule(&rule) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Parse a range with the format: [<min>]-[<max>] or <val>;
+// the values are scaled by 'scale' and rounded. A missing
+// bound is set to the specified default.
+static int parseRange(const char *val, double scale, int defMin, int defMax, int *pMin, int *pMax)
+{
+    const char *sep = strchr(val, '-');
+    char *end;
+    double d;
+
+    *pMin = defMin;
+    *pMax = defMax;
+
+    if (sep != val) {
+        d = strtod(val, &end);
+        if ((end == val) || ((sep != NULL) ? (end != sep) : (*end != '\0')) || (d < 0.0)) {
+            return -1;
+        }
+        *pMin = (int) ((d * scale) + 0.5);
+        if (sep == NULL) {
+            *pMax = *pMin;
+            return 0;
+        }
+    }
+
+    if (sep[1] != '\0') {
+        d = strtod((sep + 1), &end);
+        if ((end == (sep + 1)) || (*end != '\0') || (d < 0.0)) {
+            return -1;
+        }
+        *pMax = (int) ((d * scale) + 0.5);
+    }
+
+    return (*pMin <= *pMax) ? 0 : -1;
+}
+
+// Parse a rule with the format:
+//
+//   <name> [gender=<female|male|unspec>] [age=<min>-<max>] [weight=<min>-<max>] [wkg=<min>-<max>]
+//
+static int parseRule(char *line, CatRule *pRule)
+{
+    char *savePtr;
+    char *tok;
+
+    memset(pRule, 0, sizeof (*pRule));
+    pRule->gender = -1;
+    pRule->maxAge = CAT_MAX_AGE;
+    pRule->minWeight = -1;
+    pRule->minWkg = -1;
+
+    if (((tok = strtok_r(line, " \t", &savePtr)) == NULL) || (strlen(tok) >= CAT_MAX_NAME_LEN)) {
+        return -1;
+    }
+    snprintf(pRule->name, sizeof (pRule->name), "%s", tok);
+
+    while ((tok = strtok_r(NULL, " \t", &savePtr)) != NULL) {
+        char *val = strchr(tok, '=');
+        int s;
+
+        if (val == NULL) {
+            return -1;
+        }
+        *val++ = '\0';
+
+        if (strcmp(tok, "gender") == 0) {
+            if (strcmp(val, "female") == 0) {
+                pRule->gender = female;
+            } else if (strcmp(val, "male") == 0) {
+                pRule->gender = male;
+            } else if (strcmp(val, "unspec") == 0) {
+                pRule->gender = unspec;
+            } else {
+                return -1;
+            }
+            s = 0;
+        } else if (strcmp(tok, "age") == 0) {
+            s = parseRange(val, 1.0, 0, CAT_MAX_AGE, &pRule->minAge, &pRule->maxAge);
+        } else if (strcmp(tok, "weight") == 0) {
+            s = parseRange(val, 1.0, 0, CAT_MAX_WEIGHT, &pRule->minWeight, &pRule->maxWeight);
+        } else if (strcmp(tok, "wkg") == 0) {
+            s = parseRange(val, 100.0, 0, (CAT_MAX_WKG + 1), &pRule->minWkg, &pRule->maxWkg);
+        } else {
+            s = -1;
+        }
+
+        if (s != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int loadScheme(const char *fileName)
+{
+    char line[256];
+    int lineNum = 0;
+    FILE *fp;
+
+    if ((fp = fopen(fileName, "r")) == NULL) {
+        MSGLOG(ERROR, "Failed to open category file! file=%s (%s)", fileName, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof (line), fp) != NULL) {
+        char *comment = strchr(line, '#');
+        CatRule rule;
+
+        lineNum++;
+
+        // Skip the comments and blank lines
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strspn(line, " \t") == strlen(line)) {
+            continue;
+        }
+
+        if (parseRule(line, &rule) != 0) {
+            MSGLOG(ERROR, "Invalid category rule! file=%s line=%d", fileName, lineNum);
+            fclose(fp);
+            return -1;
+        }
+        if (addRule(&rule) != 0) {
+            // Error message already printed
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    fclose(fp);
+
+    if (numCats == 0) {
+        MSGLOG(ERROR, "No categories defined! file=%s", fileName);
+        return -1;
+    }
+
+    return 0;
+}
+
+int catInit(const char *fileName)
+{
+    memset(genderMask, 0, sizeof (genderMask));
+    memset(ageMask, 0, sizeof (ageMask));
+    memset(weightMask, 0, sizeof (weightMask));
+    memset(wkgMask, 0, sizeof (wkgMask));
+    numRules = 0;
+    numCats = 0;
+
+    if (((fileName != NULL) ? loadScheme(fileName) : loadDefScheme()) != 0) {
+        return -1;
+    }
+
+    MSGLOG(INFO, "Loaded category scheme: file=%s numCats=%d numRules=%d",
+            (fileName != NULL) ? fileName : "default", numCats, numRules);
+
+    return 0;
+}
+
+int catNumCats(void)
+{
+    return numCats;
+}
+
+const char *catName(int catIdx)
+{
+    return catNameTbl[catIdx];
+}
+
+int catFind(const char *name)
+{
+    for (int n = 0; n < numCats; n++) {
+        if (strcmp(catNameTbl[n], name) == 0) {
+            return n;
+        }
+    }
+
+    return -1;
+}
+
+int catClassify(Gender gender, int age, float weight, int ftp, int *catTbl)
+{
+    int weightIdx = (weight > 0.0) ? clamp((int) (weight + 0.5), CAT_MAX_WEIGHT) : (CAT_MAX_WEIGHT + 1);
+    int wkgIdx = ((weight > 0.0) && (ftp > 0)) ? clamp((int) (((ftp * 100) / weight) + 0.5), CAT_MAX_WKG) : (CAT_MAX_WKG + 1);
+    uint64_t mask = genderMask[gender] & ageMask[clamp(age, CAT_MAX_AGE)] & weightMask[weightIdx] & wkgMask[wkgIdx];
+    int numCatsOut = 0;
+
+    while ((mask != 0) && (numCatsOut < CAT_MAX_PER_RIDER)) {
+        int catIdx = ruleCatTbl[__builtin_ctzll(mask)];
+        int n;
+
+        mask &= (mask - 1);
+
+        // A category can have several rules
+        for (n = 0; (n < numCatsOut) && (catTbl[n] != catIdx); n++) {
+            ;
+        }
+        if (n == numCatsOut) {
+            catTbl[numCatsOut++] = catIdx;
+        }
+    }
+
+    return numCatsOut;
+}
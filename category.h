@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+
+// Leaderboard categories.
+//
+// The categories of a ride are defined by a category scheme,
+// loaded at startup from a text file with one rule per line:
+//
+//   <name> [gender=<female|male|unspec>] [age=<min>-<max>] [weight=<min>-<max>] [wkg=<min>-<max>]
+//
+// A rule without a given attribute matches any value of it,
+// and either bound of a range can be left out. The age and
+// weight (in kg) bounds are inclusive; the W/kg, computed
+// from the FTP and weight of the rider, is matched with the
+// max bound excluded, so that consecutive classes such as
+// "wkg=3.2-4.0" and "wkg=4.0-" don't overlap. A rider that
+// didn't report its weight or FTP only matches the rules
+// that don't use them. Several rules can share a name, in
+// which case a rider that matches any of them belongs to the
+// category.
+//
+// A rider belongs to every category it matches, up to
+// CAT_MAX_PER_RIDER, in the order of the rules in the file;
+// the first one is its primary category. Without a
+// scheme file, the categories are the gender and age group
+// ones (e.g. "MU40" for men 35-39.)
+//
+// The rules are compiled into dense tables, indexed by the
+// gender, the age, the weight and the W/kg (in hundredths),
+// holding the set of rules that match each value as a bit
+// mask; so classifying a rider is just ANDing four table
+// entries, no matter how many rules the scheme has.
+#define CAT_MAX_CATS        64      // max categories in a scheme
+#define CAT_MAX_RULES       64      // max rules in a scheme
+#define CAT_MAX_PER_RIDER   4       // max categories a rider can belong to
+#define CAT_MAX_NAME_LEN    12      // max length of a category name (including the null terminator)
+#define CAT_MAX_AGE         120     // max age (in years) in the tables
+#define CAT_MAX_WEIGHT      250     // max weight (in kg) in the tables
+#define CAT_MAX_WKG         1000    // max W/kg (in hundredths) in the tables
+
+typedef enum Gender {
+    unspec = 0,
+    female = 1,
+    male = 2,
+    GenderMax = 3
+} Gender;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Load the category scheme from the specified file, or the
+// default one if 'fileName' is NULL, and compile its tables.
+extern int catInit(const char *fileName);
+
+// Number of categories in the scheme
+extern int catNumCats(void);
+
+// Name of the specified category
+extern const char *catName(int catIdx);
+
+// Look up a category by name. Returns its index, or -1 if
+// there is no such category.
+extern int catFind(const char *name);
+
+// Get the categories of a rider, with its primary category
+// first, in 'catTbl', which must have room for
+// CAT_MAX_PER_RIDER entries. The weight (in kg) and FTP (in
+// watts) are 0 when not known. Returns the number of
+// categories.
+extern int catClassify(Gender gender, int age, float weight, int ftp, int *catTbl);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,88 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "compress.h"
+#include "defs.h"
+#include "log.h"
+#include "metrics.h"
+
+// The deflate stream of the thread, set up the first time
+// it compresses a message, and reset for each one.
+static __thread z_stream strm;
+static __thread Bool strmReady;
+
+static int initStream(void)
+{
+    int s;
+
+    if ((s = deflateInit2(&strm, COMP_LEVEL, Z_DEFLATED, 15, 8, Z_DEFAULT_STRATEGY)) != Z_OK) {
+        MSGLOG(ERROR, "Failed to init deflate stream! (%s)", zError(s));
+        return -1;
+    }
+    strmReady = true;
+
+    return 0;
+}
+
+EgrBuf *compNewBuf(const char *msg, size_t msgLen)
+{
+    uint64_t t0 = monoTimeNs();
+    size_t textLen = msgLen - 1;
+    EgrBuf *pBuf, *pSmall;
+    uLong bound;
+    uint32_t zlibLen;
+    int s;
+
+    if (!strmReady && (initStream() != 0)) {
+        return NULL;
+    }
+
+    // Start from scratch, with just the dictionary, so that
+    // the message can be decompressed on its own.
+    deflateReset(&strm);
+    if ((s = deflateSetDictionary(&strm, (const Bytef *) COMP_DICTIONARY, (sizeof (COMP_DICTIONARY) - 1))) != Z_OK) {
+        MSGLOG(ERROR, "Failed to set deflate dictionary! (%s)", zError(s));
+        return NULL;
+    }
+
+    bound = deflateBound(&strm, textLen);
+    if ((pBuf = malloc(sizeof (EgrBuf) + COMP_HDR_LEN + bound)) == NULL) {
+        MSGLOG(ERROR, "Failed to alloc EgrBuf object! (%s)", strerror(errno));
+        return NULL;
+    }
+
+    strm.next_in = (Bytef *) msg;
+    strm.avail_in = textLen;
+    strm.next_out = (Bytef *) (pBuf->data + COMP_HDR_LEN);
+    strm.avail_out = bound;
+    if ((s = deflate(&strm, Z_FINISH)) != Z_STREAM_END) {
+        MSGLOG(ERROR, "Failed to compress message! (%s)", zError(s));
+        free(pBuf);
+        return NULL;
+    }
+    zlibLen = bound - strm.avail_out;
+
+    pBuf->refCnt = 1;
+    pBuf->len = COMP_HDR_LEN + zlibLen;
+    pBuf->data[0] = COMP_FRAME_MARKER;
+    pBuf->data[1] = (zlibLen >> 24) & 0xff;
+    pBuf->data[2] = (zlibLen >> 16) & 0xff;
+    pBuf->data[3] = (zlibLen >> 8) & 0xff;
+    pBuf->data[4] = zlibLen & 0xff;
+
+    // Give back the room the message didn't need, as the
+    // buffer can stay queued for a while.
+    if ((pSmall = realloc(pBuf, (sizeof (EgrBuf) + pBuf->len))) != NULL) {
+        pBuf = pSmall;
+    }
+
+    metricsAdd(ctrCompBytesIn, textLen);
+    metricsAdd(ctrCompBytesOut, pBuf->len);
+    metricsRecord(histoCompress, (monoTimeNs() - t0));
+
+    return pBuf;
+}
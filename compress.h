@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "egress.h"
+
+// Leaderboard stream compression.
+//
+// A rider can ask for its leaderboard messages to be sent
+// compressed, by adding the "compression" tag to its regReq
+// message. Each leaderboard is compressed only once, no
+// matter how many riders get it: the deflate stream is reset
+// for every message, and primed with a preset dictionary of
+// the text that all the leaderboards share, so that the same
+// compressed bytes can be queued on every connection that
+// negotiated compression.
+//
+// A compressed message is sent as a frame, which the client
+// can tell apart from a plain JSON message by its first byte:
+//
+//   <COMP_FRAME_MARKER> <length> <zlibData>
+//
+// where 'length' is the length of 'zlibData' as a 32-bit
+// integer in network byte order, and 'zlibData' is the
+// message text (without the null terminator) compressed in
+// the zlib format, using the COMP_DICTIONARY.
+//
+// The stream state is kept per thread, so the messages can
+// be compressed by the builder threads as well as by the
+// event loop.
+#define COMP_FRAME_MARKER   0x01
+#define COMP_HDR_LEN        5       // length of the frame header
+#define COMP_LEVEL          1       // zlib compression level (fastest)
+
+// Preset dictionary: the strings most likely to appear in a
+// leaderboard message, with the most common ones last.
+#define COMP_DICTIONARY \
+    "\"power3s\": \"\", \"power30s\": \"\", \"power5m\": \"\", \"normPower\": \"\", \"avgSpeed\": \"\", \"wkg\": \"\"}, " \
+    "{\"msgType\": \"leaderboard\", \"category\": \"Subscription\", \"riderList\": [" \
+    "{\"name\": \"\", \"bibNum\": \"\", \"distance\": \"\", \"power\": \"\", \"dataAge\": \"\"}, " \
+    "{\"name\": \"\", \"bibNum\": \"\", \"distance\": \"\", \"power\": \"\", \"dataAge\": \"\"}, "
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Allocate a buffer with the message compressed, framed as
+// described above. 'msgLen' includes the null terminator,
+// which is not sent. Returns NULL on error.
+extern EgrBuf *compNewBuf(const char *msg, size_t msgLen);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,10 +1,18 @@
 #pragma once
 
 #include <poll.h>
+#include <stdint.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
 #include <time.h>
 
+#include <netinet/in.h>
+
+#include "analytics.h"
+#include "category.h"
+#include "egress.h"
+#include "ingress.h"
+
 // Default TCP port for the listening socket
 #define DEF_TCP_PORT    50000
 
@@ -22,44 +30,43 @@ typedef enum Bool {
 } Bool;
 
 typedef struct CmdArgs {
+    char *captureFile;          // file where the inbound traffic is captured
+    char *categoryFile;         // file with the category scheme (NULL=default gender and age group categories)
     char *controlFile;          // the URL of the ride's control file
+    char *cpuList;              // CPUs the event loop and the builder threads are pinned to (NULL=not pinned)
     int leaderboardPeriod;      // Period (in seconds) the GRS needs to send its leaderboard messages
+    Bool leaderboardStats;      // Include the rolling power and speed stats in the leaderboard messages
+    int leaderboardThreads;     // Number of worker threads that build the leaderboard messages (0=built by the event loop)
+    Bool lowLatency;            // busy poll the rider sockets, and lock the memory
+    int maxProgUpdPeriod;       // Max period (in msecs) the progUpd period can be raised to under load
     int maxRiders;              // Max number of riders that can join the group ride
+    int metricsPort;            // TCP port used to serve the metrics (0=disabled)
+    int minLeaderboardInterval; // Min time (in msecs) between two leaderboards of a category (0=only send them periodically)
+    int minProgUpdPeriod;       // Min period (in msecs) the progUpd period can be lowered to when idle
+    int overallLeaderboardPeriod; // Period (in seconds) of the overall leaderboards (0=disabled)
+    int overallLeaderboardSize; // Number of riders listed in the overall leaderboards
     int progUpdPeriod;          // Period (in seconds) the client app needs to send its progUpd messages
+    char *recordFile;           // file where the progUpd telemetry is recorded
+    char *replayFile;           // capture file to be replayed
+    double replaySpeed;         // replay speed factor (0=as fast as possible)
     char *rideName;             // the name of the group ride
+    char *shmSocket;            // path of the Unix domain socket used to attach the shared-memory gateways (NULL=disabled)
+    int simDuration;            // duration (in seconds of virtual time) of the simulated ride
+    uint32_t simSeed;           // seed of the simulated traffic
+    int simRiders;              // number of virtual riders to simulate (0=disabled)
     SockAddrStore sockAddr;     // IP address and TCP port (in network byte order) used by GRS to listen for client connections
+    int spectatorPort;          // TCP port used to listen for spectator connections (0=disabled)
+    Bool spinWait;              // spin instead of sleeping while waiting for events
+    int startLeadTime;          // Time (in seconds) the rideStarted message is sent ahead of the start time (0=at the start time)
     time_t startTime;           // Start date/time (in UTC) for the group ride
     int tcpPort;                // TCP port used by the listening socket
+    char *traceFile;            // file where slow loop iterations are traced (Chrome trace format)
+    int traceThreshold;         // min time (in usecs) of a loop iteration to be traced
+    int udpPort;                // UDP port used to receive the progUpd messages (0=disabled)
+    char *unixSocket;           // path of the Unix domain socket used to listen for local client connections (NULL=disabled)
     char *videoFile;            // the URL of the ride's video file
 } CmdArgs;
 
-typedef enum Gender {
-    unspec = 0,
-    female = 1,
-    male = 2,
-    GenderMax = 3
-} Gender;
-
-typedef enum AgeGrp {
-    undef = 0,      // undefined
-    u19 = 1,        // 0-18
-    u35 = 2,        // 19-34
-    u40 = 3,        // 35-39
-    u45 = 4,        // 40-44
-    u50 = 5,        // 45-49
-    u55 = 6,        // 50-54
-    u60 = 7,        // 55-59
-    u65 = 8,        // 60-64
-    u70 = 9,        // 65-69
-    u75 = 10,       // 70-74
-    u80 = 11,       // 75-79
-    u85 = 12,       // 80-84
-    u90 = 13,       // 85-89
-    u95 = 14,       // 90-94
-    u100 = 15,      // 95-99
-    AgeGrpMax = 16
-} AgeGrp;
-
 typedef enum RiderState {
     unknown = 0,    //
     connected = 1,  // Connected but not yet registered
@@ -67,36 +74,128 @@ typedef enum RiderState {
     active = 3      // Active
 } RiderState;
 
+// Degradation levels of the overload controller. Each level
+// includes all the ones before it.
+typedef enum OvlLevel {
+    ovlNormal = 0,              // everything on schedule
+    ovlSkipUnchanged = 1,       // no keepalives or early leaderboards
+    ovlSlowLargeCats = 2,       // halve the leaderboard rate of the largest categories
+    ovlTrimLeaderboards = 3,    // only send the top riders of each category
+    ovlRefuseRegs = 4,          // refuse new registrations
+    OvlLevelMax = 5
+} OvlLevel;
+
+struct Rider;
+
+// Node of a rider in the riderList of one of its categories
+typedef struct CatNode {
+    int catIdx;                 // index of the category
+    struct Rider *pRider;       // the rider
+
+    TAILQ_ENTRY(CatNode) tqEntry; // node in the riderList of the category
+} CatNode;
+
+// Category object
+typedef struct Category {
+    Bool changed;               // changed since its last leaderboard
+    Timespec lastReport;        // time the last leaderboard was sent
+    int numCompressed;          // registered riders that get the leaderboards compressed
+    int numRiders;              // current number of registered riders
+    int progUpdPeriod;          // progUpd period (in msecs) of the riders whose primary category this is
+    uint32_t seqNum;            // sequence number of the snapshot of the last leaderboard sent
+
+    // List of the registered riders in the category
+    TAILQ_HEAD(CatList, CatNode) riderList;
+} Category;
+
 // Rider object
 typedef struct Rider {
     int age;                    // rider's age
-    AgeGrp ageGrp;              // rider's age group
     int bibNum;                 // rider's bib number
+    Bool compression;           // send the leaderboards compressed?
+    CatNode catNodes[CAT_MAX_PER_RIDER]; // nodes in the riderLists of its categories; the first one is the primary
+    uint32_t connId;            // connection identifier
     int distance;               // rider's current distance (in meters) so far
+    size_t egrBudget;           // bytes the rider can still be sent in this loop iteration
+    Bool egrBlocked;            // socket buffer full; waiting for POLLOUT
+    Bool egrListed;             // on the egrList
+    Egress egress;              // messages waiting to be sent
+    Ingress ingress;            // ingress rate limits and partial message
     Gender gender;              // rider's gender
     char *name;                 // rider's name or alias
+    time_t lastUpdTime;         // time (UTC) of the last progUpd message
+    int numCats;                // number of categories the rider belongs to
     int power;                  // rider's current power (in watts)
+    int pollIdx;                // index of the socket in the pollFds array
+    Bool progUpdPending;        // last progUpd not included in a leaderboard sent yet
+    int progUpdPeriod;          // progUpd period (in msecs) last requested from the rider
+    int64_t progUpdRxTime;      // time (UTC, in usecs) the last progUpd was received
+    int64_t progUpdSendTime;    // time (GRS clock, in usecs) the VCA sent the last progUpd (0=not reported)
     time_t regTime;             // time (UTC) the rider registered with the GRS
     int sd;                     // file descriptor of the connected socket
     SockAddrStore sockAddr;     // remote IP address and TCP port
+    Bool startAcked;            // startAck message received?
     RiderState state;           // rider's current state
+    RiderStats stats;           // rider's rolling power and speed stats
+    char *team;                 // rider's team (NULL=none)
+    uint32_t udpSeqNum;         // sequence number of the last progUpd received over UDP
+    uint64_t udpToken;          // session token for the progUpd messages over UDP (0=UDP not used)
 
-    TAILQ_ENTRY(Rider) tqEntry; // node in the riderList
+    TAILQ_ENTRY(Rider) tqEntry; // node in the regList
+    TAILQ_ENTRY(Rider) egrEntry; // node in the egrList
 } Rider;
 
 // Group Ride Server object
 typedef struct Grs {
+    int baseProgUpdPeriod;      // progUpd period (in msecs) for the smallest categories
+    uint64_t busyTime;          // time (in nsecs) spent processing events since the last rate update
+    Category *catTbl;           // the categories of the ride, as defined by the category scheme
+    int bldFdIdx;               // index of the builder eventfd in the pollFds array
+    Rider **bibMapTbl;          // table to look up a Rider record by its bib number
+    int bibMapSize;             // number of entries in the bibMapTbl
+    int connFdIdx;              // index of the first connected socket in the pollFds array
+    Bool egrBacklog;            // riders ran out of egress budget with messages still queued
+    uint32_t lastConnId;        // identifier of the last connection accepted
+    Timespec lastMetricsUpd;    // time the metrics gauges were last updated
+    Timespec lastOverallReport; // time the overall leaderboards were last sent
+    Timespec lastRateUpd;       // time the progUpd periods were last updated
+    uint64_t lbBuildTime;       // time (in nsecs) spent building the leaderboards of the current period
+    uint64_t lbFanoutTime;      // time (in nsecs) spent sending the leaderboards of the current period
+    uint64_t lbLate;            // how late (in nsecs) the current period started
+    int lbPending;              // leaderboards of the current period still being built by the worker threads
+    uint32_t lbSeqNum;          // sequence number of the last leaderboard snapshot
+    uint64_t lbStart;           // time (monotonic, in nsecs) the current period started
+    uint32_t lbTick;            // number of leaderboard periods so far
+    Bool leaderboardStats;      // include the rider stats in the leaderboard messages?
+    Timespec goTime;            // time (UTC) the riders were told to start pedalling
     Timespec lastReport;        // time the last report was sent to the clients
+    Timespec now;               // time the current loop iteration started
+    int numCats;                // number of entries in the catTbl
+    int numConns;               // current number of rider connections
     int numFds;                 // number of entries in the pollFds array
     int numRegRiders;           // current number of registered riders
+    int numThrottled;           // number of connections throttled by the ingress rate limits
+    OvlLevel ovlLevel;          // current degradation level of the overload controller
+    int ovlTicks;               // consecutive leaderboard periods above/below the lag thresholds
     PollFd *pollFds;            // array of file descriptors to be monitored
     Bool rebuildPollFds;        // pollFds array needs to be rebuilt
     Bool rideActive;            // is the group ride active?
+    Bool rideStartedSent;       // was the rideStarted message already sent?
+    int rxStartIdx;             // offset of the first connected socket serviced in the next iteration
+    Bool startSkewReported;     // was the start skew reported by the riders logged?
+    ssize_t (*sendFn)(int sd, const void *buf, size_t len, int flags); // function used to send the messages
+    int (*clockFn)(Timespec *pTime); // function used to read the wall clock
 
-    // List of registered riders per gender and age group
-    TAILQ_HEAD(RiderList, Rider) riderList[GenderMax][AgeGrpMax];
+    // List of all the registered riders
+    TAILQ_HEAD(RiderList, Rider) regList;
+
+    // List of riders with messages waiting to be sent
+    struct RiderList egrList;
 
     int sd;                     // file descriptor of the listening socket
+    int udpSd;                  // file descriptor of the UDP socket (-1=disabled)
+    int unixSd;                 // file descriptor of the Unix domain listening socket (-1=disabled)
+    int unixFdIdx;              // index of the Unix domain listening socket in the pollFds array
 } Grs;
 
 #ifdef __cplusplus
@@ -131,10 +230,19 @@ static __inline__ void tvSub(Timespec *result, const Timespec *x, const Timespec
         result->tv_nsec = x->tv_nsec - y->tv_nsec;
     } else {
         result->tv_sec = (x->tv_sec - 1) - y->tv_sec;
-        result->tv_nsec = (x->tv_nsec + 1000000) - y->tv_nsec;
+        result->tv_nsec = (x->tv_nsec + 1000000000) - y->tv_nsec;
     }
 }
 
+// Return the current time of the monotonic clock, in
+// nanoseconds.
+static __inline__ uint64_t monoTimeNs(void)
+{
+    Timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
 #ifdef __cplusplus
 }
 #endif
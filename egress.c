@@ -0,0 +1,144 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+
+#include "egress.h"
+#include "log.h"
+
+EgrBuf *egrNewBuf(const char *msg, size_t msgLen)
+{
+    EgrBuf *pBuf;
+
+    if ((pBuf = malloc(sizeof (EgrBuf) + msgLen)) == NULL) {
+        MSGLOG(ERROR, "Failed to alloc EgrBuf object! (%s)", strerror(errno));
+        return NULL;
+    }
+
+    pBuf->refCnt = 1;
+    pBuf->len = msgLen;
+    memcpy(pBuf->data, msg, msgLen);
+
+    return pBuf;
+}
+
+void egrReleaseBuf(EgrBuf *pBuf)
+{
+    if (--pBuf->refCnt == 0) {
+        free(pBuf);
+    }
+}
+
+void egrInit(Egress *pEgr)
+{
+    memset(pEgr, 0, sizeof (*pEgr));
+    pEgr->curPrio = -1;
+}
+
+int egrQueue(Egress *pEgr, EgrPrio prio, EgrBuf *pBuf)
+{
+    EgrQueue *pQueue = &pEgr->queue[prio];
+    int dropped = 0;
+
+    if (pQueue->count == EGR_QUEUE_LEN) {
+        // Drop the oldest message; unless it is already
+        // being sent, in which case the next one is dropped
+        // instead.
+        int next = (pQueue->head + 1) % EGR_QUEUE_LEN;
+        if (pEgr->curPrio != prio) {
+            egrReleaseBuf(pQueue->tbl[pQueue->head]);
+        } else {
+            egrReleaseBuf(pQueue->tbl[next]);
+            pQueue->tbl[next] = pQueue->tbl[pQueue->head];
+        }
+        pQueue->head = next;
+        pQueue->count--;
+        pEgr->numQueued--;
+        dropped = 1;
+    }
+
+    pBuf->refCnt++;
+    pQueue->tbl[(pQueue->head + pQueue->count) % EGR_QUEUE_LEN] = pBuf;
+    pQueue->count++;
+    pEgr->numQueued++;
+
+    return dropped;
+}
+
+int egrFlush(Egress *pEgr, int sd, EgrSendFn sendFn, EgrPrio maxPrio, size_t *pBudget)
+{
+    while (pEgr->numQueued != 0) {
+        EgrQueue *pQueue;
+        EgrBuf *pBuf;
+        size_t len;
+        ssize_t n;
+
+        if (pEgr->curPrio < 0) {
+            // Pick the first message of the highest class
+            // that has any.
+            for (int prio = egrControl; prio < EgrPrioMax; prio++) {
+                if (pEgr->queue[prio].count != 0) {
+                    pEgr->curPrio = prio;
+                    break;
+                }
+            }
+            if (pEgr->curPrio > maxPrio) {
+                pEgr->curPrio = -1;
+                return egrPending;
+            }
+        }
+
+        if (*pBudget == 0) {
+            return egrPending;
+        }
+
+        pQueue = &pEgr->queue[pEgr->curPrio];
+        pBuf = pQueue->tbl[pQueue->head];
+        len = pBuf->len - pEgr->offset;
+        if (len > *pBudget) {
+            len = *pBudget;
+        }
+
+        if ((n = sendFn(sd, (pBuf->data + pEgr->offset), len, (MSG_DONTWAIT | MSG_NOSIGNAL))) < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+                return egrBlocked;
+            }
+            return -1;
+        }
+
+        *pBudget -= n;
+
+        pEgr->offset += n;
+        if (pEgr->offset < pBuf->len) {
+            if (n < len) {
+                // Socket buffer is full
+                return egrBlocked;
+            }
+            continue;
+        }
+
+        egrReleaseBuf(pBuf);
+        pQueue->head = (pQueue->head + 1) % EGR_QUEUE_LEN;
+        pQueue->count--;
+        pEgr->numQueued--;
+        pEgr->curPrio = -1;
+        pEgr->offset = 0;
+    }
+
+    return egrIdle;
+}
+
+void egrClear(Egress *pEgr)
+{
+    for (int prio = egrControl; prio < EgrPrioMax; prio++) {
+        EgrQueue *pQueue = &pEgr->queue[prio];
+        while (pQueue->count != 0) {
+            egrReleaseBuf(pQueue->tbl[pQueue->head]);
+            pQueue->head = (pQueue->head + 1) % EGR_QUEUE_LEN;
+            pQueue->count--;
+        }
+    }
+
+    egrInit(pEgr);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Prioritized egress queues of the rider connections.
+//
+// The messages are not sent as soon as they are built, but
+// queued on the connection by priority class, and sent at
+// the end of each event loop iteration: first the control
+// messages of all the connections, then their leaderboards,
+// and then the bulk traffic. Each connection can only send
+// up to EGR_BUDGET bytes per iteration, so that a large
+// category doesn't hold up the rest; whatever is left over
+// is sent in the next iteration.
+//
+// A message is never interleaved with another one: once
+// part of it is sent, the rest goes out before anything
+// else on that connection, whatever its class.
+#define EGR_QUEUE_LEN   16          // max messages queued per class and connection
+#define EGR_BUDGET      (64 * 1024) // max bytes sent per connection and loop iteration
+
+typedef enum EgrPrio {
+    egrControl = 0,             // regResp, rideStarted, rateCtl, clkSyncResp
+    egrLeaderboard = 1,         // category leaderboards and keepalives
+    egrBulk = 2,                // overall leaderboards
+    EgrPrioMax
+} EgrPrio;
+
+typedef enum EgrStatus {
+    egrIdle = 0,                // everything was sent
+    egrPending = 1,             // the budget ran out, or the class limit was reached
+    egrBlocked = 2,             // the socket buffer is full
+} EgrStatus;
+
+// A message shared by all the connections it is queued on
+typedef struct EgrBuf {
+    int refCnt;                 // number of references to the buffer
+    size_t len;                 // message length (including the null terminator)
+    char data[];                // message text
+} EgrBuf;
+
+typedef struct EgrQueue {
+    EgrBuf *tbl[EGR_QUEUE_LEN]; // messages waiting to be sent
+    int head;                   // index of the oldest message
+    int count;                  // number of messages queued
+} EgrQueue;
+
+typedef struct Egress {
+    EgrQueue queue[EgrPrioMax]; // messages waiting to be sent, by class
+    int numQueued;              // total number of messages queued
+    int curPrio;                // class of the message being sent (-1=none)
+    size_t offset;              // bytes of the message being sent already sent
+} Egress;
+
+typedef ssize_t (*EgrSendFn)(int sd, const void *buf, size_t len, int flags);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Allocate a buffer with a copy of the message
+extern EgrBuf *egrNewBuf(const char *msg, size_t msgLen);
+
+// Drop a reference to the buffer
+extern void egrReleaseBuf(EgrBuf *pBuf);
+
+// Init the queues of a new connection
+extern void egrInit(Egress *pEgr);
+
+// Queue a message on the connection, taking a reference to
+// the buffer. If the queue of its class is full, the oldest
+// message not being sent is dropped, and 1 is returned.
+extern int egrQueue(Egress *pEgr, EgrPrio prio, EgrBuf *pBuf);
+
+// Send the queued messages of the classes up to 'maxPrio',
+// without blocking, as long as the budget allows. The bytes
+// sent are taken off the budget. Returns the EgrStatus, or
+// -1 if the connection failed.
+extern int egrFlush(Egress *pEgr, int sd, EgrSendFn sendFn, EgrPrio maxPrio, size_t *pBudget);
+
+// Release all the queued messages
+extern void egrClear(Egress *pEgr);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,18 +1,41 @@
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
+#include "builder.h"
+#include "capture.h"
+#include "category.h"
+#include "compress.h"
+#include "egress.h"
+#include "ingress.h"
 #include "grs.h"
+#include "histo.h"
 #include "json.h"
 #include "log.h"
+#include "lowlat.h"
+#include "metrics.h"
+#include "msgbuf.h"
+#include "ranking.h"
+#include "recorder.h"
+#include "shmring.h"
+#include "spectator.h"
+#include "subscription.h"
+#include "trace.h"
 
 static const char *riderStateTbl[] = {
     [unknown]       "unknown",
@@ -33,11 +56,65 @@ static const char *regResp = "regResp";
 static const char *rideStarted = "rideStarted";
 static const char *progUpd = "progUpd";
 static const char *leaderboard = "leaderboard";
+static const char *rateCtl = "rateCtl";
+static const char *keepalive = "keepalive";
+static const char *clkSyncReq = "clkSyncReq";
+static const char *clkSyncResp = "clkSyncResp";
+static const char *startAck = "startAck";
+static const char *subReq = "subReq";
+static const char *subResp = "subResp";
+
+// Time (in seconds) after the go time at which the start
+// skew reported by the riders is logged.
+#define START_SKEW_REPORT_DELAY 10
+
+// Max start skew (in seconds) a rider can report; anything
+// larger is a bogus start time.
+#define START_SKEW_MAX          60
+
+// Max time (in seconds) a progUpd message can take to reach
+// the server; an older sendTime is bogus, and is ignored.
+#define SEND_TIME_MAX_DELAY     5
+
+// Start skew reported by the riders, in nanoseconds
+static Histo startSkewHisto;
+
+// The progUpd period of each category is adjusted every
+// RATE_UPD_INTERVAL seconds: the base period is raised by
+// 50% when the event loop is busy more than RATE_HIGH_UTIL
+// percent of the time, and lowered by 20% when it is busy
+// less than RATE_LOW_UTIL percent. Categories larger than
+// RATE_CAT_SIZE riders get a longer period, doubling with
+// every 4x increase in size.
+#define RATE_UPD_INTERVAL   5
+#define RATE_HIGH_UTIL      60
+#define RATE_LOW_UTIL       20
+#define RATE_CAT_SIZE       50
+
+// Thresholds of the overload controller (see updOverloadLevel)
+#define OVL_HIGH_LAG        50
+#define OVL_LOW_LAG         20
+#define OVL_RAISE_TICKS     2
+#define OVL_LOWER_TICKS     5
+
+// Number of riders in the trimmed leaderboards
+#define OVL_TOP_N           25
 
 // This table is used to look up a Rider record from
-// its associated socket file descriptor
-#define MAX_FD_VAL    (FD_SETSIZE + 1)
+// its associated socket file descriptor. The sockets are
+// monitored with ppoll(), so they are not limited to
+// FD_SETSIZE.
 static Rider *fdMapTbl[MAX_FD_VAL];
+static int maxFdVal;            // highest file descriptor in the fdMapTbl so far
+
+// The progUpd datagrams are read in batches of up to this
+// many, with recvmmsg().
+#define UDP_BATCH_SIZE  64
+#define UDP_MAX_BATCHES 4
+#define UDP_MAX_DGRAM   512
+static char udpDataBuf[UDP_BATCH_SIZE][UDP_MAX_DGRAM + 1];
+static struct iovec udpIov[UDP_BATCH_SIZE];
+static struct mmsghdr udpMsgs[UDP_BATCH_SIZE];
 
 // Format a SockAddrStore object as the string: <ipAddr>[<portNum>]
 #define SSFMT_BUF_LEN   (INET6_ADDRSTRLEN+1+5+1)
@@ -55,6 +132,12 @@ static char *ssFmt(const SockAddrStore *pSock, char *fmtBuf, size_t bufLen, Bool
         len += INET6_ADDRSTRLEN;
         pAddr = &((SockAddrIn6 *) pSock)->sin6_addr;
         port = ((SockAddrIn6 *) pSock)->sin6_port;
+    } else if (pSock->ss_family == AF_UNIX) {
+        // The clients of a Unix domain socket are usually
+        // unnamed.
+        const char *path = ((const struct sockaddr_un *) pSock)->sun_path;
+        snprintf(fmtBuf, bufLen, "unix:%.*s", (int) (SSFMT_BUF_LEN - 6), (path[0] != '\0') ? path : "*");
+        return fmtBuf;
     } else {
         snprintf(fmtBuf, bufLen, "af=%d invalid!", pSock->ss_family);
         return fmtBuf;
@@ -82,24 +165,71 @@ static const char *genTbl[] = {
         [male]      "M",
 };
 
-static const char *ageGrpTbl[] = {
-        [undef]     "G",
-        [u19]       "U19",
-        [u35]       "U35",
-        [u40]       "U40",
-        [u45]       "U45",
-        [u50]       "U50",
-        [u55]       "U55",
-        [u60]       "U60",
-        [u65]       "U65",
-        [u70]       "U70",
-        [u75]       "U75",
-        [u80]       "U80",
-        [u85]       "U85",
-        [u90]       "U90",
-        [u95]       "U95",
-        [u100]      "U100",
-};
+// Leaderboard names, used to label the metrics and to
+// subscribe the spectators: the categories of the scheme,
+// followed by the overall leaderboards, one per gender plus
+// the overall one (GenderMax).
+static const char **catNames;
+static char overallNameTbl[GenderMax + 1][16];
+
+static __inline__ int overallIdx(const Grs *pGrs, Gender gender) { return pGrs->numCats + gender; }
+
+// Queue a message shared by several riders on the egress
+// queue of the specified rider, and update the message
+// counter. The message is actually sent at the end of the
+// loop iteration (see grsFlushEgress).
+static int queueMsg(Grs *pGrs, Rider *pRider, EgrPrio prio, CtrId msgCtr, EgrBuf *pBuf)
+{
+    if (egrQueue(&pRider->egress, prio, pBuf) != 0) {
+        metricsAdd(ctrEgressDropped, 1);
+    }
+
+    if (!pRider->egrListed) {
+        TAILQ_INSERT_TAIL(&pGrs->egrList, pRider, egrEntry);
+        pRider->egrListed = true;
+    }
+
+    metricsAdd(msgCtr, 1);
+
+    return 0;
+}
+
+// Send a message to the specified rider, with the given
+// priority class.
+static int sendMsg(Grs *pGrs, Rider *pRider, EgrPrio prio, CtrId msgCtr, const char *msg, size_t msgLen)
+{
+    EgrBuf *pBuf;
+
+    if ((pBuf = egrNewBuf(msg, msgLen)) == NULL) {
+        return -1;
+    }
+
+    queueMsg(pGrs, pRider, prio, msgCtr, pBuf);
+    egrReleaseBuf(pBuf);
+
+    return 0;
+}
+
+// Queue a leaderboard message on the specified rider, as is
+// or compressed, depending on what the rider asked for. The
+// plain and compressed buffers ('ppBuf' and 'ppCompBuf') are
+// shared by all the riders that get the message, and are
+// built the first time they are needed; the caller releases
+// them once done.
+static int queueLeaderboardMsg(Grs *pGrs, Rider *pRider, EgrPrio prio, const char *msg, size_t msgLen,
+                               EgrBuf **ppBuf, EgrBuf **ppCompBuf)
+{
+    EgrBuf **ppEgrBuf = (pRider->compression) ? ppCompBuf : ppBuf;
+
+    if (*ppEgrBuf == NULL) {
+        *ppEgrBuf = (pRider->compression) ? compNewBuf(msg, msgLen) : egrNewBuf(msg, msgLen);
+        if (*ppEgrBuf == NULL) {
+            return -1;
+        }
+    }
+
+    return queueMsg(pGrs, pRider, prio, ctrMsgsOutLeaderboard, *ppEgrBuf);
+}
 
 static void buildPollFds(Grs *pGrs)
 {
@@ -111,17 +241,60 @@ static void buildPollFds(Grs *pGrs)
     pGrs->pollFds[n].events = POLLIN;
     pGrs->pollFds[n++].revents = 0;
 
-    // Now add an entry for each connected socket
-    for (int fd = 0; fd < MAX_FD_VAL; fd++) {
-        if (fdMapTbl[fd] != NULL) {
+    // The second one is the UDP socket, if enabled
+    if (pGrs->udpSd >= 0) {
+        pGrs->pollFds[n].fd = pGrs->udpSd;
+        pGrs->pollFds[n].events = POLLIN;
+        pGrs->pollFds[n++].revents = 0;
+    }
+
+    // Then the Unix domain listening socket, if enabled
+    if (pGrs->unixSd >= 0) {
+        pGrs->unixFdIdx = n;
+        pGrs->pollFds[n].fd = pGrs->unixSd;
+        pGrs->pollFds[n].events = POLLIN;
+        pGrs->pollFds[n++].revents = 0;
+    }
+
+    // Then the eventfd of the leaderboard builder, if enabled
+    if (bldActive()) {
+        pGrs->bldFdIdx = n;
+        pGrs->pollFds[n].fd = bldEventFd();
+        pGrs->pollFds[n].events = POLLIN;
+        pGrs->pollFds[n++].revents = 0;
+    }
+
+    // Then the sockets of the shared-memory gateways, if
+    // enabled
+    n = shmAddPollFds(pGrs->pollFds, n);
+
+    pGrs->connFdIdx = n;
+
+    // Now add an entry for each connected socket. The
+    // virtual connections of the gateways have nothing to
+    // poll.
+    for (int fd = 0; fd <= maxFdVal; fd++) {
+        Rider *pRider = fdMapTbl[fd];
+        if ((pRider != NULL) && shmIsConn(fd)) {
+            pRider->pollIdx = -1;
+        } else if (pRider != NULL) {
+            pRider->pollIdx = n;
             pGrs->pollFds[n].fd = fd;
-            pGrs->pollFds[n].events = (POLLIN | POLLRDHUP);
+            pGrs->pollFds[n].events = POLLRDHUP;
+            if (pRider->ingress.throttleUntil == 0) {
+                pGrs->pollFds[n].events |= POLLIN;
+            }
+            if (pRider->egrBlocked) {
+                pGrs->pollFds[n].events |= POLLOUT;
+            }
             pGrs->pollFds[n++].revents = 0;
         }
     }
 
     pGrs->numFds = n;
 
+    metricsSetGauge(gaugeConnections, pGrs->numConns);
+
     // Done!
     pGrs->rebuildPollFds = false;
 }
@@ -164,30 +337,99 @@ static int configGrsSock(Grs *pGrs, const CmdArgs *pArgs)
     return 0;
 }
 
-static int procConnect(Grs *pGrs, const CmdArgs *pArgs)
+// Open the Unix domain socket used to listen for connections
+// from clients running on the same host. They are handled
+// exactly like the TCP connections, but skip the TCP/IP
+// stack altogether.
+static int configUnixSock(Grs *pGrs, const CmdArgs *pArgs)
 {
-    int sd;
-    SockAddrStore sockAddr;
-    socklen_t addrLen = sizeof (sockAddr);
-    int noDelay = 1;
-    Rider *pRider;
+    struct sockaddr_un sockAddr = { .sun_family = AF_UNIX };
+    struct stat fileStat;
 
-    // Accept the new connection
-    if ((sd = accept(pGrs->pollFds[0].fd, (SockAddr *) &sockAddr, &addrLen)) < 0) {
-        MSGLOG(ERROR, "Failed to accept new connection! (%s)\n", strerror(errno));
+    if (strlen(pArgs->unixSocket) >= sizeof (sockAddr.sun_path)) {
+        MSGLOG(ERROR, "Unix domain socket path too long! path=%s", pArgs->unixSocket);
         return -1;
     }
+    strcpy(sockAddr.sun_path, pArgs->unixSocket);
 
-    // Disable Nagel's algo
-    if (setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof (noDelay)) != 0) {
-        MSGLOG(ERROR, "Failed to set TCP_NODELAY option! (%s)\n", strerror(errno));
-        close(sd);
+    // Remove the socket left behind by a previous run, but
+    // nothing else.
+    if ((stat(pArgs->unixSocket, &fileStat) == 0) && S_ISSOCK(fileStat.st_mode)) {
+        unlink(pArgs->unixSocket);
+    }
+
+    if ((pGrs->unixSd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        MSGLOG(ERROR, "Failed to open Unix domain socket! (%s)\n", strerror(errno));
         return -1;
     }
 
-    {
-        char fmtBuf[SSFMT_BUF_LEN];
-        MSGLOG(INFO, "New connection: sd=%d addr=%s", sd, ssFmt(&sockAddr, fmtBuf, sizeof (fmtBuf), true));
+    if (bind(pGrs->unixSd, (SockAddr *) &sockAddr, sizeof (sockAddr)) != 0) {
+        MSGLOG(ERROR, "Failed to bind Unix domain socket! path=%s (%s)\n", pArgs->unixSocket, strerror(errno));
+        close(pGrs->unixSd);
+        pGrs->unixSd = -1;
+        return -1;
+    }
+
+    if (listen(pGrs->unixSd, 64) != 0) {
+        MSGLOG(ERROR, "Failed to listen on Unix domain socket! (%s)\n", strerror(errno));
+        close(pGrs->unixSd);
+        pGrs->unixSd = -1;
+        return -1;
+    }
+
+    MSGLOG(INFO, "Listening for local connections on %s", pArgs->unixSocket);
+
+    return 0;
+}
+
+static int configUdpSock(Grs *pGrs, const CmdArgs *pArgs)
+{
+    SockAddrStore sockAddr = pArgs->sockAddr;
+
+    // Open the UDP socket used to receive the progUpd
+    // messages.
+    if ((pGrs->udpSd = socket(sockAddr.ss_family, SOCK_DGRAM, 0)) < 0) {
+        MSGLOG(ERROR, "Failed to open UDP socket! (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    // Bind it to the same address as the listening TCP
+    // socket, but using the UDP port.
+    if (sockAddr.ss_family == AF_INET) {
+        ((SockAddrIn *) &sockAddr)->sin_port = htons(pArgs->udpPort);
+    } else {
+        ((SockAddrIn6 *) &sockAddr)->sin6_port = htons(pArgs->udpPort);
+    }
+    if (bind(pGrs->udpSd, (SockAddr *) &sockAddr, ssLen(&sockAddr)) != 0) {
+        MSGLOG(ERROR, "Failed to bind UDP socket! (%s)\n", strerror(errno));
+        close(pGrs->udpSd);
+        pGrs->udpSd = -1;
+        return -1;
+    }
+    llConfigSock(pGrs->udpSd);
+
+    // Set up the receive buffers used by recvmmsg()
+    for (int n = 0; n < UDP_BATCH_SIZE; n++) {
+        udpIov[n].iov_base = udpDataBuf[n];
+        udpIov[n].iov_len = UDP_MAX_DGRAM;
+        udpMsgs[n].msg_hdr.msg_iov = &udpIov[n];
+        udpMsgs[n].msg_hdr.msg_iovlen = 1;
+    }
+
+    return 0;
+}
+
+int addRider(Grs *pGrs, int sd, const SockAddrStore *pSockAddr)
+{
+    Rider *pRider;
+    char fmtBuf[SSFMT_BUF_LEN];
+
+    MSGLOG(INFO, "New connection: sd=%d addr=%s", sd, ssFmt(pSockAddr, fmtBuf, sizeof (fmtBuf), true));
+
+    if (sd >= MAX_FD_VAL) {
+        MSGLOG(ERROR, "File descriptor out of range! sd=%d", sd);
+        close(sd);
+        return -1;
     }
 
     if ((pRider = calloc(1, sizeof (Rider))) == NULL) {
@@ -197,12 +439,22 @@ static int procConnect(Grs *pGrs, const CmdArgs *pArgs)
     }
 
     // Init what we can at this point
+    pRider->connId = ++pGrs->lastConnId;
     pRider->sd = sd;
-    pRider->sockAddr = sockAddr;
+    pRider->sockAddr = *pSockAddr;
     pRider->state = connected;
+    egrInit(&pRider->egress);
+    ingInit(&pRider->ingress, (((uint64_t) pGrs->now.tv_sec * 1000000000) + pGrs->now.tv_nsec));
 
     // Create the map entry
     fdMapTbl[sd] = pRider;
+    if (sd > maxFdVal) {
+        maxFdVal = sd;
+    }
+    pGrs->numConns++;
+
+    metricsAdd(ctrConnAccepted, 1);
+    capRecord(capConnect, pRider->connId, fmtBuf, strlen(fmtBuf));
 
     // Need to rebuild the pollFds array
     pGrs->rebuildPollFds = true;
@@ -210,7 +462,41 @@ static int procConnect(Grs *pGrs, const CmdArgs *pArgs)
     return 0;
 }
 
-static int procDisconnect(Grs *pGrs, const CmdArgs *pArgs, int fd)
+static int procConnect(Grs *pGrs, const CmdArgs *pArgs, int listenSd)
+{
+    int sd;
+    SockAddrStore sockAddr = {0};
+    socklen_t addrLen = sizeof (sockAddr);
+    int noDelay = 1;
+
+    // Accept the new connection
+    if ((sd = accept(listenSd, (SockAddr *) &sockAddr, &addrLen)) < 0) {
+        MSGLOG(ERROR, "Failed to accept new connection! (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    // The pollFds array only has room for the max number
+    // of riders.
+    if (pGrs->numConns >= pArgs->maxRiders) {
+        MSGLOG(WARN, "Too many connections! maxRiders=%d", pArgs->maxRiders);
+        close(sd);
+        return 0;
+    }
+
+    // Disable Nagel's algo
+    if ((sockAddr.ss_family != AF_UNIX) && setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof (noDelay)) != 0) {
+        MSGLOG(ERROR, "Failed to set TCP_NODELAY option! (%s)\n", strerror(errno));
+        close(sd);
+        return -1;
+    }
+    if (sockAddr.ss_family != AF_UNIX) {
+        llConfigSock(sd);
+    }
+
+    return addRider(pGrs, sd, &sockAddr);
+}
+
+int procDisconnect(Grs *pGrs, const CmdArgs *pArgs, int fd)
 {
     Rider *pRider;
 
@@ -221,13 +507,39 @@ static int procDisconnect(Grs *pGrs, const CmdArgs *pArgs, int fd)
                 fd, ssFmt(&pRider->sockAddr, fmtBuf, sizeof (fmtBuf), true),
                 riderStateTbl[pRider->state], pRider->name);
         if ((pRider->state == registered) || (pRider->state == active)) {
-            // Remove rider from its gender/age list
-            TAILQ_REMOVE(&pGrs->riderList[pRider->gender][pRider->ageGrp], pRider, tqEntry);
+            // Remove rider from its categories
+            TAILQ_REMOVE(&pGrs->regList, pRider, tqEntry);
+            for (int n = 0; n < pRider->numCats; n++) {
+                Category *pCat = &pGrs->catTbl[pRider->catNodes[n].catIdx];
+                TAILQ_REMOVE(&pCat->riderList, &pRider->catNodes[n], tqEntry);
+                pCat->numRiders--;
+                pCat->numCompressed -= pRider->compression;
+                pCat->changed = true;
+            }
+            rankRemoveRider(pRider);
+            subRemoveRider(pRider->bibNum, pRider->team);
+        }
+        if ((pRider->bibNum > 0) && (pRider->bibNum < pGrs->bibMapSize)) {
+            pGrs->bibMapTbl[pRider->bibNum] = NULL;
         }
+        if (pRider->egrListed) {
+            TAILQ_REMOVE(&pGrs->egrList, pRider, egrEntry);
+        }
+        egrClear(&pRider->egress);
+        if (pRider->ingress.throttleUntil != 0) {
+            pGrs->numThrottled--;
+        }
+        ingFree(&pRider->ingress);
+        free(pRider->team);
+        capRecord(capDisconnect, pRider->connId, NULL, 0);
         fdMapTbl[fd] = NULL;
+        pGrs->numConns--;
         free(pRider);
+        shmConnClosed(fd);
         close(fd);
 
+        metricsAdd(ctrConnClosed, 1);
+
         // Need to rebuild the pollFds array
         pGrs->rebuildPollFds = true;
 
@@ -261,45 +573,6 @@ static int ageFromTagVal(const char *tagVal)
     return age;
 }
 
-static AgeGrp ageToAgeGrp(int age)
-{
-    AgeGrp ageGrp = undef;
-
-    if ((age > 0) && (age <= 18)) {
-        ageGrp = u19;
-    } else if ((age > 18) && (age <= 34)) {
-        ageGrp = u35;
-    } else if ((age > 34) && (age <= 39)) {
-        ageGrp = u40;
-    } else if ((age > 39) && (age <= 44)) {
-        ageGrp = u45;
-    } else if ((age > 44) && (age <= 49)) {
-        ageGrp = u50;
-    } else if ((age > 49) && (age <= 54)) {
-        ageGrp = u55;
-    } else if ((age > 54) && (age <= 59)) {
-        ageGrp = u60;
-    } else if ((age > 59) && (age <= 64)) {
-        ageGrp = u65;
-    } else if ((age > 64) && (age <= 69)) {
-        ageGrp = u70;
-    } else if ((age > 69) && (age <= 74)) {
-        ageGrp = u75;
-    } else if ((age > 74) && (age <= 79)) {
-        ageGrp = u80;
-    } else if ((age > 79) && (age <= 84)) {
-        ageGrp = u85;
-    } else if ((age > 84) && (age <= 89)) {
-        ageGrp = u90;
-    } else if ((age > 89) && (age <= 94)) {
-        ageGrp = u95;
-    } else if ((age > 94) && (age <= 99)) {
-        ageGrp = u100;
-    }
-
-    return ageGrp;
-}
-
 // Send a Registration Response message
 //
 // Message format:
@@ -311,9 +584,18 @@ static AgeGrp ageToAgeGrp(int age)
 //     "startTime": "<StartTimeInUTC>",
 //     "controlFile": "<URL>",
 //     "videoFile": "<URL>",
-//     "progUpdPeriod": "<ProgUpdPeriodInSec>"
+//     "progUpdPeriod": "<ProgUpdPeriodInSec>",
+//     "udpPort": "<UdpPortNum>",
+//     "udpToken": "<SessionToken>",
+//     "compression": "deflate"
 //   }
 //
+// The "udpPort" and "udpToken" tags are only present if the
+// rider asked to send its progUpd messages over UDP, and the
+// UDP channel is enabled. The "compression" tag is only
+// present if the rider asked for the leaderboards to be
+// sent compressed.
+//
 // Example:
 //
 //   {
@@ -330,13 +612,20 @@ static int sendRegRespMsg(Grs *pGrs, const CmdArgs *pArgs, Rider *pRider)
 {
     char msg[1024];
     size_t msgLen;
-    ssize_t len;
 
-    snprintf(msg, sizeof (msg), "{\"msgType\": \"%s\", \"status\": \"success\", \"bibNum\": \"%d\", \"startTime\": \"%ld\", \"controlFile\": \"%s\", \"videoFile\": \"%s\", \"progUpdPeriod\": \"%d\"}",
+    msgLen = snprintf(msg, sizeof (msg), "{\"msgType\": \"%s\", \"status\": \"success\", \"bibNum\": \"%d\", \"startTime\": \"%ld\", \"controlFile\": \"%s\", \"videoFile\": \"%s\", \"progUpdPeriod\": \"%d\"",
             regResp, pRider->bibNum, pArgs->startTime, pArgs->controlFile, pArgs->videoFile, pArgs->progUpdPeriod);
+    if ((pRider->udpToken != 0) && (msgLen < sizeof (msg))) {
+        snprintf((msg + msgLen), (sizeof (msg) - msgLen), ", \"udpPort\": \"%d\", \"udpToken\": \"%016lx\"",
+                pArgs->udpPort, pRider->udpToken);
+    }
+    if (pRider->compression) {
+        strncat(msg, ", \"compression\": \"deflate\"", (sizeof (msg) - strlen(msg) - 1));
+    }
+    strncat(msg, "}", (sizeof (msg) - strlen(msg) - 1));
     msgLen = strlen(msg) + 1;
 
-    if ((len = send(pRider->sd, msg, msgLen, 0)) != msgLen) {
+    if (sendMsg(pGrs, pRider, egrControl, ctrMsgsOutRegResp, msg, msgLen) != 0) {
         MSGLOG(ERROR, "Failed to send data! fd=%d (%s)\n", pRider->sd, strerror(errno));
         return -1;
     }
@@ -347,37 +636,84 @@ static int sendRegRespMsg(Grs *pGrs, const CmdArgs *pArgs, Rider *pRider)
     return 0;
 }
 
-// Send a Ride Started message to all the registered riders in each
-// category.
+// Send a Registration Response message that rejects the
+// registration
 //
 // Message format:
 //
-//   {"type": "rideStarted"}
+//   {
+//     "msgType": "regResp",
+//     "status": "error"
+//   }
 //
-static int sendRideStartedMsg(Grs *pGrs, const CmdArgs *pArgs)
+static int sendRegRejectMsg(Grs *pGrs, Rider *pRider)
 {
-    char msg[1024];
+    char msg[128];
     size_t msgLen;
 
-    snprintf(msg, sizeof (msg), "{\"msgType\": \"%s\"}", rideStarted);
-    msgLen = strlen(msg) + 1;
+    msgLen = snprintf(msg, sizeof (msg), "{\"msgType\": \"%s\", \"status\": \"error\"}", regResp) + 1;
 
-    for (Gender gender = unspec; gender < GenderMax; gender++) {
-        for (AgeGrp ageGrp = undef; ageGrp < AgeGrpMax; ageGrp++) {
-            Rider *pRider;
+    if (sendMsg(pGrs, pRider, egrControl, ctrMsgsOutRegResp, msg, msgLen) != 0) {
+        MSGLOG(ERROR, "Failed to send data! fd=%d (%s)\n", pRider->sd, strerror(errno));
+        return -1;
+    }
 
-            TAILQ_FOREACH(pRider, &pGrs->riderList[gender][ageGrp], tqEntry) {
-                if (pRider->state == registered) {
-                    ssize_t len;
+    return 0;
+}
 
-                    if ((len = send(pRider->sd, msg, msgLen, 0)) != msgLen) {
-                        MSGLOG(ERROR, "Failed to send data! fd=%d (%s)\n", pRider->sd, strerror(errno));
-                        return -1;
-                    }
+// Convert a Timespec value to microseconds
+static __inline__ int64_t tvToUsecs(const Timespec *pTv)
+{
+    return ((int64_t) pTv->tv_sec * 1000000) + (pTv->tv_nsec / 1000);
+}
 
-                    MSGLOG(INFO, "Sent \"%s\" message: fd=%d name=\"%s\" bibNum=%d",
-                            rideStarted, pRider->sd, pRider->name, pRider->bibNum);
-                }
+// Send a Ride Started message to the specified rider.
+//
+// Message format:
+//
+//   {
+//     "msgType": "rideStarted",
+//     "goTime": "<GoTimeInUsecs>"
+//   }
+//
+// "goTime" is the time (in microseconds since the Epoch, on the
+// server's clock) at which the rider must start pedalling. It
+// may be in the future if the message is sent ahead of the
+// start time (see --start-lead-time).
+//
+static int sendRiderRideStartedMsg(Grs *pGrs, Rider *pRider)
+{
+    char msg[128];
+    size_t msgLen;
+
+    msgLen = snprintf(msg, sizeof (msg), "{\"msgType\": \"%s\", \"goTime\": \"%ld\"}",
+            rideStarted, tvToUsecs(&pGrs->goTime)) + 1;
+
+    if (sendMsg(pGrs, pRider, egrControl, ctrMsgsOutRideStarted, msg, msgLen) != 0) {
+        MSGLOG(ERROR, "Failed to send data! fd=%d (%s)\n", pRider->sd, strerror(errno));
+        return -1;
+    }
+
+    MSGLOG(INFO, "Sent \"%s\" message: fd=%d name=\"%s\" bibNum=%d",
+            rideStarted, pRider->sd, pRider->name, pRider->bibNum);
+
+    return 0;
+}
+
+// Send a Ride Started message to all the registered riders,
+// telling them to start pedalling at the specified go time.
+static int sendRideStartedMsg(Grs *pGrs, const CmdArgs *pArgs, const Timespec *pGoTime)
+{
+    Rider *pRider;
+
+    pGrs->goTime = *pGoTime;
+    pGrs->rideStartedSent = true;
+
+    TAILQ_FOREACH(pRider, &pGrs->regList, tqEntry) {
+        if (pRider->state == registered) {
+            if (sendRiderRideStartedMsg(pGrs, pRider) != 0) {
+                // Error message already printed
+                return -1;
             }
         }
     }
@@ -385,6 +721,80 @@ static int sendRideStartedMsg(Grs *pGrs, const CmdArgs *pArgs)
     return 0;
 }
 
+// Send a Rate Control message, which changes the period of
+// the rider's progUpd messages
+//
+// Message format:
+//
+//   {
+//     "msgType": "rateCtl",
+//     "progUpdPeriodMs": "<ProgUpdPeriodInMsec>"
+//   }
+//
+// Example:
+//
+//   {
+//     "msgType": "rateCtl",
+//     "progUpdPeriodMs": "1500"
+//   }
+//
+static int sendRateCtlMsg(Grs *pGrs, Rider *pRider, int progUpdPeriod)
+{
+    char msg[128];
+    size_t msgLen;
+
+    msgLen = snprintf(msg, sizeof (msg), "{\"msgType\": \"%s\", \"progUpdPeriodMs\": \"%d\"}", rateCtl, progUpdPeriod) + 1;
+
+    if (sendMsg(pGrs, pRider, egrControl, ctrMsgsOutRateCtl, msg, msgLen) != 0) {
+        MSGLOG(ERROR, "Failed to send data! fd=%d (%s)\n", pRider->sd, strerror(errno));
+        return -1;
+    }
+
+    pRider->progUpdPeriod = progUpdPeriod;
+
+    MSGLOG(INFO, "Sent \"%s\" message: fd=%d name=\"%s\" bibNum=%d progUpdPeriod=%d",
+            rateCtl, pRider->sd, pRider->name, pRider->bibNum, progUpdPeriod);
+
+    return 0;
+}
+
+// Add the rider to the table used to look up a Rider
+// record by its bib number.
+static int setBibMap(Grs *pGrs, Rider *pRider)
+{
+    if (pRider->bibNum >= pGrs->bibMapSize) {
+        int size = (pGrs->bibMapSize != 0) ? pGrs->bibMapSize : 1024;
+        Rider **tbl;
+        while (size <= pRider->bibNum) {
+            size *= 2;
+        }
+        if ((tbl = realloc(pGrs->bibMapTbl, (size * sizeof (Rider *)))) == NULL) {
+            MSGLOG(ERROR, "Failed to alloc bibMap table! (%s)", strerror(errno));
+            return -1;
+        }
+        memset(&tbl[pGrs->bibMapSize], 0, ((size - pGrs->bibMapSize) * sizeof (Rider *)));
+        pGrs->bibMapTbl = tbl;
+        pGrs->bibMapSize = size;
+    }
+
+    pGrs->bibMapTbl[pRider->bibNum] = pRider;
+
+    return 0;
+}
+
+// Generate a (non-zero) random token that authenticates
+// the progUpd messages a rider sends over UDP.
+static uint64_t genUdpToken(void)
+{
+    uint64_t token = 0;
+
+    while ((token == 0) && (getrandom(&token, sizeof (token), 0) != sizeof (token))) {
+        ;
+    }
+
+    return token;
+}
+
 // Process a Registration Request message
 //
 // Message format:
@@ -394,9 +804,24 @@ static int sendRideStartedMsg(Grs *pGrs, const CmdArgs *pArgs)
 //     "name": "<RidersName>",
 //     "gender": "{female|male|unspec}",
 //     "age": "<RidersAge>",
-//     "ride": "<RideName>"
+//     "ride": "<RideName>",
+//     "weight": "<WeightInKg>",
+//     "ftp": "<FtpInWatts>",
+//     "progUpdTransport": "{tcp|udp}",
+//     "team": "<TeamName>",
+//     "compression": "deflate"
 //   }
 //
+// The "weight" and "ftp" tags are optional, and only used
+// by the categories of the scheme that are based on them.
+// The "progUpdTransport" tag is optional; "udp" asks the
+// server for a session token to send the progUpd messages
+// over UDP. The "team" tag is optional too, and lets other
+// riders follow the team with a subReq message. The
+// "compression" tag is optional as well; "deflate" asks the
+// server to send the leaderboards compressed (see
+// compress.h).
+//
 // Example:
 //
 //   {
@@ -416,6 +841,13 @@ static int procRegReqMsg(Grs *pGrs, const CmdArgs *pArgs, int fd, JsonObject *pM
         if (pRider->state == connected) {
             // Found it!
 
+            // Don't take any new riders when overloaded
+            if (pGrs->ovlLevel >= ovlRefuseRegs) {
+                MSGLOG(WARN, "Registration refused because of overload! fd=%d", fd);
+                metricsAdd(ctrRegsRefused, 1);
+                return sendRegRejectMsg(pGrs, pRider);
+            }
+
             // Get all the tag values
             char *ride = jsonGetTagValue(pMsg, "ride");
             if (ride == NULL) {
@@ -429,10 +861,57 @@ static int procRegReqMsg(Grs *pGrs, const CmdArgs *pArgs, int fd, JsonObject *pM
             pRider->name = jsonGetTagValue(pMsg, "name");
             pRider->gender = genderFromTagVal(jsonGetTagValue(pMsg, "gender"));
             pRider->age = ageFromTagVal(jsonGetTagValue(pMsg, "age"));
-            pRider->ageGrp = ageToAgeGrp(pRider->age);
+
+            // The weight is optional, and only used to
+            // compute the W/kg and for the weight and W/kg
+            // categories; and so is the FTP.
+            float weight = 0.0;
+            char *weightVal = jsonGetTagValue(pMsg, "weight");
+            if (weightVal != NULL) {
+                sscanf(weightVal, "%f", &weight);
+                free(weightVal);
+            }
+            statsInit(&pRider->stats, weight);
+
+            int ftp = 0;
+            char *ftpVal = jsonGetTagValue(pMsg, "ftp");
+            if (ftpVal != NULL) {
+                sscanf(ftpVal, "%d", &ftp);
+                free(ftpVal);
+            }
 
             // Assign a bib number
             pRider->bibNum = ++pGrs->numRegRiders;
+            if (setBibMap(pGrs, pRider) != 0) {
+                free(ride);
+                return -1;
+            }
+
+            // Does the rider want to send its progress
+            // updates over UDP?
+            char *transport = jsonGetTagValue(pMsg, "progUpdTransport");
+            if ((transport != NULL) && (strcmp(transport, "udp") == 0) && (pGrs->udpSd >= 0)) {
+                pRider->udpToken = genUdpToken();
+            }
+            free(transport);
+
+            // Does the rider want its leaderboards
+            // compressed?
+            char *compression = jsonGetTagValue(pMsg, "compression");
+            if ((compression != NULL) && (strcmp(compression, "deflate") == 0)) {
+                pRider->compression = true;
+            }
+            free(compression);
+
+            // The team name can't have commas, since the
+            // subReq message takes a list of them.
+            pRider->team = jsonGetTagValue(pMsg, "team");
+            if ((pRider->team != NULL) &&
+                ((strlen(pRider->team) >= SUB_MAX_TEAM_LEN) || (strchr(pRider->team, ',') != NULL))) {
+                MSGLOG(ERROR, "Invalid team name! fd=%d team=\"%s\"", fd, pRider->team);
+                free(pRider->team);
+                pRider->team = NULL;
+            }
 
             MSGLOG(INFO, "Received \"%s\" message: fd=%d name=\"%s\" gender=%s age=%d",
                      regReq, fd, pRider->name, genderTbl[pRider->gender], pRider->age);
@@ -445,10 +924,48 @@ static int procRegReqMsg(Grs *pGrs, const CmdArgs *pArgs, int fd, JsonObject *pM
 
             // This rider is now registered
             pRider->state = registered;
+            pRider->regTime = pGrs->now.tv_sec;
+
+            // Add the rider to its categories. The rider is
+            // linked into the riderList of each one, so the
+            // telemetry is never copied.
+            int catTbl[CAT_MAX_PER_RIDER];
+            pRider->numCats = catClassify(pRider->gender, pRider->age, weight, ftp, catTbl);
+            for (int n = 0; n < pRider->numCats; n++) {
+                Category *pCat = &pGrs->catTbl[catTbl[n]];
+                pRider->catNodes[n].catIdx = catTbl[n];
+                pRider->catNodes[n].pRider = pRider;
+                TAILQ_INSERT_HEAD(&pCat->riderList, &pRider->catNodes[n], tqEntry);
+                pCat->numRiders++;
+                pCat->numCompressed += pRider->compression;
+                pCat->changed = true;
+            }
+            if (pRider->numCats == 0) {
+                MSGLOG(WARN, "Rider doesn't belong to any category! fd=%d name=\"%s\"", fd, pRider->name);
+            }
+            TAILQ_INSERT_TAIL(&pGrs->regList, pRider, tqEntry);
+            if (rankAddRider(pRider) != 0) {
+                MSGLOG(ERROR, "Failed to add rider to its gender ranking! fd=%d", fd);
+            }
+            if (subAddRider(pRider->bibNum, pRider->team) != 0) {
+                MSGLOG(ERROR, "Failed to add rider to its team! fd=%d", fd);
+            }
+            recRider(pRider->bibNum, ((pRider->numCats != 0) ? catNames[catTbl[0]] : ""), pRider->name);
+
+            // The regResp message has the default progUpd
+            // period; tell the rider if its primary category
+            // uses a different one.
+            pRider->progUpdPeriod = pArgs->progUpdPeriod * 1000;
+            if ((pRider->numCats != 0) && (pGrs->catTbl[catTbl[0]].progUpdPeriod != pRider->progUpdPeriod)) {
+                sendRateCtlMsg(pGrs, pRider, pGrs->catTbl[catTbl[0]].progUpdPeriod);
+            }
 
-            // Move the rider to the correct gender/age
-            // category.
-            TAILQ_INSERT_HEAD(&pGrs->riderList[pRider->gender][pRider->ageGrp], pRider, tqEntry);
+            // If the rideStarted message was already sent
+            // ahead of the start time, this rider needs it
+            // too.
+            if (pGrs->rideStartedSent && !pGrs->rideActive) {
+                sendRiderRideStartedMsg(pGrs, pRider);
+            }
 
             // Don't need this anymore
             free(ride);
@@ -464,6 +981,63 @@ static int procRegReqMsg(Grs *pGrs, const CmdArgs *pArgs, int fd, JsonObject *pM
     return -1;
 }
 
+// Update the rider's progress with the tag values of
+// a progUpd message.
+static void updRiderProgress(Grs *pGrs, Rider *pRider, JsonObject *pMsg)
+{
+    char *distance = jsonGetTagValue(pMsg, "distance");
+    if (distance != NULL) {
+        sscanf(distance, "%d", &pRider->distance);
+        free(distance);
+    } else {
+        MSGLOG(ERROR, "No distance specified! bibNum=%d", pRider->bibNum);
+    }
+
+    char *power = jsonGetTagValue(pMsg, "power");
+    if (power != NULL) {
+        sscanf(power, "%d", &pRider->power);
+        free(power);
+    } else {
+        MSGLOG(ERROR, "No power specified! bibNum=%d", pRider->bibNum);
+    }
+
+    // The speed is only used for the stats, so it is
+    // optional.
+    float speed = 0.0;
+    char *speedVal = jsonGetTagValue(pMsg, "speed");
+    if (speedVal != NULL) {
+        sscanf(speedVal, "%f", &speed);
+        free(speedVal);
+    }
+
+    // The time the VCA sent the message is optional; it must
+    // be on the GRS clock, as estimated with the clkSyncReq
+    // messages.
+    long long sendTime = 0;
+    char *sendTimeVal = jsonGetTagValue(pMsg, "sendTime");
+    if (sendTimeVal != NULL) {
+        sscanf(sendTimeVal, "%lld", &sendTime);
+        free(sendTimeVal);
+    }
+
+    pRider->progUpdRxTime = tvToUsecs(&pGrs->now);
+    pRider->progUpdSendTime = 0;
+    if ((sendTime <= pRider->progUpdRxTime) &&
+        (sendTime >= (pRider->progUpdRxTime - (SEND_TIME_MAX_DELAY * 1000000LL)))) {
+        pRider->progUpdSendTime = sendTime;
+    }
+    pRider->progUpdPending = true;
+
+    statsUpdate(&pRider->stats, pGrs->now.tv_sec, pRider->power, speed);
+    recSample(&pGrs->now, pRider->bibNum, pRider->distance, pRider->power, speed);
+
+    pRider->lastUpdTime = pGrs->now.tv_sec;
+    for (int n = 0; n < pRider->numCats; n++) {
+        pGrs->catTbl[pRider->catNodes[n].catIdx].changed = true;
+    }
+    subRiderChanged(pRider->bibNum);
+}
+
 // Process a Progress Update message
 //
 // Message format:
@@ -497,22 +1071,7 @@ static int procProgUpdMsg(Grs *pGrs, const CmdArgs *pArgs, int fd, JsonObject *p
     // Use the file descriptor to locate the Rider record
     if ((pRider = fdMapTbl[fd]) != NULL) {
         if (pRider->state == registered) {
-            // Get all the tag values
-            char *distance = jsonGetTagValue(pMsg, "distance");
-            if (distance != NULL) {
-                sscanf(distance, "%d", &pRider->distance);
-                free(distance);
-            } else {
-                MSGLOG(ERROR, "No distance specified! fd=%d", fd);
-            }
-
-            char *power = jsonGetTagValue(pMsg, "power");
-            if (power != NULL) {
-                sscanf(power, "%d", &pRider->power);
-                free(power);
-            } else {
-                MSGLOG(ERROR, "No power specified! fd=%d", fd);
-            }
+            updRiderProgress(pGrs, pRider, pMsg);
 
             MSGLOG(INFO, "Received \"%s\" message: fd=%d name=\"%s\" distance=%d power=%d",
                     progUpd, fd, pRider->name, pRider->distance, pRider->power);
@@ -528,42 +1087,621 @@ static int procProgUpdMsg(Grs *pGrs, const CmdArgs *pArgs, int fd, JsonObject *p
     return -1;
 }
 
-static int procData(Grs *pGrs, const CmdArgs *pArgs, int fd)
+// Process a Clock Sync Request message, which the VCA uses to
+// estimate the offset between its clock and the server's, the
+// same way NTP does:
+//
+//   offset = ((serverRxTime - clientTime) + (serverTxTime - clientRxTime)) / 2
+//
+// where "clientRxTime" is the time the VCA received the
+// response. It can be sent at any time after the connection
+// is established.
+//
+// Message format:
+//
+//   {
+//     "msgType": "clkSyncReq",
+//     "clientTime": "<ClientTimeInUsecs>"
+//   }
+//
+// Response format:
+//
+//   {
+//     "msgType": "clkSyncResp",
+//     "clientTime": "<ClientTimeInUsecs>",
+//     "serverRxTime": "<ServerTimeInUsecs>",
+//     "serverTxTime": "<ServerTimeInUsecs>"
+//   }
+//
+static int procClkSyncReqMsg(Grs *pGrs, const CmdArgs *pArgs, int fd, JsonObject *pMsg)
 {
-    char dataBuf[1000];
-    ssize_t dataLen;
+    Rider *pRider;
+    Timespec txTime;
+    char msg[256];
+    size_t msgLen;
+    long long clientTime;
 
-    //printf("Data available: fd=%d\n", fd);
+    if ((pRider = fdMapTbl[fd]) == NULL) {
+        return -1;
+    }
 
-    // Read in all the available data
-    if ((dataLen = read(fd, dataBuf, sizeof (dataBuf))) > 0) {
-        JsonObject msg = {0};
-        if (jsonFindObject(dataBuf, dataLen, &msg) == 0) {
-            const char *msgType = jsonFindTag(&msg, "msgType");
-            if (msgType != NULL) {
-                if (strncmp(msgType, "\"regReq\"", 8) == 0) {
-                    procRegReqMsg(pGrs, pArgs, fd, &msg);
-                } else if (strncmp(msgType, "\"progUpd\"", 9) == 0) {
-                    procProgUpdMsg(pGrs, pArgs, fd, &msg);
-                } else {
-                    MSGLOG(ERROR, "Unsupported message type! msgType=%s", msgType);
-                    jsonDumpObject(&msg);
-                    return -1;
-                }
+    char *val = jsonGetTagValue(pMsg, "clientTime");
+    if ((val == NULL) || (sscanf(val, "%lld", &clientTime) != 1)) {
+        MSGLOG(ERROR, "No client time specified! fd=%d", fd);
+        free(val);
+        return -1;
+    }
+    free(val);
+
+    MSGLOG(INFO, "Received \"%s\" message: fd=%d clientTime=%lld", clkSyncReq, fd, clientTime);
+
+    // The time the message was received is approximated by
+    // the time the current loop iteration started; the
+    // transmit time is taken as late as possible.
+    pGrs->clockFn(&txTime);
+    msgLen = snprintf(msg, sizeof (msg), "{\"msgType\": \"%s\", \"clientTime\": \"%lld\", \"serverRxTime\": \"%ld\", \"serverTxTime\": \"%ld\"}",
+            clkSyncResp, clientTime, tvToUsecs(&pGrs->now), tvToUsecs(&txTime)) + 1;
+
+    if (sendMsg(pGrs, pRider, egrControl, ctrMsgsOutClkSyncResp, msg, msgLen) != 0) {
+        MSGLOG(ERROR, "Failed to send data! fd=%d (%s)\n", pRider->sd, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Process a Start Acknowledge message, in which the VCA reports
+// the time it actually started, converted to the server's clock
+// using the offset it estimated with the clkSyncReq messages.
+//
+// Message format:
+//
+//   {
+//     "msgType": "startAck",
+//     "startTime": "<StartTimeInUsecs>"
+//   }
+//
+static int procStartAckMsg(Grs *pGrs, const CmdArgs *pArgs, int fd, JsonObject *pMsg)
+{
+    Rider *pRider;
+    long long startTime;
+    int64_t goTime, skew;
+
+    if (((pRider = fdMapTbl[fd]) == NULL) || (pRider->state != registered) ||
+        !pGrs->rideStartedSent || pRider->startAcked) {
+        MSGLOG(ERROR, "Unexpected \"%s\" message! fd=%d", startAck, fd);
+        return -1;
+    }
+
+    char *val = jsonGetTagValue(pMsg, "startTime");
+    if ((val == NULL) || (sscanf(val, "%lld", &startTime) != 1)) {
+        MSGLOG(ERROR, "No start time specified! fd=%d", fd);
+        free(val);
+        return -1;
+    }
+    free(val);
+
+    // Make sure the start time is anywhere near the go time,
+    // before doing any math with it.
+    goTime = tvToUsecs(&pGrs->goTime);
+    if ((startTime < (goTime - (START_SKEW_MAX * 1000000LL))) ||
+        (startTime > (goTime + (START_SKEW_MAX * 1000000LL)))) {
+        MSGLOG(ERROR, "Invalid start time! fd=%d startTime=%lld", fd, startTime);
+        return -1;
+    }
+    pRider->startAcked = true;
+
+    // Record the absolute difference from the go time
+    skew = startTime - goTime;
+    MSGLOG(INFO, "Received \"%s\" message: fd=%d name=\"%s\" skew=%ld usecs",
+            startAck, fd, pRider->name, skew);
+    if (skew < 0) {
+        skew = -skew;
+    }
+    metricsRecord(histoStartSkew, (skew * 1000));
+    histoRecord(&startSkewHisto, (skew * 1000));
+
+    return 0;
+}
+
+// Process a Subscription Request message, which replaces the
+// rider's custom leaderboard with one that follows the riders
+// with the listed bib numbers, and the members of the listed
+// teams, whatever their category. Both tags are optional; a
+// message with neither just cancels the subscription.
+//
+// Message format:
+//
+//   {
+//     "msgType": "subReq",
+//     "bibNums": "<BibNum>[,<BibNum>...]",
+//     "teams": "<TeamName>[,<TeamName>...]"
+//   }
+//
+// Response format:
+//
+//   {
+//     "msgType": "subResp",
+//     "status": "{error|success}",
+//     "numRiders": "<NumRiders>"
+//   }
+//
+static int procSubReqMsg(Grs *pGrs, const CmdArgs *pArgs, int fd, JsonObject *pMsg)
+{
+    Rider *pRider;
+    int bibTbl[SUB_MAX_RIDERS];
+    int numBibs = 0;
+    char *teamTbl[SUB_MAX_TEAMS];
+    int numTeams = 0;
+    char *savePtr;
+    char msg[128];
+    size_t msgLen;
+    int numRiders;
+
+    if (((pRider = fdMapTbl[fd]) == NULL) || (pRider->state != registered)) {
+        MSGLOG(ERROR, "Unexpected \"%s\" message! fd=%d", subReq, fd);
+        return -1;
+    }
+
+    char *bibNums = jsonGetTagValue(pMsg, "bibNums");
+    if (bibNums != NULL) {
+        for (char *bib = strtok_r(bibNums, ", ", &savePtr); (bib != NULL) && (numBibs < SUB_MAX_RIDERS);
+             bib = strtok_r(NULL, ", ", &savePtr)) {
+            // The bib numbers are assigned sequentially, so
+            // anything else can't be a rider of this ride.
+            if ((sscanf(bib, "%d", &bibTbl[numBibs]) == 1) &&
+                (bibTbl[numBibs] >= 1) && (bibTbl[numBibs] <= pGrs->numRegRiders)) {
+                numBibs++;
+            }
+        }
+    }
+
+    char *teams = jsonGetTagValue(pMsg, "teams");
+    if (teams != NULL) {
+        for (char *team = strtok_r(teams, ",", &savePtr); (team != NULL) && (numTeams < SUB_MAX_TEAMS);
+             team = strtok_r(NULL, ",", &savePtr)) {
+            if (strlen(team) < SUB_MAX_TEAM_LEN) {
+                teamTbl[numTeams++] = team;
+            }
+        }
+    }
+
+    numRiders = subSubscribe(pRider->bibNum, bibTbl, numBibs, teamTbl, numTeams);
+
+    MSGLOG(INFO, "Received \"%s\" message: fd=%d name=\"%s\" bibNums=%d teams=%d riders=%d",
+            subReq, fd, pRider->name, numBibs, numTeams, numRiders);
+
+    free(bibNums);
+    free(teams);
+
+    if (numRiders < 0) {
+        msgLen = snprintf(msg, sizeof (msg), "{\"msgType\": \"%s\", \"status\": \"error\"}", subResp) + 1;
+    } else {
+        msgLen = snprintf(msg, sizeof (msg), "{\"msgType\": \"%s\", \"status\": \"success\", \"numRiders\": \"%d\"}",
+                subResp, numRiders) + 1;
+    }
+
+    if (sendMsg(pGrs, pRider, egrControl, ctrMsgsOutSubResp, msg, msgLen) != 0) {
+        MSGLOG(ERROR, "Failed to send data! fd=%d (%s)\n", pRider->sd, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Log the distribution of the start skew reported by the
+// riders.
+static void reportStartSkew(Grs *pGrs)
+{
+    MSGLOG(INFO, "Start skew: riders=%d acks=%lu p50=%.3f p90=%.3f p99=%.3f max=%.3f msecs",
+            pGrs->numRegRiders, startSkewHisto.count,
+            (histoPercentile(&startSkewHisto, 50.0) / 1e6),
+            (histoPercentile(&startSkewHisto, 90.0) / 1e6),
+            (histoPercentile(&startSkewHisto, 99.0) / 1e6),
+            (startSkewHisto.max / 1e6));
+    pGrs->startSkewReported = true;
+}
+
+// Process the data received on the specified connection. The
+// data must be null-terminated.
+int procMsg(Grs *pGrs, const CmdArgs *pArgs, int fd, const char *data, size_t dataLen)
+{
+    JsonObject msg = {0};
+    uint64_t start = monoTimeNs();
+    int s = 0;
+
+    if (jsonFindObject(data, dataLen, &msg) == 0) {
+        const char *msgType = jsonFindTag(&msg, "msgType");
+        if (msgType != NULL) {
+            if (strncmp(msgType, "\"regReq\"", 8) == 0) {
+                uint64_t t = traceBegin();
+                metricsAdd(ctrMsgsInRegReq, 1);
+                procRegReqMsg(pGrs, pArgs, fd, &msg);
+                traceEnd(phaseRegistration, t, fd);
+            } else if (strncmp(msgType, "\"progUpd\"", 9) == 0) {
+                metricsAdd(ctrMsgsInProgUpd, 1);
+                procProgUpdMsg(pGrs, pArgs, fd, &msg);
+            } else if (strncmp(msgType, "\"clkSyncReq\"", 12) == 0) {
+                metricsAdd(ctrMsgsInClkSyncReq, 1);
+                procClkSyncReqMsg(pGrs, pArgs, fd, &msg);
+            } else if (strncmp(msgType, "\"startAck\"", 10) == 0) {
+                metricsAdd(ctrMsgsInStartAck, 1);
+                procStartAckMsg(pGrs, pArgs, fd, &msg);
+            } else if (strncmp(msgType, "\"subReq\"", 8) == 0) {
+                metricsAdd(ctrMsgsInSubReq, 1);
+                procSubReqMsg(pGrs, pArgs, fd, &msg);
             } else {
-                MSGLOG(ERROR, "JSON message has no type element!");
-                jsonDumpObject(&msg);
-                return -1;
+                MSGLOG(ERROR, "Unsupported message type! fd=%d msgType=%.16s", fd, msgType);
+                metricsAdd(ctrMsgsInInvalid, 1);
+                s = -1;
             }
         } else {
-            MSGLOG(ERROR, "No JSON message found! fd=%d", fd);
-            return -1;
+            MSGLOG(ERROR, "JSON message has no type element! fd=%d", fd);
+            metricsAdd(ctrMsgsInInvalid, 1);
+            s = -1;
         }
     } else {
+        MSGLOG(ERROR, "No JSON message found! fd=%d", fd);
+        metricsAdd(ctrMsgsInInvalid, 1);
+        s = -1;
+    }
+
+    metricsRecord(histoProcData, (monoTimeNs() - start));
+
+    return s;
+}
+
+static const char *ingPenaltyTbl[] = {
+    [ingAccept]         "accept",
+    [ingDrop]           "drop",
+    [ingThrottle]       "throttle",
+    [ingDisconnect]     "disconnect",
+};
+
+// Apply the penalty for a message that broke the rate
+// limits, or that was invalid. Returns -1 if the rider was
+// disconnected.
+static int applyIngPenalty(Grs *pGrs, const CmdArgs *pArgs, Rider *pRider, IngVerdict verdict)
+{
+    int fd = pRider->sd;
+
+    if (verdict != ingDrop) {
+        MSGLOG(WARN, "Ingress penalty: fd=%d bibNum=%d strikes=%d action=%s",
+                fd, pRider->bibNum, pRider->ingress.strikes, ingPenaltyTbl[verdict]);
+    }
+
+    if (verdict == ingDrop) {
+        metricsAdd(ctrIngressDropped, 1);
+    } else if (verdict == ingThrottle) {
+        // Stop polling the socket for input until the
+        // throttle expires.
+        metricsAdd(ctrIngressThrottled, 1);
+        pGrs->numThrottled++;
+        if ((pGrs->pollFds != NULL) && (pRider->pollIdx >= 0)) {
+            pGrs->pollFds[pRider->pollIdx].events &= ~POLLIN;
+        }
+    } else if (verdict == ingDisconnect) {
+        metricsAdd(ctrIngressDisconnected, 1);
+        procDisconnect(pGrs, pArgs, fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Find the end of the message at the start of the buffer:
+// either its null terminator, or, for the clients that send
+// plain JSON, the closing brace of the object. Returns the
+// length of the message, or 0 if it's not complete yet.
+static size_t findMsgEnd(const char *buf, size_t len)
+{
+    int level = 0;
+
+    for (size_t n = 0; n < len; n++) {
+        if (buf[n] == '\0') {
+            return (n + 1);
+        } else if (buf[n] == '{') {
+            level++;
+        } else if ((buf[n] == '}') && (level > 0) && (--level == 0)) {
+            // Take the null terminator too, if it's there
+            return ((n + 1) < len) && (buf[n + 1] == '\0') ? (n + 2) : (n + 1);
+        }
+    }
+
+    return 0;
+}
+
+int procRxData(Grs *pGrs, const CmdArgs *pArgs, int fd, const char *data, size_t dataLen)
+{
+    Rider *pRider = fdMapTbl[fd];
+    Ingress *pIng = &pRider->ingress;
+    uint64_t now = ((uint64_t) pGrs->now.tv_sec * 1000000000) + pGrs->now.tv_nsec;
+    const char *buf = data;
+    size_t len = dataLen;
+    size_t off = 0;
+
+    metricsAdd(ctrBytesIn, dataLen);
+
+    if (pIng->throttleUntil != 0) {
+        // Only possible when replaying, or on the virtual
+        // connections of a shared-memory gateway, which
+        // aren't polled.
+        metricsAdd(ctrIngressDropped, 1);
+        return 0;
+    }
+
+    // Complete the partial message left over by the previous
+    // read, if any.
+    if (pIng->rxLen != 0) {
+        if (ingAppend(pIng, data, dataLen) != 0) {
+            MSGLOG(ERROR, "Message too long! fd=%d", fd);
+            pIng->rxLen = 0;
+            return applyIngPenalty(pGrs, pArgs, pRider, ingStrike(pIng, now));
+        }
+        buf = pIng->rxBuf;
+        len = pIng->rxLen;
+    }
+
+    // Process each complete message, as long as the rate
+    // limits allow.
+    while (off < len) {
+        char msgBuf[ING_MAX_MSG_SIZE + 1];
+        const char *msg = (buf + off);
+        IngVerdict verdict;
+        size_t msgLen;
+
+        // Skip the separators between the messages, e.g. the
+        // null terminator of a message that ended at its
+        // closing brace in the previous read.
+        if ((*msg == '\0') || isspace((unsigned char) *msg)) {
+            off++;
+            continue;
+        }
+
+        if ((msgLen = findMsgEnd(msg, (len - off))) == 0) {
+            break;
+        }
+
+        off += msgLen;
+
+        // The message parser expects the text to be null
+        // terminated.
+        if ((msg[msgLen - 1] != '\0') && (msgLen <= ING_MAX_MSG_SIZE)) {
+            memcpy(msgBuf, msg, msgLen);
+            msgBuf[msgLen++] = '\0';
+            msg = msgBuf;
+        }
+
+        if (msg[msgLen - 1] != '\0') {
+            MSGLOG(ERROR, "Message too long! fd=%d", fd);
+            verdict = ingStrike(pIng, now);
+        } else if (((verdict = ingCheck(pIng, now, msgLen)) == ingAccept) &&
+                   (procMsg(pGrs, pArgs, fd, msg, msgLen) != 0)) {
+            verdict = ingStrike(pIng, now);
+        }
+
+        if (verdict != ingAccept) {
+            if (applyIngPenalty(pGrs, pArgs, pRider, verdict) != 0) {
+                // The rider is gone
+                return 0;
+            }
+            if (verdict == ingThrottle) {
+                // Discard the rest of the data
+                pIng->rxLen = 0;
+                return 0;
+            }
+        }
+    }
+
+    // Keep the partial message at the end, if any
+    if (off == len) {
+        pIng->rxLen = 0;
+    } else if (ingSavePartial(pIng, (buf + off), (len - off)) != 0) {
+        MSGLOG(ERROR, "Message too long! fd=%d", fd);
+        pIng->rxLen = 0;
+        return applyIngPenalty(pGrs, pArgs, pRider, ingStrike(pIng, now));
+    }
+
+    return 0;
+}
+
+int procConnData(Grs *pGrs, const CmdArgs *pArgs, int fd, const char *data, size_t dataLen)
+{
+    if (capActive()) {
+        capRecord(capData, fdMapTbl[fd]->connId, data, dataLen);
+    }
+
+    return procRxData(pGrs, pArgs, fd, data, dataLen);
+}
+
+// Read the data available on a rider connection, up to the
+// read budget; whatever is left is read in the next loop
+// iteration, so that a busy connection can't hold up the
+// others.
+static int procData(Grs *pGrs, const CmdArgs *pArgs, int fd)
+{
+    char dataBuf[ING_READ_BUDGET];
+    ssize_t dataLen;
+
+    if ((dataLen = read(fd, dataBuf, sizeof (dataBuf))) > 0) {
+        return procConnData(pGrs, pArgs, fd, dataBuf, dataLen);
+    } else if ((dataLen < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+        return 0;
+    }
+
+    // The connection was closed, or failed
+    if (dataLen < 0) {
         MSGLOG(ERROR, "Failed to read data! fd=%d (%s)", fd, strerror(errno));
+    }
+
+    return procDisconnect(pGrs, pArgs, fd);
+}
+
+// Get the value of a tag as an unsigned number
+static int getNumTagVal(JsonObject *pMsg, const char *tag, int base, uint64_t *pVal)
+{
+    char *tagVal = jsonGetTagValue(pMsg, tag);
+    char *end;
+
+    if (tagVal == NULL) {
+        return -1;
+    }
+
+    *pVal = strtoull(tagVal, &end, base);
+    if ((end == tagVal) || (*end != '\0')) {
+        free(tagVal);
+        return -1;
+    }
+
+    free(tagVal);
+
+    return 0;
+}
+
+// Process a Progress Update message received over UDP. The
+// message has the same tags as the one sent over TCP, plus
+// the rider's bib number, the session token returned in the
+// regResp message, and a sequence number that is incremented
+// with each message. Messages that arrive out of order are
+// discarded, as they carry stale data.
+//
+// Message format:
+//
+//   {
+//     "msgType": "progUpd",
+//     "bibNum": "<BibNumber>",
+//     "udpToken": "<SessionToken>",
+//     "seqNum": "<SequenceNumber>",
+//     "distance": "<DistanceInMeters>",
+//     "power": "<PowerInWatts>",
+//     "speed": "<SpeedInMetersPerSec>"
+//   }
+//
+// Example:
+//
+//   {
+//     "msgType": "progUpd",
+//     "bibNum": "123",
+//     "udpToken": "5f0e6a3c9b1d2e47",
+//     "seqNum": "42",
+//     "distance": "1620",
+//     "power": "250",
+//     "speed": "9.722"
+//   }
+//
+static int procUdpMsg(Grs *pGrs, const CmdArgs *pArgs, const char *data, size_t dataLen)
+{
+    JsonObject msg = {0};
+    const char *msgType;
+    uint64_t bibNum, token, seqNum;
+    uint64_t now = ((uint64_t) pGrs->now.tv_sec * 1000000000) + pGrs->now.tv_nsec;
+    IngVerdict verdict;
+    Rider *pRider;
+
+    metricsAdd(ctrBytesIn, dataLen);
+
+    if ((jsonFindObject(data, dataLen, &msg) != 0) ||
+        ((msgType = jsonFindTag(&msg, "msgType")) == NULL) ||
+        (strncmp(msgType, "\"progUpd\"", 9) != 0)) {
+        MSGLOG(ERROR, "Invalid UDP message!");
+        metricsAdd(ctrUdpRejected, 1);
+        return -1;
+    }
+
+    if ((getNumTagVal(&msg, "bibNum", 10, &bibNum) != 0) ||
+        (getNumTagVal(&msg, "udpToken", 16, &token) != 0) ||
+        (getNumTagVal(&msg, "seqNum", 10, &seqNum) != 0)) {
+        MSGLOG(ERROR, "Missing or invalid UDP message tags!");
+        metricsAdd(ctrUdpRejected, 1);
+        return -1;
+    }
+
+    // Use the bib number to locate the Rider record, and
+    // make sure the message comes from that rider.
+    if ((bibNum >= pGrs->bibMapSize) ||
+        ((pRider = pGrs->bibMapTbl[bibNum]) == NULL) ||
+        (pRider->udpToken == 0) || (pRider->udpToken != token)) {
+        MSGLOG(ERROR, "Unauthenticated UDP message! bibNum=%lu", bibNum);
+        metricsAdd(ctrUdpRejected, 1);
+        return -1;
+    }
+
+    // The datagrams are charged to the ingress limits of the
+    // rider's connection, and take the same penalties as the
+    // messages received on it.
+    if (pRider->ingress.throttleUntil != 0) {
+        metricsAdd(ctrIngressDropped, 1);
+        return 0;
+    }
+    if ((verdict = ingCheck(&pRider->ingress, now, dataLen)) != ingAccept) {
+        return applyIngPenalty(pGrs, pArgs, pRider, verdict);
+    }
+
+    // Discard duplicate and out-of-order messages
+    if ((int32_t) ((uint32_t) seqNum - pRider->udpSeqNum) <= 0) {
+        metricsAdd(ctrUdpStale, 1);
+        return 0;
+    }
+
+    // Make sure the group ride has started
+    if (!pGrs->rideActive) {
+        MSGLOG(ERROR, "Group ride is not active! bibNum=%lu", bibNum);
+        metricsAdd(ctrUdpRejected, 1);
+        applyIngPenalty(pGrs, pArgs, pRider, ingStrike(&pRider->ingress, now));
         return -1;
     }
 
+    pRider->udpSeqNum = seqNum;
+    updRiderProgress(pGrs, pRider, &msg);
+    metricsAdd(ctrUdpAccepted, 1);
+
+    // The accepted messages are captured as if they had been
+    // received on the rider's TCP connection, so the null
+    // terminator the datagram doesn't carry is recorded too.
+    if (capActive()) {
+        capRecord(capData, pRider->connId, data, (dataLen + 1));
+    }
+
+    MSGLOG(INFO, "Received \"%s\" message: bibNum=%d seqNum=%u name=\"%s\" distance=%d power=%d",
+            progUpd, pRider->bibNum, pRider->udpSeqNum, pRider->name, pRider->distance, pRider->power);
+
+    return 0;
+}
+
+// Read and process the datagrams received on the UDP socket,
+// in batches.
+static int procUdpData(Grs *pGrs, const CmdArgs *pArgs)
+{
+    for (int b = 0; b < UDP_MAX_BATCHES; b++) {
+        int n;
+
+        if ((n = recvmmsg(pGrs->udpSd, udpMsgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL)) < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+                break;
+            }
+            MSGLOG(ERROR, "Failed to read UDP data! (%s)", strerror(errno));
+            return -1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            size_t dataLen = udpMsgs[i].msg_len;
+
+            if (udpMsgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                MSGLOG(ERROR, "UDP message too long!");
+                metricsAdd(ctrUdpRejected, 1);
+                continue;
+            }
+
+            udpDataBuf[i][dataLen] = '\0';
+            procUdpMsg(pGrs, pArgs, udpDataBuf[i], dataLen);
+        }
+
+        if (n < UDP_BATCH_SIZE) {
+            // No more datagrams pending
+            break;
+        }
+    }
+
     return 0;
 }
 
@@ -573,19 +1711,58 @@ int procFdEvents(Grs *pGrs, const CmdArgs *pArgs, int nFds)
 
     // First check for new connections
     if (pGrs->pollFds[0].revents & POLLIN) {
-        if (procConnect(pGrs, pArgs) != 0) {
+        uint64_t t = traceBegin();
+        if (procConnect(pGrs, pArgs, pGrs->sd) != 0) {
             MSGLOG(ERROR, "Failed to create new connection!");
             return -1;
         }
+        traceEnd(phaseAccept, t, pGrs->pollFds[0].fd);
+    }
+    if ((pGrs->unixSd >= 0) && (pGrs->pollFds[pGrs->unixFdIdx].revents & POLLIN)) {
+        uint64_t t = traceBegin();
+        if (procConnect(pGrs, pArgs, pGrs->unixSd) != 0) {
+            MSGLOG(ERROR, "Failed to create new local connection!");
+            return -1;
+        }
+        traceEnd(phaseAccept, t, pGrs->unixSd);
+    }
+
+    // Then attach and detach the shared-memory gateways
+    if (shmProcFdEvents(pGrs, pArgs, pGrs->pollFds) != 0) {
+        MSGLOG(ERROR, "Failed to process shared-memory gateway events!");
+        return -1;
+    }
+
+    // Then check for progUpd messages sent over UDP
+    if ((pGrs->udpSd >= 0) && (pGrs->pollFds[1].revents & POLLIN)) {
+        uint64_t t = traceBegin();
+        if (procUdpData(pGrs, pArgs) != 0) {
+            // Error message already printed
+            return -1;
+        }
+        traceEnd(phaseReadParse, t, pGrs->udpSd);
     }
 
-    // Next check for events on any of the connected sockets
-    for (int n = 1; n < pGrs->numFds; n++) {
+    // Next check for events on any of the connected sockets,
+    // starting from a different one at each iteration, so
+    // that none of them is always served first.
+    int numConns = pGrs->numFds - pGrs->connFdIdx;
+    for (int i = 0; i < numConns; i++) {
+        int n = pGrs->connFdIdx + ((pGrs->rxStartIdx + i) % numConns);
         int revents = pGrs->pollFds[n].revents;
-        if (revents & (POLLRDHUP | POLLHUP)) {
+        if ((revents & POLLOUT) && (fdMapTbl[pGrs->pollFds[n].fd] != NULL)) {
+            // The socket can take more data; its messages
+            // are sent at the end of the loop iteration.
+            fdMapTbl[pGrs->pollFds[n].fd]->egrBlocked = false;
+            pGrs->pollFds[n].events &= ~POLLOUT;
+            revents &= ~POLLOUT;
+        }
+        if (revents & (POLLRDHUP | POLLHUP | POLLERR)) {
             s = procDisconnect(pGrs, pArgs, pGrs->pollFds[n].fd);
         } else if (revents & POLLIN) {
+            uint64_t t = traceBegin();
             s = procData(pGrs, pArgs, pGrs->pollFds[n].fd);
+            traceEnd(phaseReadParse, t, pGrs->pollFds[n].fd);
         } else if (revents != 0) {
             MSGLOG(ERROR, "Unknown event! fd=%d revents=%x",
                     pGrs->pollFds[n].fd, pGrs->pollFds[n].revents);
@@ -593,6 +1770,10 @@ int procFdEvents(Grs *pGrs, const CmdArgs *pArgs, int nFds)
         }
     }
 
+    if (numConns != 0) {
+        pGrs->rxStartIdx = (pGrs->rxStartIdx + 1) % numConns;
+    }
+
     if (pGrs->rebuildPollFds) {
         // Rebuild the pollFds array to add new connections
         // and remove stale connections...
@@ -635,99 +1816,1220 @@ int procFdEvents(Grs *pGrs, const CmdArgs *pArgs, int nFds)
 //   }
 //  }
 //
-int sendLeaderboardMsg(Grs *pGrs, const CmdArgs *pArgs)
+// Sort the riders by distance, in descending order
+static int cmpRiderDistance(const void *p1, const void *p2)
 {
-    //MSGLOG(INFO, "Sending leaderboard messages...");
+    const Rider *pRider1 = *(const Rider **) p1;
+    const Rider *pRider2 = *(const Rider **) p2;
 
-    for (Gender gender = unspec; gender < GenderMax; gender++) {
-        for (AgeGrp ageGrp = undef; ageGrp < AgeGrpMax; ageGrp++) {
-            Rider *pRider;
-            static char msg[65536];
-            char *buf;
-            size_t bufLen;
-            size_t msgLen;
-            int numRiders;
-            int n;
-
-            buf = msg;
-            bufLen = sizeof (msg);
-            msgLen = 0;
-            numRiders = 0;
-
-            n = snprintf(buf, bufLen, "{\"msgType\": \"%s\", \"category\": \"%s%s\", \"riderList\": [",
-                    leaderboard, genTbl[gender], ageGrpTbl[ageGrp]);
-            msgLen += n;
-            buf += n;
-            bufLen -= n;
-
-            // Populate the riderList array
-            TAILQ_FOREACH(pRider, &pGrs->riderList[gender][ageGrp], tqEntry) {
-                if (pRider->state == registered) {
-                    n = snprintf(buf, bufLen, "{\"name\": \"%s\", \"bibNum\": \"%d\", \"distance\": \"%d\", \"power\": \"%d\"}, ",
-                            pRider->name, pRider->bibNum, pRider->distance, pRider->power);
-                    msgLen += n;
-                    buf += n;
-                    bufLen -= n;
-                    numRiders++;
-                }
-            }
+    return (pRider2->distance > pRider1->distance) - (pRider2->distance < pRider1->distance);
+}
 
-            // Remove the last ", " characters
-            msgLen -= 2;
-            buf -= 2;
-            bufLen +=2;
-
-            n = snprintf(buf, bufLen, "]}");
-            msgLen += n;
-            buf += n;
-            bufLen -= n;
-
-            if (numRiders > 0) {
-                MSGLOG(INFO, "Sending \"%s\" message: %s", leaderboard, msg);
-
-                // Now send the message to all the riders in this category
-                TAILQ_FOREACH(pRider, &pGrs->riderList[gender][ageGrp], tqEntry) {
-                    if (pRider->state == registered) {
-                        ssize_t len;
-
-                        if ((len = send(pRider->sd, msg, msgLen, 0)) != msgLen) {
-                            MSGLOG(ERROR, "Failed to send message! fd=%d (%s)\n", pRider->sd, strerror(errno));
-                            return -1;
-                        }
-
-                        MSGLOG(INFO, "Sent \"%s\" message: fd=%d name=\"%s\" bibNum=%d",
-                                leaderboard, pRider->sd, pRider->name, pRider->bibNum);
-                    }
-                }
-            }
-        }
+// Return the age (in msecs) of the rider's telemetry: the time
+// since the VCA sent its last progUpd message, if it said when,
+// or else since the server received it.
+static int telemetryAge(const Grs *pGrs, const Rider *pRider)
+{
+    int64_t dataTime = pRider->progUpdRxTime;
+    int64_t age;
+
+    if (pRider->progUpdSendTime != 0) {
+        dataTime = pRider->progUpdSendTime;
+    } else if (dataTime == 0) {
+        // No progUpd yet
+        dataTime = (int64_t) pRider->regTime * 1000000;
     }
 
-    clock_gettime(CLOCK_REALTIME, &pGrs->lastReport);
+    // Keep it in range, whatever the clocks did, and even if
+    // the rider has been quiet for ages.
+    age = (tvToUsecs(&pGrs->now) - dataTime) / 1000;
+    if (age < 0) {
+        return 0;
+    }
+
+    return (age > INT_MAX) ? INT_MAX : (int) age;
+}
+
+static int printLeaderboardEntry(const Grs *pGrs, const Rider *pRider, MsgBuf *pBuf)
+{
+    return bldPrintEntry(pBuf, pRider->name, pRider->bibNum, pRider->distance, pRider->power, telemetryAge(pGrs, pRider),
+                         (pGrs->leaderboardStats ? &pRider->stats.summary : NULL));
+}
+
+int buildLeaderboardMsg(const Grs *pGrs, int catIdx, int maxEntries, MsgBuf *pBuf)
+{
+    static const Rider **sortTbl;
+    static int sortTblSize;
+    const CatNode *pNode;
+    int numRiders = 0;
+
+    msgBufReset(pBuf);
+
+    if (msgBufPrintf(pBuf, "{\"msgType\": \"%s\", \"category\": \"%s\", \"riderList\": [",
+            leaderboard, catNames[catIdx]) < 0) {
+        return -1;
+    }
+
+    // Populate the riderList array
+    if (maxEntries == 0) {
+        TAILQ_FOREACH(pNode, &pGrs->catTbl[catIdx].riderList, tqEntry) {
+            const Rider *pRider = pNode->pRider;
+            if (pRider->state == registered) {
+                if (printLeaderboardEntry(pGrs, pRider, pBuf) < 0) {
+                    return -1;
+                }
+                numRiders++;
+            }
+        }
+    } else {
+        // Only include the riders that are ahead
+        TAILQ_FOREACH(pNode, &pGrs->catTbl[catIdx].riderList, tqEntry) {
+            const Rider *pRider = pNode->pRider;
+            if (pRider->state == registered) {
+                if (numRiders == sortTblSize) {
+                    int size = (sortTblSize != 0) ? (sortTblSize * 2) : 1024;
+                    const Rider **tbl;
+                    if ((tbl = realloc(sortTbl, (size * sizeof (Rider *)))) == NULL) {
+                        return -1;
+                    }
+                    sortTbl = tbl;
+                    sortTblSize = size;
+                }
+                sortTbl[numRiders++] = pRider;
+            }
+        }
+
+        qsort(sortTbl, numRiders, sizeof (Rider *), cmpRiderDistance);
+
+        for (int n = 0; (n < numRiders) && (n < maxEntries); n++) {
+            if (printLeaderboardEntry(pGrs, sortTbl[n], pBuf) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    if (numRiders > 0) {
+        // Remove the last ", " characters
+        msgBufTrim(pBuf, 2);
+    }
+
+    if (msgBufPrintf(pBuf, "]}") < 0) {
+        return -1;
+    }
+
+    return numRiders;
+}
+
+static const char *ovlLevelTbl[] = {
+    [ovlNormal]             "normal",
+    [ovlSkipUnchanged]      "skipUnchanged",
+    [ovlSlowLargeCats]      "slowLargeCats",
+    [ovlTrimLeaderboards]   "trimLeaderboards",
+    [ovlRefuseRegs]         "refuseRegs",
+};
+
+// Update the degradation level of the overload controller,
+// based on the lag of the last leaderboard period; i.e. how
+// late it started, plus the time it took to build and send
+// all the leaderboards, as a percentage of the period. The
+// level goes up one step after OVL_RAISE_TICKS consecutive
+// periods with a lag above OVL_HIGH_LAG, and down one step
+// after OVL_LOWER_TICKS consecutive periods below OVL_LOW_LAG.
+static void updOverloadLevel(Grs *pGrs, const CmdArgs *pArgs, uint64_t lag)
+{
+    int lagPct = (lag * 100) / ((uint64_t) pArgs->leaderboardPeriod * 1000000000);
+    OvlLevel level = pGrs->ovlLevel;
+
+    metricsSetGauge(gaugeLeaderboardLag, lagPct);
+
+    if (lagPct > OVL_HIGH_LAG) {
+        pGrs->ovlTicks = (pGrs->ovlTicks > 0) ? (pGrs->ovlTicks + 1) : 1;
+        if ((pGrs->ovlTicks >= OVL_RAISE_TICKS) && (level < ovlRefuseRegs)) {
+            level++;
+        }
+    } else if (lagPct < OVL_LOW_LAG) {
+        pGrs->ovlTicks = (pGrs->ovlTicks < 0) ? (pGrs->ovlTicks - 1) : -1;
+        if ((pGrs->ovlTicks <= -OVL_LOWER_TICKS) && (level > ovlNormal)) {
+            level--;
+        }
+    } else {
+        pGrs->ovlTicks = 0;
+    }
+
+    if (level != pGrs->ovlLevel) {
+        MSGLOG(WARN, "Overload level changed: %s -> %s lag=%d%%", ovlLevelTbl[pGrs->ovlLevel], ovlLevelTbl[level], lagPct);
+        pGrs->ovlLevel = level;
+        pGrs->ovlTicks = 0;
+        metricsSetGauge(gaugeOverloadLevel, level);
+        metricsAdd(ctrOvlLevelChanges, 1);
+    }
+}
+
+// Send a Keepalive message to the riders in a category whose
+// leaderboard didn't change during the last period.
+//
+// Message format:
+//
+//   {
+//     "msgType": "keepalive",
+//     "category": "<Category>"
+//   }
+//
+static int sendKeepaliveMsg(Grs *pGrs, int catIdx)
+{
+    char msg[128];
+    size_t msgLen;
+    CatNode *pNode;
+
+    EgrBuf *pBuf = NULL;
+
+    msgLen = snprintf(msg, sizeof (msg), "{\"msgType\": \"%s\", \"category\": \"%s\"}",
+            keepalive, catNames[catIdx]) + 1;
+
+    TAILQ_FOREACH(pNode, &pGrs->catTbl[catIdx].riderList, tqEntry) {
+        Rider *pRider = pNode->pRider;
+        if (pRider->state == registered) {
+            if ((pBuf == NULL) && ((pBuf = egrNewBuf(msg, msgLen)) == NULL)) {
+                return -1;
+            }
+            queueMsg(pGrs, pRider, egrLeaderboard, ctrMsgsOutKeepalive, pBuf);
+        }
+    }
+
+    if (pBuf != NULL) {
+        egrReleaseBuf(pBuf);
+    }
+
+    return 0;
+}
+
+// Send the leaderboard message of a category to its riders
+// and spectators, and add the time it took to the fan-out
+// time. The progUpd messages received up to 'snapTime' (when
+// the message was built) are included in it, so their
+// freshness is recorded. If the message was already
+// compressed by a builder thread, 'pCompBuf' has it.
+static int fanoutCatLeaderboardMsg(Grs *pGrs, int catIdx, const MsgBuf *pMsg, EgrBuf *pCompBuf,
+                                   int64_t snapTime, uint64_t *pFanoutTime)
+{
+    size_t msgLen = pMsg->len + 1;
+    uint64_t t1 = monoTimeNs();
+    int64_t now = tvToUsecs(&pGrs->now);
+    CatNode *pNode;
+    EgrBuf *pEgrBuf = NULL;
+    int s = 0;
+
+    // Hold our own reference to the compressed message, so
+    // that it's released along with the plain one.
+    if (pCompBuf != NULL) {
+        pCompBuf->refCnt++;
+    }
+
+    MSGLOG(INFO, "Sending \"%s\" message: %s", leaderboard, pMsg->data);
+
+    // The spectators get the same message, but they
+    // are served by their own thread.
+    specPublish(catIdx, pMsg->data, msgLen);
+
+    // Now queue the message to all the riders in this
+    // category; they all share the same buffer, or the
+    // same compressed one.
+    TAILQ_FOREACH(pNode, &pGrs->catTbl[catIdx].riderList, tqEntry) {
+        Rider *pRider = pNode->pRider;
+        if (pRider->state == registered) {
+            if ((s = queueLeaderboardMsg(pGrs, pRider, egrLeaderboard, pMsg->data, msgLen, &pEgrBuf, &pCompBuf)) != 0) {
+                break;
+            }
+
+            // A rider in several categories has its progUpd
+            // recorded by the first leaderboard that has it.
+            if (pRider->progUpdPending && (pRider->progUpdRxTime <= snapTime)) {
+                metricsRecordFreshness(catIdx, ((now - pRider->progUpdRxTime) * 1000));
+                pRider->progUpdPending = false;
+            }
+
+            MSGLOG(INFO, "Sent \"%s\" message: fd=%d name=\"%s\" bibNum=%d",
+                    leaderboard, pRider->sd, pRider->name, pRider->bibNum);
+        }
+    }
+    if (pEgrBuf != NULL) {
+        egrReleaseBuf(pEgrBuf);
+    }
+    if (pCompBuf != NULL) {
+        egrReleaseBuf(pCompBuf);
+    }
+
+    *pFanoutTime += monoTimeNs() - t1;
+    traceEnd(phaseLbFanout, t1, catIdx);
+
+    return s;
+}
+
+// Take a snapshot of the telemetry of the riders in a
+// category, and queue it for the builder threads. If both
+// jobs of the category are still busy, the category is left
+// as changed, to be reported in a later period.
+static int snapCatLeaderboard(Grs *pGrs, int catIdx, int maxEntries, uint32_t lbTick)
+{
+    Category *pCat = &pGrs->catTbl[catIdx];
+    const CatNode *pNode;
+    BldJob *pJob;
+
+    if ((pJob = bldGetJob(catIdx)) == NULL) {
+        metricsAdd(ctrLbSnapsSkipped, 1);
+        return 0;
+    }
+
+    pJob->seqNum = ++pGrs->lbSeqNum;
+    pJob->lbTick = lbTick;
+    pJob->snapTime = tvToUsecs(&pGrs->now);
+    snprintf(pJob->category, sizeof (pJob->category), "%s", catNames[catIdx]);
+    pJob->maxEntries = maxEntries;
+    pJob->stats = pGrs->leaderboardStats;
+    pJob->compress = (pCat->numCompressed != 0);
+
+    TAILQ_FOREACH(pNode, &pCat->riderList, tqEntry) {
+        const Rider *pRider = pNode->pRider;
+        if (pRider->state == registered) {
+            if (bldAddEntry(pJob, pRider->name, pRider->bibNum, pRider->distance, pRider->power, telemetryAge(pGrs, pRider),
+                            &pRider->stats.summary) != 0) {
+                MSGLOG(ERROR, "Failed to take leaderboard snapshot! (%s)", strerror(errno));
+                bldRelease(pJob);
+                return -1;
+            }
+        }
+    }
+
+    pCat->changed = false;
+    pCat->lastReport = pGrs->now;
+
+    if (pJob->numEntries == 0) {
+        // Nothing to report
+        bldRelease(pJob);
+        return 0;
+    }
+
+    bldSubmit(pJob);
+    if (lbTick != 0) {
+        pGrs->lbPending++;
+    }
+
+    return 0;
+}
+
+// Build and send the leaderboard message of a category, and
+// add the time it took to the build and fan-out times. If
+// the builder threads are enabled, this only takes the
+// snapshot of the category; the message is sent when it's
+// built. A 'lbTick' of 0 means it's an early leaderboard.
+static int sendCatLeaderboardMsg(Grs *pGrs, int catIdx, int maxEntries, uint32_t lbTick,
+                                 uint64_t *pBuildTime, uint64_t *pFanoutTime)
+{
+    static MsgBuf msg;
+    Category *pCat = &pGrs->catTbl[catIdx];
+    CatNode *pNode;
+    int numRiders;
+    uint64_t t0 = monoTimeNs();
+
+    // Bring the stats of the riders up to date
+    if (pGrs->leaderboardStats) {
+        TAILQ_FOREACH(pNode, &pCat->riderList, tqEntry) {
+            statsFinalize(&pNode->pRider->stats, pGrs->now.tv_sec);
+        }
+    }
+
+    if (bldActive()) {
+        return snapCatLeaderboard(pGrs, catIdx, maxEntries, lbTick);
+    }
+
+    if ((numRiders = buildLeaderboardMsg(pGrs, catIdx, maxEntries, &msg)) < 0) {
+        MSGLOG(ERROR, "Failed to build leaderboard message! (%s)", strerror(errno));
+        return -1;
+    }
+
+    *pBuildTime += monoTimeNs() - t0;
+    traceEnd(phaseLbBuild, t0, catIdx);
+
+    pCat->changed = false;
+    pCat->lastReport = pGrs->now;
+
+    if (numRiders > 0) {
+        return fanoutCatLeaderboardMsg(pGrs, catIdx, &msg, NULL, tvToUsecs(&pGrs->now), pFanoutTime);
+    }
+
+    return 0;
+}
+
+// All the leaderboards of the current period were sent:
+// record how long it took, and update the overload level.
+static void endLeaderboardPeriod(Grs *pGrs, const CmdArgs *pArgs)
+{
+    metricsRecord(histoLbBuild, pGrs->lbBuildTime);
+    metricsRecord(histoLbFanout, pGrs->lbFanoutTime);
+    updOverloadLevel(pGrs, pArgs, (pGrs->lbLate + (monoTimeNs() - pGrs->lbStart)));
+    pGrs->lbPending = 0;
+}
+
+// Send the leaderboard messages built by the worker threads.
+// Since each category has two jobs, a message is dropped if
+// a newer one of the same category was already sent.
+static int sendBuiltLeaderboardMsgs(Grs *pGrs, const CmdArgs *pArgs)
+{
+    BldJob *pJob;
+
+    while ((pJob = bldTakeDone()) != NULL) {
+        Category *pCat = &pGrs->catTbl[pJob->catIdx];
+        uint64_t fanoutTime = 0;
+        int s = 0;
+
+        if (pJob->numRiders < 0) {
+            MSGLOG(ERROR, "Failed to build leaderboard message! category=%s", pJob->category);
+        } else if ((int32_t) (pJob->seqNum - pCat->seqNum) > 0) {
+            pCat->seqNum = pJob->seqNum;
+            s = fanoutCatLeaderboardMsg(pGrs, pJob->catIdx, &pJob->msg, pJob->compBuf, pJob->snapTime, &fanoutTime);
+        }
+
+        if (pJob->lbTick == 0) {
+            // Early leaderboard
+            metricsRecord(histoLbBuild, pJob->buildTime);
+            metricsRecord(histoLbFanout, fanoutTime);
+        } else if ((pJob->lbTick == pGrs->lbTick) && (pGrs->lbPending != 0)) {
+            pGrs->lbBuildTime += pJob->buildTime;
+            pGrs->lbFanoutTime += fanoutTime;
+            if (--pGrs->lbPending == 0) {
+                endLeaderboardPeriod(pGrs, pArgs);
+            }
+        }
+
+        bldRelease(pJob);
+
+        if (s != 0) {
+            // Error message already printed
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int sendLeaderboardMsg(Grs *pGrs, const CmdArgs *pArgs)
+{
+    int maxEntries = (pGrs->ovlLevel >= ovlTrimLeaderboards) ? OVL_TOP_N : 0;
+    int largeCatSize = INT_MAX;
+    Timespec due, late = {0};
+    Timespec keepaliveTime = pGrs->now;
+
+    //MSGLOG(INFO, "Sending leaderboard messages...");
+
+    // If the builder threads haven't finished the previous
+    // period yet, it already took more than a whole period.
+    if (pGrs->lbPending != 0) {
+        endLeaderboardPeriod(pGrs, pArgs);
+    }
+
+    pGrs->lbTick++;
+    pGrs->lbStart = monoTimeNs();
+    pGrs->lbBuildTime = 0;
+    pGrs->lbFanoutTime = 0;
+
+    // How late did this period start?
+    if (pGrs->lastReport.tv_sec != 0) {
+        due = pGrs->lastReport;
+        due.tv_sec += pArgs->leaderboardPeriod;
+        if (tvCmp(&pGrs->now, &due) > 0) {
+            tvSub(&late, &pGrs->now, &due);
+        }
+    }
+    pGrs->lbLate = ((uint64_t) late.tv_sec * 1000000000) + late.tv_nsec;
+
+    // When overloaded, the largest categories only get their
+    // leaderboard every other period.
+    if (pGrs->ovlLevel >= ovlSlowLargeCats) {
+        int maxCatSize = 0;
+        for (int n = 0; n < pGrs->numCats; n++) {
+            if (pGrs->catTbl[n].numRiders > maxCatSize) {
+                maxCatSize = pGrs->catTbl[n].numRiders;
+            }
+        }
+        largeCatSize = (maxCatSize + 1) / 2;
+    }
+
+    // Categories that sent their leaderboard early, within
+    // the last period, don't need a keepalive.
+    keepaliveTime.tv_sec -= pArgs->leaderboardPeriod;
+
+    for (int n = 0; n < pGrs->numCats; n++) {
+        Category *pCat = &pGrs->catTbl[n];
+
+        if (!pCat->changed) {
+            // Nothing new to report; unless overloaded, just
+            // let the riders know the server is still there.
+            if ((pGrs->ovlLevel == ovlNormal) &&
+                (tvCmp(&pCat->lastReport, &keepaliveTime) <= 0) &&
+                (sendKeepaliveMsg(pGrs, n) != 0)) {
+                return -1;
+            }
+            continue;
+        }
+
+        if ((pCat->numRiders >= largeCatSize) && ((pGrs->lbTick % 2) != 0)) {
+            continue;
+        }
+
+        if (sendCatLeaderboardMsg(pGrs, n, maxEntries, pGrs->lbTick,
+                                  &pGrs->lbBuildTime, &pGrs->lbFanoutTime) != 0) {
+            // Error message already printed
+            return -1;
+        }
+    }
+
+    // With the builder threads, the period ends when the
+    // last of its leaderboards is sent.
+    if (pGrs->lbPending == 0) {
+        endLeaderboardPeriod(pGrs, pArgs);
+    }
+
+    pGrs->lastReport = pGrs->now;
+
+    return 0;
+}
+
+// Build and send the overall leaderboard of the specified
+// gender (or of all the riders, if 'gender' is GenderMax),
+// listing the first 'maxEntries' riders.
+static int sendOverallLeaderboardMsg(Grs *pGrs, Gender gender, int maxEntries, const Rider **rankTbl, MsgBuf *pBuf)
+{
+    int numEntries = rankMerge(gender, maxEntries, rankTbl);
+    EgrBuf *pEgrBuf = NULL;
+    EgrBuf *pCompBuf = NULL;
+    Rider *pRider;
+    size_t msgLen;
+    int s = 0;
+
+    if (numEntries == 0) {
+        return 0;
+    }
+
+    msgBufReset(pBuf);
+    if (msgBufPrintf(pBuf, "{\"msgType\": \"%s\", \"category\": \"%s\", \"riderList\": [",
+            leaderboard, catNames[overallIdx(pGrs, gender)]) < 0) {
+        MSGLOG(ERROR, "Failed to build overall leaderboard message! (%s)", strerror(errno));
+        return -1;
+    }
+    for (int n = 0; n < numEntries; n++) {
+        if (printLeaderboardEntry(pGrs, rankTbl[n], pBuf) < 0) {
+            MSGLOG(ERROR, "Failed to build overall leaderboard message! (%s)", strerror(errno));
+            return -1;
+        }
+    }
+    msgBufTrim(pBuf, 2);
+    if (msgBufPrintf(pBuf, "]}") < 0) {
+        MSGLOG(ERROR, "Failed to build overall leaderboard message! (%s)", strerror(errno));
+        return -1;
+    }
+    msgLen = pBuf->len + 1;
+
+    MSGLOG(INFO, "Sending \"%s\" message: %s", leaderboard, pBuf->data);
+
+    specPublish(overallIdx(pGrs, gender), pBuf->data, msgLen);
+
+    // Send it to all the riders it covers, after their
+    // category leaderboards.
+    TAILQ_FOREACH(pRider, &pGrs->regList, tqEntry) {
+        if ((pRider->state == registered) && ((gender == GenderMax) || (pRider->gender == gender))) {
+            if ((s = queueLeaderboardMsg(pGrs, pRider, egrBulk, pBuf->data, msgLen, &pEgrBuf, &pCompBuf)) != 0) {
+                break;
+            }
+        }
+    }
+
+    if (pEgrBuf != NULL) {
+        egrReleaseBuf(pEgrBuf);
+    }
+    if (pCompBuf != NULL) {
+        egrReleaseBuf(pCompBuf);
+    }
+
+    return s;
+}
+
+// Send the overall and gender overall leaderboards. They are
+// built by merging the gender rankings, so their cost only
+// depends on the number of riders listed, plus the cost of
+// keeping the gender rankings sorted.
+static int sendOverallLeaderboardMsgs(Grs *pGrs, const CmdArgs *pArgs)
+{
+    static MsgBuf msg;
+    static const Rider **rankTbl;
+    uint64_t t0 = monoTimeNs();
+
+    if ((rankTbl == NULL) &&
+        ((rankTbl = calloc(pArgs->overallLeaderboardSize, sizeof (Rider *))) == NULL)) {
+        MSGLOG(ERROR, "Failed to alloc overall ranking table!");
+        return -1;
+    }
+
+    rankSort();
+
+    for (Gender gender = unspec; gender <= GenderMax; gender++) {
+        if (sendOverallLeaderboardMsg(pGrs, gender, pArgs->overallLeaderboardSize, rankTbl, &msg) != 0) {
+            // Error message already printed
+            return -1;
+        }
+    }
+
+    pGrs->lastOverallReport = pGrs->now;
+    metricsRecord(histoLbOverall, (monoTimeNs() - t0));
+
+    return 0;
+}
+
+// Send the custom leaderboards of the subscriptions that
+// changed since their last one. Only the riders they follow
+// are looked up, by bib number, so the cost depends on the
+// size of the subscriptions, not on the size of the ride.
+static int sendSubLeaderboardMsgs(Grs *pGrs, const CmdArgs *pArgs)
+{
+    static MsgBuf msg;
+    const Rider *sortTbl[SUB_MAX_RIDERS];
+    int bibNum;
+
+    while ((bibNum = subTakeChanged()) != 0) {
+        Rider *pRider = (bibNum < pGrs->bibMapSize) ? pGrs->bibMapTbl[bibNum] : NULL;
+        const int *bibTbl;
+        int numBibs, numRiders = 0;
+        EgrBuf *pCompBuf;
+
+        if ((pRider == NULL) || (pRider->state != registered)) {
+            continue;
+        }
+
+        numBibs = subGetRiders(bibNum, &bibTbl);
+        for (int n = 0; n < numBibs; n++) {
+            const Rider *pFollowed = (bibTbl[n] < pGrs->bibMapSize) ? pGrs->bibMapTbl[bibTbl[n]] : NULL;
+            if ((pFollowed != NULL) && (pFollowed->state == registered)) {
+                sortTbl[numRiders++] = pFollowed;
+            }
+        }
+        qsort(sortTbl, numRiders, sizeof (Rider *), cmpRiderDistance);
+
+        msgBufReset(&msg);
+        if (msgBufPrintf(&msg, "{\"msgType\": \"%s\", \"category\": \"Subscription\", \"riderList\": [", leaderboard) < 0) {
+            MSGLOG(ERROR, "Failed to build subscription leaderboard message! (%s)", strerror(errno));
+            return -1;
+        }
+        for (int n = 0; n < numRiders; n++) {
+            if (printLeaderboardEntry(pGrs, sortTbl[n], &msg) < 0) {
+                MSGLOG(ERROR, "Failed to build subscription leaderboard message! (%s)", strerror(errno));
+                return -1;
+            }
+        }
+        if (numRiders > 0) {
+            // Remove the last ", " characters
+            msgBufTrim(&msg, 2);
+        }
+        if (msgBufPrintf(&msg, "]}") < 0) {
+            MSGLOG(ERROR, "Failed to build subscription leaderboard message! (%s)", strerror(errno));
+            return -1;
+        }
+
+        MSGLOG(INFO, "Sending \"%s\" message: fd=%d bibNum=%d category=Subscription numRiders=%d",
+                leaderboard, pRider->sd, pRider->bibNum, numRiders);
+
+        if (!pRider->compression) {
+            sendMsg(pGrs, pRider, egrBulk, ctrMsgsOutLeaderboard, msg.data, (msg.len + 1));
+        } else if ((pCompBuf = compNewBuf(msg.data, (msg.len + 1))) != NULL) {
+            queueMsg(pGrs, pRider, egrBulk, ctrMsgsOutLeaderboard, pCompBuf);
+            egrReleaseBuf(pCompBuf);
+        }
+    }
+
+    return 0;
+}
+
+// Return the earliest time a changed category can send its
+// leaderboard ahead of the next period.
+static Timespec earlyReportTime(const Grs *pGrs, const CmdArgs *pArgs, int catIdx)
+{
+    Timespec t = pGrs->catTbl[catIdx].lastReport;
+
+    t.tv_sec += pArgs->minLeaderboardInterval / 1000;
+    t.tv_nsec += (pArgs->minLeaderboardInterval % 1000) * 1000000;
+    if (t.tv_nsec >= 1000000000) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000;
+    }
+
+    return t;
+}
+
+// Send the leaderboards of the categories that changed, as
+// long as they haven't sent one in the last
+// minLeaderboardInterval msecs.
+static int sendEarlyLeaderboardMsgs(Grs *pGrs, const CmdArgs *pArgs)
+{
+    uint64_t buildTime = 0;
+    uint64_t fanoutTime = 0;
+
+    for (int n = 0; n < pGrs->numCats; n++) {
+        if (pGrs->catTbl[n].changed) {
+            Timespec t = earlyReportTime(pGrs, pArgs, n);
+            if ((tvCmp(&pGrs->now, &t) >= 0) &&
+                (sendCatLeaderboardMsg(pGrs, n, 0, 0, &buildTime, &fanoutTime) != 0)) {
+                return -1;
+            }
+        }
+    }
+
+    if (buildTime != 0) {
+        metricsRecord(histoLbBuild, buildTime);
+        metricsRecord(histoLbFanout, fanoutTime);
+    }
+
+    return 0;
+}
+
+void grsUnblockEgress(Grs *pGrs, int fd)
+{
+    Rider *pRider = fdMapTbl[fd];
+
+    if ((pRider != NULL) && pRider->egrBlocked) {
+        pRider->egrBlocked = false;
+        if ((pGrs->pollFds != NULL) && (pRider->pollIdx >= 0)) {
+            pGrs->pollFds[pRider->pollIdx].events &= ~POLLOUT;
+        }
+    }
+}
+
+void grsFlushEgress(Grs *pGrs, const CmdArgs *pArgs)
+{
+    Rider *pRider, *pNext;
+
+    TAILQ_FOREACH(pRider, &pGrs->egrList, egrEntry) {
+        pRider->egrBudget = EGR_BUDGET;
+    }
+
+    // One pass per class, so that the control messages of
+    // all the riders go out before any leaderboard.
+    for (EgrPrio prio = egrControl; prio < EgrPrioMax; prio++) {
+        for (pRider = TAILQ_FIRST(&pGrs->egrList); pRider != NULL; pRider = pNext) {
+            size_t budget = pRider->egrBudget;
+            int s;
+
+            pNext = TAILQ_NEXT(pRider, egrEntry);
+            if (pRider->egrBlocked) {
+                continue;
+            }
+
+            s = egrFlush(&pRider->egress, pRider->sd, pGrs->sendFn, prio, &pRider->egrBudget);
+            metricsAdd(ctrBytesOut, (budget - pRider->egrBudget));
+            if (s < 0) {
+                // Drop the rider, rather than the whole
+                // ride.
+                metricsAdd(ctrSendFailures, 1);
+                MSGLOG(ERROR, "Failed to send data! fd=%d (%s)", pRider->sd, strerror(errno));
+                procDisconnect(pGrs, pArgs, pRider->sd);
+            } else if (s == egrIdle) {
+                TAILQ_REMOVE(&pGrs->egrList, pRider, egrEntry);
+                pRider->egrListed = false;
+            } else if (s == egrBlocked) {
+                // Wait until the socket can take more data
+                pRider->egrBlocked = true;
+                if ((pGrs->pollFds != NULL) && (pRider->pollIdx >= 0)) {
+                    pGrs->pollFds[pRider->pollIdx].events |= POLLOUT;
+                }
+            }
+        }
+    }
+
+    // Riders that ran out of budget get another turn in the
+    // next iteration, without waiting for any events.
+    pGrs->egrBacklog = false;
+    TAILQ_FOREACH(pRider, &pGrs->egrList, egrEntry) {
+        if (!pRider->egrBlocked) {
+            pGrs->egrBacklog = true;
+            break;
+        }
+    }
+
+    if (pGrs->rebuildPollFds && (pGrs->pollFds != NULL)) {
+        buildPollFds(pGrs);
+    }
+}
+
+// Return how long the event loop can wait for events before
+// the next leaderboard is due.
+static void nextTimeout(const Grs *pGrs, const CmdArgs *pArgs, Timespec *pTimeout)
+{
+    Timespec leaderboardPeriod = { .tv_sec = pArgs->leaderboardPeriod, .tv_nsec = 0};
+    Timespec next = pGrs->lastReport;
+    Timespec now;
+
+    *pTimeout = leaderboardPeriod;
+
+    // Some riders still have messages to send, or some
+    // gateways records to be read
+    if (pGrs->egrBacklog || shmBacklog()) {
+        pTimeout->tv_sec = pTimeout->tv_nsec = 0;
+        return;
+    }
+
+    // Wake up at least once per second to lift the expired
+    // throttles.
+    if ((pGrs->numThrottled != 0) && (pTimeout->tv_sec > 1)) {
+        pTimeout->tv_sec = 1;
+    }
+
+    if (!pGrs->rideActive) {
+        // Wake up on time to send the rideStarted message
+        // and to start the ride.
+        if (pArgs->startTime == 0) {
+            return;
+        }
+        next.tv_sec = pArgs->startTime;
+        next.tv_nsec = 0;
+        if ((pArgs->startLeadTime != 0) && !pGrs->rideStartedSent) {
+            next.tv_sec -= pArgs->startLeadTime;
+        }
+    } else {
+        next.tv_sec += pArgs->leaderboardPeriod;
+    }
+
+    // Are the overall leaderboards due sooner?
+    if (pGrs->rideActive && (pArgs->overallLeaderboardPeriod != 0) && (pGrs->ovlLevel < ovlSlowLargeCats)) {
+        Timespec t = { .tv_sec = (pGrs->lastOverallReport.tv_sec + pArgs->overallLeaderboardPeriod), .tv_nsec = 0 };
+        if (tvCmp(&t, &next) < 0) {
+            next = t;
+        }
+    }
+
+    // Can a changed category send its leaderboard sooner?
+    if (pGrs->rideActive && (pArgs->minLeaderboardInterval != 0) && (pGrs->ovlLevel == ovlNormal)) {
+        for (int n = 0; n < pGrs->numCats; n++) {
+            if (pGrs->catTbl[n].changed) {
+                Timespec t = earlyReportTime(pGrs, pArgs, n);
+                if (tvCmp(&t, &next) < 0) {
+                    next = t;
+                }
+            }
+        }
+    }
+
+    pGrs->clockFn(&now);
+    if (tvCmp(&next, &now) > 0) {
+        tvSub(pTimeout, &next, &now);
+        if (tvCmp(pTimeout, &leaderboardPeriod) > 0) {
+            *pTimeout = leaderboardPeriod;
+        }
+    } else {
+        pTimeout->tv_sec = pTimeout->tv_nsec = 0;
+    }
+}
+
+// Flags set by the signal handler
+static volatile sig_atomic_t dumpRequested;
+static volatile sig_atomic_t exitRequested;
+
+static void sigHandler(int signum)
+{
+    if (signum == SIGUSR1) {
+        dumpRequested = 1;
+    } else {
+        exitRequested = 1;
+    }
+}
+
+// Block the signals handled by the event loop, so that
+// they are only delivered while waiting in ppoll(), and
+// return in 'pWaitMask' the signal mask to be used by
+// ppoll().
+static int setupSignals(sigset_t *pWaitMask)
+{
+    struct sigaction sa = { .sa_handler = sigHandler };
+    sigset_t sigMask;
+
+    sigemptyset(&sigMask);
+    sigaddset(&sigMask, SIGUSR1);
+    sigaddset(&sigMask, SIGINT);
+    sigaddset(&sigMask, SIGTERM);
+
+    if (pthread_sigmask(SIG_BLOCK, &sigMask, pWaitMask) != 0) {
+        MSGLOG(ERROR, "Failed to block signals!");
+        return -1;
+    }
+    sigdelset(pWaitMask, SIGUSR1);
+    sigdelset(pWaitMask, SIGINT);
+    sigdelset(pWaitMask, SIGTERM);
+
+    sigemptyset(&sa.sa_mask);
+    if ((sigaction(SIGUSR1, &sa, NULL) != 0) ||
+        (sigaction(SIGINT, &sa, NULL) != 0) ||
+        (sigaction(SIGTERM, &sa, NULL) != 0)) {
+        MSGLOG(ERROR, "Failed to install signal handlers! (%s)", strerror(errno));
+        return -1;
+    }
 
     return 0;
 }
 
-int grsMain(Grs *pGrs, const CmdArgs *pArgs)
+// Update the per-category rider gauges. A rider is considered
+// active if it has sent a progUpd message within the last few
+// update periods.
+static void updateCatGauges(Grs *pGrs, const CmdArgs *pArgs)
+{
+    time_t activeTime = pGrs->now.tv_sec - ((3 * pArgs->maxProgUpdPeriod) / 1000) - 1;
+
+    for (int n = 0; n < pGrs->numCats; n++) {
+        const CatNode *pNode;
+        int numActiveRiders = 0;
+
+        TAILQ_FOREACH(pNode, &pGrs->catTbl[n].riderList, tqEntry) {
+            if (pNode->pRider->lastUpdTime >= activeTime) {
+                numActiveRiders++;
+            }
+        }
+
+        metricsSetCatGauges(n, pGrs->catTbl[n].numRiders, numActiveRiders);
+    }
+
+    pGrs->lastMetricsUpd = pGrs->now;
+}
+
+// Adjust the progUpd period of each category, based on the
+// utilization of the event loop and the size of the category,
+// and send a rateCtl message to the riders in the categories
+// whose period changed.
+static void updProgUpdPeriods(Grs *pGrs, const CmdArgs *pArgs)
+{
+    Timespec deltaT;
+    uint64_t interval;
+    int util;
+
+    if (pGrs->lastRateUpd.tv_sec == 0) {
+        // First interval
+        pGrs->busyTime = 0;
+        pGrs->lastRateUpd = pGrs->now;
+        return;
+    }
+
+    tvSub(&deltaT, &pGrs->now, &pGrs->lastRateUpd);
+    interval = ((uint64_t) deltaT.tv_sec * 1000000000) + deltaT.tv_nsec;
+    util = (interval != 0) ? ((pGrs->busyTime * 100) / interval) : 0;
+
+    if (util > RATE_HIGH_UTIL) {
+        pGrs->baseProgUpdPeriod += pGrs->baseProgUpdPeriod / 2;
+    } else if (util < RATE_LOW_UTIL) {
+        pGrs->baseProgUpdPeriod -= pGrs->baseProgUpdPeriod / 5;
+    }
+    if (pGrs->baseProgUpdPeriod < pArgs->minProgUpdPeriod) {
+        pGrs->baseProgUpdPeriod = pArgs->minProgUpdPeriod;
+    } else if (pGrs->baseProgUpdPeriod > pArgs->maxProgUpdPeriod) {
+        pGrs->baseProgUpdPeriod = pArgs->maxProgUpdPeriod;
+    }
+
+    for (int n = 0; n < pGrs->numCats; n++) {
+        Category *pCat = &pGrs->catTbl[n];
+        int period = pGrs->baseProgUpdPeriod;
+        CatNode *pNode;
+
+        for (int size = pCat->numRiders; size > (4 * RATE_CAT_SIZE); size /= 4) {
+            period *= 2;
+        }
+
+        // Round it to 100 ms, so that small changes in the
+        // load don't cause a flood of rateCtl messages.
+        period = ((period + 50) / 100) * 100;
+        if (period < pArgs->minProgUpdPeriod) {
+            period = pArgs->minProgUpdPeriod;
+        } else if (period > pArgs->maxProgUpdPeriod) {
+            period = pArgs->maxProgUpdPeriod;
+        }
+
+        if ((period != pCat->progUpdPeriod) && (pCat->numRiders > 0)) {
+            MSGLOG(INFO, "Changing progUpd period: category=%s numRiders=%d util=%d%% period=%d->%d ms",
+                    catNames[n], pCat->numRiders, util, pCat->progUpdPeriod, period);
+        }
+        if (period != pCat->progUpdPeriod) {
+            pCat->progUpdPeriod = period;
+
+            // The period of a rider is the one of its
+            // primary category.
+            TAILQ_FOREACH(pNode, &pCat->riderList, tqEntry) {
+                Rider *pRider = pNode->pRider;
+                if ((pNode == &pRider->catNodes[0]) && (pRider->progUpdPeriod != period)) {
+                    sendRateCtlMsg(pGrs, pRider, period);
+                }
+            }
+        }
+    }
+
+    metricsSetGauge(gaugeLoopUtilization, util);
+    metricsSetGauge(gaugeBaseProgUpdPeriod, pGrs->baseProgUpdPeriod);
+
+    pGrs->busyTime = 0;
+    pGrs->lastRateUpd = pGrs->now;
+}
+
+// Start reading again from the connections whose throttle
+// expired.
+static void unthrottleRiders(Grs *pGrs)
+{
+    for (int fd = 0; (fd <= maxFdVal) && (pGrs->numThrottled != 0); fd++) {
+        Rider *pRider = fdMapTbl[fd];
+        if ((pRider != NULL) && (pRider->ingress.throttleUntil != 0) &&
+            (pGrs->now.tv_sec >= pRider->ingress.throttleUntil)) {
+            pRider->ingress.throttleUntil = 0;
+            pGrs->numThrottled--;
+            if ((pGrs->pollFds != NULL) && (pRider->pollIdx >= 0)) {
+                pGrs->pollFds[pRider->pollIdx].events |= POLLIN;
+            }
+        }
+    }
+}
+
+Bool grsExitRequested(void)
+{
+    return exitRequested;
+}
+
+void grsCheckDump(void)
+{
+    if (dumpRequested) {
+        dumpRequested = 0;
+        traceDump();
+    }
+}
+
+// Start the group ride
+int startRide(Grs *pGrs, const CmdArgs *pArgs)
+{
+    // Ready-Set-Go! Unless the riders were already told
+    // when to start.
+    MSGLOG(INFO, "Ready... Set... Go!");
+    if (!pGrs->rideStartedSent && (sendRideStartedMsg(pGrs, pArgs, &pGrs->now) != 0)) {
+        // Error message already printed
+        return -1;
+    }
+
+    pGrs->rideActive = true;
+    capRecord(capRideStarted, 0, NULL, 0);
+
+    return 0;
+}
+
+// Run the periodic tasks that are due at the current
+// loop time.
+int procTimers(Grs *pGrs, const CmdArgs *pArgs)
 {
     Timespec leaderboardPeriod = { .tv_sec = pArgs->leaderboardPeriod, .tv_nsec = 0};
 
-    // Initialize the lists of registered riders
-    for (Gender gender = unspec; gender < GenderMax; gender++) {
-        for (AgeGrp ageGrp = undef; ageGrp < AgeGrpMax; ageGrp++) {
-            TAILQ_INIT(&pGrs->riderList[gender][ageGrp]);
+    if (pGrs->rideActive) {
+        Timespec deltaT;
+
+        // Time to send the leaderboard messages?
+        tvSub(&deltaT, &pGrs->now, &pGrs->lastReport);
+        if (tvCmp(&deltaT, &leaderboardPeriod) >= 0) {
+            // Send the leaderboard message to each of
+            // the registered riders...
+            if (sendLeaderboardMsg(pGrs, pArgs) != 0) {
+                // Error message already printed
+                return -1;
+            }
+
+            // ...and the custom leaderboards to the riders
+            // that subscribed to one, unless the server is
+            // falling behind.
+            if ((pGrs->ovlLevel < ovlSlowLargeCats) && (sendSubLeaderboardMsgs(pGrs, pArgs) != 0)) {
+                // Error message already printed
+                return -1;
+            }
+        } else if ((pArgs->minLeaderboardInterval != 0) && (pGrs->ovlLevel == ovlNormal)) {
+            // Send the leaderboards of the categories that
+            // changed, without waiting for the next period.
+            if (sendEarlyLeaderboardMsgs(pGrs, pArgs) != 0) {
+                // Error message already printed
+                return -1;
+            }
+        }
+
+        // Time to send the overall leaderboards? They are
+        // skipped when the server is falling behind.
+        if ((pArgs->overallLeaderboardPeriod != 0) && (pGrs->ovlLevel < ovlSlowLargeCats) &&
+            ((pGrs->now.tv_sec - pGrs->lastOverallReport.tv_sec) >= pArgs->overallLeaderboardPeriod)) {
+            if (sendOverallLeaderboardMsgs(pGrs, pArgs) != 0) {
+                // Error message already printed
+                return -1;
+            }
+        }
+
+        // Time to report the start skew?
+        if (!pGrs->startSkewReported && (startSkewHisto.count != 0) &&
+            (pGrs->now.tv_sec >= (pGrs->goTime.tv_sec + START_SKEW_REPORT_DELAY))) {
+            reportStartSkew(pGrs);
+        }
+    } else if ((pArgs->startTime != 0) && (pGrs->now.tv_sec >= pArgs->startTime)) {
+        // Time to start the ride!
+        if (startRide(pGrs, pArgs) != 0) {
+            // Error message already printed
+            return -1;
+        }
+    } else if ((pArgs->startTime != 0) && (pArgs->startLeadTime != 0) && !pGrs->rideStartedSent &&
+               (pGrs->now.tv_sec >= (pArgs->startTime - pArgs->startLeadTime))) {
+        // Tell the riders ahead of time when to start, so that
+        // they can all start at the same instant, no matter how
+        // long it takes to send them all the message.
+        Timespec goTime = { .tv_sec = pArgs->startTime, .tv_nsec = 0 };
+        MSGLOG(INFO, "Sending \"%s\" message ahead of the start time...", rideStarted);
+        if (sendRideStartedMsg(pGrs, pArgs, &goTime) != 0) {
+            // Error message already printed
+            return -1;
         }
     }
 
-    // Allocate space for the list of file descriptors
-    // to be monitored by poll()
-    if ((pGrs->pollFds = calloc(pArgs->maxRiders, sizeof (PollFd))) == NULL) {
-        MSGLOG(ERROR, "Failed to alloc pollFds array! (%s)", strerror(errno));
+    if (pGrs->now.tv_sec != pGrs->lastMetricsUpd.tv_sec) {
+        updateCatGauges(pGrs, pArgs);
+    }
+
+    if (pGrs->numThrottled != 0) {
+        unthrottleRiders(pGrs);
+    }
+
+    // Time to adjust the progUpd periods? This is only done
+    // if a range of periods was specified.
+    if ((pArgs->minProgUpdPeriod != pArgs->maxProgUpdPeriod) &&
+        ((pGrs->now.tv_sec - pGrs->lastRateUpd.tv_sec) >= RATE_UPD_INTERVAL)) {
+        updProgUpdPeriods(pGrs, pArgs);
+    }
+
+    return 0;
+}
+
+// Read the wall clock
+static int realClock(Timespec *pTime)
+{
+    return clock_gettime(CLOCK_REALTIME, pTime);
+}
+
+// The virtual clock used by the replay and simulation
+// drivers just returns the loop time they set.
+static const Grs *pVirtualGrs;
+
+static int virtualClock(Timespec *pTime)
+{
+    *pTime = pVirtualGrs->now;
+    return 0;
+}
+
+void grsSetVirtualClock(Grs *pGrs)
+{
+    pVirtualGrs = pGrs;
+    pGrs->clockFn = virtualClock;
+}
+
+int grsRunTimers(Grs *pGrs, const CmdArgs *pArgs, const Timespec *pUntil)
+{
+    while (true) {
+        Timespec due = *pUntil;
+
+        if (pGrs->rideActive && (pGrs->lastReport.tv_sec != 0)) {
+            due = pGrs->lastReport;
+            due.tv_sec += pArgs->leaderboardPeriod;
+            if (tvCmp(&due, pUntil) > 0) {
+                due = *pUntil;
+            }
+        }
+
+        pGrs->now = due;
+        if (procTimers(pGrs, pArgs) != 0) {
+            return -1;
+        }
+
+        if (tvCmp(&due, pUntil) >= 0) {
+            return 0;
+        }
+    }
+}
+
+int grsInitCats(Grs *pGrs, const CmdArgs *pArgs)
+{
+    if (catInit(pArgs->categoryFile) != 0) {
+        // Error message already printed
         return -1;
     }
 
-    // Open the listening TCP socket
-    if (configGrsSock(pGrs, pArgs) != 0) {
+    pGrs->numCats = catNumCats();
+    if (((pGrs->catTbl = calloc(pGrs->numCats, sizeof (Category))) == NULL) ||
+        ((catNames = calloc((pGrs->numCats + GenderMax + 1), sizeof (char *))) == NULL)) {
+        MSGLOG(ERROR, "Failed to alloc category table! (%s)", strerror(errno));
+        return -1;
+    }
+
+    for (int n = 0; n < pGrs->numCats; n++) {
+        TAILQ_INIT(&pGrs->catTbl[n].riderList);
+        pGrs->catTbl[n].progUpdPeriod = pArgs->progUpdPeriod * 1000;
+        catNames[n] = catName(n);
+    }
+    for (Gender gender = unspec; gender <= GenderMax; gender++) {
+        snprintf(overallNameTbl[gender], sizeof (overallNameTbl[gender]), "%sOverall", (gender != GenderMax) ? genTbl[gender] : "");
+        catNames[overallIdx(pGrs, gender)] = overallNameTbl[gender];
+    }
+
+    TAILQ_INIT(&pGrs->regList);
+
+    return 0;
+}
+
+int grsInit(Grs *pGrs, const CmdArgs *pArgs, sigset_t *pWaitMask)
+{
+    // SIGUSR1 dumps the loop latency histograms, while
+    // SIGINT and SIGTERM make the server exit. This needs
+    // to be done before any threads are created, so they
+    // inherit the blocked signals.
+    if (setupSignals(pWaitMask) != 0) {
+        // Error message already printed
+        return -1;
+    }
+
+    pGrs->udpSd = -1;
+    pGrs->unixSd = -1;
+    pGrs->baseProgUpdPeriod = pArgs->progUpdPeriod * 1000;
+    pGrs->leaderboardStats = pArgs->leaderboardStats;
+
+    if (traceInit(pArgs->traceFile, pArgs->traceThreshold) != 0) {
+        // Error message already printed
+        return -1;
+    }
+
+    TAILQ_INIT(&pGrs->egrList);
+
+    // Load the category scheme, and allocate the state of
+    // just the categories it defines.
+    if (grsInitCats(pGrs, pArgs) != 0) {
+        // Error message already printed
+        return -1;
+    }
+
+    // Start collecting (and maybe serving) the metrics
+    if (metricsInit(pArgs->metricsPort, pGrs->numCats, catNames) != 0) {
+        // Error message already printed
+        return -1;
+    }
+
+    if (pGrs->sendFn == NULL) {
+        pGrs->sendFn = send;
+    }
+    if (pGrs->clockFn == NULL) {
+        pGrs->clockFn = realClock;
+    }
+
+    // Start capturing the inbound traffic?
+    if ((pArgs->captureFile != NULL) && (capInit(pArgs->captureFile) != 0)) {
+        // Error message already printed
+        return -1;
+    }
+
+    // Start recording the telemetry?
+    if ((pArgs->recordFile != NULL) && (recInit(pArgs->recordFile, pArgs->rideName) != 0)) {
         // Error message already printed
         return -1;
     }
@@ -736,63 +3038,204 @@ int grsMain(Grs *pGrs, const CmdArgs *pArgs)
     // active right away.
     if (pArgs->startTime == 0) {
         pGrs->rideActive = true;
+        capRecord(capRideStarted, 0, NULL, 0);
     }
 
-    while (true) {
+    return 0;
+}
+
+// Wait for an event on the file descriptors, or until the
+// timeout expires. With --spin-wait, the file descriptors
+// are polled without blocking, over and over, so the thread
+// never sleeps; pending signals are still delivered, since
+// every ppoll() call unblocks them.
+static int waitForEvents(Grs *pGrs, const CmdArgs *pArgs, const Timespec *pTimeout, const sigset_t *pWaitMask)
+{
+    static const Timespec noWait = {0};
+    Timespec deadline, now;
+    int nFds;
+
+    if (!pArgs->spinWait) {
+        return ppoll(pGrs->pollFds, pGrs->numFds, pTimeout, pWaitMask);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += pTimeout->tv_sec;
+    deadline.tv_nsec += pTimeout->tv_nsec;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    do {
+        if ((nFds = ppoll(pGrs->pollFds, pGrs->numFds, &noWait, pWaitMask)) != 0) {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (tvCmp(&now, &deadline) < 0);
+
+    return nFds;
+}
+
+int grsMain(Grs *pGrs, const CmdArgs *pArgs)
+{
+    sigset_t waitMask;
+
+    if (grsInit(pGrs, pArgs, &waitMask) != 0) {
+        // Error message already printed
+        return -1;
+    }
+
+    // Set up the low-latency mode, if enabled
+    if (llInit(pArgs) != 0) {
+        // Error message already printed
+        return -1;
+    }
+
+    // Start the leaderboard builder threads?
+    if ((pArgs->leaderboardThreads != 0) && (bldInit(pArgs->leaderboardThreads, pGrs->numCats) != 0)) {
+        // Error message already printed
+        return -1;
+    }
+
+    // Allocate space for the list of file descriptors
+    // to be monitored by poll(): the listening TCP socket,
+    // the UDP socket, the listening Unix domain socket, the
+    // builder eventfd, the shared-memory gateway sockets,
+    // and the connected sockets.
+    if ((pGrs->pollFds = calloc((pArgs->maxRiders + 5 + SHM_MAX_GATEWAYS), sizeof (PollFd))) == NULL) {
+        MSGLOG(ERROR, "Failed to alloc pollFds array! (%s)", strerror(errno));
+        return -1;
+    }
+
+    // Open the UDP socket for the progUpd messages?
+    if ((pArgs->udpPort != 0) && (configUdpSock(pGrs, pArgs) != 0)) {
+        // Error message already printed
+        return -1;
+    }
+
+    // Open the listening Unix domain socket?
+    if ((pArgs->unixSocket != NULL) && (configUnixSock(pGrs, pArgs) != 0)) {
+        // Error message already printed
+        return -1;
+    }
+
+    // Listen for the shared-memory gateways?
+    if ((pArgs->shmSocket != NULL) && (shmInit(pGrs, pArgs) != 0)) {
+        // Error message already printed
+        return -1;
+    }
+
+    // Open the listening TCP socket
+    if (configGrsSock(pGrs, pArgs) != 0) {
+        // Error message already printed
+        return -1;
+    }
+
+    // Start the spectator listener?
+    if (pArgs->spectatorPort != 0) {
+        SockAddrStore sockAddr = pArgs->sockAddr;
+        if (sockAddr.ss_family == AF_INET) {
+            ((SockAddrIn *) &sockAddr)->sin_port = htons(pArgs->spectatorPort);
+        } else {
+            ((SockAddrIn6 *) &sockAddr)->sin6_port = htons(pArgs->spectatorPort);
+        }
+        if (specInit(&sockAddr, (pGrs->numCats + GenderMax + 1), catNames) != 0) {
+            // Error message already printed
+            return -1;
+        }
+    }
+
+    // The event loop gets its own CPU, now that all the other
+    // threads were started.
+    if (llPinThread(-1) != 0) {
+        // Error message already printed
+        return -1;
+    }
+
+    while (!exitRequested) {
         int nFds;
         Timespec start, end;
         Timespec deltaT = {0};
         Timespec timeout;
+        uint64_t t;
+
+        traceIterBegin();
 
         // Wait for an event on any of the file descriptors
-        // we are monitoring, or until the leaderboard report
-        // period expires.
-        tvSub(&timeout, &leaderboardPeriod, &deltaT);
-        if ((nFds = ppoll(pGrs->pollFds, pGrs->numFds, &timeout, NULL)) < 0) {
-            MSGLOG(ERROR, "Failed to wait for file descriptor events! (%s)", strerror(errno));
-            return -1;
+        // we are monitoring, or until the next leaderboard
+        // is due.
+        nextTimeout(pGrs, pArgs, &timeout);
+        t = traceBegin();
+        if ((nFds = waitForEvents(pGrs, pArgs, &timeout, &waitMask)) < 0) {
+            if (errno != EINTR) {
+                MSGLOG(ERROR, "Failed to wait for file descriptor events! (%s)", strerror(errno));
+                return -1;
+            }
+            nFds = 0;
         }
+        traceEnd(phasePollWait, t, nFds);
 
-        clock_gettime(CLOCK_REALTIME, &start);
+        pGrs->clockFn(&start);
+        pGrs->now = start;
 
         if (nFds > 0) {
+            // The pollFds array may be rebuilt while
+            // processing the events.
+            Bool lbsBuilt = bldActive() && (pGrs->pollFds[pGrs->bldFdIdx].revents & POLLIN);
+
             // Process the file descriptor events
             if (procFdEvents(pGrs, pArgs, nFds) != 0) {
                 // Error message already printed
                 return -1;
             }
-        }
 
-        if (pGrs->rideActive) {
-            // Time to send the leaderboard messages?
-            tvSub(&deltaT, &start, &pGrs->lastReport);
-            if (tvCmp(&deltaT, &leaderboardPeriod) >= 0) {
-                // Send the leaderboard message to each of
-                // the registered riders...
-                if (sendLeaderboardMsg(pGrs, pArgs) != 0) {
-                    // Error message already printed
-                    return -1;
-                }
+            // Send the leaderboards built by the worker
+            // threads
+            if (lbsBuilt && (sendBuiltLeaderboardMsgs(pGrs, pArgs) != 0)) {
+                // Error message already printed
+                return -1;
             }
-        } else {
-            // Time to start the ride?
-            time_t now = time(NULL);
-            if (now >= pArgs->startTime) {
-                // Ready-Set-Go!
-                MSGLOG(INFO, "Ready... Set... Go!");
-                if (sendRideStartedMsg(pGrs, pArgs) != 0) {
-                    // Error message already printed
-                    return -1;
-                }
+        }
 
-                pGrs->rideActive = true;
-            }
+        // Process the records sent by the shared-memory
+        // gateways
+        if (shmActive()) {
+            t = traceBegin();
+            shmProcRings(pGrs, pArgs);
+            traceEnd(phaseReadParse, t, 0);
+        }
+
+        // Send the leaderboards, start the ride, etc.
+        if (procTimers(pGrs, pArgs) != 0) {
+            // Error message already printed
+            return -1;
         }
 
-        clock_gettime(CLOCK_REALTIME, &end);
+        // Send the queued messages
+        t = traceBegin();
+        grsFlushEgress(pGrs, pArgs);
+        traceEnd(phaseEgress, t, 0);
+
+        grsCheckDump();
+
+        pGrs->clockFn(&end);
         tvSub(&deltaT, &end, &start);
+        metricsRecord(histoLoopIter, ((uint64_t) deltaT.tv_sec * 1000000000) + deltaT.tv_nsec);
+        pGrs->busyTime += ((uint64_t) deltaT.tv_sec * 1000000000) + deltaT.tv_nsec;
+
+        traceIterEnd();
+    }
+
+    MSGLOG(INFO, "Exit requested. BYE!");
+    traceDump();
+    bldClose();
+    capClose();
+    recClose();
+    if (pGrs->unixSd >= 0) {
+        unlink(pArgs->unixSocket);
     }
+    shmClose(pArgs);
 
     return 0;
 }
-
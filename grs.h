@@ -1,6 +1,12 @@
 #pragma once
 
+#include <signal.h>
+
 #include "defs.h"
+#include "msgbuf.h"
+
+// Highest file descriptor value (plus one) of a connection
+#define MAX_FD_VAL    65536
 
 #ifdef __cplusplus
 extern "C" {
@@ -8,6 +14,79 @@ extern "C" {
 
 extern int grsMain(Grs *pGrs, const CmdArgs *pArgs);
 
+// Replay the traffic in the specified capture file through
+// the message processing code, without any sockets.
+extern int grsReplay(Grs *pGrs, const CmdArgs *pArgs);
+
+// Set up the server state, signal handling, metrics, etc.
+// Returns in 'pWaitMask' the signal mask to use while waiting
+// for events.
+extern int grsInit(Grs *pGrs, const CmdArgs *pArgs, sigset_t *pWaitMask);
+
+// Load the category scheme, and set up the categories and
+// the list of registered riders. Called by grsInit().
+extern int grsInitCats(Grs *pGrs, const CmdArgs *pArgs);
+
+// Drive a ride with virtual riders, on a virtual clock, as
+// fast as possible.
+extern int grsSimulate(Grs *pGrs, const CmdArgs *pArgs);
+
+// Make the server read the time from pGrs->now, which the
+// caller advances, instead of from the wall clock.
+extern void grsSetVirtualClock(Grs *pGrs);
+
+// Run all the periodic tasks due up to the specified time,
+// advancing the loop time (pGrs->now) as they go. Used with
+// the virtual clock.
+extern int grsRunTimers(Grs *pGrs, const CmdArgs *pArgs, const Timespec *pUntil);
+
+// Has a SIGINT or SIGTERM been received?
+extern Bool grsExitRequested(void);
+
+// Dump the latency histograms if a SIGUSR1 has been received
+extern void grsCheckDump(void);
+
+// Create the Rider object for a new connection
+extern int addRider(Grs *pGrs, int sd, const SockAddrStore *pSockAddr);
+
+// Process a null-terminated message received on the given
+// connection.
+extern int procMsg(Grs *pGrs, const CmdArgs *pArgs, int fd, const char *data, size_t dataLen);
+
+// Process the data received on the given connection: split
+// it into messages, which end at a null terminator or at the
+// closing brace of the JSON object, whichever comes first,
+// enforcing the ingress rate limits.
+extern int procRxData(Grs *pGrs, const CmdArgs *pArgs, int fd, const char *data, size_t dataLen);
+
+// Process the data received on the given connection, after
+// capturing it.
+extern int procConnData(Grs *pGrs, const CmdArgs *pArgs, int fd, const char *data, size_t dataLen);
+
+// Close the given connection and destroy its Rider object
+extern int procDisconnect(Grs *pGrs, const CmdArgs *pArgs, int fd);
+
+// Start the group ride
+extern int startRide(Grs *pGrs, const CmdArgs *pArgs);
+
+// Run the periodic tasks (leaderboards, ride start, etc.)
+// that are due at the time in pGrs->now.
+extern int procTimers(Grs *pGrs, const CmdArgs *pArgs);
+
+// Send the messages queued on the rider connections, as
+// long as their sockets and byte budgets allow.
+extern void grsFlushEgress(Grs *pGrs, const CmdArgs *pArgs);
+
+// Let the rider on the given connection send its queued
+// messages again, after its connection was blocked.
+extern void grsUnblockEgress(Grs *pGrs, int fd);
+
+// Build the leaderboard message for the specified category,
+// returning the number of riders in the category, or -1 on
+// error. If 'maxEntries' is not zero, only that many riders
+// are listed, sorted by distance.
+extern int buildLeaderboardMsg(const Grs *pGrs, int catIdx, int maxEntries, MsgBuf *pBuf);
+
 #ifdef __cplusplus
 }
 #endif
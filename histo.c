@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "histo.h"
+
+uint64_t histoBucketMax(unsigned idx)
+{
+    unsigned shift;
+    uint64_t sub;
+
+    if (idx < HISTO_SUB_CNT) {
+        return idx;
+    }
+
+    shift = (idx / (HISTO_SUB_CNT / 2)) - 1;
+    sub = idx - (shift * (HISTO_SUB_CNT / 2));
+
+    return ((sub + 1) << shift) - 1;
+}
+
+void histoMerge(Histo *pDst, const Histo *pSrc)
+{
+    uint64_t max = __atomic_load_n(&pSrc->max, __ATOMIC_RELAXED);
+
+    for (unsigned n = 0; n < HISTO_NUM_BUCKETS; n++) {
+        pDst->buckets[n] += __atomic_load_n(&pSrc->buckets[n], __ATOMIC_RELAXED);
+    }
+    pDst->count += __atomic_load_n(&pSrc->count, __ATOMIC_RELAXED);
+    pDst->sum += __atomic_load_n(&pSrc->sum, __ATOMIC_RELAXED);
+    if (max > pDst->max) {
+        pDst->max = max;
+    }
+}
+
+void histoReset(Histo *pHisto)
+{
+    memset(pHisto, 0, sizeof (*pHisto));
+}
+
+uint64_t histoPercentile(const Histo *pHisto, double pct)
+{
+    uint64_t target;
+    uint64_t total = 0;
+
+    if (pHisto->count == 0) {
+        return 0;
+    }
+
+    target = (uint64_t) ((pct / 100.0) * pHisto->count + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+
+    for (unsigned n = 0; n < HISTO_NUM_BUCKETS; n++) {
+        total += pHisto->buckets[n];
+        if (total >= target) {
+            uint64_t val = histoBucketMax(n);
+            return (val < pHisto->max) ? val : pHisto->max;
+        }
+    }
+
+    return pHisto->max;
+}
+
+int histoPrintProm(const Histo *pHisto, MsgBuf *pBuf, const char *name, const char *labels)
+{
+    const char *sep = (labels[0] != '\0') ? "," : "";
+    uint64_t bound = 1000;  // 1 usec
+    uint64_t total = 0;
+    unsigned n = 0;
+    char lblBuf[256] = "";
+
+    for (int b = 0; b < 24; b++, bound *= 2) {
+        // Add up all the buckets whose values are
+        // below the bound.
+        while ((n < HISTO_NUM_BUCKETS) && (histoBucketMax(n) < bound)) {
+            total += pHisto->buckets[n++];
+        }
+        if (msgBufPrintf(pBuf, "%s_bucket{%s%sle=\"%.9g\"} %lu\n",
+                name, labels, sep, (bound / 1e9), total) < 0) {
+            return -1;
+        }
+    }
+
+    if (labels[0] != '\0') {
+        snprintf(lblBuf, sizeof (lblBuf), "{%s}", labels);
+    }
+
+    if ((msgBufPrintf(pBuf, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep, pHisto->count) < 0) ||
+        (msgBufPrintf(pBuf, "%s_sum%s %.9f\n", name, lblBuf, (pHisto->sum / 1e9)) < 0) ||
+        (msgBufPrintf(pBuf, "%s_count%s %lu\n", name, lblBuf, pHisto->count) < 0)) {
+        return -1;
+    }
+
+    return 0;
+}
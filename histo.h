@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "msgbuf.h"
+
+// HDR-style histogram of 64-bit values (typically nanoseconds).
+// Each power-of-two range is split into HISTO_SUB_CNT/2 linear
+// sub-buckets, so the recorded values are kept with a relative
+// error of at most 1/(HISTO_SUB_CNT/2), over the full 64-bit
+// range, in a fixed amount of memory.
+//
+// A histogram has a single writer: the recording thread uses
+// relaxed stores, so other threads can read it at any time
+// without taking a lock.
+#define HISTO_SUB_BITS      5
+#define HISTO_SUB_CNT       (1 << HISTO_SUB_BITS)
+#define HISTO_NUM_BUCKETS   ((64 - HISTO_SUB_BITS + 2) * (HISTO_SUB_CNT / 2))
+
+typedef struct Histo {
+    uint64_t count;                         // number of recorded values
+    uint64_t sum;                           // sum of the recorded values
+    uint64_t max;                           // largest recorded value
+    uint64_t buckets[HISTO_NUM_BUCKETS];    // number of values per bucket
+} Histo;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static __inline__ unsigned histoIndex(uint64_t val)
+{
+    unsigned shift;
+
+    if (val < HISTO_SUB_CNT) {
+        return val;
+    }
+
+    shift = (63 - __builtin_clzll(val)) - HISTO_SUB_BITS + 1;
+
+    return (shift * (HISTO_SUB_CNT / 2)) + (unsigned) (val >> shift);
+}
+
+// Record a value in the histogram
+static __inline__ void histoRecord(Histo *pHisto, uint64_t val)
+{
+    unsigned idx = histoIndex(val);
+
+    __atomic_store_n(&pHisto->buckets[idx], (pHisto->buckets[idx] + 1), __ATOMIC_RELAXED);
+    __atomic_store_n(&pHisto->sum, (pHisto->sum + val), __ATOMIC_RELAXED);
+    if (val > pHisto->max) {
+        __atomic_store_n(&pHisto->max, val, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&pHisto->count, (pHisto->count + 1), __ATOMIC_RELAXED);
+}
+
+// Return the largest value that falls in the given bucket
+extern uint64_t histoBucketMax(unsigned idx);
+
+// Add the contents of the source histogram to the target
+extern void histoMerge(Histo *pDst, const Histo *pSrc);
+
+// Clear all the recorded values
+extern void histoReset(Histo *pHisto);
+
+// Return the value at the given percentile (0.0 - 100.0)
+extern uint64_t histoPercentile(const Histo *pHisto, double pct);
+
+// Append the histogram to the buffer in Prometheus text
+// format, using exponential buckets from 1 usec to ~8 sec.
+// The values are assumed to be in nanoseconds, and are
+// reported in seconds.
+extern int histoPrintProm(const Histo *pHisto, MsgBuf *pBuf, const char *name, const char *labels);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ingress.h"
+
+// Size of the partial message buffer: a message that is
+// almost complete, plus a full read.
+#define ING_RX_BUF_SIZE     (ING_MAX_MSG_SIZE + ING_READ_BUDGET)
+
+// Refill the bucket for the time elapsed since the last
+// refill, and try to take 'n' tokens from it.
+static int takeTokens(TokenBucket *pBucket, double rate, double burst, uint64_t now, double n)
+{
+    if (now > pBucket->lastTime) {
+        pBucket->tokens += rate * (now - pBucket->lastTime) / 1e9;
+        if (pBucket->tokens > burst) {
+            pBucket->tokens = burst;
+        }
+        pBucket->lastTime = now;
+    }
+
+    if (pBucket->tokens < n) {
+        return -1;
+    }
+
+    pBucket->tokens -= n;
+
+    return 0;
+}
+
+void ingInit(Ingress *pIng, uint64_t now)
+{
+    memset(pIng, 0, sizeof (*pIng));
+    pIng->msgBucket.tokens = ING_MSG_BURST;
+    pIng->msgBucket.lastTime = now;
+    pIng->byteBucket.tokens = ING_BYTE_BURST;
+    pIng->byteBucket.lastTime = now;
+}
+
+IngVerdict ingCheck(Ingress *pIng, uint64_t now, size_t msgLen)
+{
+    // Take the message token first, so that the bytes of a
+    // message that is dropped anyway are not charged.
+    if ((takeTokens(&pIng->msgBucket, ING_MSG_RATE, ING_MSG_BURST, now, 1) != 0) ||
+        (takeTokens(&pIng->byteBucket, ING_BYTE_RATE, ING_BYTE_BURST, now, msgLen) != 0)) {
+        return ingStrike(pIng, now);
+    }
+
+    return ingAccept;
+}
+
+IngVerdict ingStrike(Ingress *pIng, uint64_t now)
+{
+    time_t sec = now / 1000000000;
+
+    // One strike is forgiven for every second since the
+    // last one, not counting the time spent throttled.
+    if ((pIng->lastStrike != 0) && (sec > pIng->lastStrike)) {
+        pIng->strikes -= (sec - pIng->lastStrike);
+        if (pIng->strikes < 0) {
+            pIng->strikes = 0;
+        }
+    }
+    pIng->strikes++;
+    pIng->lastStrike = sec;
+
+    if (pIng->strikes >= ING_DISCONNECT_STRIKES) {
+        return ingDisconnect;
+    } else if ((pIng->strikes % ING_THROTTLE_STRIKES) == 0) {
+        pIng->throttleUntil = sec + ING_THROTTLE_SECS;
+        pIng->lastStrike = pIng->throttleUntil;
+        return ingThrottle;
+    }
+
+    return ingDrop;
+}
+
+int ingAppend(Ingress *pIng, const char *data, size_t len)
+{
+    if ((pIng->rxLen + len) > ING_RX_BUF_SIZE) {
+        return -1;
+    }
+
+    memcpy((pIng->rxBuf + pIng->rxLen), data, len);
+    pIng->rxLen += len;
+
+    return 0;
+}
+
+int ingSavePartial(Ingress *pIng, const char *data, size_t len)
+{
+    if (len > ING_MAX_MSG_SIZE) {
+        return -1;
+    }
+
+    if ((pIng->rxBuf == NULL) && ((pIng->rxBuf = malloc(ING_RX_BUF_SIZE)) == NULL)) {
+        return -1;
+    }
+
+    memmove(pIng->rxBuf, data, len);
+    pIng->rxLen = len;
+
+    return 0;
+}
+
+void ingFree(Ingress *pIng)
+{
+    free(pIng->rxBuf);
+    pIng->rxBuf = NULL;
+    pIng->rxLen = 0;
+}
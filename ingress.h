@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Ingress rate limiting of the rider connections.
+//
+// Each connection has two token buckets, one for messages
+// and one for bytes, that refill continuously at a fixed
+// rate up to their burst size; every inbound message takes
+// one message token and as many byte tokens as its length.
+// A message that finds a bucket empty, or that is invalid,
+// is a strike against the connection. The strikes decay by
+// one per second of good behavior, and escalate the penalty:
+// the offending message is dropped; every ING_THROTTLE_STRIKES
+// the connection is not read for ING_THROTTLE_SECS; and after
+// ING_DISCONNECT_STRIKES it is closed.
+//
+// A well-behaved rider sends at most a few messages per
+// second, so the limits are far above that.
+#define ING_MSG_RATE            20          // messages per second
+#define ING_MSG_BURST           50          // max messages in a burst
+#define ING_BYTE_RATE           (16 * 1024) // bytes per second
+#define ING_BYTE_BURST          (64 * 1024) // max bytes in a burst
+#define ING_THROTTLE_STRIKES    10
+#define ING_DISCONNECT_STRIKES  30
+#define ING_THROTTLE_SECS       2
+
+// Max bytes read from a connection per loop iteration;
+// whatever is left stays in the socket until the next one.
+#define ING_READ_BUDGET         4096
+
+// Max size of a message
+#define ING_MAX_MSG_SIZE        4096
+
+typedef enum IngVerdict {
+    ingAccept = 0,              // process the message
+    ingDrop = 1,                // drop the message
+    ingThrottle = 2,            // drop the message, and stop reading the connection for a while
+    ingDisconnect = 3,          // drop the message, and close the connection
+} IngVerdict;
+
+typedef struct TokenBucket {
+    double tokens;              // tokens available
+    uint64_t lastTime;          // time (in nsecs) of the last refill
+} TokenBucket;
+
+typedef struct Ingress {
+    TokenBucket msgBucket;      // message tokens
+    TokenBucket byteBucket;     // byte tokens
+    int strikes;                // current number of strikes
+    time_t lastStrike;          // time (UTC) of the last strike
+    time_t throttleUntil;       // time (UTC) the connection can be read again (0=not throttled)
+    char *rxBuf;                // partial message received so far (NULL=none)
+    size_t rxLen;               // number of bytes in rxBuf
+} Ingress;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Init the rate limiter of a new connection, with full buckets
+extern void ingInit(Ingress *pIng, uint64_t now);
+
+// Charge a message of the given length to the buckets, at
+// time 'now' (in nsecs).
+extern IngVerdict ingCheck(Ingress *pIng, uint64_t now, size_t msgLen);
+
+// Record a strike against the connection, at time 'now'
+// (in nsecs), and return the penalty.
+extern IngVerdict ingStrike(Ingress *pIng, uint64_t now);
+
+// Append the data read to the partial message. Returns -1
+// if it doesn't fit in the buffer.
+extern int ingAppend(Ingress *pIng, const char *data, size_t len);
+
+// Keep the partial message at the end of the data read, to
+// be completed by the next read. The data may be the tail
+// of the partial message buffer itself.
+extern int ingSavePartial(Ingress *pIng, const char *data, size_t len);
+
+// Release the partial message buffer
+extern void ingFree(Ingress *pIng);
+
+#ifdef __cplusplus
+}
+#endif
@@ -10,6 +10,7 @@
 #include <unistd.h>
 
 #include "json.h"
+#include "log.h"
 
 // Create a null-terminated string with the characters
 // between 'start' and 'end' inclusive.
@@ -55,20 +56,10 @@ int jsonFindObject(const char *data, size_t dataLen, JsonObject *pObj)
     return -1;
 }
 
-static void dumpText(const char *data, size_t dataLen)
-{
-    const char *pEnd = data + dataLen;
-    for (const char *p = data; p <= pEnd; p++) {
-        fputc(*p, stdout);
-    }
-    fputc('\n', stdout);
-    fflush(stdout);
-}
-
 // Dump the JSON object
 void jsonDumpObject(const JsonObject *pObj)
 {
-    dumpText(pObj->start, (pObj->end - pObj->start));
+    MSGLOG(INFO, "%.*s", (int) (pObj->end - pObj->start + 1), pObj->start);
 }
 
 // Locate the specified tag within the given JSON object and
@@ -1,43 +1,290 @@
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "defs.h"
 #include "log.h"
 
+// The messages are formatted by the calling thread into a
+// slot of a lock-free multi-producer/single-consumer ring,
+// and written to stdout by a background thread. If the ring
+// is full, the message is dropped (and counted) rather than
+// blocking the caller.
+#define LOG_RING_SIZE   4096            // must be a power of 2
+#define LOG_MSG_MAX     1024            // max length of the message text
+
+typedef struct LogSlot {
+    uint64_t seq;                       // sequence number of the slot
+    time_t timestamp;                   // time the message was logged
+    LogLevel level;                     // message level
+    const char *function;               // name of the calling function
+    char text[LOG_MSG_MAX];             // message text
+} LogSlot;
+
 static const char *logLevelTbl[] = {
         [NONE]  "NONE",
         [INFO]  "INFO",
         [WARN]  "WARN",
         [ERROR] "ERROR",
-        [FATAL] "FATAL,"
+        [FATAL] "FATAL",
 };
 
-static LogLevel logLevel = NONE;
+LogLevel logLevel = NONE;
+
+static unsigned logRateLimit = 100;
+
+static LogSlot *logRing;
+static uint64_t logHead;                // next slot to be written out
+static uint64_t logTail;                // next slot to be filled
+static uint64_t logDropped;             // messages dropped because the ring was full
 
 void setLogLevel(LogLevel level)
 {
     logLevel = level;
 }
 
-void msgLog(LogLevel level, const char *function, const char *fmt, ...)
+void setLogRateLimit(unsigned maxPerSec)
 {
-    time_t now = time(NULL);
-    struct tm tm;
-    char timestamp[80];
-    va_list ap;
+    logRateLimit = maxPerSec;
+}
+
+static time_t logTime(void)
+{
+    struct timespec ts;
+#ifdef CLOCK_REALTIME_COARSE
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+    return ts.tv_sec;
+}
+
+// Format the timestamp, reusing the last result if it is
+// for the same second.
+static const char *fmtTimestamp(time_t timestamp)
+{
+    static time_t lastTime = -1;
+    static char lastStamp[80];
+
+    if (timestamp != lastTime) {
+        struct tm tm;
+        strftime(lastStamp, sizeof (lastStamp), "%Y-%m-%dT%H:%M:%S", localtime_r(&timestamp, &tm));
+        lastTime = timestamp;
+    }
+
+    return lastStamp;
+}
+
+static void writeMsg(time_t timestamp, LogLevel level, const char *function, const char *text)
+{
+    fprintf(stdout, "%s:%s:%s: %s\n", fmtTimestamp(timestamp), logLevelTbl[level], function, text);
+}
+
+static void *logThread(void *arg)
+{
+    uint64_t dropped = 0;
+    sigset_t sigMask;
 
-    strftime(timestamp, sizeof (timestamp), "%Y-%m-%dT%H:%M:%S", localtime_r(&now, &tm));
-    fprintf(stdout, "%s:%s:%s: ", timestamp, logLevelTbl[level], function);
-    va_start(ap, fmt);
-    vfprintf(stdout, fmt, ap);
-    va_end(ap);
-    fprintf(stdout, "\n");
+    // Leave the signals to the event loop
+    sigfillset(&sigMask);
+    pthread_sigmask(SIG_BLOCK, &sigMask, NULL);
+
+    while (true) {
+        Bool wrote = false;
+
+        while (true) {
+            LogSlot *pSlot = &logRing[logHead & (LOG_RING_SIZE - 1)];
+            if (__atomic_load_n(&pSlot->seq, __ATOMIC_ACQUIRE) != (logHead + 1)) {
+                break;
+            }
+            writeMsg(pSlot->timestamp, pSlot->level, pSlot->function, pSlot->text);
+            __atomic_store_n(&pSlot->seq, (logHead + LOG_RING_SIZE), __ATOMIC_RELEASE);
+            __atomic_store_n(&logHead, (logHead + 1), __ATOMIC_RELEASE);
+            wrote = true;
+        }
+
+        if (__atomic_load_n(&logDropped, __ATOMIC_RELAXED) != dropped) {
+            uint64_t total = __atomic_load_n(&logDropped, __ATOMIC_RELAXED);
+            char text[80];
+            snprintf(text, sizeof (text), "Dropped %lu messages! (log ring full)", (total - dropped));
+            writeMsg(logTime(), WARN, __FUNCTION__, text);
+            dropped = total;
+            wrote = true;
+        }
+
+        if (wrote) {
+            fflush(stdout);
+        } else {
+            struct timespec nap = { .tv_sec = 0, .tv_nsec = 2000000 };
+            nanosleep(&nap, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+int logInit(void)
+{
+    pthread_t tid;
+
+    if ((logRing = calloc(LOG_RING_SIZE, sizeof (LogSlot))) == NULL) {
+        return -1;
+    }
+
+    for (uint64_t n = 0; n < LOG_RING_SIZE; n++) {
+        logRing[n].seq = n;
+    }
+
+    if (pthread_create(&tid, NULL, logThread, NULL) != 0) {
+        free(logRing);
+        logRing = NULL;
+        return -1;
+    }
+    pthread_detach(tid);
+
+    atexit(logFlush);
+
+    return 0;
+}
+
+void logFlush(void)
+{
+    if (logRing != NULL) {
+        // Give the log thread up to a second to drain
+        // the ring.
+        for (int n = 0; n < 1000; n++) {
+            if (__atomic_load_n(&logHead, __ATOMIC_ACQUIRE) == __atomic_load_n(&logTail, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            usleep(1000);
+        }
+    }
     fflush(stdout);
-    if (level == FATAL) {
-        exit(-1);
+}
+
+// Check whether the message from the given call site is
+// allowed under the rate limit. When the site leaves a
+// period of suppression, the number of suppressed messages
+// is returned in 'pSuppressed'. The same call site can be
+// hit by several threads at once, so its state is only
+// updated with atomic operations; a race at the start of a
+// window can let a message or two more through, but never
+// loses the count of the suppressed ones.
+static Bool rateLimitOk(LogSite *pSite, time_t now, uint32_t *pSuppressed)
+{
+    time_t window;
+
+    *pSuppressed = 0;
+
+    if (logRateLimit == 0) {
+        return true;
+    }
+
+    window = __atomic_load_n(&pSite->window, __ATOMIC_RELAXED);
+    if ((window != now) &&
+        __atomic_compare_exchange_n(&pSite->window, &window, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&pSite->count, 0, __ATOMIC_RELAXED);
     }
+
+    if (__atomic_fetch_add(&pSite->count, 1, __ATOMIC_RELAXED) >= logRateLimit) {
+        __atomic_fetch_add(&pSite->suppressed, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    *pSuppressed = __atomic_exchange_n(&pSite->suppressed, 0, __ATOMIC_RELAXED);
+
+    return true;
 }
 
+static void fmtText(char *text, size_t size, const char *fmt, va_list ap, uint32_t suppressed)
+{
+    int n = vsnprintf(text, size, fmt, ap);
+    size_t len;
+
+    if (n < 0) {
+        text[0] = '\0';
+        return;
+    }
 
+    len = ((size_t) n < size) ? (size_t) n : (size - 1);
+    if ((size_t) n >= size) {
+        // Mark the message as truncated
+        memcpy((text + size - 6), "[...]", 6);
+    }
+
+    // Drop any trailing newlines
+    while ((len > 0) && (text[len-1] == '\n')) {
+        text[--len] = '\0';
+    }
 
+    if (suppressed != 0) {
+        snprintf((text + len), (size - len), " (%u similar messages suppressed)", suppressed);
+    }
+}
+
+void msgLog(LogLevel level, const char *function, LogSite *pSite, const char *fmt, ...)
+{
+    time_t now = logTime();
+    uint32_t suppressed = 0;
+    va_list ap;
+
+    if ((level != FATAL) && !rateLimitOk(pSite, now, &suppressed)) {
+        return;
+    }
+
+    if ((logRing == NULL) || (level == FATAL)) {
+        char text[LOG_MSG_MAX];
+
+        // Write the message synchronously, after any
+        // messages still in the ring.
+        logFlush();
+        va_start(ap, fmt);
+        fmtText(text, sizeof (text), fmt, ap, suppressed);
+        va_end(ap);
+        writeMsg(now, level, function, text);
+        fflush(stdout);
+    } else {
+        uint64_t pos = __atomic_load_n(&logTail, __ATOMIC_RELAXED);
+        LogSlot *pSlot;
+
+        // Claim a slot in the ring
+        while (true) {
+            uint64_t seq;
+            int64_t diff;
+
+            pSlot = &logRing[pos & (LOG_RING_SIZE - 1)];
+            seq = __atomic_load_n(&pSlot->seq, __ATOMIC_ACQUIRE);
+            diff = (int64_t) (seq - pos);
+            if (diff == 0) {
+                if (__atomic_compare_exchange_n(&logTail, &pos, (pos + 1), true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Ring is full!
+                __atomic_fetch_add(&logDropped, 1, __ATOMIC_RELAXED);
+                return;
+            } else {
+                pos = __atomic_load_n(&logTail, __ATOMIC_RELAXED);
+            }
+        }
+
+        pSlot->timestamp = now;
+        pSlot->level = level;
+        pSlot->function = function;
+        va_start(ap, fmt);
+        fmtText(pSlot->text, sizeof (pSlot->text), fmt, ap, suppressed);
+        va_end(ap);
+
+        // Hand it over to the log thread
+        __atomic_store_n(&pSlot->seq, (pos + 1), __ATOMIC_RELEASE);
+    }
+
+    if (level == FATAL) {
+        exit(-1);
+    }
+}
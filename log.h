@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdint.h>
+#include <time.h>
+
 typedef enum LogLevel {
     NONE=0,
     INFO,
@@ -8,15 +11,52 @@ typedef enum LogLevel {
     FATAL,
 } LogLevel;
 
-#define MSGLOG(level, fmt, args...)     msgLog((level), __FUNCTION__, (fmt), ##args)
+// Messages below this level are compiled out; e.g. build
+// with -DLOG_MIN_LEVEL=WARN to remove all the INFO messages.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL   NONE
+#endif
+
+// Per call site state used to rate-limit the messages. It
+// is shared by all the threads, and only accessed with
+// atomic operations.
+typedef struct LogSite {
+    time_t window;              // current one-second window
+    uint32_t count;             // messages logged in the current window
+    uint32_t suppressed;        // messages suppressed so far
+} LogSite;
+
+// The level test is done before the arguments are evaluated,
+// so a filtered-out message costs a single comparison.
+#define MSGLOG(level, fmt, args...) \
+    do { \
+        if (((level) >= LOG_MIN_LEVEL) && ((level) >= logLevel)) { \
+            static LogSite logSite; \
+            msgLog((level), __FUNCTION__, &logSite, (fmt), ##args); \
+        } \
+    } while (0)
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+extern LogLevel logLevel;
+
 void setLogLevel(LogLevel level);
 
-void msgLog(LogLevel level, const char *function, const char *fmt, ...)  __attribute__ ((__format__ (__printf__, 3, 4)));
+// Set the max number of messages per second allowed from
+// each call site (0=unlimited).
+void setLogRateLimit(unsigned maxPerSec);
+
+// Start the background thread that writes the messages to
+// stdout. Until this is called, messages are written
+// synchronously.
+int logInit(void);
+
+// Wait until all the queued messages have been written
+void logFlush(void);
+
+void msgLog(LogLevel level, const char *function, LogSite *pSite, const char *fmt, ...)  __attribute__ ((__format__ (__printf__, 4, 5)));
 
 #ifdef __cplusplus
 }
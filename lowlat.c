@@ -0,0 +1,163 @@
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "defs.h"
+#include "log.h"
+#include "lowlat.h"
+
+static int cpuTbl[LL_MAX_CPUS];
+static int numCpus;
+static Bool busyPoll;
+
+// Parse a CPU list with the format: <cpu>[-<cpu>][,<cpu>[-<cpu>]...]
+static int parseCpuList(const char *cpuList)
+{
+    const char *p = cpuList;
+
+    while (*p != '\0') {
+        int first, last, len;
+
+        if (sscanf(p, "%d%n", &first, &len) != 1) {
+            return -1;
+        }
+        p += len;
+        last = first;
+        if (*p == '-') {
+            p++;
+            if (sscanf(p, "%d%n", &last, &len) != 1) {
+                return -1;
+            }
+            p += len;
+        }
+        if ((first < 0) || (last < first) || (last >= CPU_SETSIZE)) {
+            return -1;
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            if (numCpus == LL_MAX_CPUS) {
+                return -1;
+            }
+            cpuTbl[numCpus++] = cpu;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0') {
+            return -1;
+        }
+    }
+
+    return (numCpus != 0) ? 0 : -1;
+}
+
+// Reserve the heap the riders are expected to need, and lock
+// all the memory of the process, present and future. The heap
+// is never trimmed, and the large blocks come from it too, so
+// the memory freed is reused instead of being given back to
+// the kernel and faulted in again.
+static int lockMemory(const CmdArgs *pArgs)
+{
+    size_t reserve = (size_t) pArgs->maxRiders * LL_HEAP_PER_RIDER;
+    void *pHeap;
+
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        MSGLOG(ERROR, "Failed to lock the process memory! (%s)", strerror(errno));
+        return -1;
+    }
+
+    if ((pHeap = malloc(reserve)) == NULL) {
+        MSGLOG(ERROR, "Failed to reserve heap! size=%zu (%s)", reserve, strerror(errno));
+        return -1;
+    }
+    memset(pHeap, 0, reserve);
+    free(pHeap);
+
+    MSGLOG(INFO, "Locked the process memory: heapReserve=%zu", reserve);
+
+    return 0;
+}
+
+int llInit(const CmdArgs *pArgs)
+{
+    if ((pArgs->cpuList != NULL) && (parseCpuList(pArgs->cpuList) != 0)) {
+        MSGLOG(ERROR, "Invalid CPU list! cpuList=%s", pArgs->cpuList);
+        return -1;
+    }
+
+    if (pArgs->lowLatency) {
+        busyPoll = true;
+        if (lockMemory(pArgs) != 0) {
+            // Error message already printed
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int llPinThread(int workerIdx)
+{
+    cpu_set_t cpuSet;
+    int cpu, s;
+
+    if (numCpus == 0) {
+        return 0;
+    }
+
+    // The event loop gets the first CPU to itself, unless
+    // there is only one.
+    if (workerIdx < 0) {
+        cpu = cpuTbl[0];
+    } else if (numCpus == 1) {
+        cpu = cpuTbl[0];
+    } else {
+        cpu = cpuTbl[1 + (workerIdx % (numCpus - 1))];
+    }
+
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
+    if ((s = pthread_setaffinity_np(pthread_self(), sizeof (cpuSet), &cpuSet)) != 0) {
+        MSGLOG(ERROR, "Failed to pin thread! cpu=%d (%s)", cpu, strerror(s));
+        return -1;
+    }
+
+    MSGLOG(INFO, "Pinned %s thread to CPU %d", ((workerIdx < 0) ? "event loop" : "builder"), cpu);
+
+    return 0;
+}
+
+void llConfigSock(int sd)
+{
+    static Bool warned;
+    int usecs = LL_BUSY_POLL_USECS;
+
+    if (!busyPoll) {
+        return;
+    }
+
+    // Raising the busy poll time above the net.core.busy_read
+    // setting takes CAP_NET_ADMIN; the mode still works without
+    // it, just with less benefit.
+    if ((setsockopt(sd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof (usecs)) != 0) && !warned) {
+        MSGLOG(WARN, "Failed to set SO_BUSY_POLL option! (%s)", strerror(errno));
+        warned = true;
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    {
+        int enable = 1;
+        if ((setsockopt(sd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &enable, sizeof (enable)) != 0) && !warned) {
+            MSGLOG(WARN, "Failed to set SO_PREFER_BUSY_POLL option! (%s)", strerror(errno));
+            warned = true;
+        }
+    }
+#endif
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "defs.h"
+
+// Low-latency runtime mode.
+//
+// For events where the tail latency matters more than the
+// CPU usage (e.g. sprint finishes), the GRS can trade CPU
+// time for latency:
+//
+// - The event loop is pinned to the first CPU of the
+//   --cpu-list, and the leaderboard builder threads to the
+//   rest, round-robin (or to the same one, if it's the only
+//   one listed), so that they don't migrate and keep their
+//   caches warm. The other threads (logger, metrics,
+//   spectators, etc.) are left unpinned.
+//
+// - With --low-latency, the rider sockets are set to busy
+//   poll the device queues (SO_BUSY_POLL and, where the
+//   kernel supports it, SO_PREFER_BUSY_POLL) instead of
+//   waiting for the interrupts; and all the memory of the
+//   process is locked, after reserving enough heap for the
+//   max number of riders, so that the event loop never takes
+//   a page fault.
+//
+// - With --spin-wait, the event loop never goes to sleep: it
+//   keeps polling its file descriptors without blocking until
+//   there is an event or a timer is due.
+#define LL_MAX_CPUS             64
+#define LL_BUSY_POLL_USECS      50          // busy poll time of the sockets
+#define LL_HEAP_PER_RIDER       (16 * 1024) // heap reserved per rider
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Parse the CPU list, and reserve and lock the memory if
+// the low-latency mode is enabled.
+extern int llInit(const CmdArgs *pArgs);
+
+// Pin the calling thread to its CPU: the event loop is
+// worker -1, and the builder threads are workers 0..N-1.
+// Does nothing if there is no CPU list.
+extern int llPinThread(int workerIdx);
+
+// Enable busy polling on a rider socket, if the low-latency
+// mode is enabled.
+extern void llConfigSock(int sd);
+
+#ifdef __cplusplus
+}
+#endif
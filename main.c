@@ -21,8 +21,20 @@ static const char *help =
         "    can have 100's of participants.\n"
         "\n"
         "OPTIONS:\n"
+        "    --capture <file>\n"
+        "        Specifies the file where all the inbound traffic is captured,\n"
+        "        for later use with the --replay option.\n"
+        "    --category-file <file>\n"
+        "        Specifies the file with the category scheme of the ride: the age,\n"
+        "        weight and W/kg bands, open and elite classes, etc. that define\n"
+        "        the leaderboard categories. By default, the riders are placed in\n"
+        "        the gender and age group categories.\n"
         "    --control-file <url>\n"
         "        Specifies the URL of the ride's control file.\n"
+        "    --cpu-list <cpu>[,<cpu>...]\n"
+        "        Pins the event loop to the first CPU in the list, and the leaderboard\n"
+        "        builder threads to the rest, round-robin. Ranges such as 2-5 are\n"
+        "        accepted too. By default the threads are not pinned.\n"
         "    --help\n"
         "        Show this help and exit.\n"
         "    --ip-addr <addr>\n"
@@ -32,20 +44,127 @@ static const char *help =
         "    --leaderboard-period <secs>\n"
         "        Specifies the period (in seconds) the GRS app needs to send\n"
         "        its \"leaderboard\" messages to the client apps.\n"
+        "    --leaderboard-stats\n"
+        "        Include the 3s, 30s and 5 min average power, the normalized power,\n"
+        "        the average speed and the W/kg of each rider in the leaderboard\n"
+        "        messages.\n"
+        "    --leaderboard-threads <num>\n"
+        "        Specifies the number of worker threads that build the leaderboard\n"
+        "        messages from a snapshot of each category, leaving only the\n"
+        "        fan-out to the event loop. The default is 0, which builds them\n"
+        "        in the event loop.\n"
+        "    --log-level <level>\n"
+        "        Specifies the minimum level (info, warn, error or fatal) of the\n"
+        "        messages written to the log. The default is info.\n"
+        "    --log-rate-limit <num>\n"
+        "        Specifies the maximum number of messages per second written\n"
+        "        to the log from any given place in the code. Messages above\n"
+        "        the limit are suppressed, and their count reported later. The\n"
+        "        default is 100; use 0 to disable the limit.\n"
+        "    --low-latency\n"
+        "        Trades CPU time for latency: the rider sockets busy poll the network\n"
+        "        device, and all the memory is reserved and locked at startup, so that\n"
+        "        the event loop never takes a page fault. Usually combined with\n"
+        "        --cpu-list and --spin-wait.\n"
+        "    --max-prog-update-period <msecs>\n"
+        "        Specifies the max period (in milliseconds) the server can ask\n"
+        "        the client apps to send their progUpd messages at, when it is\n"
+        "        heavily loaded or their category is large. The default is the\n"
+        "        value of --prog-update-period.\n"
         "    --max-riders <num>\n"
         "        Specifies the maximum number of riders allowed to join the\n"
         "        group ride.\n"
+        "    --metrics-port <port>\n"
+        "        Specifies the TCP port used to serve the server's metrics, in\n"
+        "        the Prometheus text format, on http://127.0.0.1:<port>/metrics\n"
+        "        By default the metrics are not served.\n"
+        "    --min-leaderboard-interval <msecs>\n"
+        "        When specified, the leaderboard of a category is sent as soon as\n"
+        "        it changes, instead of waiting for the next leaderboard period,\n"
+        "        but no more often than every <msecs>. The default is 0, which\n"
+        "        only sends the leaderboards periodically.\n"
+        "    --min-prog-update-period <msecs>\n"
+        "        Specifies the min period (in milliseconds) the server can ask\n"
+        "        the client apps to send their progUpd messages at, when it is\n"
+        "        lightly loaded. The default is the value of --prog-update-period.\n"
+        "    --overall-leaderboard-period <secs>\n"
+        "        When specified, the overall leaderboard and the leaderboard of each\n"
+        "        gender are sent every <secs> seconds, listing the riders across\n"
+        "        all the categories. The default is 0, which disables them.\n"
+        "    --overall-leaderboard-size <num>\n"
+        "        Specifies the number of riders listed in the overall leaderboards.\n"
+        "        The default is 50.\n"
         "    --prog-update-period <secs>\n"
         "        Specifies the period (in seconds) the client app's need to send\n"
         "        their \"progress update\" messages to the server.\n"
+        "    --record-file <file>\n"
+        "        Specifies the file where every progress update is recorded, for\n"
+        "        post-ride results and analysis. The file is written by a separate\n"
+        "        thread, and can be exported to CSV with the tools/grsrec tool.\n"
+        "    --replay <file>\n"
+        "        Replays the traffic in the specified capture file through the\n"
+        "        server, instead of listening for connections. The outbound\n"
+        "        messages are discarded. The other options (ride name, periods,\n"
+        "        etc.) should match the ones used when the traffic was captured.\n"
+        "    --replay-speed <factor>\n"
+        "        Specifies the speed factor of the replay; e.g. 1 replays the\n"
+        "        traffic at the original speed, 10 replays it ten times faster.\n"
+        "        The default is 0, which replays it as fast as possible.\n"
         "    --ride-name <name>\n"
         "        Specifies the name of the group ride.\n"
+        "    --shm-socket <path>\n"
+        "        Specifies the path of a Unix domain socket where the server accepts\n"
+        "        gateways running on the same host, which exchange the messages of\n"
+        "        their riders with it through a shared-memory ring. By default the\n"
+        "        shared-memory transport is disabled.\n"
+        "    --sim-duration <secs>\n"
+        "        Specifies the duration (in virtual time) of the simulated ride.\n"
+        "        The default is 3600.\n"
+        "    --sim-seed <num>\n"
+        "        Specifies the seed of the simulated traffic. The same seed, with\n"
+        "        the same options, always produces the same traffic. The default\n"
+        "        is 1.\n"
+        "    --simulate <riders>\n"
+        "        Runs a ride with the specified number of virtual riders, on a\n"
+        "        virtual clock, as fast as possible, instead of listening for\n"
+        "        connections. The --max-riders option must allow for all of them.\n"
+        "    --spectator-port <num>\n"
+        "        Specifies the TCP port where the server listens for spectator\n"
+        "        connections. Spectators subscribe to the leaderboards of one\n"
+        "        or more categories, without registering as riders. The default\n"
+        "        is 0, which disables the spectator listener.\n"
+        "    --spin-wait\n"
+        "        Makes the event loop spin, polling its sockets without blocking,\n"
+        "        instead of sleeping while waiting for events. It keeps a CPU 100%\n"
+        "        busy, but saves the wake-up latency.\n"
+        "    --start-lead-time <secs>\n"
+        "        When specified, the \"rideStarted\" message is sent <secs> seconds\n"
+        "        ahead of the start time, with the exact time at which the riders\n"
+        "        must start, so that they all start at the same instant. The\n"
+        "        default is 0, which sends it at the start time.\n"
         "    --start-time <time>\n"
         "        Specifies the start date and time (in ISO 8601 UTC format) of\n"
         "        the group ride; e.g. 2023-04-01T17:00:00Z\n"
         "    --tcp-port <port>\n"
         "        Specifies the TCP port used by the GRS app. The default is TCP\n"
         "        port 50000.\n"
+        "    --trace-file <file>\n"
+        "        Specifies the file where the phases of the slow event loop\n"
+        "        iterations are written, in the Chrome trace event format. The\n"
+        "        latency histograms of each phase are always kept, and written\n"
+        "        to stdout when the server receives the SIGUSR1 signal, or exits.\n"
+        "    --trace-threshold <usecs>\n"
+        "        Specifies the minimum processing time (in microseconds) of an\n"
+        "        event loop iteration for it to be written to the trace file.\n"
+        "        The default is 10000 usecs.\n"
+        "    --udp-port <num>\n"
+        "        Specifies the UDP port where the server receives the progUpd\n"
+        "        messages of the riders that opt into the UDP channel at\n"
+        "        registration. The default is 0, which disables the UDP channel.\n"
+        "    --unix-socket <path>\n"
+        "        Specifies the path of a Unix domain socket where the server also\n"
+        "        listens for rider connections, e.g. from pacer bots or gateways\n"
+        "        running on the same host. By default only the TCP port is used.\n"
         "    --version\n"
         "        Show program's version info and exit.\n"
         "    --video-file <url>\n"
@@ -78,7 +197,11 @@ static int parseCmdArgs(int argc, char *argv[], CmdArgs *pArgs)
     pArgs->maxRiders = 100;
     pArgs->progUpdPeriod = 1;
     pArgs->leaderboardPeriod = 2;
+    pArgs->overallLeaderboardSize = 50;
+    pArgs->simDuration = 3600;
+    pArgs->simSeed = 1;
     pArgs->tcpPort = DEF_TCP_PORT;
+    pArgs->traceThreshold = 10000;
 
     for (int n = 1; n <= numArgs; n++) {
         const char *arg;
@@ -86,13 +209,34 @@ static int parseCmdArgs(int argc, char *argv[], CmdArgs *pArgs)
 
         arg = argv[n];
 
-        if (strcmp(arg, "--control-file") == 0) {
+        if (strcmp(arg, "--capture") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<file>");
+            } else {
+                pArgs->captureFile = strdup(val);
+            }
+        } else if (strcmp(arg, "--category-file") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<file>");
+            } else {
+                pArgs->categoryFile = strdup(val);
+            }
+        } else if (strcmp(arg, "--control-file") == 0) {
             val = argv[++n];
             if (val == NULL) {
                 return missArg(arg, "<url>");
             } else {
                 pArgs->controlFile = strdup(val);
             }
+        } else if (strcmp(arg, "--cpu-list") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<cpu>[,<cpu>...]");
+            } else {
+                pArgs->cpuList = strdup(val);
+            }
         } else if (strcmp(arg, "--help") == 0) {
             fprintf(stdout, "%s\n", help);
             exit(0);
@@ -122,6 +266,49 @@ static int parseCmdArgs(int argc, char *argv[], CmdArgs *pArgs)
             } else if (sscanf(val, "%d", &pArgs->leaderboardPeriod) != 1) {
                 return invArg(val);
             }
+        } else if (strcmp(arg, "--leaderboard-stats") == 0) {
+            pArgs->leaderboardStats = true;
+        } else if (strcmp(arg, "--leaderboard-threads") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<num>");
+            } else if ((sscanf(val, "%d", &pArgs->leaderboardThreads) != 1) || (pArgs->leaderboardThreads < 0)) {
+                return invArg(val);
+            }
+        } else if (strcmp(arg, "--log-level") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<level>");
+            } else if (strcmp(val, "info") == 0) {
+                setLogLevel(INFO);
+            } else if (strcmp(val, "warn") == 0) {
+                setLogLevel(WARN);
+            } else if (strcmp(val, "error") == 0) {
+                setLogLevel(ERROR);
+            } else if (strcmp(val, "fatal") == 0) {
+                setLogLevel(FATAL);
+            } else {
+                return invArg(val);
+            }
+        } else if (strcmp(arg, "--log-rate-limit") == 0) {
+            unsigned maxPerSec;
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<num>");
+            } else if (sscanf(val, "%u", &maxPerSec) != 1) {
+                return invArg(val);
+            } else {
+                setLogRateLimit(maxPerSec);
+            }
+        } else if (strcmp(arg, "--low-latency") == 0) {
+            pArgs->lowLatency = true;
+        } else if (strcmp(arg, "--max-prog-update-period") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<msecs>");
+            } else if (sscanf(val, "%d", &pArgs->maxProgUpdPeriod) != 1) {
+                return invArg(val);
+            }
         } else if (strcmp(arg, "--max-riders") == 0) {
             val = argv[++n];
             if (val == NULL) {
@@ -129,6 +316,41 @@ static int parseCmdArgs(int argc, char *argv[], CmdArgs *pArgs)
             } else if (sscanf(val, "%d", &pArgs->maxRiders) != 1) {
                 return invArg(val);
             }
+        } else if (strcmp(arg, "--metrics-port") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<port>");
+            } else if (sscanf(val, "%d", &pArgs->metricsPort) != 1) {
+                return invArg(val);
+            }
+        } else if (strcmp(arg, "--min-leaderboard-interval") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<msecs>");
+            } else if ((sscanf(val, "%d", &pArgs->minLeaderboardInterval) != 1) || (pArgs->minLeaderboardInterval < 0)) {
+                return invArg(val);
+            }
+        } else if (strcmp(arg, "--min-prog-update-period") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<msecs>");
+            } else if (sscanf(val, "%d", &pArgs->minProgUpdPeriod) != 1) {
+                return invArg(val);
+            }
+        } else if (strcmp(arg, "--overall-leaderboard-period") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<secs>");
+            } else if ((sscanf(val, "%d", &pArgs->overallLeaderboardPeriod) != 1) || (pArgs->overallLeaderboardPeriod < 0)) {
+                return invArg(val);
+            }
+        } else if (strcmp(arg, "--overall-leaderboard-size") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<num>");
+            } else if ((sscanf(val, "%d", &pArgs->overallLeaderboardSize) != 1) || (pArgs->overallLeaderboardSize <= 0)) {
+                return invArg(val);
+            }
         } else if (strcmp(arg, "--prog-update-period") == 0) {
             val = argv[++n];
             if (val == NULL) {
@@ -136,6 +358,27 @@ static int parseCmdArgs(int argc, char *argv[], CmdArgs *pArgs)
             } else if (sscanf(val, "%d", &pArgs->progUpdPeriod) != 1) {
                 return invArg(val);
             }
+        } else if (strcmp(arg, "--record-file") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<file>");
+            } else {
+                pArgs->recordFile = strdup(val);
+            }
+        } else if (strcmp(arg, "--replay") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<file>");
+            } else {
+                pArgs->replayFile = strdup(val);
+            }
+        } else if (strcmp(arg, "--replay-speed") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<factor>");
+            } else if ((sscanf(val, "%lf", &pArgs->replaySpeed) != 1) || (pArgs->replaySpeed < 0.0)) {
+                return invArg(val);
+            }
         } else if (strcmp(arg, "--ride-name") == 0) {
             val = argv[++n];
             if (val == NULL) {
@@ -143,6 +386,50 @@ static int parseCmdArgs(int argc, char *argv[], CmdArgs *pArgs)
             } else {
                 pArgs->rideName = strdup(val);
             }
+        } else if (strcmp(arg, "--shm-socket") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<path>");
+            } else {
+                pArgs->shmSocket = strdup(val);
+            }
+        } else if (strcmp(arg, "--sim-duration") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<secs>");
+            } else if ((sscanf(val, "%d", &pArgs->simDuration) != 1) || (pArgs->simDuration <= 0)) {
+                return invArg(val);
+            }
+        } else if (strcmp(arg, "--sim-seed") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<num>");
+            } else if (sscanf(val, "%u", &pArgs->simSeed) != 1) {
+                return invArg(val);
+            }
+        } else if (strcmp(arg, "--simulate") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<riders>");
+            } else if ((sscanf(val, "%d", &pArgs->simRiders) != 1) || (pArgs->simRiders < 0)) {
+                return invArg(val);
+            }
+        } else if (strcmp(arg, "--spectator-port") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<num>");
+            } else if (sscanf(val, "%d", &pArgs->spectatorPort) != 1) {
+                return invArg(val);
+            }
+        } else if (strcmp(arg, "--spin-wait") == 0) {
+            pArgs->spinWait = true;
+        } else if (strcmp(arg, "--start-lead-time") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<secs>");
+            } else if ((sscanf(val, "%d", &pArgs->startLeadTime) != 1) || (pArgs->startLeadTime < 0)) {
+                return invArg(val);
+            }
         } else if (strcmp(arg, "--start-time") == 0) {
             val = argv[++n];
             if (val == NULL) {
@@ -162,6 +449,34 @@ static int parseCmdArgs(int argc, char *argv[], CmdArgs *pArgs)
             } else if (sscanf(val, "%d", &pArgs->tcpPort) != 1) {
                 return invArg(val);
             }
+        } else if (strcmp(arg, "--trace-file") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<file>");
+            } else {
+                pArgs->traceFile = strdup(val);
+            }
+        } else if (strcmp(arg, "--trace-threshold") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<usecs>");
+            } else if (sscanf(val, "%d", &pArgs->traceThreshold) != 1) {
+                return invArg(val);
+            }
+        } else if (strcmp(arg, "--udp-port") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<num>");
+            } else if (sscanf(val, "%d", &pArgs->udpPort) != 1) {
+                return invArg(val);
+            }
+        } else if (strcmp(arg, "--unix-socket") == 0) {
+            val = argv[++n];
+            if (val == NULL) {
+                return missArg(arg, "<path>");
+            } else {
+                pArgs->unixSocket = strdup(val);
+            }
         } else if (strcmp(arg, "--version") == 0) {
             fprintf(stdout, "Program version %s built on %s %s\n", PROGRAM_VERSION, __DATE__, __TIME__);
             exit(0);
@@ -192,7 +507,7 @@ static int parseCmdArgs(int argc, char *argv[], CmdArgs *pArgs)
         return missOpt("--video-file <url>");
     }
 
-    if (pArgs->startTime != 0) {
+    if ((pArgs->startTime != 0) && (pArgs->replayFile == NULL) && (pArgs->simRiders == 0)) {
         time_t now = time(NULL);
         if (pArgs->startTime < now) {
             time_t diff = now - pArgs->startTime;
@@ -207,6 +522,30 @@ static int parseCmdArgs(int argc, char *argv[], CmdArgs *pArgs)
         return invArg("TCP port must be in the range 49152-65535");
     }
 
+    if (pArgs->minProgUpdPeriod == 0) {
+        pArgs->minProgUpdPeriod = pArgs->progUpdPeriod * 1000;
+    }
+    if (pArgs->maxProgUpdPeriod == 0) {
+        pArgs->maxProgUpdPeriod = pArgs->progUpdPeriod * 1000;
+    }
+    if ((pArgs->minProgUpdPeriod <= 0) ||
+        (pArgs->minProgUpdPeriod > (pArgs->progUpdPeriod * 1000)) ||
+        (pArgs->maxProgUpdPeriod < (pArgs->progUpdPeriod * 1000))) {
+        return invArg("Min/max progUpd periods must be around the progUpd period");
+    }
+
+    if ((pArgs->spectatorPort != 0) && ((pArgs->spectatorPort < 49152) || (pArgs->spectatorPort > 65535))) {
+        return invArg("Spectator port must be in the range 49152-65535");
+    }
+
+    if ((pArgs->udpPort != 0) && ((pArgs->udpPort < 49152) || (pArgs->udpPort > 65535))) {
+        return invArg("UDP port must be in the range 49152-65535");
+    }
+
+    if ((pArgs->metricsPort < 0) || (pArgs->metricsPort > 65535)) {
+        return invArg("Metrics port must be in the range 0-65535");
+    }
+
     // If no address was specified, use the IPv4 wildcard
     if (pArgs->sockAddr.ss_family == 0) {
         pArgs->sockAddr.ss_family = AF_INET;
@@ -236,12 +575,35 @@ int main(int argc, char *argv[])
     CmdArgs cmdArgs = { 0 };
     Grs grs = { 0 };
 
+    // Start the logger thread, so that the event loop
+    // doesn't have to wait for the log messages to be
+    // written out.
+    if (logInit() != 0) {
+        fprintf(stderr, "Failed to start the logger!\n");
+    }
+
     // Parse the command-line arguments
     if (parseCmdArgs(argc, argv, &cmdArgs) != 0) {
         fprintf(stderr, "Use --help for the list of supported options.\n\n");
         return -1;
     }
 
+    if (cmdArgs.replayFile != NULL) {
+        // Replay the captured traffic...
+        if (grsReplay(&grs, &cmdArgs) != 0) {
+            MSGLOG(FATAL, "Something went wrong. BYE!");
+            return -1;
+        }
+        return 0;
+    } else if (cmdArgs.simRiders != 0) {
+        // Run the simulated ride...
+        if (grsSimulate(&grs, &cmdArgs) != 0) {
+            MSGLOG(FATAL, "Something went wrong. BYE!");
+            return -1;
+        }
+        return 0;
+    }
+
     // Start the main work loop...
     if (grsMain(&grs, &cmdArgs) != 0) {
         MSGLOG(FATAL, "Something went wrong. BYE!");
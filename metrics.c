@@ -0,0 +1,372 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "defs.h"
+#include "log.h"
+#include "metrics.h"
+#include "msgbuf.h"
+
+typedef struct MetricDesc {
+    const char *name;           // metric name
+    const char *labels;         // metric labels (if any)
+    const char *help;           // metric description
+} MetricDesc;
+
+static const MetricDesc ctrDescTbl[] = {
+    [ctrConnAccepted]       { "grs_connections_accepted_total", "", "Number of client connections accepted" },
+    [ctrConnClosed]         { "grs_connections_closed_total", "", "Number of client connections closed" },
+    [ctrMsgsInRegReq]       { "grs_messages_in_total", "type=\"regReq\"", "Number of messages received, by type" },
+    [ctrMsgsInProgUpd]      { "grs_messages_in_total", "type=\"progUpd\"", NULL },
+    [ctrMsgsInClkSyncReq]   { "grs_messages_in_total", "type=\"clkSyncReq\"", NULL },
+    [ctrMsgsInStartAck]     { "grs_messages_in_total", "type=\"startAck\"", NULL },
+    [ctrMsgsInSubReq]       { "grs_messages_in_total", "type=\"subReq\"", NULL },
+    [ctrMsgsInInvalid]      { "grs_messages_in_total", "type=\"invalid\"", NULL },
+    [ctrMsgsOutRegResp]     { "grs_messages_out_total", "type=\"regResp\"", "Number of messages sent, by type" },
+    [ctrMsgsOutRideStarted] { "grs_messages_out_total", "type=\"rideStarted\"", NULL },
+    [ctrMsgsOutLeaderboard] { "grs_messages_out_total", "type=\"leaderboard\"", NULL },
+    [ctrMsgsOutRateCtl]     { "grs_messages_out_total", "type=\"rateCtl\"", NULL },
+    [ctrMsgsOutKeepalive]   { "grs_messages_out_total", "type=\"keepalive\"", NULL },
+    [ctrMsgsOutClkSyncResp] { "grs_messages_out_total", "type=\"clkSyncResp\"", NULL },
+    [ctrMsgsOutSubResp]     { "grs_messages_out_total", "type=\"subResp\"", NULL },
+    [ctrRegsRefused]        { "grs_registrations_refused_total", "", "Number of registrations refused because of overload" },
+    [ctrOvlLevelChanges]    { "grs_overload_level_changes_total", "", "Number of changes of the overload degradation level" },
+    [ctrLbSnapsSkipped]     { "grs_leaderboard_snapshots_skipped_total", "", "Number of leaderboard snapshots skipped because the builder threads fell behind" },
+    [ctrBytesIn]            { "grs_bytes_in_total", "", "Number of bytes received" },
+    [ctrBytesOut]           { "grs_bytes_out_total", "", "Number of bytes sent" },
+    [ctrSendFailures]       { "grs_send_failures_total", "", "Number of failed send operations" },
+    [ctrEgressDropped]      { "grs_egress_messages_dropped_total", "", "Number of messages dropped because a rider's egress queue was full" },
+    [ctrIngressDropped]     { "grs_ingress_penalties_total", "action=\"drop\"", "Number of ingress rate limit penalties, by action" },
+    [ctrIngressThrottled]   { "grs_ingress_penalties_total", "action=\"throttle\"", NULL },
+    [ctrIngressDisconnected] { "grs_ingress_penalties_total", "action=\"disconnect\"", NULL },
+    [ctrUdpAccepted]        { "grs_udp_datagrams_total", "result=\"accepted\"", "Number of progUpd datagrams received over UDP, by result" },
+    [ctrUdpStale]           { "grs_udp_datagrams_total", "result=\"stale\"", NULL },
+    [ctrUdpRejected]        { "grs_udp_datagrams_total", "result=\"rejected\"", NULL },
+    [ctrSpecMsgsOut]        { "grs_spectator_messages_out_total", "", "Number of messages sent to spectators" },
+    [ctrSpecBytesOut]       { "grs_spectator_bytes_out_total", "", "Number of bytes sent to spectators" },
+    [ctrSpecDropped]        { "grs_spectator_messages_dropped_total", "", "Number of messages dropped because a spectator fell behind" },
+    [ctrCompBytesIn]        { "grs_compression_bytes_total", "stage=\"in\"", "Number of bytes of the leaderboard messages compressed, before and after compression" },
+    [ctrCompBytesOut]       { "grs_compression_bytes_total", "stage=\"out\"", NULL },
+};
+
+static const MetricDesc histoDescTbl[] = {
+    [histoLoopIter]         { "grs_loop_iteration_seconds", "", "Time spent processing an event loop iteration" },
+    [histoProcData]         { "grs_procdata_seconds", "", "Time spent parsing and processing an inbound message" },
+    [histoLbBuild]          { "grs_leaderboard_build_seconds", "", "Time spent building the leaderboard messages of a period" },
+    [histoLbFanout]         { "grs_leaderboard_fanout_seconds", "", "Time spent sending the leaderboard messages of a period" },
+    [histoLbOverall]        { "grs_leaderboard_overall_seconds", "", "Time spent building and sending the overall leaderboard messages" },
+    [histoStartSkew]        { "grs_start_skew_seconds", "", "Difference between the time each rider started and the go time, as reported by the riders" },
+    [histoCompress]         { "grs_compression_seconds", "", "Time spent compressing a leaderboard message, once for all the riders that get it" },
+};
+
+static const MetricDesc gaugeDescTbl[] = {
+    [gaugeConnections]      { "grs_connections", "", "Current number of client connections" },
+    [gaugeSpectators]       { "grs_spectators", "", "Current number of spectator connections" },
+    [gaugeLoopUtilization]  { "grs_loop_utilization_percent", "", "Percentage of time the event loop was busy during the last rate update interval" },
+    [gaugeBaseProgUpdPeriod] { "grs_progupd_period_milliseconds", "", "Progress update period requested from the riders in the smallest categories" },
+    [gaugeOverloadLevel]    { "grs_overload_level", "", "Current degradation level of the overload controller (0=normal)" },
+    [gaugeLeaderboardLag]   { "grs_leaderboard_lag_percent", "", "Lag of the last leaderboard period, as a percentage of the period" },
+};
+
+__thread Metrics *pThreadMetrics;
+
+// List of the per-thread metrics objects
+static pthread_mutex_t metricsLock = PTHREAD_MUTEX_INITIALIZER;
+static Metrics *metricsList;
+
+static int64_t gauges[GaugeIdMax];
+
+// Per-category gauges
+typedef struct CatGauges {
+    int numRegRiders;
+    int numActiveRiders;
+} CatGauges;
+
+static int numCats;
+static const char **catNames;
+static CatGauges *catGauges;
+static Histo *catFreshness;     // per-category freshness histograms
+
+static int listenSd = -1;
+
+// Allocate the metrics object of the calling thread. This
+// is only done once per thread, so it is OK to take the
+// lock here.
+Metrics *metricsThreadInit(void)
+{
+    Metrics *pMetrics;
+
+    if ((pMetrics = calloc(1, sizeof (Metrics))) == NULL) {
+        MSGLOG(FATAL, "Failed to alloc Metrics object! (%s)", strerror(errno));
+    }
+
+    pthread_mutex_lock(&metricsLock);
+    pMetrics->next = metricsList;
+    metricsList = pMetrics;
+    pthread_mutex_unlock(&metricsLock);
+
+    pThreadMetrics = pMetrics;
+
+    return pMetrics;
+}
+
+void metricsSetGauge(GaugeId id, int64_t val)
+{
+    __atomic_store_n(&gauges[id], val, __ATOMIC_RELAXED);
+}
+
+void metricsSetCatGauges(int catIdx, int numRegRiders, int numActiveRiders)
+{
+    if ((catGauges != NULL) && (catIdx < numCats)) {
+        __atomic_store_n(&catGauges[catIdx].numRegRiders, numRegRiders, __ATOMIC_RELAXED);
+        __atomic_store_n(&catGauges[catIdx].numActiveRiders, numActiveRiders, __ATOMIC_RELAXED);
+    }
+}
+
+void metricsRecordFreshness(int catIdx, uint64_t nsecs)
+{
+    if ((catFreshness != NULL) && (catIdx < numCats)) {
+        histoRecord(&catFreshness[catIdx], nsecs);
+    }
+}
+
+static int printHeader(MsgBuf *pBuf, const MetricDesc *pDesc, const char *type)
+{
+    if (pDesc->help == NULL) {
+        // Same metric as the previous one, but with
+        // different labels.
+        return 0;
+    }
+
+    return msgBufPrintf(pBuf, "# HELP %s %s\n# TYPE %s %s\n", pDesc->name, pDesc->help, pDesc->name, type);
+}
+
+static int printValue(MsgBuf *pBuf, const MetricDesc *pDesc, int64_t val)
+{
+    if (pDesc->labels[0] != '\0') {
+        return msgBufPrintf(pBuf, "%s{%s} %ld\n", pDesc->name, pDesc->labels, val);
+    }
+
+    return msgBufPrintf(pBuf, "%s %ld\n", pDesc->name, val);
+}
+
+// Format all the metrics using the Prometheus text format
+static int buildMetricsText(MsgBuf *pBuf)
+{
+    uint64_t ctrs[CtrIdMax] = {0};
+    static Histo histos[HistoIdMax];
+
+    msgBufReset(pBuf);
+
+    // Add up the values of all the threads
+    memset(histos, 0, sizeof (histos));
+    pthread_mutex_lock(&metricsLock);
+    for (Metrics *pMetrics = metricsList; pMetrics != NULL; pMetrics = pMetrics->next) {
+        for (int n = 0; n < CtrIdMax; n++) {
+            ctrs[n] += __atomic_load_n(&pMetrics->ctrs[n], __ATOMIC_RELAXED);
+        }
+        for (int n = 0; n < HistoIdMax; n++) {
+            histoMerge(&histos[n], &pMetrics->histos[n]);
+        }
+    }
+    pthread_mutex_unlock(&metricsLock);
+
+    for (int n = 0; n < CtrIdMax; n++) {
+        if ((printHeader(pBuf, &ctrDescTbl[n], "counter") < 0) ||
+            (printValue(pBuf, &ctrDescTbl[n], ctrs[n]) < 0)) {
+            return -1;
+        }
+    }
+
+    for (int n = 0; n < GaugeIdMax; n++) {
+        if ((printHeader(pBuf, &gaugeDescTbl[n], "gauge") < 0) ||
+            (printValue(pBuf, &gaugeDescTbl[n], __atomic_load_n(&gauges[n], __ATOMIC_RELAXED)) < 0)) {
+            return -1;
+        }
+    }
+
+    // The compression ratio is derived from the byte counters
+    if (msgBufPrintf(pBuf, "# HELP grs_compression_ratio Ratio of the size of the leaderboard messages compressed to the size of their compressed frames\n"
+                           "# TYPE grs_compression_ratio gauge\n"
+                           "grs_compression_ratio %.3f\n",
+                           (ctrs[ctrCompBytesOut] != 0) ? ((double) ctrs[ctrCompBytesIn] / ctrs[ctrCompBytesOut]) : 0.0) < 0) {
+        return -1;
+    }
+
+    if (msgBufPrintf(pBuf, "# HELP grs_registered_riders Current number of registered riders, by category\n"
+                           "# TYPE grs_registered_riders gauge\n") < 0) {
+        return -1;
+    }
+    for (int n = 0; n < numCats; n++) {
+        if (msgBufPrintf(pBuf, "grs_registered_riders{category=\"%s\"} %d\n",
+                catNames[n], __atomic_load_n(&catGauges[n].numRegRiders, __ATOMIC_RELAXED)) < 0) {
+            return -1;
+        }
+    }
+
+    if (msgBufPrintf(pBuf, "# HELP grs_active_riders Current number of riders sending progress updates, by category\n"
+                           "# TYPE grs_active_riders gauge\n") < 0) {
+        return -1;
+    }
+    for (int n = 0; n < numCats; n++) {
+        if (msgBufPrintf(pBuf, "grs_active_riders{category=\"%s\"} %d\n",
+                catNames[n], __atomic_load_n(&catGauges[n].numActiveRiders, __ATOMIC_RELAXED)) < 0) {
+            return -1;
+        }
+    }
+
+    for (int n = 0; n < HistoIdMax; n++) {
+        if ((printHeader(pBuf, &histoDescTbl[n], "histogram") < 0) ||
+            (histoPrintProm(&histos[n], pBuf, histoDescTbl[n].name, histoDescTbl[n].labels) < 0)) {
+            return -1;
+        }
+    }
+
+    if (msgBufPrintf(pBuf, "# HELP grs_leaderboard_freshness_seconds Time from the reception of a progress update to its inclusion in a leaderboard sent, by category\n"
+                           "# TYPE grs_leaderboard_freshness_seconds histogram\n") < 0) {
+        return -1;
+    }
+    for (int n = 0; n < numCats; n++) {
+        char labels[64];
+        snprintf(labels, sizeof (labels), "category=\"%s\"", catNames[n]);
+        if (histoPrintProm(&catFreshness[n], pBuf, "grs_leaderboard_freshness_seconds", labels) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void serveRequest(int sd, MsgBuf *pBuf)
+{
+    char req[1024];
+    size_t reqLen = 0;
+    char hdr[256];
+    const char *status = "200 OK";
+
+    // Read in the request line and headers; we don't
+    // care about anything else.
+    while (reqLen < (sizeof (req) - 1)) {
+        ssize_t len = read(sd, (req + reqLen), (sizeof (req) - 1 - reqLen));
+        if (len <= 0) {
+            return;
+        }
+        reqLen += len;
+        req[reqLen] = '\0';
+        if (strstr(req, "\r\n\r\n") != NULL) {
+            break;
+        }
+    }
+
+    if ((strncmp(req, "GET /metrics ", 13) == 0) || (strncmp(req, "GET / ", 6) == 0)) {
+        if (buildMetricsText(pBuf) != 0) {
+            status = "500 Internal Server Error";
+            msgBufReset(pBuf);
+        }
+    } else {
+        status = "404 Not Found";
+        msgBufReset(pBuf);
+    }
+
+    snprintf(hdr, sizeof (hdr), "HTTP/1.0 %s\r\n"
+                                "Content-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: %zu\r\n"
+                                "Connection: close\r\n\r\n",
+                                status, pBuf->len);
+    if ((send(sd, hdr, strlen(hdr), MSG_NOSIGNAL) > 0) && (pBuf->len != 0)) {
+        send(sd, pBuf->data, pBuf->len, MSG_NOSIGNAL);
+    }
+}
+
+static void *metricsThread(void *arg)
+{
+    MsgBuf msgBuf = {0};
+
+    while (true) {
+        struct timeval timeout = { .tv_sec = 2, .tv_usec = 0 };
+        int sd;
+
+        if ((sd = accept(listenSd, NULL, NULL)) < 0) {
+            if (errno != EINTR) {
+                MSGLOG(ERROR, "Failed to accept metrics connection! (%s)", strerror(errno));
+                sleep(1);
+            }
+            continue;
+        }
+
+        // Don't let a stalled client block the listener
+        setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+        setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+
+        serveRequest(sd, &msgBuf);
+        close(sd);
+    }
+
+    return NULL;
+}
+
+int metricsInit(int port, int nCats, const char *names[])
+{
+    SockAddrIn sockAddr = { .sin_family = AF_INET };
+    int enable = 1;
+    pthread_t tid;
+
+    numCats = nCats;
+    catNames = names;
+    if (((catGauges = calloc(nCats, sizeof (CatGauges))) == NULL) ||
+        ((catFreshness = calloc(nCats, sizeof (Histo))) == NULL)) {
+        MSGLOG(ERROR, "Failed to alloc category metrics! (%s)", strerror(errno));
+        return -1;
+    }
+
+    if (port == 0) {
+        // Metrics are collected, but not served
+        return 0;
+    }
+
+    // The metrics are only served on the loopback
+    // interface.
+    sockAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sockAddr.sin_port = htons(port);
+
+    if ((listenSd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        MSGLOG(ERROR, "Failed to open metrics socket! (%s)", strerror(errno));
+        return -1;
+    }
+
+    if (setsockopt(listenSd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof (enable)) != 0) {
+        MSGLOG(ERROR, "Failed to set SO_REUSEADDR option! (%s)", strerror(errno));
+        close(listenSd);
+        return -1;
+    }
+
+    if (bind(listenSd, (SockAddr *) &sockAddr, sizeof (sockAddr)) != 0) {
+        MSGLOG(ERROR, "Failed to bind metrics socket! (%s)", strerror(errno));
+        close(listenSd);
+        return -1;
+    }
+
+    if (listen(listenSd, 4) != 0) {
+        MSGLOG(ERROR, "Failed to listen on metrics socket! (%s)", strerror(errno));
+        close(listenSd);
+        return -1;
+    }
+
+    if (pthread_create(&tid, NULL, metricsThread, NULL) != 0) {
+        MSGLOG(ERROR, "Failed to create metrics thread!");
+        close(listenSd);
+        return -1;
+    }
+    pthread_detach(tid);
+
+    MSGLOG(INFO, "Serving metrics on http://127.0.0.1:%d/metrics", port);
+
+    return 0;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "histo.h"
+
+// Counters, maintained per thread. Each thread only ever
+// updates its own set, so no locks or atomic RMW operations
+// are needed on the hot path; the counters of all threads
+// are added up when the metrics are scraped.
+typedef enum CtrId {
+    ctrConnAccepted = 0,        // connections accepted
+    ctrConnClosed,              // connections closed
+    ctrMsgsInRegReq,            // "regReq" messages received
+    ctrMsgsInProgUpd,           // "progUpd" messages received
+    ctrMsgsInClkSyncReq,        // "clkSyncReq" messages received
+    ctrMsgsInStartAck,          // "startAck" messages received
+    ctrMsgsInSubReq,            // "subReq" messages received
+    ctrMsgsInInvalid,           // invalid/unsupported messages received
+    ctrMsgsOutRegResp,          // "regResp" messages sent
+    ctrMsgsOutRideStarted,      // "rideStarted" messages sent
+    ctrMsgsOutLeaderboard,      // "leaderboard" messages sent
+    ctrMsgsOutRateCtl,          // "rateCtl" messages sent
+    ctrMsgsOutKeepalive,        // "keepalive" messages sent
+    ctrMsgsOutClkSyncResp,      // "clkSyncResp" messages sent
+    ctrMsgsOutSubResp,          // "subResp" messages sent
+    ctrRegsRefused,             // registrations refused because of overload
+    ctrOvlLevelChanges,         // changes of the overload degradation level
+    ctrLbSnapsSkipped,          // leaderboard snapshots skipped because the builder fell behind
+    ctrBytesIn,                 // bytes received
+    ctrBytesOut,                // bytes sent
+    ctrSendFailures,            // failed send() calls
+    ctrEgressDropped,           // messages dropped because a rider's egress queue was full
+    ctrIngressDropped,          // inbound messages dropped by the ingress rate limits
+    ctrIngressThrottled,        // connections throttled by the ingress rate limits
+    ctrIngressDisconnected,     // connections closed by the ingress rate limits
+    ctrUdpAccepted,             // progUpd datagrams accepted
+    ctrUdpStale,                // progUpd datagrams discarded as out of order
+    ctrUdpRejected,             // invalid or unauthenticated datagrams
+    ctrSpecMsgsOut,             // messages sent to spectators
+    ctrSpecBytesOut,            // bytes sent to spectators
+    ctrSpecDropped,             // messages dropped because a spectator fell behind
+    ctrCompBytesIn,             // bytes of the leaderboard messages compressed
+    ctrCompBytesOut,            // bytes of the compressed frames
+    CtrIdMax
+} CtrId;
+
+// Latency histograms, also maintained per thread
+typedef enum HistoId {
+    histoLoopIter = 0,          // event loop iteration time
+    histoProcData,              // time to parse and process an inbound message
+    histoLbBuild,               // time to build the leaderboard messages
+    histoLbFanout,              // time to send the leaderboard messages
+    histoLbOverall,             // time to build and send the overall leaderboard messages
+    histoStartSkew,             // difference between the time a rider started and the go time
+    histoCompress,              // time to compress a leaderboard message
+    HistoIdMax
+} HistoId;
+
+// Gauges, set by the event loop
+typedef enum GaugeId {
+    gaugeConnections = 0,       // current number of connections
+    gaugeSpectators,            // current number of spectator connections
+    gaugeLoopUtilization,       // percentage of time the event loop is busy
+    gaugeBaseProgUpdPeriod,     // progUpd period (in msecs) for the smallest categories
+    gaugeOverloadLevel,         // current degradation level of the overload controller
+    gaugeLeaderboardLag,        // lag of the last leaderboard period, as a percentage of the period
+    GaugeIdMax
+} GaugeId;
+
+typedef struct Metrics {
+    uint64_t ctrs[CtrIdMax];
+    Histo histos[HistoIdMax];
+    struct Metrics *next;
+} Metrics;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern __thread Metrics *pThreadMetrics;
+
+extern Metrics *metricsThreadInit(void);
+
+static __inline__ Metrics *metricsGet(void)
+{
+    Metrics *pMetrics = pThreadMetrics;
+    return (pMetrics != NULL) ? pMetrics : metricsThreadInit();
+}
+
+// Add the given value to the specified counter
+static __inline__ void metricsAdd(CtrId id, uint64_t val)
+{
+    Metrics *pMetrics = metricsGet();
+    __atomic_store_n(&pMetrics->ctrs[id], (pMetrics->ctrs[id] + val), __ATOMIC_RELAXED);
+}
+
+// Record a value (in nanoseconds) in the specified histogram
+static __inline__ void metricsRecord(HistoId id, uint64_t nsecs)
+{
+    histoRecord(&metricsGet()->histos[id], nsecs);
+}
+
+extern void metricsSetGauge(GaugeId id, int64_t val);
+
+// Set the number of registered and active riders in the
+// specified category.
+extern void metricsSetCatGauges(int catIdx, int numRegRiders, int numActiveRiders);
+
+// Record how long (in nanoseconds) a progUpd message took to
+// be included in a leaderboard of the specified category.
+// Only the event loop calls this.
+extern void metricsRecordFreshness(int catIdx, uint64_t nsecs);
+
+// Start the HTTP listener that serves the metrics in the
+// Prometheus text format. If 'port' is zero, the metrics are
+// still collected, but not served. The category names are
+// used to label the per-category gauges.
+extern int metricsInit(int port, int numCats, const char *catNames[]);
+
+#ifdef __cplusplus
+}
+#endif
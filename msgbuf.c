@@ -0,0 +1,74 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msgbuf.h"
+
+#define MSGBUF_MIN_SIZE     4096
+
+static int msgBufGrow(MsgBuf *pBuf, size_t minSize)
+{
+    size_t size = (pBuf->size != 0) ? pBuf->size : MSGBUF_MIN_SIZE;
+    char *data;
+
+    while (size < minSize) {
+        size *= 2;
+    }
+
+    if ((data = realloc(pBuf->data, size)) == NULL) {
+        return -1;
+    }
+
+    pBuf->data = data;
+    pBuf->size = size;
+
+    return 0;
+}
+
+void msgBufFree(MsgBuf *pBuf)
+{
+    free(pBuf->data);
+    pBuf->data = NULL;
+    pBuf->len = pBuf->size = 0;
+}
+
+int msgBufPrintf(MsgBuf *pBuf, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if ((pBuf->size - pBuf->len) < 2) {
+        if (msgBufGrow(pBuf, (pBuf->len + 2)) != 0) {
+            return -1;
+        }
+    }
+
+    // Try to format the text in the available space;
+    // if it doesn't fit, grow the buffer and try again.
+    va_start(ap, fmt);
+    n = vsnprintf((pBuf->data + pBuf->len), (pBuf->size - pBuf->len), fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return -1;
+    }
+
+    if ((pBuf->len + n) >= pBuf->size) {
+        if (msgBufGrow(pBuf, (pBuf->len + n + 1)) != 0) {
+            return -1;
+        }
+        va_start(ap, fmt);
+        vsnprintf((pBuf->data + pBuf->len), (pBuf->size - pBuf->len), fmt, ap);
+        va_end(ap);
+    }
+
+    pBuf->len += n;
+
+    return n;
+}
+
+void msgBufTrim(MsgBuf *pBuf, size_t n)
+{
+    pBuf->len = (n < pBuf->len) ? (pBuf->len - n) : 0;
+    pBuf->data[pBuf->len] = '\0';
+}
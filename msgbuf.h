@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+
+// A growable buffer used to build the outgoing messages.
+typedef struct MsgBuf {
+    char *data;     // start of the message text
+    size_t len;     // number of bytes used (excluding the null terminator)
+    size_t size;    // number of bytes allocated
+} MsgBuf;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Discard the current contents of the buffer, but keep
+// its storage around for the next message.
+static __inline__ void msgBufReset(MsgBuf *pBuf) { pBuf->len = 0; if (pBuf->data != NULL) pBuf->data[0] = '\0'; }
+
+// Release the storage used by the buffer
+extern void msgBufFree(MsgBuf *pBuf);
+
+// Append formatted text to the buffer, growing it as
+// needed.
+extern int msgBufPrintf(MsgBuf *pBuf, const char *fmt, ...) __attribute__ ((__format__ (__printf__, 2, 3)));
+
+// Remove the last N characters from the buffer
+extern void msgBufTrim(MsgBuf *pBuf, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
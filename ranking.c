@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ranking.h"
+
+// If the insertion sort has to move the riders more than
+// this many places per rider, on average, the ranking has
+// changed too much, and it's cheaper to just sort it.
+#define RANK_MAX_SHIFTS     8
+
+typedef struct Ranking {
+    const Rider **tbl;          // riders of the gender, sorted by distance
+    int len;                    // number of riders in the table
+    int size;                   // number of entries allocated
+} Ranking;
+
+// Cursor into the ranking of a gender, used by the merge
+typedef struct RankCursor {
+    const Ranking *pRank;
+    int pos;
+} RankCursor;
+
+static Ranking rankTbl[GenderMax];
+
+static int cmpRiderDistance(const void *p1, const void *p2)
+{
+    const Rider *pRider1 = *(const Rider **) p1;
+    const Rider *pRider2 = *(const Rider **) p2;
+
+    return (pRider2->distance > pRider1->distance) - (pRider2->distance < pRider1->distance);
+}
+
+static void sortRanking(Ranking *pRank)
+{
+    const Rider **tbl = pRank->tbl;
+    long maxShifts = (long) pRank->len * RANK_MAX_SHIFTS;
+    long numShifts = 0;
+
+    for (int n = 1; n < pRank->len; n++) {
+        const Rider *pRider = tbl[n];
+        int m = n;
+
+        while ((m > 0) && (tbl[m - 1]->distance < pRider->distance)) {
+            tbl[m] = tbl[m - 1];
+            m--;
+        }
+        tbl[m] = pRider;
+
+        if ((numShifts += (n - m)) > maxShifts) {
+            qsort(tbl, pRank->len, sizeof (Rider *), cmpRiderDistance);
+            return;
+        }
+    }
+}
+
+// Restore the heap property from the given node down; the
+// cursor whose current rider has the longest distance is
+// at the top.
+static void siftDown(RankCursor *heap, int heapLen, int n)
+{
+    for (;;) {
+        int child = (2 * n) + 1;
+        RankCursor tmp;
+
+        if (child >= heapLen) {
+            break;
+        }
+        if (((child + 1) < heapLen) &&
+            (heap[child + 1].pRank->tbl[heap[child + 1].pos]->distance > heap[child].pRank->tbl[heap[child].pos]->distance)) {
+            child++;
+        }
+        if (heap[n].pRank->tbl[heap[n].pos]->distance >= heap[child].pRank->tbl[heap[child].pos]->distance) {
+            break;
+        }
+        tmp = heap[n];
+        heap[n] = heap[child];
+        heap[child] = tmp;
+        n = child;
+    }
+}
+
+int rankAddRider(const Rider *pRider)
+{
+    Ranking *pRank = &rankTbl[pRider->gender];
+
+    if (pRank->len == pRank->size) {
+        int size = (pRank->size != 0) ? (pRank->size * 2) : 64;
+        const Rider **tbl;
+        if ((tbl = realloc(pRank->tbl, (size * sizeof (Rider *)))) == NULL) {
+            return -1;
+        }
+        pRank->tbl = tbl;
+        pRank->size = size;
+    }
+
+    // New riders start at the back; the next sort will
+    // put them in their place.
+    pRank->tbl[pRank->len++] = pRider;
+
+    return 0;
+}
+
+void rankRemoveRider(const Rider *pRider)
+{
+    Ranking *pRank = &rankTbl[pRider->gender];
+
+    for (int n = 0; n < pRank->len; n++) {
+        if (pRank->tbl[n] == pRider) {
+            memmove(&pRank->tbl[n], &pRank->tbl[n + 1], ((pRank->len - n - 1) * sizeof (Rider *)));
+            pRank->len--;
+            break;
+        }
+    }
+}
+
+void rankSort(void)
+{
+    for (Gender gender = unspec; gender < GenderMax; gender++) {
+        sortRanking(&rankTbl[gender]);
+    }
+}
+
+int rankMerge(Gender gender, int maxEntries, const Rider **pTbl)
+{
+    RankCursor heap[GenderMax];
+    int heapLen = 0;
+    int numEntries = 0;
+
+    // Start with the leader of each gender
+    for (Gender g = unspec; g < GenderMax; g++) {
+        if ((gender != GenderMax) && (g != gender)) {
+            continue;
+        }
+        if (rankTbl[g].len != 0) {
+            heap[heapLen].pRank = &rankTbl[g];
+            heap[heapLen].pos = 0;
+            heapLen++;
+        }
+    }
+    for (int n = (heapLen / 2) - 1; n >= 0; n--) {
+        siftDown(heap, heapLen, n);
+    }
+
+    // Take the overall leader, and replace it with the next
+    // rider of its gender.
+    while ((heapLen != 0) && (numEntries < maxEntries)) {
+        pTbl[numEntries++] = heap[0].pRank->tbl[heap[0].pos];
+        if (++heap[0].pos == heap[0].pRank->len) {
+            heap[0] = heap[--heapLen];
+        }
+        siftDown(heap, heapLen, 0);
+    }
+
+    return numEntries;
+}
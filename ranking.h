@@ -0,0 +1,42 @@
+#pragma once
+
+#include "defs.h"
+
+// Per-gender rankings, used to build the overall and gender
+// overall leaderboards.
+//
+// Each gender keeps an array of its registered riders,
+// sorted by distance; a rider is in exactly one of them, no
+// matter how many categories it belongs to. (The category
+// rankings are not merged instead, since a rider in several
+// categories would have to be skipped as a duplicate, and
+// there would be many more of them to merge.) Between two
+// overall leaderboards the riders only move a few places, so
+// the arrays are re-sorted with an insertion sort, which is
+// close to linear on nearly sorted data. The overall ranking
+// is then produced by a k-way merge of the gender rankings,
+// stopping as soon as enough riders have been listed; no
+// sort of all the riders is ever done.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Add a newly registered rider to the ranking of its gender
+extern int rankAddRider(const Rider *pRider);
+
+// Remove a rider from the ranking of its gender
+extern void rankRemoveRider(const Rider *pRider);
+
+// Bring the rankings of all the genders up to date
+extern void rankSort(void);
+
+// Get the ranking of the specified gender (or merge the
+// rankings of all the genders, if 'gender' is GenderMax)
+// into 'pTbl', which must have room for 'maxEntries' riders.
+// Returns the number of riders stored in 'pTbl'.
+extern int rankMerge(Gender gender, int maxEntries, const Rider **pTbl);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,299 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "log.h"
+#include "recorder.h"
+
+// The samples and the rider records are queued in two
+// single-producer/single-consumer rings: the event loop
+// appends them at the tail, and the writer thread takes them
+// from the head. The writer thread collects the samples into
+// a block, and writes it out when it is full, or when its
+// oldest sample is REC_FLUSH_SECS old. The file is synced
+// every REC_SYNC_SECS, so that a crash loses at most that
+// much telemetry. The memory used is fixed.
+#define REC_RING_SAMPLES    65536   // must be a power of 2
+#define REC_RING_RIDERS     1024    // must be a power of 2
+#define REC_FLUSH_SECS      5
+#define REC_SYNC_SECS       10
+
+#define REC_ALIGN(n)        (((n) + (REC_BLOCK_ALIGN - 1)) & ~((size_t) REC_BLOCK_ALIGN - 1))
+#define REC_BLOCK_SIZE      REC_ALIGN(sizeof (RecBlkHdr) + REC_COLS_SIZE(REC_BLOCK_SAMPLES))
+
+static RecSample *sampleRing;
+static uint64_t sampleHead;
+static uint64_t sampleTail;
+static uint64_t samplesDropped;
+static RecRider *riderRing;
+static uint64_t riderHead;
+static uint64_t riderTail;
+static uint64_t ridersDropped;
+
+// Block being filled by the writer thread
+static RecSample blkSamples[REC_BLOCK_SAMPLES];
+static int blkCount;
+static uint64_t blkStart;
+static char *blkBuf;
+
+static int recFd = -1;
+static pthread_t recTid;
+static volatile int recStop;
+
+// Write out a block, padding it to the block alignment
+static void writeBlock(RecBlkHdr *pHdr, size_t len)
+{
+    size_t size = REC_ALIGN(len);
+    size_t off = 0;
+
+    memset((blkBuf + len), 0, (size - len));
+    pHdr->size = size;
+    memcpy(blkBuf, pHdr, sizeof (*pHdr));
+
+    while (off < size) {
+        ssize_t n = write(recFd, (blkBuf + off), (size - off));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            MSGLOG(ERROR, "Failed to write recording file! (%s)", strerror(errno));
+            return;
+        }
+        off += n;
+    }
+}
+
+// Write out the samples collected so far, by column
+static void writeSamples(void)
+{
+    RecBlkHdr hdr = { .type = recBlkSamples, .count = blkCount };
+    char *cols = blkBuf + sizeof (hdr);
+    uint32_t *timeCol = (uint32_t *) (cols + REC_COL_TIME(blkCount));
+    uint32_t *bibNumCol = (uint32_t *) (cols + REC_COL_BIBNUM(blkCount));
+    int32_t *distanceCol = (int32_t *) (cols + REC_COL_DISTANCE(blkCount));
+    uint16_t *powerCol = (uint16_t *) (cols + REC_COL_POWER(blkCount));
+    uint16_t *speedCol = (uint16_t *) (cols + REC_COL_SPEED(blkCount));
+
+    if (blkCount == 0) {
+        return;
+    }
+
+    hdr.baseTime = blkSamples[0].time;
+    for (int n = 1; n < blkCount; n++) {
+        if (blkSamples[n].time < hdr.baseTime) {
+            hdr.baseTime = blkSamples[n].time;
+        }
+    }
+
+    for (int n = 0; n < blkCount; n++) {
+        const RecSample *pSample = &blkSamples[n];
+        timeCol[n] = pSample->time - hdr.baseTime;
+        bibNumCol[n] = pSample->bibNum;
+        distanceCol[n] = pSample->distance;
+        powerCol[n] = pSample->power;
+        speedCol[n] = pSample->speed;
+    }
+
+    writeBlock(&hdr, (sizeof (hdr) + REC_COLS_SIZE(blkCount)));
+    blkCount = 0;
+}
+
+// Write out the rider records queued so far
+static int writeRiders(void)
+{
+    uint64_t head = riderHead;
+    uint64_t tail = __atomic_load_n(&riderTail, __ATOMIC_ACQUIRE);
+    RecBlkHdr hdr = { .type = recBlkRiders };
+    RecRider *pRider = (RecRider *) (blkBuf + sizeof (hdr));
+    size_t maxRiders = (REC_BLOCK_SIZE - sizeof (hdr)) / sizeof (RecRider);
+
+    if (head == tail) {
+        return 0;
+    }
+
+    while ((head != tail) && (hdr.count < maxRiders)) {
+        pRider[hdr.count++] = riderRing[head++ & (REC_RING_RIDERS - 1)];
+    }
+    __atomic_store_n(&riderHead, head, __ATOMIC_RELEASE);
+
+    writeBlock(&hdr, (sizeof (hdr) + (hdr.count * sizeof (RecRider))));
+
+    return hdr.count;
+}
+
+// Move the queued samples to the current block, writing it
+// out every time it fills up.
+static int takeSamples(void)
+{
+    uint64_t head = sampleHead;
+    uint64_t tail = __atomic_load_n(&sampleTail, __ATOMIC_ACQUIRE);
+    int numSamples = tail - head;
+
+    while (head != tail) {
+        if (blkCount == 0) {
+            blkStart = monoTimeNs();
+        }
+        blkSamples[blkCount++] = sampleRing[head++ & (REC_RING_SAMPLES - 1)];
+        if (blkCount == REC_BLOCK_SAMPLES) {
+            // The block buffer is separate from the ring, so
+            // the space can be released before writing it.
+            __atomic_store_n(&sampleHead, head, __ATOMIC_RELEASE);
+            writeSamples();
+        }
+    }
+    __atomic_store_n(&sampleHead, head, __ATOMIC_RELEASE);
+
+    return numSamples;
+}
+
+static void *recThread(void *arg)
+{
+    sigset_t sigMask;
+    uint64_t lastSync = monoTimeNs();
+
+    // Leave the signals to the event loop
+    sigfillset(&sigMask);
+    pthread_sigmask(SIG_BLOCK, &sigMask, NULL);
+
+    while (true) {
+        int numRecs = writeRiders() + takeSamples();
+        uint64_t now;
+
+        if ((numRecs == 0) && recStop) {
+            break;
+        }
+
+        // The flush and sync deadlines are checked on every
+        // pass, so that a steady stream of samples can't hold
+        // them off.
+        now = monoTimeNs();
+        if ((blkCount != 0) && ((now - blkStart) >= (REC_FLUSH_SECS * 1000000000ULL))) {
+            writeSamples();
+        }
+        if ((now - lastSync) >= (REC_SYNC_SECS * 1000000000ULL)) {
+            fdatasync(recFd);
+            lastSync = now;
+        }
+
+        // Only take a nap when there was nothing to do
+        if (numRecs == 0) {
+            struct timespec nap = { .tv_sec = 0, .tv_nsec = 10000000 };
+            nanosleep(&nap, NULL);
+        }
+    }
+
+    writeSamples();
+    fdatasync(recFd);
+
+    return NULL;
+}
+
+int recInit(const char *fileName, const char *rideName)
+{
+    RecFileHdr hdr = { .magic = REC_MAGIC };
+
+    if (((sampleRing = calloc(REC_RING_SAMPLES, sizeof (RecSample))) == NULL) ||
+        ((riderRing = calloc(REC_RING_RIDERS, sizeof (RecRider))) == NULL) ||
+        (posix_memalign((void **) &blkBuf, REC_BLOCK_ALIGN, REC_BLOCK_SIZE) != 0)) {
+        MSGLOG(ERROR, "Failed to alloc recording buffers! (%s)", strerror(errno));
+        return -1;
+    }
+
+    if ((recFd = open(fileName, (O_WRONLY | O_CREAT | O_TRUNC), 0644)) < 0) {
+        MSGLOG(ERROR, "Failed to open recording file! file=%s (%s)", fileName, strerror(errno));
+        return -1;
+    }
+
+    // The file header takes a whole block too
+    hdr.startSec = time(NULL);
+    snprintf(hdr.rideName, sizeof (hdr.rideName), "%s", rideName);
+    memset(blkBuf, 0, REC_BLOCK_ALIGN);
+    memcpy(blkBuf, &hdr, sizeof (hdr));
+    if (write(recFd, blkBuf, REC_BLOCK_ALIGN) != REC_BLOCK_ALIGN) {
+        MSGLOG(ERROR, "Failed to write recording file! file=%s (%s)", fileName, strerror(errno));
+        return -1;
+    }
+
+    if (pthread_create(&recTid, NULL, recThread, NULL) != 0) {
+        MSGLOG(ERROR, "Failed to create recorder thread!");
+        return -1;
+    }
+
+    MSGLOG(INFO, "Recording telemetry to file %s", fileName);
+
+    return 0;
+}
+
+int recActive(void)
+{
+    return (recFd >= 0);
+}
+
+void recSample(const struct timespec *pTime, uint32_t bibNum, int distance, int power, float speed)
+{
+    uint64_t tail = sampleTail;
+    RecSample *pSample;
+
+    if (recFd < 0) {
+        return;
+    }
+
+    if ((tail - __atomic_load_n(&sampleHead, __ATOMIC_ACQUIRE)) == REC_RING_SAMPLES) {
+        if ((samplesDropped++ % 1000) == 0) {
+            MSGLOG(WARN, "Recorder ring full! dropped=%lu", samplesDropped);
+        }
+        return;
+    }
+
+    pSample = &sampleRing[tail & (REC_RING_SAMPLES - 1)];
+    pSample->time = ((int64_t) pTime->tv_sec * 1000) + (pTime->tv_nsec / 1000000);
+    pSample->bibNum = bibNum;
+    pSample->distance = distance;
+    pSample->power = ((power > 0) && (power < UINT16_MAX)) ? power : ((power > 0) ? UINT16_MAX : 0);
+    pSample->speed = ((speed > 0.0) && (speed < 655.0)) ? (speed * 100) : 0;
+
+    __atomic_store_n(&sampleTail, (tail + 1), __ATOMIC_RELEASE);
+}
+
+void recRider(uint32_t bibNum, const char *category, const char *name)
+{
+    uint64_t tail = riderTail;
+    RecRider *pRider;
+
+    if (recFd < 0) {
+        return;
+    }
+
+    if ((tail - __atomic_load_n(&riderHead, __ATOMIC_ACQUIRE)) == REC_RING_RIDERS) {
+        ridersDropped++;
+        MSGLOG(WARN, "Recorder ring full! bibNum=%u", bibNum);
+        return;
+    }
+
+    pRider = &riderRing[tail & (REC_RING_RIDERS - 1)];
+    pRider->bibNum = bibNum;
+    snprintf(pRider->category, sizeof (pRider->category), "%s", category);
+    snprintf(pRider->name, sizeof (pRider->name), "%s", (name != NULL) ? name : "");
+
+    __atomic_store_n(&riderTail, (tail + 1), __ATOMIC_RELEASE);
+}
+
+void recClose(void)
+{
+    if (recFd >= 0) {
+        recStop = 1;
+        pthread_join(recTid, NULL);
+        close(recFd);
+        recFd = -1;
+        if ((samplesDropped != 0) || (ridersDropped != 0)) {
+            MSGLOG(WARN, "Recorder samples dropped: %lu riders dropped: %lu", samplesDropped, ridersDropped);
+        }
+    }
+}
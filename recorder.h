@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// Telemetry recording file format: a RecFileHdr followed by
+// a sequence of blocks, each made of a RecBlkHdr followed by
+// its contents. The header and every block are padded to a
+// multiple of REC_BLOCK_ALIGN bytes. All values are in host
+// byte order.
+//
+// A samples block stores up to REC_BLOCK_SAMPLES progUpd
+// samples by column: all the time offsets first, then all
+// the bib numbers, distances, powers and speeds. A riders
+// block stores the RecRider records of the riders that
+// registered since the previous one.
+#define REC_MAGIC           "GRSREC1"
+#define REC_BLOCK_ALIGN     4096
+#define REC_BLOCK_SAMPLES   8192
+
+typedef struct RecFileHdr {
+    char magic[8];              // REC_MAGIC
+    int64_t startSec;           // wall clock time (UTC) the recording started
+    char rideName[64];          // name of the group ride
+} RecFileHdr;
+
+typedef enum RecBlkType {
+    recBlkSamples = 1,          // progUpd samples, stored by column
+    recBlkRiders = 2,           // rider records
+} RecBlkType;
+
+typedef struct RecBlkHdr {
+    uint32_t type;              // block type (RecBlkType)
+    uint32_t count;             // number of samples or riders in the block
+    uint32_t size;              // size of the block, including this header and the padding
+    uint32_t reserved;
+    int64_t baseTime;           // time (in msecs since the Epoch) the time offsets are relative to
+} RecBlkHdr;
+
+// A progUpd sample, as queued by the event loop
+typedef struct RecSample {
+    int64_t time;               // time (in msecs since the Epoch) the sample was received
+    uint32_t bibNum;            // rider's bib number
+    int32_t distance;           // distance (in meters)
+    uint16_t power;             // power (in watts)
+    uint16_t speed;             // speed (in cm/s)
+} RecSample;
+
+typedef struct RecRider {
+    uint32_t bibNum;            // rider's bib number
+    char category[12];          // rider's category
+    char name[48];              // rider's name (truncated)
+} RecRider;
+
+// Offsets of the columns in a samples block that holds
+// 'count' samples, relative to the end of the RecBlkHdr.
+#define REC_COL_TIME(count)     0                                       // uint32_t time offset (in msecs)
+#define REC_COL_BIBNUM(count)   (REC_COL_TIME(count) + (4 * (count)))   // uint32_t bib number
+#define REC_COL_DISTANCE(count) (REC_COL_BIBNUM(count) + (4 * (count))) // int32_t distance
+#define REC_COL_POWER(count)    (REC_COL_DISTANCE(count) + (4 * (count))) // uint16_t power
+#define REC_COL_SPEED(count)    (REC_COL_POWER(count) + (2 * (count)))  // uint16_t speed
+#define REC_COLS_SIZE(count)    (REC_COL_SPEED(count) + (2 * (count)))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Start recording the progUpd samples to the specified file.
+// The blocks are written by a background thread.
+extern int recInit(const char *fileName, const char *rideName);
+
+// Is the telemetry being recorded?
+extern int recActive(void);
+
+// Queue a progUpd sample. This is called from the event
+// loop, so it never blocks: if the writer thread falls
+// behind, the sample is dropped and counted.
+extern void recSample(const struct timespec *pTime, uint32_t bibNum, int distance, int power, float speed);
+
+// Queue the record of a newly registered rider
+extern void recRider(uint32_t bibNum, const char *category, const char *name);
+
+// Write out the pending samples and close the file
+extern void recClose(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,198 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "grs.h"
+#include "log.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "trace.h"
+
+// The replay driver feeds the records of a capture file
+// through the same code used to process the live traffic,
+// without any sockets: each captured connection is given a
+// file descriptor on /dev/null, and all the messages sent
+// by the server are discarded (but counted.)
+//
+// The loop time (pGrs->now) follows the timestamps in the
+// capture, so the leaderboards are built at the same points
+// in the traffic as in the original ride, no matter how fast
+// the capture is replayed.
+
+static uint64_t numMsgsOut;
+static uint64_t numBytesOut;
+
+static ssize_t replaySend(int sd, const void *buf, size_t len, int flags)
+{
+    numMsgsOut++;
+    numBytesOut += len;
+    return len;
+}
+
+static int *connFdTbl;
+static uint32_t connFdTblSize;
+
+static int *connFd(uint32_t connId)
+{
+    if (connId >= connFdTblSize) {
+        uint32_t size = (connFdTblSize != 0) ? connFdTblSize : 1024;
+        int *tbl;
+        while (size <= connId) {
+            size *= 2;
+        }
+        if ((tbl = realloc(connFdTbl, (size * sizeof (int)))) == NULL) {
+            MSGLOG(FATAL, "Failed to alloc connection table! (%s)", strerror(errno));
+        }
+        for (uint32_t n = connFdTblSize; n < size; n++) {
+            tbl[n] = -1;
+        }
+        connFdTbl = tbl;
+        connFdTblSize = size;
+    }
+
+    return &connFdTbl[connId];
+}
+
+// Parse the remote address recorded with the connection,
+// which has the format: <ipAddr>[<portNum>]
+static void parseSockAddr(const char *str, SockAddrStore *pSockAddr)
+{
+    char addr[INET6_ADDRSTRLEN];
+    unsigned short port = 0;
+
+    memset(pSockAddr, 0, sizeof (*pSockAddr));
+    pSockAddr->ss_family = AF_INET;
+
+    if (sscanf(str, "%45[^[][%hu]", addr, &port) < 1) {
+        return;
+    }
+
+    if (inet_pton(AF_INET, addr, &((SockAddrIn *) pSockAddr)->sin_addr) == 1) {
+        ((SockAddrIn *) pSockAddr)->sin_port = htons(port);
+    } else if (inet_pton(AF_INET6, addr, &((SockAddrIn6 *) pSockAddr)->sin6_addr) == 1) {
+        pSockAddr->ss_family = AF_INET6;
+        ((SockAddrIn6 *) pSockAddr)->sin6_port = htons(port);
+    }
+}
+
+int grsReplay(Grs *pGrs, const CmdArgs *pArgs)
+{
+    CapFileHdr hdr;
+    CapRecHdr rec;
+    static char data[CAP_MAX_DATA + 1];
+    uint64_t numRecs = 0, numMsgsIn = 0;
+    uint64_t wallStart, elapsed;
+    sigset_t waitMask;
+    FILE *fp;
+    int s;
+
+    if ((fp = capOpen(pArgs->replayFile, &hdr)) == NULL) {
+        // Error message already printed
+        return -1;
+    }
+
+    // Discard all the outbound messages
+    pGrs->sendFn = replaySend;
+    grsSetVirtualClock(pGrs);
+
+    if (grsInit(pGrs, pArgs, &waitMask) != 0) {
+        // Error message already printed
+        return -1;
+    }
+
+    // The ride starts when the capture says it did
+    pGrs->rideActive = false;
+
+    MSGLOG(INFO, "Replaying capture file %s at speed %.2f", pArgs->replayFile, pArgs->replaySpeed);
+
+    wallStart = monoTimeNs();
+
+    while (!grsExitRequested() && ((s = capRead(fp, &rec, data)) == 1)) {
+        Timespec recTime = { .tv_sec = hdr.startSec, .tv_nsec = hdr.startNsec };
+        uint64_t t;
+        int *pFd;
+
+        recTime.tv_sec += (rec.timestamp + recTime.tv_nsec) / 1000000000;
+        recTime.tv_nsec = (rec.timestamp + recTime.tv_nsec) % 1000000000;
+
+        // Pace the replay
+        if (pArgs->replaySpeed > 0.0) {
+            uint64_t target = wallStart + (uint64_t) (rec.timestamp / pArgs->replaySpeed);
+            uint64_t now = monoTimeNs();
+            if (target > now) {
+                usleep((target - now) / 1000);
+            }
+        }
+
+        traceIterBegin();
+
+        if (grsRunTimers(pGrs, pArgs, &recTime) != 0) {
+            return -1;
+        }
+
+        pFd = connFd(rec.connId);
+
+        switch (rec.type) {
+        case capConnect:
+            if ((*pFd = open("/dev/null", O_RDONLY)) < 0) {
+                MSGLOG(ERROR, "Failed to open /dev/null! (%s)", strerror(errno));
+                return -1;
+            } else {
+                SockAddrStore sockAddr;
+                parseSockAddr(data, &sockAddr);
+                t = traceBegin();
+                addRider(pGrs, *pFd, &sockAddr);
+                traceEnd(phaseAccept, t, *pFd);
+            }
+            break;
+        case capData:
+            if (*pFd >= 0) {
+                t = traceBegin();
+                procRxData(pGrs, pArgs, *pFd, data, rec.len);
+                traceEnd(phaseReadParse, t, *pFd);
+                numMsgsIn++;
+            }
+            break;
+        case capDisconnect:
+            if (*pFd >= 0) {
+                procDisconnect(pGrs, pArgs, *pFd);
+                *pFd = -1;
+            }
+            break;
+        case capRideStarted:
+            if (!pGrs->rideActive && (startRide(pGrs, pArgs) != 0)) {
+                return -1;
+            }
+            break;
+        default:
+            MSGLOG(ERROR, "Invalid capture record! type=%u", rec.type);
+            break;
+        }
+
+        grsFlushEgress(pGrs, pArgs);
+        grsCheckDump();
+        traceIterEnd();
+        numRecs++;
+    }
+
+    fclose(fp);
+
+    if (s < 0) {
+        MSGLOG(ERROR, "Failed to read capture file! file=%s", pArgs->replayFile);
+    }
+
+    elapsed = monoTimeNs() - wallStart;
+
+    MSGLOG(INFO, "Replay done: records=%lu msgsIn=%lu msgsOut=%lu bytesOut=%lu elapsed=%.3f secs throughput=%.0f msgsIn/sec",
+            numRecs, numMsgsIn, numMsgsOut, numBytesOut, (elapsed / 1e9),
+            ((elapsed != 0) ? (numMsgsIn * 1e9 / elapsed) : 0.0));
+    traceDump();
+    recClose();
+
+    return 0;
+}
@@ -0,0 +1,632 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "grs.h"
+#include "log.h"
+#include "shmring.h"
+
+// Max bytes of records read from the ring of a gateway in
+// one event loop iteration; whatever is left is read in the
+// next one, so that a busy gateway can't hold up the riders
+// on the other connections.
+#define SHM_RX_BUDGET   (256 * 1024)
+
+// Room in the tx ring that the data records leave for the
+// shmRecClose records, so that the GRS can always let the
+// gateway know a connection was closed, even if it isn't
+// reading its ring.
+#define SHM_TX_RESERVE  (64 * 1024)
+
+typedef struct ShmGateway {
+    int sd;                     // file descriptor of the gateway socket (-1=slot unused)
+    int pollIdx;                // index of the socket in the pollFds array (-1=not there yet)
+    int gwNum;                  // gateway number, used in the connection names
+    ShmArea *pArea;             // the shared rings
+    uint64_t rxHead;            // our copy of the head of the rx ring
+    uint64_t txTail;            // our copy of the tail of the tx ring
+    Bool backlog;               // records left in the rx ring
+    Bool txBlocked;             // a connection ran out of room in the tx ring
+    Bool failed;                // broken ring; the gateway has to be detached
+    Bool detaching;             // the connections are being closed
+    int maxConnId;              // highest connection id opened so far
+    int *connTbl;               // file descriptor of each connection (-1=closed)
+} ShmGateway;
+
+// The gateway and connection id of each virtual connection,
+// indexed by its file descriptor.
+typedef struct ShmConn {
+    ShmGateway *pGw;            // NULL=not a virtual connection
+    uint32_t connId;
+} ShmConn;
+
+static int listenSd = -1;
+static int listenIdx = -1;
+static int lastGwNum;
+static ShmGateway gwTbl[SHM_MAX_GATEWAYS];
+static ShmConn fdTbl[MAX_FD_VAL];
+
+// Copy data out of the ring, taking care of the wraparound
+static void ringRead(const ShmRing *pRing, uint64_t off, void *buf, size_t len)
+{
+    size_t idx = off & (SHM_RING_SIZE - 1);
+    size_t n = ((SHM_RING_SIZE - idx) < len) ? (SHM_RING_SIZE - idx) : len;
+
+    memcpy(buf, &pRing->data[idx], n);
+    memcpy(((char *) buf + n), pRing->data, (len - n));
+}
+
+// Copy data into the ring, taking care of the wraparound
+static void ringCopy(ShmRing *pRing, uint64_t off, const void *buf, size_t len)
+{
+    size_t idx = off & (SHM_RING_SIZE - 1);
+    size_t n = ((SHM_RING_SIZE - idx) < len) ? (SHM_RING_SIZE - idx) : len;
+
+    memcpy(&pRing->data[idx], buf, n);
+    memcpy(pRing->data, ((const char *) buf + n), (len - n));
+}
+
+// Wake up the gateway. If the socket buffer is full, there
+// is already a doorbell waiting to be read.
+static void ringDoorbell(ShmGateway *pGw)
+{
+    char bell = 0;
+
+    if ((send(pGw->sd, &bell, 1, (MSG_DONTWAIT | MSG_NOSIGNAL)) < 0) &&
+        (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+        pGw->failed = true;
+    }
+}
+
+// Write a record to the tx ring, leaving at least 'reserve'
+// bytes free. Returns 0 if the record was written, 1 if it
+// doesn't fit, or -1 if the ring is broken.
+static int ringWrite(ShmGateway *pGw, uint32_t connId, ShmRecType type, const void *data, size_t len, size_t reserve)
+{
+    ShmRing *pRing = &pGw->pArea->txRing;
+    ShmRecHdr hdr = { .connId = connId, .type = type, .len = len };
+    size_t recLen = SHM_REC_LEN(len);
+    uint64_t head = __atomic_load_n(&pRing->head, __ATOMIC_SEQ_CST);
+
+    if ((pGw->txTail - head) > SHM_RING_SIZE) {
+        MSGLOG(ERROR, "Invalid tx ring head! gw=%d", pGw->gwNum);
+        pGw->failed = true;
+        return -1;
+    }
+
+    if ((SHM_RING_SIZE - (pGw->txTail - head)) < (recLen + reserve)) {
+        // Ask for a doorbell when the gateway frees up some
+        // room, then check again, in case it just did.
+        __atomic_store_n(&pRing->spaceWaiting, 1, __ATOMIC_SEQ_CST);
+        head = __atomic_load_n(&pRing->head, __ATOMIC_SEQ_CST);
+        if (((pGw->txTail - head) > SHM_RING_SIZE) ||
+            ((SHM_RING_SIZE - (pGw->txTail - head)) < (recLen + reserve))) {
+            return 1;
+        }
+        __atomic_store_n(&pRing->spaceWaiting, 0, __ATOMIC_SEQ_CST);
+    }
+
+    ringCopy(pRing, pGw->txTail, &hdr, sizeof (hdr));
+    if (len != 0) {
+        ringCopy(pRing, (pGw->txTail + sizeof (hdr)), data, len);
+    }
+    pGw->txTail += recLen;
+    __atomic_store_n(&pRing->tail, pGw->txTail, __ATOMIC_SEQ_CST);
+
+    if (__atomic_exchange_n(&pRing->dataWaiting, 0, __ATOMIC_SEQ_CST) != 0) {
+        ringDoorbell(pGw);
+    }
+
+    return 0;
+}
+
+// Close the connections of the gateway, and release its
+// resources.
+static void detachGateway(Grs *pGrs, const CmdArgs *pArgs, ShmGateway *pGw)
+{
+    // There is no point in sending the shmRecClose records
+    pGw->detaching = true;
+    for (int connId = 0; connId <= pGw->maxConnId; connId++) {
+        if (pGw->connTbl[connId] >= 0) {
+            procDisconnect(pGrs, pArgs, pGw->connTbl[connId]);
+        }
+    }
+
+    MSGLOG(INFO, "Shared-memory gateway detached: gw=%d sd=%d failed=%d", pGw->gwNum, pGw->sd, pGw->failed);
+
+    munmap(pGw->pArea, sizeof (ShmArea));
+    close(pGw->sd);
+    free(pGw->connTbl);
+    memset(pGw, 0, sizeof (*pGw));
+    pGw->sd = -1;
+
+    // Need to rebuild the pollFds array
+    pGrs->rebuildPollFds = true;
+}
+
+// Accept a new gateway: create its shared memory area, and
+// hand it over.
+static int attachGateway(Grs *pGrs)
+{
+    ShmGateway *pGw = NULL;
+    int sd, memFd;
+    char byte = 'G';
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof (int))];
+        struct cmsghdr align;
+    } ctrl = {0};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctrl.buf,
+        .msg_controllen = sizeof (ctrl.buf)
+    };
+    struct cmsghdr *pCmsg;
+
+    if ((sd = accept4(listenSd, NULL, NULL, (SOCK_NONBLOCK | SOCK_CLOEXEC))) < 0) {
+        MSGLOG(ERROR, "Failed to accept new gateway! (%s)", strerror(errno));
+        return -1;
+    }
+
+    for (int n = 0; n < SHM_MAX_GATEWAYS; n++) {
+        if (gwTbl[n].sd < 0) {
+            pGw = &gwTbl[n];
+            break;
+        }
+    }
+    if (pGw == NULL) {
+        MSGLOG(WARN, "Too many shared-memory gateways! max=%d", SHM_MAX_GATEWAYS);
+        close(sd);
+        return 0;
+    }
+
+    // The area is sealed, so that the gateway can't shrink it
+    // under our feet.
+    if ((memFd = memfd_create("grs-shm", (MFD_CLOEXEC | MFD_ALLOW_SEALING))) < 0) {
+        MSGLOG(ERROR, "Failed to create shared memory! (%s)", strerror(errno));
+        close(sd);
+        return 0;
+    }
+    if ((ftruncate(memFd, sizeof (ShmArea)) != 0) ||
+        (fcntl(memFd, F_ADD_SEALS, (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)) != 0) ||
+        ((pGw->pArea = mmap(NULL, sizeof (ShmArea), (PROT_READ | PROT_WRITE), MAP_SHARED, memFd, 0)) == MAP_FAILED)) {
+        MSGLOG(ERROR, "Failed to set up shared memory! (%s)", strerror(errno));
+        close(memFd);
+        close(sd);
+        pGw->pArea = NULL;
+        return 0;
+    }
+
+    if ((pGw->connTbl = malloc(SHM_MAX_CONNS * sizeof (int))) == NULL) {
+        MSGLOG(ERROR, "Failed to alloc connection table! (%s)", strerror(errno));
+        munmap(pGw->pArea, sizeof (ShmArea));
+        close(memFd);
+        close(sd);
+        pGw->pArea = NULL;
+        return 0;
+    }
+    memset(pGw->connTbl, 0xff, (SHM_MAX_CONNS * sizeof (int)));
+
+    pGw->pArea->magic = SHM_MAGIC;
+    pGw->pArea->version = SHM_VERSION;
+    pGw->pArea->ringSize = SHM_RING_SIZE;
+    pGw->pArea->maxConns = SHM_MAX_CONNS;
+    pGw->pArea->maxData = SHM_MAX_DATA;
+
+    // We are waiting for the first records
+    pGw->pArea->rxRing.dataWaiting = 1;
+
+    pCmsg = CMSG_FIRSTHDR(&msg);
+    pCmsg->cmsg_level = SOL_SOCKET;
+    pCmsg->cmsg_type = SCM_RIGHTS;
+    pCmsg->cmsg_len = CMSG_LEN(sizeof (int));
+    memcpy(CMSG_DATA(pCmsg), &memFd, sizeof (int));
+    if (sendmsg(sd, &msg, MSG_NOSIGNAL) != 1) {
+        MSGLOG(ERROR, "Failed to send shared memory to gateway! (%s)", strerror(errno));
+        munmap(pGw->pArea, sizeof (ShmArea));
+        free(pGw->connTbl);
+        close(memFd);
+        close(sd);
+        pGw->pArea = NULL;
+        pGw->connTbl = NULL;
+        return 0;
+    }
+    close(memFd);
+
+    pGw->sd = sd;
+    pGw->pollIdx = -1;
+    pGw->gwNum = ++lastGwNum;
+    pGw->maxConnId = -1;
+
+    MSGLOG(INFO, "Shared-memory gateway attached: gw=%d sd=%d", pGw->gwNum, sd);
+
+    // Need to rebuild the pollFds array
+    pGrs->rebuildPollFds = true;
+
+    return 0;
+}
+
+// Open a virtual connection. Its file descriptor is only
+// used to look up its Rider object; it is never polled.
+static void openConn(Grs *pGrs, const CmdArgs *pArgs, ShmGateway *pGw, uint32_t connId)
+{
+    SockAddrStore sockAddr = { .ss_family = AF_UNIX };
+    int fd;
+
+    if (pGw->connTbl[connId] >= 0) {
+        MSGLOG(ERROR, "Connection already open! gw=%d connId=%u", pGw->gwNum, connId);
+        return;
+    }
+
+    if (pGrs->numConns >= pArgs->maxRiders) {
+        MSGLOG(WARN, "Too many connections! maxRiders=%d", pArgs->maxRiders);
+    } else if ((fd = open("/dev/null", (O_RDONLY | O_CLOEXEC))) < 0) {
+        MSGLOG(ERROR, "Failed to open /dev/null! (%s)", strerror(errno));
+    } else {
+        snprintf(((struct sockaddr_un *) &sockAddr)->sun_path, sizeof (((struct sockaddr_un *) &sockAddr)->sun_path),
+                 "shm%d/%u", pGw->gwNum, connId);
+        if (addRider(pGrs, fd, &sockAddr) == 0) {
+            fdTbl[fd].pGw = pGw;
+            fdTbl[fd].connId = connId;
+            pGw->connTbl[connId] = fd;
+            if ((int) connId > pGw->maxConnId) {
+                pGw->maxConnId = connId;
+            }
+            return;
+        }
+    }
+
+    // Turn the connection down
+    if (ringWrite(pGw, connId, shmRecClose, NULL, 0, 0) != 0) {
+        pGw->failed = true;
+    }
+}
+
+// Process one of the records sent by the gateway
+static int procRecord(Grs *pGrs, const CmdArgs *pArgs, ShmGateway *pGw, const ShmRecHdr *pHdr, const char *data)
+{
+    int fd;
+
+    if (pHdr->connId >= SHM_MAX_CONNS) {
+        MSGLOG(ERROR, "Invalid connection id! gw=%d connId=%u", pGw->gwNum, pHdr->connId);
+        return -1;
+    }
+    fd = pGw->connTbl[pHdr->connId];
+
+    if (pHdr->type == shmRecOpen) {
+        openConn(pGrs, pArgs, pGw, pHdr->connId);
+    } else if (pHdr->type == shmRecData) {
+        if ((fd >= 0) && (pHdr->len != 0)) {
+            procConnData(pGrs, pArgs, fd, data, pHdr->len);
+        }
+    } else if (pHdr->type == shmRecClose) {
+        if (fd >= 0) {
+            procDisconnect(pGrs, pArgs, fd);
+        }
+    } else {
+        MSGLOG(ERROR, "Invalid record type! gw=%d type=%u", pGw->gwNum, pHdr->type);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Read the records in the rx ring of the gateway, up to the
+// budget.
+static void readRing(Grs *pGrs, const CmdArgs *pArgs, ShmGateway *pGw)
+{
+    ShmRing *pRing = &pGw->pArea->rxRing;
+    uint64_t tail = __atomic_load_n(&pRing->tail, __ATOMIC_SEQ_CST);
+    size_t budget = SHM_RX_BUDGET;
+    char dataBuf[SHM_MAX_DATA];
+
+    pGw->backlog = false;
+
+    while (!pGw->failed) {
+        ShmRecHdr hdr;
+        size_t recLen;
+
+        if ((tail - pGw->rxHead) > SHM_RING_SIZE) {
+            MSGLOG(ERROR, "Invalid rx ring tail! gw=%d", pGw->gwNum);
+            pGw->failed = true;
+            break;
+        }
+
+        if (tail == pGw->rxHead) {
+            // Ask for a doorbell when the gateway sends more
+            // records, then check again, in case it just did.
+            __atomic_store_n(&pRing->dataWaiting, 1, __ATOMIC_SEQ_CST);
+            tail = __atomic_load_n(&pRing->tail, __ATOMIC_SEQ_CST);
+            if (tail == pGw->rxHead) {
+                break;
+            }
+            __atomic_store_n(&pRing->dataWaiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        if (budget == 0) {
+            pGw->backlog = true;
+            break;
+        }
+
+        // The data is copied out of the ring before it is
+        // checked, so the gateway can't change it under our
+        // feet.
+        if ((tail - pGw->rxHead) < sizeof (hdr)) {
+            MSGLOG(ERROR, "Truncated record! gw=%d", pGw->gwNum);
+            pGw->failed = true;
+            break;
+        }
+        ringRead(pRing, pGw->rxHead, &hdr, sizeof (hdr));
+        recLen = SHM_REC_LEN(hdr.len);
+        if ((hdr.len > SHM_MAX_DATA) || (recLen > (tail - pGw->rxHead))) {
+            MSGLOG(ERROR, "Invalid record length! gw=%d len=%u", pGw->gwNum, hdr.len);
+            pGw->failed = true;
+            break;
+        }
+        ringRead(pRing, (pGw->rxHead + sizeof (hdr)), dataBuf, hdr.len);
+        pGw->rxHead += recLen;
+        budget = (recLen < budget) ? (budget - recLen) : 0;
+
+        if (procRecord(pGrs, pArgs, pGw, &hdr, dataBuf) != 0) {
+            pGw->failed = true;
+        }
+    }
+
+    // Let the gateway know there is more room
+    __atomic_store_n(&pRing->head, pGw->rxHead, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&pRing->spaceWaiting, 0, __ATOMIC_SEQ_CST) != 0) {
+        ringDoorbell(pGw);
+    }
+}
+
+int shmInit(Grs *pGrs, const CmdArgs *pArgs)
+{
+    struct sockaddr_un sockAddr = { .sun_family = AF_UNIX };
+    struct stat fileStat;
+    struct rlimit fdLimit;
+
+    for (int n = 0; n < SHM_MAX_GATEWAYS; n++) {
+        gwTbl[n].sd = -1;
+    }
+
+    if (strlen(pArgs->shmSocket) >= sizeof (sockAddr.sun_path)) {
+        MSGLOG(ERROR, "Shared-memory socket path too long! path=%s", pArgs->shmSocket);
+        return -1;
+    }
+    strcpy(sockAddr.sun_path, pArgs->shmSocket);
+
+    // Each virtual connection takes a file descriptor
+    if ((getrlimit(RLIMIT_NOFILE, &fdLimit) == 0) && (fdLimit.rlim_cur < fdLimit.rlim_max)) {
+        fdLimit.rlim_cur = fdLimit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fdLimit);
+    }
+
+    // Remove the socket left behind by a previous run, but
+    // nothing else.
+    if ((stat(pArgs->shmSocket, &fileStat) == 0) && S_ISSOCK(fileStat.st_mode)) {
+        unlink(pArgs->shmSocket);
+    }
+
+    if ((listenSd = socket(AF_UNIX, (SOCK_STREAM | SOCK_CLOEXEC), 0)) < 0) {
+        MSGLOG(ERROR, "Failed to open shared-memory socket! (%s)", strerror(errno));
+        return -1;
+    }
+
+    if (bind(listenSd, (SockAddr *) &sockAddr, sizeof (sockAddr)) != 0) {
+        MSGLOG(ERROR, "Failed to bind shared-memory socket! path=%s (%s)", pArgs->shmSocket, strerror(errno));
+        close(listenSd);
+        listenSd = -1;
+        return -1;
+    }
+
+    if (listen(listenSd, SHM_MAX_GATEWAYS) != 0) {
+        MSGLOG(ERROR, "Failed to listen on shared-memory socket! (%s)", strerror(errno));
+        close(listenSd);
+        listenSd = -1;
+        return -1;
+    }
+
+    pGrs->sendFn = shmSend;
+
+    MSGLOG(INFO, "Listening for shared-memory gateways on %s", pArgs->shmSocket);
+
+    return 0;
+}
+
+Bool shmActive(void)
+{
+    return (listenSd >= 0);
+}
+
+int shmAddPollFds(PollFd *pollFds, int n)
+{
+    if (listenSd < 0) {
+        return n;
+    }
+
+    listenIdx = n;
+    pollFds[n].fd = listenSd;
+    pollFds[n].events = POLLIN;
+    pollFds[n++].revents = 0;
+
+    for (int i = 0; i < SHM_MAX_GATEWAYS; i++) {
+        ShmGateway *pGw = &gwTbl[i];
+        if (pGw->sd >= 0) {
+            pGw->pollIdx = n;
+            pollFds[n].fd = pGw->sd;
+            pollFds[n].events = (POLLIN | POLLRDHUP);
+            pollFds[n++].revents = 0;
+        }
+    }
+
+    return n;
+}
+
+int shmProcFdEvents(Grs *pGrs, const CmdArgs *pArgs, const PollFd *pollFds)
+{
+    if (listenSd < 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < SHM_MAX_GATEWAYS; i++) {
+        ShmGateway *pGw = &gwTbl[i];
+        int revents;
+
+        if ((pGw->sd < 0) || (pGw->pollIdx < 0)) {
+            continue;
+        }
+
+        revents = pollFds[pGw->pollIdx].revents;
+        if (revents & POLLIN) {
+            // Just the doorbell; the records are read from
+            // the ring on every loop iteration.
+            char bells[64];
+            ssize_t len;
+            while ((len = recv(pGw->sd, bells, sizeof (bells), MSG_DONTWAIT)) > 0)
+                ;
+            if ((len == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))) {
+                revents |= POLLHUP;
+            }
+        }
+        if (revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+            detachGateway(pGrs, pArgs, pGw);
+        }
+    }
+
+    if (pollFds[listenIdx].revents & POLLIN) {
+        return attachGateway(pGrs);
+    }
+
+    return 0;
+}
+
+void shmProcRings(Grs *pGrs, const CmdArgs *pArgs)
+{
+    for (int i = 0; i < SHM_MAX_GATEWAYS; i++) {
+        ShmGateway *pGw = &gwTbl[i];
+
+        if (pGw->sd < 0) {
+            continue;
+        }
+
+        readRing(pGrs, pArgs, pGw);
+
+        // Once the gateway has made enough room in the tx
+        // ring, let its connections send again.
+        if (pGw->txBlocked && !pGw->failed) {
+            ShmRing *pRing = &pGw->pArea->txRing;
+            uint64_t head = __atomic_load_n(&pRing->head, __ATOMIC_SEQ_CST);
+            if ((pGw->txTail - head) > SHM_RING_SIZE) {
+                pGw->failed = true;
+            } else if ((SHM_RING_SIZE - (pGw->txTail - head)) >= (SHM_TX_RESERVE + SHM_REC_LEN(SHM_MAX_DATA))) {
+                pGw->txBlocked = false;
+                for (int connId = 0; connId <= pGw->maxConnId; connId++) {
+                    if (pGw->connTbl[connId] >= 0) {
+                        grsUnblockEgress(pGrs, pGw->connTbl[connId]);
+                    }
+                }
+            }
+        }
+
+        if (pGw->failed) {
+            detachGateway(pGrs, pArgs, pGw);
+        }
+    }
+}
+
+Bool shmBacklog(void)
+{
+    for (int i = 0; i < SHM_MAX_GATEWAYS; i++) {
+        if ((gwTbl[i].sd >= 0) && gwTbl[i].backlog) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+Bool shmIsConn(int fd)
+{
+    return (fd < MAX_FD_VAL) && (fdTbl[fd].pGw != NULL);
+}
+
+ssize_t shmSend(int sd, const void *buf, size_t len, int flags)
+{
+    ShmGateway *pGw;
+    size_t sent = 0;
+
+    if (!shmIsConn(sd)) {
+        return send(sd, buf, len, flags);
+    }
+
+    pGw = fdTbl[sd].pGw;
+    if (pGw->failed) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    // Send as much as fits, in records of up to the max size
+    while (sent < len) {
+        size_t n = ((len - sent) < SHM_MAX_DATA) ? (len - sent) : SHM_MAX_DATA;
+        int s = ringWrite(pGw, fdTbl[sd].connId, shmRecData, ((const char *) buf + sent), n, SHM_TX_RESERVE);
+        if (s < 0) {
+            errno = EPIPE;
+            return -1;
+        } else if (s > 0) {
+            break;
+        }
+        sent += n;
+    }
+
+    if (sent == 0) {
+        pGw->txBlocked = true;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return sent;
+}
+
+void shmConnClosed(int fd)
+{
+    ShmGateway *pGw;
+    uint32_t connId;
+
+    if (!shmIsConn(fd)) {
+        return;
+    }
+
+    pGw = fdTbl[fd].pGw;
+    connId = fdTbl[fd].connId;
+    pGw->connTbl[connId] = -1;
+    fdTbl[fd].pGw = NULL;
+
+    // Let the gateway know, so it can reuse the id. If it
+    // hasn't been reading its ring, there is no way to tell
+    // it anymore.
+    if (!pGw->failed && !pGw->detaching && (ringWrite(pGw, connId, shmRecClose, NULL, 0, 0) != 0)) {
+        MSGLOG(ERROR, "No room for the close record! gw=%d connId=%u", pGw->gwNum, connId);
+        pGw->failed = true;
+    }
+}
+
+void shmClose(const CmdArgs *pArgs)
+{
+    if (listenSd >= 0) {
+        close(listenSd);
+        listenSd = -1;
+        unlink(pArgs->shmSocket);
+    }
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "defs.h"
+
+// Shared-memory ring transport.
+//
+// A gateway running on the same host, multiplexing many riders
+// (e.g. a relay for a whole club), can exchange their messages
+// with the GRS through shared memory instead of one socket per
+// rider. The gateway attaches by connecting to the Unix domain
+// socket given with --shm-socket; the GRS answers with a single
+// byte that carries (as SCM_RIGHTS ancillary data) the file
+// descriptor of a sealed memfd holding a ShmArea, which the
+// gateway maps read-write. The socket stays open for as long
+// as the gateway is attached, and is used as its doorbell.
+//
+// The ShmArea has two rings: rxRing, written by the gateway
+// and read by the GRS, and txRing, written by the GRS and read
+// by the gateway. Each ring is a single-producer single-consumer
+// byte stream of records, made of a ShmRecHdr followed by its
+// data, padded to a multiple of 8 bytes. The records wrap
+// around the end of the data array. 'head' and 'tail' are the
+// stream offsets of the next byte to be read and written; they
+// only ever grow, and their difference is never more than
+// SHM_RING_SIZE. The producer publishes a record by storing
+// the new tail once the whole record is written.
+//
+// Every rider of the gateway is a virtual connection, with
+// an id picked by the gateway, below SHM_MAX_CONNS. The
+// gateway opens it with a shmRecOpen record, sends the
+// rider's messages in shmRecData records, and closes it with
+// a shmRecClose record. The GRS sends the messages to the
+// rider in shmRecData records, and a shmRecClose record when
+// the connection is closed, whoever closed it. The records
+// of a closed connection are ignored, and its id can be
+// reused once the shmRecClose record from the GRS has been
+// received. Inside the GRS a virtual connection is a rider
+// like any other: the same messages, framing, rate limits and
+// egress queues, and it counts against --max-riders.
+//
+// To avoid a system call per record, the doorbell is only rung
+// when it's needed: a consumer that finds its ring empty sets
+// 'dataWaiting' before going to sleep, and a producer that
+// finds its ring full sets 'spaceWaiting'. The other side
+// clears the flag and writes a byte on the socket after it
+// stores the tail (or the head, respectively). The flag and
+// the offset must be stored and loaded with sequentially
+// consistent atomics.
+#define SHM_MAGIC           0x47525352  // "GRSR"
+#define SHM_VERSION         1
+#define SHM_RING_SIZE       (4 * 1024 * 1024) // bytes of data per ring; a power of 2
+#define SHM_MAX_CONNS       65536       // virtual connection ids per gateway
+#define SHM_MAX_DATA        4096        // max data per record
+#define SHM_MAX_GATEWAYS    4           // max gateways attached at the same time
+
+// Length of a record with 'len' bytes of data
+#define SHM_REC_LEN(len)    ((sizeof (ShmRecHdr) + (len) + 7) & ~((size_t) 7))
+
+typedef enum ShmRecType {
+    shmRecOpen = 1,             // the gateway opened a connection
+    shmRecData = 2,             // data of the connection
+    shmRecClose = 3,            // the connection was closed
+} ShmRecType;
+
+typedef struct ShmRecHdr {
+    uint32_t connId;            // virtual connection id
+    uint16_t type;              // ShmRecType
+    uint16_t reserved1;         // must be 0
+    uint32_t len;               // data length (up to SHM_MAX_DATA)
+    uint32_t reserved2;         // must be 0
+} ShmRecHdr;
+
+typedef struct ShmRing {
+    uint64_t head __attribute__ ((aligned (64))); // stream offset of the next byte to be read
+    uint64_t tail __attribute__ ((aligned (64))); // stream offset of the next byte to be written
+    uint32_t dataWaiting __attribute__ ((aligned (64))); // the consumer waits for a doorbell
+    uint32_t spaceWaiting;      // the producer waits for a doorbell
+    char data[SHM_RING_SIZE] __attribute__ ((aligned (64)));
+} ShmRing;
+
+typedef struct ShmArea {
+    uint32_t magic;             // SHM_MAGIC
+    uint32_t version;           // SHM_VERSION
+    uint32_t ringSize;          // SHM_RING_SIZE
+    uint32_t maxConns;          // SHM_MAX_CONNS
+    uint32_t maxData;           // SHM_MAX_DATA
+    ShmRing rxRing;             // gateway to GRS
+    ShmRing txRing;             // GRS to gateway
+} ShmArea;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Listen for gateways on the Unix domain socket
+extern int shmInit(Grs *pGrs, const CmdArgs *pArgs);
+
+// Is the shared-memory transport enabled?
+extern Bool shmActive(void);
+
+// Add the listening socket and the sockets of the attached
+// gateways to the pollFds array, starting at index 'n'.
+// Returns the index of the next free entry.
+extern int shmAddPollFds(PollFd *pollFds, int n);
+
+// Process the events of the listening socket and of the
+// gateway sockets: attach the new gateways, and detach the
+// ones that hung up.
+extern int shmProcFdEvents(Grs *pGrs, const CmdArgs *pArgs, const PollFd *pollFds);
+
+// Process the records waiting in the rings of the gateways,
+// up to a budget per gateway. Called on every iteration of
+// the event loop, since the gateways only ring the doorbell
+// when the GRS is waiting for it.
+extern void shmProcRings(Grs *pGrs, const CmdArgs *pArgs);
+
+// Are there any records left over by the budget?
+extern Bool shmBacklog(void);
+
+// Is the file descriptor that of a virtual connection?
+extern Bool shmIsConn(int fd);
+
+// Send function that writes the data of the virtual
+// connections to their ring, and that of the other
+// connections to their socket.
+extern ssize_t shmSend(int sd, const void *buf, size_t len, int flags);
+
+// Called when a connection is closed; lets the gateway know,
+// if it is a virtual one.
+extern void shmConnClosed(int fd);
+
+// Remove the Unix domain socket
+extern void shmClose(const CmdArgs *pArgs);
+
+#ifdef __cplusplus
+}
+#endif
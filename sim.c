@@ -0,0 +1,436 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+
+#include "grs.h"
+#include "log.h"
+#include "recorder.h"
+#include "trace.h"
+
+// The simulation driver runs a whole ride with virtual riders,
+// on a virtual clock, as fast as the CPU allows, through the
+// same code that processes the live traffic.
+//
+// Each virtual rider has an in-memory connection: a file
+// descriptor on /dev/null, so that it has a slot in the
+// rider tables, with a send function that hands the messages
+// of the server straight to the rider. The riders react to
+// them like a VCA would: they register, wait for the start,
+// and then send their progress updates with the period the
+// server asks for, which closes the rate control loop.
+//
+// All the events are kept in a heap ordered by virtual time,
+// and everything random comes from a generator seeded with
+// --sim-seed, so a given set of options always produces the
+// same traffic. With the leaderboards built by the event
+// loop, the messages sent by the server are the same too,
+// which the digest printed at the end makes easy to check.
+
+#define SIM_EPOCH           1700000000  // virtual time (UTC) the simulation starts at
+#define SIM_REG_WINDOW      10          // time (in secs) over which the riders register
+#define SIM_START_DELAY     5           // time (in secs) from the end of the registrations to the start
+#define SIM_REPORT_PERIOD   600         // time (in secs) between progress reports
+
+#define NSECS_PER_SEC       1000000000
+
+typedef struct SimRider {
+    int fd;                     // file descriptor of the in-memory connection (-1=not connected)
+    int distance;               // distance (in meters) so far
+    int power;                  // current power (in watts)
+    int progUpdPeriod;          // progUpd period (in msecs) requested by the server
+    Bool midMsg;                // in the middle of a message from the server?
+    uint32_t numLeaderboards;   // leaderboard messages received
+} SimRider;
+
+typedef struct SimEvent {
+    uint64_t time;              // virtual time (in nsecs since the start of the simulation)
+    int riderIdx;               // index of the rider
+} SimEvent;
+
+static SimRider *riderTbl;
+static int *fdRiderTbl;         // index of the rider that owns each file descriptor
+static int fdRiderTblSize;
+
+static SimEvent *eventHeap;
+static int numEvents;
+
+static uint64_t simTime;        // current virtual time (in nsecs since the start of the simulation)
+static uint64_t rngState;
+static uint64_t numMsgsIn;
+static uint64_t numMsgsOut;
+static uint64_t numBytesOut;
+static uint64_t digest = 0xcbf29ce484222325ULL;
+
+// xorshift64* generator, so that the results don't depend
+// on the C library.
+static uint32_t simRandom(void)
+{
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+
+    return (uint32_t) ((rngState * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static void toTimespec(uint64_t time, Timespec *pTime)
+{
+    pTime->tv_sec = SIM_EPOCH + (time / NSECS_PER_SEC);
+    pTime->tv_nsec = time % NSECS_PER_SEC;
+}
+
+static Bool eventBefore(const SimEvent *pEvent1, const SimEvent *pEvent2)
+{
+    return (pEvent1->time < pEvent2->time) ||
+           ((pEvent1->time == pEvent2->time) && (pEvent1->riderIdx < pEvent2->riderIdx));
+}
+
+// The heap has room for one event per rider, which is all
+// they ever have pending.
+static void pushEvent(uint64_t time, int riderIdx)
+{
+    int n = numEvents++;
+
+    eventHeap[n].time = time;
+    eventHeap[n].riderIdx = riderIdx;
+
+    while (n > 0) {
+        int parent = (n - 1) / 2;
+        SimEvent tmp;
+        if (!eventBefore(&eventHeap[n], &eventHeap[parent])) {
+            break;
+        }
+        tmp = eventHeap[n];
+        eventHeap[n] = eventHeap[parent];
+        eventHeap[parent] = tmp;
+        n = parent;
+    }
+}
+
+static SimEvent popEvent(void)
+{
+    SimEvent top = eventHeap[0];
+    int n = 0;
+
+    eventHeap[0] = eventHeap[--numEvents];
+
+    while (true) {
+        int child = (2 * n) + 1;
+        SimEvent tmp;
+        if (child >= numEvents) {
+            break;
+        }
+        if (((child + 1) < numEvents) && eventBefore(&eventHeap[child + 1], &eventHeap[child])) {
+            child++;
+        }
+        if (!eventBefore(&eventHeap[child], &eventHeap[n])) {
+            break;
+        }
+        tmp = eventHeap[n];
+        eventHeap[n] = eventHeap[child];
+        eventHeap[child] = tmp;
+        n = child;
+    }
+
+    return top;
+}
+
+// Schedule the next progUpd of the rider, one period from
+// now, give or take 2%.
+static void scheduleProgUpd(int riderIdx)
+{
+    uint64_t period = (uint64_t) riderTbl[riderIdx].progUpdPeriod * 1000000;
+    uint64_t jitter = period / 50;
+
+    pushEvent((simTime + period - jitter + (simRandom() % ((2 * jitter) + 1))), riderIdx);
+}
+
+// Process a message sent by the server to the rider
+static void simRxMsg(int riderIdx, const char *msg, size_t len)
+{
+    SimRider *pRider = &riderTbl[riderIdx];
+    const char *msgType = msg + strlen("{\"msgType\": \"");
+
+    numMsgsOut++;
+
+    // All the messages start with the msgType tag
+    if (len < (strlen("{\"msgType\": \"") + 16)) {
+        return;
+    }
+
+    if (strncmp(msgType, "leaderboard\"", 12) == 0) {
+        pRider->numLeaderboards++;
+    } else if (strncmp(msgType, "rideStarted\"", 12) == 0) {
+        // The first progUpd goes out anywhere within the
+        // first period.
+        pushEvent((simTime + (simRandom() % ((uint64_t) pRider->progUpdPeriod * 1000000))), riderIdx);
+    } else if ((strncmp(msgType, "rateCtl\"", 8) == 0) && (memchr(msg, '\0', len) != NULL)) {
+        static const char tag[] = "\"progUpdPeriodMs\": \"";
+        const char *val = strstr(msg, tag);
+        int period;
+        if ((val != NULL) && (sscanf((val + sizeof (tag) - 1), "%d", &period) == 1) && (period > 0)) {
+            pRider->progUpdPeriod = period;
+        }
+    }
+}
+
+// In-memory send: hand the data straight to the rider that
+// owns the connection.
+static ssize_t simSend(int sd, const void *buf, size_t len, int flags)
+{
+    const char *data = buf;
+    const char *end = data + len;
+    int riderIdx = fdRiderTbl[sd];
+    SimRider *pRider = &riderTbl[riderIdx];
+
+    // FNV-1a style digest of the outbound data, taken a word at a
+    // time, as the leaderboards add up to a lot of bytes.
+    numBytesOut += len;
+    for (size_t n = 0; n < len; n += sizeof (uint64_t)) {
+        uint64_t word = 0;
+        memcpy(&word, (data + n), ((len - n) < sizeof (word)) ? (len - n) : sizeof (word));
+        digest = (digest ^ word) * 0x100000001b3ULL;
+    }
+
+    while (data < end) {
+        const char *nul;
+        if (!pRider->midMsg) {
+            simRxMsg(riderIdx, data, (end - data));
+        }
+        if ((nul = memchr(data, '\0', (end - data))) == NULL) {
+            pRider->midMsg = true;
+            break;
+        }
+        pRider->midMsg = false;
+        data = nul + 1;
+    }
+
+    return len;
+}
+
+static int simConnect(Grs *pGrs, const CmdArgs *pArgs, int riderIdx)
+{
+    static const char *genders[] = { "female", "male", "unspec" };
+    SimRider *pRider = &riderTbl[riderIdx];
+    SockAddrStore sockAddr = { .ss_family = AF_INET };
+    char msg[256];
+    int len;
+
+    if ((pRider->fd = open("/dev/null", O_RDONLY)) < 0) {
+        MSGLOG(ERROR, "Failed to open /dev/null! (%s)", strerror(errno));
+        return -1;
+    }
+    if (pRider->fd >= fdRiderTblSize) {
+        MSGLOG(ERROR, "File descriptor out of range! fd=%d", pRider->fd);
+        return -1;
+    }
+    fdRiderTbl[pRider->fd] = riderIdx;
+
+    ((SockAddrIn *) &sockAddr)->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ((SockAddrIn *) &sockAddr)->sin_port = htons(49152 + (riderIdx % 16384));
+    if (addRider(pGrs, pRider->fd, &sockAddr) != 0) {
+        pRider->fd = -1;
+        return -1;
+    }
+
+    len = snprintf(msg, sizeof (msg),
+            "{\"msgType\": \"regReq\", \"name\": \"Rider %d\", \"gender\": \"%s\", \"age\": \"%u\", \"ride\": \"%s\"}",
+            (riderIdx + 1), genders[simRandom() % 3], (18 + (simRandom() % 60)), pArgs->rideName);
+    numMsgsIn++;
+
+    return procRxData(pGrs, pArgs, pRider->fd, msg, (len + 1));
+}
+
+static int simProgUpd(Grs *pGrs, const CmdArgs *pArgs, int riderIdx)
+{
+    SimRider *pRider = &riderTbl[riderIdx];
+    double speed;
+    char msg[256];
+    int len;
+
+    pRider->power += (int) (simRandom() % 21) - 10;
+    if (pRider->power < 50) {
+        pRider->power = 50;
+    }
+    speed = pRider->power / 25.0;
+    pRider->distance += (int) ((speed * pRider->progUpdPeriod) / 1000);
+
+    len = snprintf(msg, sizeof (msg),
+            "{\"msgType\": \"progUpd\", \"distance\": \"%d\", \"power\": \"%d\", \"speed\": \"%.3f\"}",
+            pRider->distance, pRider->power, speed);
+    numMsgsIn++;
+
+    if (procRxData(pGrs, pArgs, pRider->fd, msg, (len + 1)) != 0) {
+        // The connection was closed
+        pRider->fd = -1;
+        return 0;
+    }
+
+    scheduleProgUpd(riderIdx);
+
+    return 0;
+}
+
+// Move the virtual clock forward, running the periodic tasks
+// due on the way.
+static int advanceTo(Grs *pGrs, const CmdArgs *pArgs, uint64_t time)
+{
+    Timespec until;
+
+    simTime = time;
+    toTimespec(time, &until);
+
+    return grsRunTimers(pGrs, pArgs, &until);
+}
+
+static long maxRssKb(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    return usage.ru_maxrss;
+}
+
+int grsSimulate(Grs *pGrs, const CmdArgs *pArgs)
+{
+    const uint64_t startTime = (uint64_t) (SIM_REG_WINDOW + SIM_START_DELAY) * NSECS_PER_SEC;
+    const uint64_t endTime = startTime + ((uint64_t) pArgs->simDuration * NSECS_PER_SEC);
+    uint64_t nextReport = startTime;
+    uint64_t wallStart, elapsed;
+    uint32_t minLbs = UINT32_MAX, maxLbs = 0;
+    uint64_t sumLbs = 0;
+    struct rlimit fdLimit;
+    sigset_t waitMask;
+
+    if (pArgs->simRiders > pArgs->maxRiders) {
+        MSGLOG(ERROR, "Max riders too low for the simulation! simRiders=%d maxRiders=%d", pArgs->simRiders, pArgs->maxRiders);
+        return -1;
+    }
+
+    // Each virtual rider needs a file descriptor
+    if ((getrlimit(RLIMIT_NOFILE, &fdLimit) == 0) && (fdLimit.rlim_cur < fdLimit.rlim_max)) {
+        fdLimit.rlim_cur = fdLimit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fdLimit);
+    }
+    if ((getrlimit(RLIMIT_NOFILE, &fdLimit) != 0) || (fdLimit.rlim_cur < (rlim_t) (pArgs->simRiders + 64))) {
+        MSGLOG(ERROR, "Not enough file descriptors for %d riders! limit=%lu", pArgs->simRiders, (unsigned long) fdLimit.rlim_cur);
+        return -1;
+    }
+    fdRiderTblSize = pArgs->simRiders + 64 + 1024;
+
+    if (((riderTbl = calloc(pArgs->simRiders, sizeof (SimRider))) == NULL) ||
+        ((fdRiderTbl = calloc(fdRiderTblSize, sizeof (int))) == NULL) ||
+        ((eventHeap = calloc(pArgs->simRiders, sizeof (SimEvent))) == NULL)) {
+        MSGLOG(ERROR, "Failed to alloc simulation tables! (%s)", strerror(errno));
+        return -1;
+    }
+
+    // Deliver all the outbound messages to the virtual riders,
+    // and read the time from the virtual clock.
+    pGrs->sendFn = simSend;
+    grsSetVirtualClock(pGrs);
+    toTimespec(0, &pGrs->now);
+
+    if (grsInit(pGrs, pArgs, &waitMask) != 0) {
+        // Error message already printed
+        return -1;
+    }
+
+    // The ride starts once everybody registered
+    pGrs->rideActive = false;
+
+    rngState = (pArgs->simSeed * 0x9e3779b97f4a7c15ULL) | 1;
+
+    // Registration storm: the riders connect and register
+    // evenly spread over the registration window.
+    for (int n = 0; n < pArgs->simRiders; n++) {
+        riderTbl[n].fd = -1;
+        riderTbl[n].power = 150 + (simRandom() % 150);
+        riderTbl[n].progUpdPeriod = pArgs->progUpdPeriod * 1000;
+        pushEvent((((uint64_t) SIM_REG_WINDOW * NSECS_PER_SEC * n) / pArgs->simRiders), n);
+    }
+
+    MSGLOG(INFO, "Simulating a %d-second ride with %d riders, seed %u", pArgs->simDuration, pArgs->simRiders, pArgs->simSeed);
+
+    wallStart = monoTimeNs();
+
+    while (!grsExitRequested()) {
+        uint64_t next = (numEvents != 0) ? eventHeap[0].time : UINT64_MAX;
+        SimEvent event;
+
+        if (!pGrs->rideActive && (next >= startTime)) {
+            if ((advanceTo(pGrs, pArgs, startTime) != 0) || (startRide(pGrs, pArgs) != 0)) {
+                return -1;
+            }
+            grsFlushEgress(pGrs, pArgs);
+            continue;
+        }
+
+        if (next >= endTime) {
+            break;
+        }
+
+        traceIterBegin();
+
+        event = popEvent();
+        if (advanceTo(pGrs, pArgs, event.time) != 0) {
+            return -1;
+        }
+
+        if (riderTbl[event.riderIdx].fd < 0) {
+            if (simConnect(pGrs, pArgs, event.riderIdx) != 0) {
+                MSGLOG(ERROR, "Failed to connect virtual rider! riderIdx=%d", event.riderIdx);
+            }
+        } else if (simProgUpd(pGrs, pArgs, event.riderIdx) != 0) {
+            return -1;
+        }
+
+        grsFlushEgress(pGrs, pArgs);
+        grsCheckDump();
+        traceIterEnd();
+
+        if (simTime >= nextReport) {
+            MSGLOG(INFO, "Simulation: time=%lu secs riders=%d msgsIn=%lu msgsOut=%lu maxRss=%ld KB",
+                    ((simTime - startTime) / NSECS_PER_SEC), pGrs->numRegRiders, numMsgsIn, numMsgsOut, maxRssKb());
+            nextReport += (uint64_t) SIM_REPORT_PERIOD * NSECS_PER_SEC;
+        }
+    }
+
+    // Run the ride to the end, and then everybody leaves
+    if (advanceTo(pGrs, pArgs, endTime) != 0) {
+        return -1;
+    }
+    grsFlushEgress(pGrs, pArgs);
+    for (int n = 0; n < pArgs->simRiders; n++) {
+        SimRider *pRider = &riderTbl[n];
+        if (pRider->fd >= 0) {
+            procDisconnect(pGrs, pArgs, pRider->fd);
+            pRider->fd = -1;
+        }
+        if (pRider->numLeaderboards < minLbs) {
+            minLbs = pRider->numLeaderboards;
+        }
+        if (pRider->numLeaderboards > maxLbs) {
+            maxLbs = pRider->numLeaderboards;
+        }
+        sumLbs += pRider->numLeaderboards;
+    }
+
+    elapsed = monoTimeNs() - wallStart;
+
+    MSGLOG(INFO, "Simulation done: riders=%d duration=%d secs elapsed=%.3f secs speedup=%.0fx msgsIn=%lu msgsOut=%lu bytesOut=%lu",
+            pArgs->simRiders, pArgs->simDuration, (elapsed / 1e9),
+            ((elapsed != 0) ? (((endTime - startTime) * 1.0) / elapsed) : 0.0),
+            numMsgsIn, numMsgsOut, numBytesOut);
+    MSGLOG(INFO, "Simulation done: leaderboards per rider min=%u avg=%.1f max=%u maxRss=%ld KB digest=%016lx",
+            minLbs, ((double) sumLbs / pArgs->simRiders), maxLbs, maxRssKb(), digest);
+    traceDump();
+    recClose();
+
+    return 0;
+}
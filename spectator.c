@@ -0,0 +1,440 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "egress.h"
+#include "json.h"
+#include "log.h"
+#include "metrics.h"
+#include "spectator.h"
+
+// Max size of the subscription request
+#define SPEC_MAX_REQ    1024
+
+typedef struct Spectator {
+    int sd;                     // file descriptor of the connected socket
+    Bool subscribed;            // has the subscription been accepted?
+    Bool closing;               // close the connection once the queue is drained
+    Bool closed;                // connection closed; object to be freed
+    uint8_t *subs;              // subscribed categories
+    Egress egress;              // messages waiting to be sent
+    size_t reqLen;              // bytes of the request received so far
+    char req[SPEC_MAX_REQ];     // subscription request
+} Spectator;
+
+static int listenSd = -1;
+static int wakeFd = -1;
+static int numCats;
+static const char **catNames;
+
+// Latest leaderboard of each category, handed over by the
+// event loop and not yet picked up by the spectator thread.
+// Once handed over, the reference counts of the buffers are
+// only ever touched by the spectator thread.
+static EgrBuf **pendingTbl;
+
+// Number of connected spectators, used by the event loop
+// to skip publishing when nobody is listening
+static int numSpecs;
+
+// The connected spectators; only used by the spectator
+// thread.
+static Spectator **specTbl;
+static int specTblSize;
+
+// Send as many of the queued messages as the socket will
+// take without blocking, up to the egress budget; whatever
+// is left is sent when the socket polls writable again.
+static int flushQueue(Spectator *pSpec)
+{
+    int numQueued = pSpec->egress.numQueued;
+    size_t budget = EGR_BUDGET;
+    int s;
+
+    s = egrFlush(&pSpec->egress, pSpec->sd, send, egrBulk, &budget);
+    metricsAdd(ctrSpecBytesOut, (EGR_BUDGET - budget));
+    metricsAdd(ctrSpecMsgsOut, (numQueued - pSpec->egress.numQueued));
+    if (s < 0) {
+        return -1;
+    }
+
+    return (pSpec->closing && (s == egrIdle)) ? -1 : 0;
+}
+
+// Add a message to the spectator's queue. If the queue is
+// full, the oldest message not being sent is dropped.
+static void queueSpecMsg(Spectator *pSpec, EgrPrio prio, EgrBuf *pBuf)
+{
+    if (egrQueue(&pSpec->egress, prio, pBuf) != 0) {
+        metricsAdd(ctrSpecDropped, 1);
+    }
+}
+
+static void sendSpecResp(Spectator *pSpec, const char *status)
+{
+    char msg[256];
+    EgrBuf *pBuf;
+    int msgLen;
+
+    msgLen = snprintf(msg, sizeof (msg), "{\"msgType\": \"specResp\", \"status\": \"%s\"}", status) + 1;
+
+    if ((pBuf = egrNewBuf(msg, msgLen)) != NULL) {
+        queueSpecMsg(pSpec, egrControl, pBuf);
+        egrReleaseBuf(pBuf);
+    }
+}
+
+// Process a Spectator Request message
+//
+// Message format:
+//
+//   {
+//     "msgType": "specReq",
+//     "categories": "{all|<Category>[,<Category>...]}"
+//   }
+//
+// Example:
+//
+//   {
+//     "msgType": "specReq",
+//     "categories": "MU35,WU40"
+//   }
+//
+static int procSpecReq(Spectator *pSpec, const char *data, size_t dataLen)
+{
+    JsonObject msg = {0};
+    const char *msgType;
+    char *cats, *cat, *savePtr;
+    int numSubs = 0;
+
+    if ((jsonFindObject(data, dataLen, &msg) != 0) ||
+        ((msgType = jsonFindTag(&msg, "msgType")) == NULL) ||
+        (strncmp(msgType, "\"specReq\"", 9) != 0) ||
+        ((cats = jsonGetTagValue(&msg, "categories")) == NULL)) {
+        MSGLOG(ERROR, "Invalid spectator request! sd=%d", pSpec->sd);
+        return -1;
+    }
+
+    for (cat = strtok_r(cats, ", ", &savePtr); cat != NULL; cat = strtok_r(NULL, ", ", &savePtr)) {
+        int n;
+
+        if (strcmp(cat, "all") == 0) {
+            memset(pSpec->subs, 1, numCats);
+            numSubs = numCats;
+            continue;
+        }
+
+        for (n = 0; n < numCats; n++) {
+            if (strcmp(cat, catNames[n]) == 0) {
+                pSpec->subs[n] = 1;
+                numSubs++;
+                break;
+            }
+        }
+
+        if (n == numCats) {
+            MSGLOG(ERROR, "Invalid category! sd=%d category=%s", pSpec->sd, cat);
+            free(cats);
+            return -1;
+        }
+    }
+
+    free(cats);
+
+    if (numSubs == 0) {
+        MSGLOG(ERROR, "No categories specified! sd=%d", pSpec->sd);
+        return -1;
+    }
+
+    MSGLOG(INFO, "New spectator: sd=%d numCats=%d", pSpec->sd, numSubs);
+
+    pSpec->subscribed = true;
+
+    return 0;
+}
+
+static int procSpecData(Spectator *pSpec)
+{
+    char discard[256];
+    ssize_t len;
+
+    if (pSpec->subscribed) {
+        // Nothing else is expected from the spectator;
+        // just check for a closed connection.
+        len = read(pSpec->sd, discard, sizeof (discard));
+        return (len > 0) ? 0 : -1;
+    }
+
+    if ((len = read(pSpec->sd, (pSpec->req + pSpec->reqLen), (sizeof (pSpec->req) - 1 - pSpec->reqLen))) <= 0) {
+        return -1;
+    }
+    pSpec->reqLen += len;
+    pSpec->req[pSpec->reqLen] = '\0';
+
+    // Wait for the complete message
+    if ((memchr(pSpec->req, '}', pSpec->reqLen) == NULL) && (pSpec->reqLen < (sizeof (pSpec->req) - 1))) {
+        return 0;
+    }
+
+    if (procSpecReq(pSpec, pSpec->req, pSpec->reqLen) != 0) {
+        sendSpecResp(pSpec, "error");
+        pSpec->closing = true;
+    } else {
+        sendSpecResp(pSpec, "success");
+    }
+
+    return flushQueue(pSpec);
+}
+
+static void acceptSpectator(void)
+{
+    Spectator *pSpec;
+    int noDelay = 1;
+    int sd;
+
+    if ((sd = accept4(listenSd, NULL, NULL, SOCK_NONBLOCK)) < 0) {
+        MSGLOG(ERROR, "Failed to accept spectator connection! (%s)", strerror(errno));
+        return;
+    }
+
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof (noDelay));
+
+    if (numSpecs == specTblSize) {
+        int size = (specTblSize != 0) ? (specTblSize * 2) : 64;
+        Spectator **tbl;
+        if ((tbl = realloc(specTbl, (size * sizeof (Spectator *)))) == NULL) {
+            MSGLOG(ERROR, "Failed to alloc spectator table! (%s)", strerror(errno));
+            close(sd);
+            return;
+        }
+        specTbl = tbl;
+        specTblSize = size;
+    }
+
+    if (((pSpec = calloc(1, sizeof (Spectator))) == NULL) ||
+        ((pSpec->subs = calloc(numCats, sizeof (uint8_t))) == NULL)) {
+        MSGLOG(ERROR, "Failed to alloc Spectator object! (%s)", strerror(errno));
+        free(pSpec);
+        close(sd);
+        return;
+    }
+
+    pSpec->sd = sd;
+    egrInit(&pSpec->egress);
+    specTbl[numSpecs] = pSpec;
+    __atomic_store_n(&numSpecs, (numSpecs + 1), __ATOMIC_RELAXED);
+    metricsSetGauge(gaugeSpectators, numSpecs);
+}
+
+// Free the spectators whose connection has been closed
+static void removeClosedSpectators(void)
+{
+    int n = 0;
+
+    for (int i = 0; i < numSpecs; i++) {
+        Spectator *pSpec = specTbl[i];
+        if (pSpec->closed) {
+            egrClear(&pSpec->egress);
+            close(pSpec->sd);
+            free(pSpec->subs);
+            free(pSpec);
+        } else {
+            specTbl[n++] = pSpec;
+        }
+    }
+
+    if (n != numSpecs) {
+        __atomic_store_n(&numSpecs, n, __ATOMIC_RELAXED);
+        metricsSetGauge(gaugeSpectators, numSpecs);
+    }
+}
+
+// Queue the leaderboards handed over by the event loop on
+// the spectators subscribed to their category.
+static void distributeLeaderboards(void)
+{
+    uint64_t val;
+
+    if (read(wakeFd, &val, sizeof (val)) != sizeof (val)) {
+        return;
+    }
+
+    for (int cat = 0; cat < numCats; cat++) {
+        EgrBuf *pBuf;
+
+        if ((pBuf = __atomic_exchange_n(&pendingTbl[cat], NULL, __ATOMIC_ACQUIRE)) == NULL) {
+            continue;
+        }
+
+        for (int i = 0; i < numSpecs; i++) {
+            Spectator *pSpec = specTbl[i];
+            if (pSpec->subscribed && !pSpec->closed && pSpec->subs[cat]) {
+                queueSpecMsg(pSpec, egrLeaderboard, pBuf);
+                if (flushQueue(pSpec) != 0) {
+                    pSpec->closed = true;
+                }
+            }
+        }
+
+        egrReleaseBuf(pBuf);
+    }
+}
+
+static void *specThread(void *arg)
+{
+    PollFd *pollFds = NULL;
+    int pollFdsSize = 0;
+
+    while (true) {
+        int n = 0;
+
+        // The pollFds array is rebuilt on each iteration, as
+        // the events of each spectator depend on whether it
+        // has messages waiting to be sent.
+        if (pollFdsSize < (numSpecs + 2)) {
+            PollFd *fds;
+            int size = specTblSize + 2;
+            if ((fds = realloc(pollFds, (size * sizeof (PollFd)))) == NULL) {
+                MSGLOG(ERROR, "Failed to alloc pollFds array! (%s)", strerror(errno));
+                sleep(1);
+                continue;
+            }
+            pollFds = fds;
+            pollFdsSize = size;
+        }
+
+        pollFds[n].fd = listenSd;
+        pollFds[n++].events = POLLIN;
+        pollFds[n].fd = wakeFd;
+        pollFds[n++].events = POLLIN;
+        for (int i = 0; i < numSpecs; i++) {
+            pollFds[n].fd = specTbl[i]->sd;
+            pollFds[n++].events = (specTbl[i]->egress.numQueued != 0) ? (POLLIN | POLLOUT) : POLLIN;
+        }
+
+        if (poll(pollFds, n, -1) < 0) {
+            if (errno != EINTR) {
+                MSGLOG(ERROR, "Failed to wait for spectator events! (%s)", strerror(errno));
+                sleep(1);
+            }
+            continue;
+        }
+
+        // Process the events of the current spectators first,
+        // as the others can change the spectator table.
+        for (int i = 2; i < n; i++) {
+            Spectator *pSpec = specTbl[i - 2];
+            int revents = pollFds[i].revents;
+
+            if (revents & (POLLHUP | POLLERR)) {
+                pSpec->closed = true;
+            } else if ((revents & POLLIN) && (procSpecData(pSpec) != 0)) {
+                pSpec->closed = true;
+            } else if ((revents & POLLOUT) && (flushQueue(pSpec) != 0)) {
+                pSpec->closed = true;
+            }
+        }
+
+        if (pollFds[1].revents & POLLIN) {
+            distributeLeaderboards();
+        }
+
+        removeClosedSpectators();
+
+        if (pollFds[0].revents & POLLIN) {
+            acceptSpectator();
+        }
+    }
+
+    return NULL;
+}
+
+Bool specActive(void)
+{
+    return (__atomic_load_n(&numSpecs, __ATOMIC_RELAXED) != 0);
+}
+
+void specPublish(int catIdx, const char *msg, size_t msgLen)
+{
+    EgrBuf *pBuf, *pOld;
+    uint64_t val = 1;
+
+    if (!specActive()) {
+        return;
+    }
+
+    if ((pBuf = egrNewBuf(msg, msgLen)) == NULL) {
+        // Error message already printed
+        return;
+    }
+
+    // If the previous leaderboard of this category hasn't
+    // been picked up yet, it is stale: replace it.
+    if ((pOld = __atomic_exchange_n(&pendingTbl[catIdx], pBuf, __ATOMIC_ACQ_REL)) != NULL) {
+        egrReleaseBuf(pOld);
+        metricsAdd(ctrSpecDropped, 1);
+    }
+
+    if (write(wakeFd, &val, sizeof (val)) != sizeof (val)) {
+        MSGLOG(ERROR, "Failed to wake up the spectator thread! (%s)", strerror(errno));
+    }
+}
+
+int specInit(const SockAddrStore *pSockAddr, int nCats, const char *names[])
+{
+    int enable = 1;
+    pthread_t tid;
+
+    numCats = nCats;
+    catNames = names;
+    if ((pendingTbl = calloc(nCats, sizeof (EgrBuf *))) == NULL) {
+        MSGLOG(ERROR, "Failed to alloc spectator table! (%s)", strerror(errno));
+        return -1;
+    }
+
+    if ((wakeFd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        MSGLOG(ERROR, "Failed to create eventfd! (%s)", strerror(errno));
+        return -1;
+    }
+
+    if ((listenSd = socket(pSockAddr->ss_family, SOCK_STREAM, 0)) < 0) {
+        MSGLOG(ERROR, "Failed to open spectator socket! (%s)", strerror(errno));
+        return -1;
+    }
+
+    if (setsockopt(listenSd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof (enable)) != 0) {
+        MSGLOG(ERROR, "Failed to set SO_REUSEADDR option! (%s)", strerror(errno));
+        close(listenSd);
+        return -1;
+    }
+
+    if (bind(listenSd, (SockAddr *) pSockAddr, ssLen(pSockAddr)) != 0) {
+        MSGLOG(ERROR, "Failed to bind spectator socket! (%s)", strerror(errno));
+        close(listenSd);
+        return -1;
+    }
+
+    if (listen(listenSd, 64) != 0) {
+        MSGLOG(ERROR, "Failed to listen on spectator socket! (%s)", strerror(errno));
+        close(listenSd);
+        return -1;
+    }
+
+    if (pthread_create(&tid, NULL, specThread, NULL) != 0) {
+        MSGLOG(ERROR, "Failed to create spectator thread!");
+        close(listenSd);
+        return -1;
+    }
+    pthread_detach(tid);
+
+    return 0;
+}
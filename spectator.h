@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "defs.h"
+
+// Spectators are read-only clients (commentators, team
+// managers, video overlays, etc.) that connect to their own
+// listener and subscribe to the leaderboards of one or more
+// categories. They are served by a separate thread, so that
+// they never slow down the event loop that serves the riders.
+//
+// The event loop hands over each leaderboard message to the
+// spectator thread, which queues the same buffer on every
+// spectator subscribed to its category. Each spectator has a
+// small queue; if a spectator can't keep up, the oldest
+// messages in its queue are dropped.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Start the spectator listener on the specified address.
+// The category names are used to parse the subscriptions.
+extern int specInit(const SockAddrStore *pSockAddr, int numCats, const char *catNames[]);
+
+// Are there any spectators connected?
+extern Bool specActive(void);
+
+// Publish the leaderboard message of the specified category.
+// The message is copied, so the caller can reuse its buffer
+// as soon as this returns. It never blocks.
+extern void specPublish(int catIdx, const char *msg, size_t msgLen);
+
+#ifdef __cplusplus
+}
+#endif
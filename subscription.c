@@ -0,0 +1,349 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "log.h"
+#include "subscription.h"
+
+// Set of bib numbers
+typedef struct BibSet {
+    int *tbl;                   // bib numbers in the set
+    int num;                    // number of entries used
+    int size;                   // number of entries allocated
+} BibSet;
+
+typedef struct Subscription {
+    BibSet riders;              // riders followed
+    int teamTbl[SUB_MAX_TEAMS]; // teams followed (index in the teamTbl)
+    int numTeams;               // number of teams followed
+    Bool changed;               // changed since its last leaderboard?
+} Subscription;
+
+typedef struct SubTeam {
+    char name[SUB_MAX_TEAM_LEN]; // name of the team
+    BibSet members;             // riders in the team
+    BibSet subscribers;         // riders whose subscription follows the team
+} SubTeam;
+
+typedef struct SubBib {
+    BibSet followers;           // riders whose subscription follows this rider
+    Subscription *pSub;         // this rider's own subscription (NULL=none)
+} SubBib;
+
+// The bib numbers are assigned sequentially, so the table
+// never needs to be larger than this.
+#define SUB_MAX_BIB_NUM     (1 << 24)
+
+static SubBib *bibTbl;          // indexed by bib number
+static int bibTblSize;
+static SubTeam *teamTbl;
+static int numTeams;
+static BibSet changedSet;       // riders whose subscription changed since its last leaderboard
+
+static int bibSetFind(const BibSet *pSet, int bibNum)
+{
+    for (int n = 0; n < pSet->num; n++) {
+        if (pSet->tbl[n] == bibNum) {
+            return n;
+        }
+    }
+
+    return -1;
+}
+
+static int bibSetAdd(BibSet *pSet, int bibNum)
+{
+    if (pSet->num == pSet->size) {
+        int size = (pSet->size != 0) ? (pSet->size * 2) : 16;
+        int *tbl;
+        if ((tbl = realloc(pSet->tbl, (size * sizeof (int)))) == NULL) {
+            MSGLOG(ERROR, "Failed to alloc bib set! (%s)", strerror(errno));
+            return -1;
+        }
+        pSet->tbl = tbl;
+        pSet->size = size;
+    }
+
+    pSet->tbl[pSet->num++] = bibNum;
+
+    return 0;
+}
+
+static void bibSetDel(BibSet *pSet, int bibNum)
+{
+    int n;
+
+    if ((n = bibSetFind(pSet, bibNum)) >= 0) {
+        pSet->tbl[n] = pSet->tbl[--pSet->num];
+    }
+}
+
+static void bibSetFree(BibSet *pSet)
+{
+    free(pSet->tbl);
+    memset(pSet, 0, sizeof (*pSet));
+}
+
+// Get the entry of the rider, growing the table as needed
+static SubBib *getBib(int bibNum)
+{
+    if ((bibNum <= 0) || (bibNum >= SUB_MAX_BIB_NUM)) {
+        MSGLOG(ERROR, "Invalid bib number! bibNum=%d", bibNum);
+        return NULL;
+    }
+
+    if (bibNum >= bibTblSize) {
+        size_t size = (bibTblSize != 0) ? bibTblSize : 1024;
+        SubBib *tbl;
+        while (size <= (size_t) bibNum) {
+            size *= 2;
+        }
+        if ((tbl = realloc(bibTbl, (size * sizeof (SubBib)))) == NULL) {
+            MSGLOG(ERROR, "Failed to alloc subscription table! (%s)", strerror(errno));
+            return NULL;
+        }
+        memset(&tbl[bibTblSize], 0, ((size - bibTblSize) * sizeof (SubBib)));
+        bibTbl = tbl;
+        bibTblSize = size;
+    }
+
+    return &bibTbl[bibNum];
+}
+
+// Look up a team by name, optionally adding it if it is not
+// known yet. There are only a handful of teams in a ride, so
+// a linear search is good enough.
+static int findTeam(const char *name, Bool add)
+{
+    SubTeam *tbl;
+
+    for (int n = 0; n < numTeams; n++) {
+        if (strcmp(teamTbl[n].name, name) == 0) {
+            return n;
+        }
+    }
+
+    if (!add) {
+        return -1;
+    }
+
+    if ((tbl = realloc(teamTbl, ((numTeams + 1) * sizeof (SubTeam)))) == NULL) {
+        MSGLOG(ERROR, "Failed to alloc team table! (%s)", strerror(errno));
+        return -1;
+    }
+    teamTbl = tbl;
+    memset(&teamTbl[numTeams], 0, sizeof (SubTeam));
+    snprintf(teamTbl[numTeams].name, sizeof (teamTbl[numTeams].name), "%s", name);
+
+    return numTeams++;
+}
+
+static void markChanged(int subBib)
+{
+    Subscription *pSub = bibTbl[subBib].pSub;
+
+    if (!pSub->changed && (bibSetAdd(&changedSet, subBib) == 0)) {
+        pSub->changed = true;
+    }
+}
+
+// Make the subscription of rider 'subBib' follow rider
+// 'bibNum'.
+static int follow(int subBib, int bibNum)
+{
+    Subscription *pSub = bibTbl[subBib].pSub;
+    SubBib *pBib;
+
+    if ((bibSetFind(&pSub->riders, bibNum) >= 0) || (pSub->riders.num == SUB_MAX_RIDERS)) {
+        return 0;
+    }
+
+    if ((pBib = getBib(bibNum)) == NULL) {
+        return -1;
+    }
+
+    if (bibSetAdd(&pSub->riders, bibNum) != 0) {
+        return -1;
+    }
+    if (bibSetAdd(&pBib->followers, subBib) != 0) {
+        bibSetDel(&pSub->riders, bibNum);
+        return -1;
+    }
+
+    markChanged(subBib);
+
+    return 0;
+}
+
+static void unsubscribe(int bibNum)
+{
+    Subscription *pSub;
+
+    if ((bibNum >= bibTblSize) || ((pSub = bibTbl[bibNum].pSub) == NULL)) {
+        return;
+    }
+
+    for (int n = 0; n < pSub->riders.num; n++) {
+        bibSetDel(&bibTbl[pSub->riders.tbl[n]].followers, bibNum);
+    }
+    for (int n = 0; n < pSub->numTeams; n++) {
+        bibSetDel(&teamTbl[pSub->teamTbl[n]].subscribers, bibNum);
+    }
+    if (pSub->changed) {
+        bibSetDel(&changedSet, bibNum);
+    }
+
+    bibSetFree(&pSub->riders);
+    free(pSub);
+    bibTbl[bibNum].pSub = NULL;
+}
+
+int subAddRider(int bibNum, const char *team)
+{
+    SubTeam *pTeam;
+    int teamIdx;
+
+    if (team == NULL) {
+        return 0;
+    }
+
+    if ((teamIdx = findTeam(team, true)) < 0) {
+        return -1;
+    }
+    pTeam = &teamTbl[teamIdx];
+
+    if (bibSetAdd(&pTeam->members, bibNum) != 0) {
+        return -1;
+    }
+
+    for (int n = 0; n < pTeam->subscribers.num; n++) {
+        if (follow(pTeam->subscribers.tbl[n], bibNum) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void subRemoveRider(int bibNum, const char *team)
+{
+    int teamIdx;
+
+    if ((team != NULL) && ((teamIdx = findTeam(team, false)) >= 0)) {
+        bibSetDel(&teamTbl[teamIdx].members, bibNum);
+    }
+
+    unsubscribe(bibNum);
+
+    if (bibNum < bibTblSize) {
+        BibSet *pFollowers = &bibTbl[bibNum].followers;
+        for (int n = 0; n < pFollowers->num; n++) {
+            int subBib = pFollowers->tbl[n];
+            bibSetDel(&bibTbl[subBib].pSub->riders, bibNum);
+            markChanged(subBib);
+        }
+        bibSetFree(pFollowers);
+    }
+}
+
+int subSubscribe(int bibNum, const int *bibTblIn, int numBibs, char * const *teamTblIn, int numTeamsIn)
+{
+    Subscription *pSub;
+    SubBib *pBib;
+
+    unsubscribe(bibNum);
+
+    if ((numBibs == 0) && (numTeamsIn == 0)) {
+        return 0;
+    }
+
+    if ((pBib = getBib(bibNum)) == NULL) {
+        return -1;
+    }
+    if ((pSub = calloc(1, sizeof (Subscription))) == NULL) {
+        MSGLOG(ERROR, "Failed to alloc Subscription object! (%s)", strerror(errno));
+        return -1;
+    }
+    pBib->pSub = pSub;
+
+    for (int n = 0; n < numBibs; n++) {
+        if ((bibTblIn[n] > 0) && (follow(bibNum, bibTblIn[n]) != 0)) {
+            unsubscribe(bibNum);
+            return -1;
+        }
+    }
+
+    for (int n = 0; (n < numTeamsIn) && (pSub->numTeams < SUB_MAX_TEAMS); n++) {
+        SubTeam *pTeam;
+        int teamIdx;
+
+        // A team nobody registered with yet is still
+        // followed, in case its members join later.
+        if ((teamIdx = findTeam(teamTblIn[n], true)) < 0) {
+            unsubscribe(bibNum);
+            return -1;
+        }
+        pTeam = &teamTbl[teamIdx];
+        if (bibSetFind(&pTeam->subscribers, bibNum) >= 0) {
+            continue;
+        }
+        if (bibSetAdd(&pTeam->subscribers, bibNum) != 0) {
+            unsubscribe(bibNum);
+            return -1;
+        }
+        pSub->teamTbl[pSub->numTeams++] = teamIdx;
+
+        for (int m = 0; m < pTeam->members.num; m++) {
+            if (follow(bibNum, pTeam->members.tbl[m]) != 0) {
+                unsubscribe(bibNum);
+                return -1;
+            }
+        }
+    }
+
+    // Send the first leaderboard even if none of the riders
+    // followed has registered yet.
+    markChanged(bibNum);
+
+    return pSub->riders.num;
+}
+
+void subRiderChanged(int bibNum)
+{
+    if (bibNum < bibTblSize) {
+        const BibSet *pFollowers = &bibTbl[bibNum].followers;
+        for (int n = 0; n < pFollowers->num; n++) {
+            markChanged(pFollowers->tbl[n]);
+        }
+    }
+}
+
+int subTakeChanged(void)
+{
+    int bibNum;
+
+    if (changedSet.num == 0) {
+        return 0;
+    }
+
+    bibNum = changedSet.tbl[--changedSet.num];
+    bibTbl[bibNum].pSub->changed = false;
+
+    return bibNum;
+}
+
+int subGetRiders(int bibNum, const int **pBibTbl)
+{
+    const Subscription *pSub;
+
+    if ((bibNum >= bibTblSize) || ((pSub = bibTbl[bibNum].pSub) == NULL)) {
+        *pBibTbl = NULL;
+        return 0;
+    }
+
+    *pBibTbl = pSub->riders.tbl;
+
+    return pSub->riders.num;
+}
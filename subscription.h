@@ -0,0 +1,54 @@
+#pragma once
+
+// Interest-based leaderboards.
+//
+// Besides the leaderboard of its own category, a rider can
+// subscribe to a custom leaderboard that lists any set of
+// riders, across categories: a list of bib numbers, and/or
+// the members of one or more teams.
+//
+// Everything is keyed by bib number. Each subscription keeps
+// the set of riders it follows, and each rider has an index
+// of the subscribers that follow it; so when a rider sends a
+// progUpd message, only the subscriptions that include it
+// are flagged as changed, and each leaderboard period only
+// those get a new message, built straight from the records
+// of the riders they follow.
+#define SUB_MAX_RIDERS      100     // max riders followed by a subscription
+#define SUB_MAX_TEAMS       8       // max teams followed by a subscription
+#define SUB_MAX_TEAM_LEN    32      // max length of a team name (including the null terminator)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Add a newly registered rider to its team (if any). The
+// subscriptions that follow the team start following the
+// rider as well.
+extern int subAddRider(int bibNum, const char *team);
+
+// Remove a rider that left the ride, along with its own
+// subscription.
+extern void subRemoveRider(int bibNum, const char *team);
+
+// Replace the subscription of a rider with the specified
+// bib numbers and teams; with none of either, the rider is
+// just unsubscribed. Returns the number of riders followed,
+// which is capped at SUB_MAX_RIDERS, or -1 on error.
+extern int subSubscribe(int bibNum, const int *bibTbl, int numBibs, char * const *teamTbl, int numTeams);
+
+// Flag the subscriptions that follow the rider as changed
+extern void subRiderChanged(int bibNum);
+
+// Take the next subscription that changed since its last
+// leaderboard, and return the bib number of its rider, or
+// 0 if there are none left.
+extern int subTakeChanged(void);
+
+// Get the bib numbers of the riders the subscription of the
+// specified rider follows. Returns the number of riders.
+extern int subGetRiders(int bibNum, const int **pBibTbl);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,178 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+// Generate a synthetic capture file that can be replayed
+// through the GRS with the --replay option, to profile or
+// benchmark the server with a repeatable workload.
+//
+// The workload has two phases: a registration storm, in
+// which all the riders connect and register within the
+// first second, followed by the group ride itself, in which
+// each rider sends a progress update every second until the
+// end of the ride.
+
+typedef struct GenArgs {
+    const char *fileName;
+    const char *rideName;
+    int numRiders;
+    int duration;
+    unsigned int seed;
+} GenArgs;
+
+typedef struct GenRider {
+    int distance;
+    int power;
+} GenRider;
+
+static const char *help =
+        "SYNTAX:\n"
+        "    gencap [OPTIONS] <file>\n"
+        "\n"
+        "    Generates a synthetic capture file for the GRS --replay option.\n"
+        "\n"
+        "OPTIONS:\n"
+        "    --duration <secs>\n"
+        "        Specifies the duration of the ride. The default is 300.\n"
+        "    --help\n"
+        "        Show this help and exit.\n"
+        "    --riders <num>\n"
+        "        Specifies the number of riders. The default is 1000.\n"
+        "    --ride-name <name>\n"
+        "        Specifies the name of the group ride. The default is \"Synthetic\".\n"
+        "    --seed <num>\n"
+        "        Specifies the seed of the random number generator. The default is 1.\n"
+        "\n";
+
+static int writeRec(FILE *fp, uint64_t timestamp, uint32_t connId, CapRecType type, const char *data, size_t len)
+{
+    CapRecHdr rec = { .timestamp = timestamp, .connId = connId, .type = type, .len = len };
+
+    if ((fwrite(&rec, sizeof (rec), 1, fp) != 1) ||
+        ((len != 0) && (fwrite(data, len, 1, fp) != 1))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int genCapture(const GenArgs *pArgs)
+{
+    CapFileHdr hdr = { .magic = CAP_MAGIC };
+    GenRider *riders;
+    const uint64_t nsecs = 1000000000;
+    uint64_t ts;
+    char msg[512];
+    int len;
+    FILE *fp;
+
+    if ((riders = calloc(pArgs->numRiders, sizeof (GenRider))) == NULL) {
+        fprintf(stderr, "Failed to alloc rider table!\n");
+        return -1;
+    }
+
+    if ((fp = fopen(pArgs->fileName, "w")) == NULL) {
+        fprintf(stderr, "Failed to create file %s!\n", pArgs->fileName);
+        return -1;
+    }
+
+    hdr.startSec = time(NULL);
+    hdr.startNsec = 0;
+    if (fwrite(&hdr, sizeof (hdr), 1, fp) != 1) {
+        fprintf(stderr, "Failed to write file %s!\n", pArgs->fileName);
+        return -1;
+    }
+
+    srandom(pArgs->seed);
+
+    // Registration storm: all the riders connect and send
+    // their regReq within the first second.
+    for (int n = 0; n < pArgs->numRiders; n++) {
+        static const char *genders[] = { "female", "male", "unspec" };
+        uint32_t connId = n + 1;
+        ts = (nsecs * n) / pArgs->numRiders;
+        len = snprintf(msg, sizeof (msg), "127.0.0.1[%5u]", (49152 + n % 16384));
+        writeRec(fp, ts, connId, capConnect, msg, len);
+        len = snprintf(msg, sizeof (msg),
+                "{\"msgType\": \"regReq\", \"name\": \"Rider %d\", \"gender\": \"%s\", \"age\": \"%ld\", \"ride\": \"%s\"}",
+                connId, genders[random() % 3], (18 + random() % 60), pArgs->rideName);
+        writeRec(fp, (ts + 1000), connId, capData, msg, (len + 1));
+        riders[n].power = 150 + random() % 150;
+    }
+
+    // The ride starts one second later
+    writeRec(fp, (2 * nsecs), 0, capRideStarted, NULL, 0);
+
+    // Steady state: each rider sends a progUpd every second,
+    // spread out evenly across the second.
+    for (int t = 0; t < pArgs->duration; t++) {
+        for (int n = 0; n < pArgs->numRiders; n++) {
+            GenRider *pRider = &riders[n];
+            pRider->power += (random() % 21) - 10;
+            pRider->distance += pRider->power / 25;
+            ts = ((2 + t) * nsecs) + ((nsecs * n) / pArgs->numRiders) + 1000;
+            len = snprintf(msg, sizeof (msg),
+                    "{\"msgType\": \"progUpd\", \"distance\": \"%d\", \"power\": \"%d\", \"speed\": \"%.3f\"}",
+                    pRider->distance, pRider->power, (pRider->power / 25.0));
+            writeRec(fp, ts, (n + 1), capData, msg, (len + 1));
+        }
+    }
+
+    // Everybody leaves at the end of the ride
+    ts = (2 + pArgs->duration) * nsecs;
+    for (int n = 0; n < pArgs->numRiders; n++) {
+        writeRec(fp, ts, (n + 1), capDisconnect, NULL, 0);
+    }
+
+    free(riders);
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Failed to write file %s!\n", pArgs->fileName);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    GenArgs args = { .rideName = "Synthetic", .numRiders = 1000, .duration = 300, .seed = 1 };
+
+    for (int n = 1; n < argc; n++) {
+        const char *arg = argv[n];
+        const char *val = argv[n + 1];
+
+        if (strcmp(arg, "--help") == 0) {
+            fprintf(stdout, "%s", help);
+            return 0;
+        } else if ((strcmp(arg, "--duration") == 0) && (val != NULL)) {
+            args.duration = atoi(val);
+            n++;
+        } else if ((strcmp(arg, "--riders") == 0) && (val != NULL)) {
+            args.numRiders = atoi(val);
+            n++;
+        } else if ((strcmp(arg, "--ride-name") == 0) && (val != NULL)) {
+            args.rideName = val;
+            n++;
+        } else if ((strcmp(arg, "--seed") == 0) && (val != NULL)) {
+            args.seed = strtoul(val, NULL, 0);
+            n++;
+        } else if ((arg[0] != '-') && (args.fileName == NULL)) {
+            args.fileName = arg;
+        } else {
+            fprintf(stderr, "Invalid option: %s\n", arg);
+            return -1;
+        }
+    }
+
+    if ((args.fileName == NULL) || (args.numRiders <= 0) || (args.duration <= 0)) {
+        fprintf(stderr, "%s", help);
+        return -1;
+    }
+
+    return (genCapture(&args) == 0) ? 0 : -1;
+}
@@ -0,0 +1,261 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "recorder.h"
+
+// Export the telemetry recorded by the GRS --record-file
+// option to CSV: either the final results of the ride, or
+// the trace of one rider.
+
+typedef struct RecArgs {
+    const char *fileName;
+    long traceBibNum;           // bib number of the rider to trace (0=print the results)
+} RecArgs;
+
+// Results of a rider, accumulated over all the samples
+typedef struct RiderResult {
+    uint32_t bibNum;
+    char category[12];
+    char name[48];
+    int32_t distance;
+    int64_t firstTime;
+    int64_t lastTime;
+    uint64_t numSamples;
+    uint64_t powerSum;
+    uint32_t maxPower;
+    uint64_t speedSum;
+} RiderResult;
+
+static RiderResult *resultTbl;
+static size_t resultTblSize;
+
+static const char *help =
+        "SYNTAX:\n"
+        "    grsrec [OPTIONS] <file>\n"
+        "\n"
+        "    Exports a GRS telemetry recording to CSV. By default, it prints\n"
+        "    the final results of the ride.\n"
+        "\n"
+        "OPTIONS:\n"
+        "    --help\n"
+        "        Show this help and exit.\n"
+        "    --trace <bibNum>\n"
+        "        Print every sample of the specified rider, instead of the\n"
+        "        results.\n"
+        "\n";
+
+static RiderResult *getResult(uint32_t bibNum)
+{
+    if (bibNum >= resultTblSize) {
+        size_t size = (resultTblSize != 0) ? resultTblSize : 1024;
+        RiderResult *tbl;
+        while (size <= bibNum) {
+            size *= 2;
+        }
+        if ((tbl = realloc(resultTbl, (size * sizeof (RiderResult)))) == NULL) {
+            return NULL;
+        }
+        memset((tbl + resultTblSize), 0, ((size - resultTblSize) * sizeof (RiderResult)));
+        resultTbl = tbl;
+        resultTblSize = size;
+    }
+
+    return &resultTbl[bibNum];
+}
+
+static int procRiders(const RecBlkHdr *pHdr, const char *data)
+{
+    const RecRider *pRider = (const RecRider *) data;
+
+    for (uint32_t n = 0; n < pHdr->count; n++, pRider++) {
+        RiderResult *pResult;
+        if ((pResult = getResult(pRider->bibNum)) == NULL) {
+            return -1;
+        }
+        pResult->bibNum = pRider->bibNum;
+        memcpy(pResult->category, pRider->category, sizeof (pResult->category));
+        memcpy(pResult->name, pRider->name, sizeof (pResult->name));
+        pResult->category[sizeof (pResult->category) - 1] = '\0';
+        pResult->name[sizeof (pResult->name) - 1] = '\0';
+    }
+
+    return 0;
+}
+
+static int procSamples(const RecArgs *pArgs, const RecFileHdr *pFileHdr, const RecBlkHdr *pHdr, const char *data)
+{
+    uint32_t count = pHdr->count;
+    const uint32_t *timeCol = (const uint32_t *) (data + REC_COL_TIME(count));
+    const uint32_t *bibNumCol = (const uint32_t *) (data + REC_COL_BIBNUM(count));
+    const int32_t *distanceCol = (const int32_t *) (data + REC_COL_DISTANCE(count));
+    const uint16_t *powerCol = (const uint16_t *) (data + REC_COL_POWER(count));
+    const uint16_t *speedCol = (const uint16_t *) (data + REC_COL_SPEED(count));
+
+    if (pArgs->traceBibNum != 0) {
+        // Only the bib number column needs to be scanned
+        for (uint32_t n = 0; n < count; n++) {
+            if (bibNumCol[n] == pArgs->traceBibNum) {
+                int64_t t = pHdr->baseTime + timeCol[n];
+                fprintf(stdout, "%.3f,%d,%u,%.2f\n",
+                        ((t - (pFileHdr->startSec * 1000)) / 1000.0),
+                        distanceCol[n], powerCol[n], (speedCol[n] / 100.0));
+            }
+        }
+        return 0;
+    }
+
+    for (uint32_t n = 0; n < count; n++) {
+        int64_t t = pHdr->baseTime + timeCol[n];
+        RiderResult *pResult;
+        if ((pResult = getResult(bibNumCol[n])) == NULL) {
+            return -1;
+        }
+        pResult->bibNum = bibNumCol[n];
+        if ((pResult->numSamples++ == 0) || (t < pResult->firstTime)) {
+            pResult->firstTime = t;
+        }
+        if (t >= pResult->lastTime) {
+            pResult->lastTime = t;
+            pResult->distance = distanceCol[n];
+        }
+        pResult->powerSum += powerCol[n];
+        pResult->speedSum += speedCol[n];
+        if (powerCol[n] > pResult->maxPower) {
+            pResult->maxPower = powerCol[n];
+        }
+    }
+
+    return 0;
+}
+
+static int cmpResult(const void *p1, const void *p2)
+{
+    const RiderResult *pRes1 = p1;
+    const RiderResult *pRes2 = p2;
+
+    if (pRes1->distance != pRes2->distance) {
+        return (pRes2->distance > pRes1->distance) ? 1 : -1;
+    }
+
+    return (pRes1->lastTime > pRes2->lastTime) - (pRes1->lastTime < pRes2->lastTime);
+}
+
+static void printResults(void)
+{
+    size_t numResults = 0;
+
+    // Compact the table, dropping the bib numbers that
+    // didn't send any progress updates.
+    for (size_t n = 0; n < resultTblSize; n++) {
+        if (resultTbl[n].numSamples != 0) {
+            resultTbl[numResults++] = resultTbl[n];
+        }
+    }
+
+    qsort(resultTbl, numResults, sizeof (RiderResult), cmpResult);
+
+    fprintf(stdout, "rank,bibNum,name,category,distance,time,avgPower,maxPower,avgSpeed\n");
+    for (size_t n = 0; n < numResults; n++) {
+        const RiderResult *pResult = &resultTbl[n];
+        fprintf(stdout, "%zu,%u,\"%s\",%s,%d,%.3f,%lu,%u,%.2f\n",
+                (n + 1), pResult->bibNum, pResult->name, pResult->category, pResult->distance,
+                ((pResult->lastTime - pResult->firstTime) / 1000.0),
+                (pResult->powerSum / pResult->numSamples), pResult->maxPower,
+                (pResult->speedSum / 100.0 / pResult->numSamples));
+    }
+}
+
+static int readRecording(const RecArgs *pArgs)
+{
+    RecFileHdr fileHdr;
+    char *blk;
+    FILE *fp;
+    int s = 0;
+
+    if ((blk = malloc(REC_BLOCK_ALIGN)) == NULL) {
+        fprintf(stderr, "Failed to alloc block buffer!\n");
+        return -1;
+    }
+
+    if ((fp = fopen(pArgs->fileName, "rb")) == NULL) {
+        fprintf(stderr, "Failed to open file %s!\n", pArgs->fileName);
+        return -1;
+    }
+
+    // The file header takes a whole block
+    if ((fread(blk, REC_BLOCK_ALIGN, 1, fp) != 1) ||
+        (memcmp(blk, REC_MAGIC, sizeof (REC_MAGIC)) != 0)) {
+        fprintf(stderr, "Invalid recording file %s!\n", pArgs->fileName);
+        fclose(fp);
+        return -1;
+    }
+    memcpy(&fileHdr, blk, sizeof (fileHdr));
+
+    if (pArgs->traceBibNum != 0) {
+        fprintf(stdout, "time,distance,power,speed\n");
+    }
+
+    while (s == 0) {
+        RecBlkHdr hdr;
+        char *data;
+
+        if (fread(&hdr, sizeof (hdr), 1, fp) != 1) {
+            // End of file
+            break;
+        }
+
+        if ((hdr.size < sizeof (hdr)) || ((hdr.size % REC_BLOCK_ALIGN) != 0) ||
+            ((data = realloc(blk, hdr.size)) == NULL) ||
+            (fread((blk = data), (hdr.size - sizeof (hdr)), 1, fp) != 1)) {
+            fprintf(stderr, "Invalid or truncated block in file %s!\n", pArgs->fileName);
+            s = -1;
+            break;
+        }
+
+        if (hdr.type == recBlkRiders) {
+            s = procRiders(&hdr, data);
+        } else if (hdr.type == recBlkSamples) {
+            s = procSamples(pArgs, &fileHdr, &hdr, data);
+        }
+    }
+
+    fclose(fp);
+
+    if ((s == 0) && (pArgs->traceBibNum == 0)) {
+        printResults();
+    }
+
+    return s;
+}
+
+int main(int argc, char **argv)
+{
+    RecArgs args = {0};
+
+    for (int n = 1; n < argc; n++) {
+        const char *arg = argv[n];
+        const char *val = argv[n + 1];
+
+        if (strcmp(arg, "--help") == 0) {
+            fprintf(stdout, "%s", help);
+            return 0;
+        } else if ((strcmp(arg, "--trace") == 0) && (val != NULL)) {
+            args.traceBibNum = atol(val);
+            n++;
+        } else if ((arg[0] != '-') && (args.fileName == NULL)) {
+            args.fileName = arg;
+        } else {
+            fprintf(stderr, "Invalid option: %s\n", arg);
+            return -1;
+        }
+    }
+
+    if ((args.fileName == NULL) || (args.traceBibNum < 0)) {
+        fprintf(stderr, "%s", help);
+        return -1;
+    }
+
+    return (readRecording(&args) == 0) ? 0 : -1;
+}
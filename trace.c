@@ -0,0 +1,162 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histo.h"
+#include "log.h"
+#include "trace.h"
+
+// Max number of phase spans kept per iteration for
+// the Chrome trace output.
+#define TRACE_MAX_SPANS     1024
+
+typedef struct TraceSpan {
+    TracePhase phase;
+    int arg;
+    uint64_t start;
+    uint64_t dur;
+} TraceSpan;
+
+static const char *phaseNameTbl[] = {
+    [phasePollWait]     "pollWait",
+    [phaseAccept]       "accept",
+    [phaseReadParse]    "readParse",
+    [phaseRegistration] "registration",
+    [phaseLbBuild]      "lbBuild",
+    [phaseLbFanout]     "lbFanout",
+    [phaseEgress]       "egress",
+};
+
+// Per-iteration totals
+static uint64_t iterStart;
+static uint64_t phaseTime[TracePhaseMax];
+static unsigned phaseCount[TracePhaseMax];
+
+// Time spent in each phase per iteration, and total
+// time of each iteration (not counting the wait)
+static Histo phaseHisto[TracePhaseMax];
+static Histo iterHisto;
+
+// Chrome trace output
+static FILE *traceFp;
+static uint64_t traceThreshold;
+static uint64_t traceEpoch;
+static TraceSpan *spans;
+static unsigned numSpans;
+static unsigned numSlowIters;
+
+int traceInit(const char *traceFile, int thresholdUs)
+{
+    traceEpoch = monoTimeNs();
+    traceThreshold = (uint64_t) thresholdUs * 1000;
+
+    if (traceFile != NULL) {
+        if ((spans = calloc(TRACE_MAX_SPANS, sizeof (TraceSpan))) == NULL) {
+            MSGLOG(ERROR, "Failed to alloc trace spans! (%s)", strerror(errno));
+            return -1;
+        }
+
+        if ((traceFp = fopen(traceFile, "w")) == NULL) {
+            MSGLOG(ERROR, "Failed to open trace file! file=%s (%s)", traceFile, strerror(errno));
+            return -1;
+        }
+
+        // Use the JSON Array Format, which doesn't need
+        // the closing bracket, so the file is valid even
+        // if the app is killed.
+        fprintf(traceFp, "[\n");
+    }
+
+    return 0;
+}
+
+void traceIterBegin(void)
+{
+    iterStart = monoTimeNs();
+    memset(phaseTime, 0, sizeof (phaseTime));
+    memset(phaseCount, 0, sizeof (phaseCount));
+    numSpans = 0;
+}
+
+void traceEnd(TracePhase phase, uint64_t start, int arg)
+{
+    uint64_t dur = monoTimeNs() - start;
+
+    phaseTime[phase] += dur;
+    phaseCount[phase]++;
+
+    if ((spans != NULL) && (numSpans < TRACE_MAX_SPANS)) {
+        TraceSpan *pSpan = &spans[numSpans++];
+        pSpan->phase = phase;
+        pSpan->arg = arg;
+        pSpan->start = start;
+        pSpan->dur = dur;
+    }
+}
+
+static void writeSlowIter(uint64_t iterEnd, uint64_t busyTime)
+{
+    // Time values are in microseconds since the start
+    // of the app.
+    fprintf(traceFp, "{\"name\": \"iteration\", \"cat\": \"grs\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"busyUs\": %.3f, \"numSpans\": %u}},\n",
+            ((iterStart - traceEpoch) / 1e3), ((iterEnd - iterStart) / 1e3), (busyTime / 1e3), numSpans);
+
+    for (unsigned n = 0; n < numSpans; n++) {
+        const TraceSpan *pSpan = &spans[n];
+        fprintf(traceFp, "{\"name\": \"%s\", \"cat\": \"grs\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"arg\": %d}},\n",
+                phaseNameTbl[pSpan->phase], ((pSpan->start - traceEpoch) / 1e3), (pSpan->dur / 1e3), pSpan->arg);
+    }
+
+    numSlowIters++;
+}
+
+void traceIterEnd(void)
+{
+    uint64_t iterEnd = monoTimeNs();
+    uint64_t busyTime = (iterEnd - iterStart) - phaseTime[phasePollWait];
+
+    for (int n = 0; n < TracePhaseMax; n++) {
+        if (phaseCount[n] != 0) {
+            histoRecord(&phaseHisto[n], phaseTime[n]);
+        }
+    }
+    histoRecord(&iterHisto, busyTime);
+
+    if ((traceFp != NULL) && (busyTime >= traceThreshold)) {
+        writeSlowIter(iterEnd, busyTime);
+    }
+}
+
+static void dumpHisto(const char *name, const Histo *pHisto)
+{
+    fprintf(stdout, "    %-12s count=%lu mean=%.1f p50=%.1f p90=%.1f p99=%.1f p999=%.1f max=%.1f (usecs)\n",
+            name, pHisto->count,
+            ((pHisto->count != 0) ? ((double) pHisto->sum / pHisto->count / 1e3) : 0.0),
+            (histoPercentile(pHisto, 50.0) / 1e3),
+            (histoPercentile(pHisto, 90.0) / 1e3),
+            (histoPercentile(pHisto, 99.0) / 1e3),
+            (histoPercentile(pHisto, 99.9) / 1e3),
+            (pHisto->max / 1e3));
+}
+
+void traceDump(void)
+{
+    // The dump was asked for, so it is written straight to
+    // stdout, whatever the log level, once the log messages
+    // queued so far are out of the way.
+    logFlush();
+
+    fprintf(stdout, "Event loop latency per iteration:\n");
+    dumpHisto("busy", &iterHisto);
+    for (int n = 0; n < TracePhaseMax; n++) {
+        dumpHisto(phaseNameTbl[n], &phaseHisto[n]);
+    }
+
+    if (traceFp != NULL) {
+        fprintf(stdout, "Slow iterations written to trace file: %u\n", numSlowIters);
+        fflush(traceFp);
+    }
+
+    fflush(stdout);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "defs.h"
+
+// Phases of an event loop iteration. Notice that the phases
+// can be nested; e.g. the registration of a rider happens
+// while its regReq message is being processed, so that time
+// is accounted for in both phases.
+typedef enum TracePhase {
+    phasePollWait = 0,          // waiting for events in ppoll()
+    phaseAccept,                // accepting new connections
+    phaseReadParse,             // reading and processing inbound messages
+    phaseRegistration,          // registering riders
+    phaseLbBuild,               // building the leaderboard messages
+    phaseLbFanout,              // queueing the leaderboard messages
+    phaseEgress,                // sending the queued messages
+    TracePhaseMax
+} TracePhase;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Set up the tracer. If 'traceFile' is not NULL, the phases of
+// every iteration that takes longer than 'thresholdUs' (not
+// counting the time waiting for events) are written to it as
+// Chrome trace events, which can be viewed with chrome://tracing
+// or https://ui.perfetto.dev
+extern int traceInit(const char *traceFile, int thresholdUs);
+
+// Mark the start of a new loop iteration
+extern void traceIterBegin(void);
+
+// Mark the end of the current loop iteration
+extern void traceIterEnd(void);
+
+// Return the start time of a phase
+static __inline__ uint64_t traceBegin(void) { return monoTimeNs(); }
+
+// Record the end of a phase, started at time 'start'. The
+// 'arg' value (e.g. a file descriptor) is included in the
+// Chrome trace event.
+extern void traceEnd(TracePhase phase, uint64_t start, int arg);
+
+// Write the latency histograms of each phase to stdout,
+// whatever the log level
+extern void traceDump(void);
+
+#ifdef __cplusplus
+}
+#endif